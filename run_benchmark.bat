@@ -0,0 +1,19 @@
+rem Renders bundled scenes with RayCLI and compares results against stored baselines,
+rem scenes without baseline are skipped unless --record is passed (then it is recorded from current run).
+rem Baselines hold absolute Mrays/s, so they are valid only on the machine which recorded them and are not
+rem committed, record them once per machine before comparing.
+rem usage: run_benchmark.bat [--record]
+set RECORD=0
+if "%1" == "--record" set RECORD=1
+set RES=0
+if not exist benchmarks mkdir benchmarks
+for %%s in (sponza_simple bathroom coffee) do (
+    if exist benchmarks\%%s_avx2.json (
+        RayCLI.exe -scene assets/scenes/%%s.json -w 640 -h 360 -spp 16 -repeat 3 -backend avx2 -out benchmarks/%%s_avx2.png -baseline benchmarks/%%s_avx2.json || set RES=1
+    ) else if %RECORD% == 1 (
+        RayCLI.exe -scene assets/scenes/%%s.json -w 640 -h 360 -spp 16 -repeat 3 -backend avx2 -out benchmarks/%%s_avx2.png -json benchmarks/%%s_avx2.json || set RES=1
+    ) else (
+        echo Skipping %%s: baseline benchmarks\%%s_avx2.json is missing ^(run with --record on this machine to create it^)
+    )
+)
+exit /b %RES%
\ No newline at end of file
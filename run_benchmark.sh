@@ -0,0 +1,31 @@
+#!/bin/sh
+# Renders bundled scenes with RayCLI and compares results against stored baselines,
+# scenes without baseline are skipped unless --record is passed (then it is recorded from current run).
+# Baselines hold absolute Mrays/s, so they are valid only on the machine which recorded them and are not
+# committed, record them once per machine before comparing.
+# usage: ./run_benchmark.sh [--record] [backend]
+
+RECORD=0
+if [ "$1" = "--record" ]; then
+    RECORD=1
+    shift
+fi
+
+BACKEND=${1:-avx2}
+ARGS="-w 640 -h 360 -spp 16 -repeat 3 -backend $BACKEND"
+RES=0
+
+mkdir -p benchmarks
+
+for SCENE in sponza_simple bathroom coffee; do
+    BASELINE=benchmarks/${SCENE}_${BACKEND}.json
+    if [ -f "$BASELINE" ]; then
+        ./RayCLI -scene assets/scenes/$SCENE.json $ARGS -out benchmarks/${SCENE}_${BACKEND}.png -baseline $BASELINE || RES=1
+    elif [ $RECORD -eq 1 ]; then
+        ./RayCLI -scene assets/scenes/$SCENE.json $ARGS -out benchmarks/${SCENE}_${BACKEND}.png -json $BASELINE || RES=1
+    else
+        echo "Skipping $SCENE: baseline $BASELINE is missing (run with --record on this machine to create it)"
+    fi
+done
+
+exit $RES
@@ -62,11 +62,12 @@ Viewer::Viewer(int w, int h, const char *local_dir, const char *_scene_name, int
         Ray::settings_t s;
         s.w = w;
         s.h = h;
+        s.threads_count = 0;
 
         std::shared_ptr<Ray::RendererBase> ray_renderer;
 
         if (nogpu) {
-            ray_renderer = Ray::CreateRenderer(s, Ray::RendererRef | Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2);
+            ray_renderer = Ray::CreateRenderer(s, Ray::RendererRef | Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512);
         } else {
             ray_renderer = Ray::CreateRenderer(s);
         }
@@ -2,18 +2,21 @@
 
 #include <cassert>
 #include <cctype>
+#include <cstring>
 
 #include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <map>
 #include <sstream>
+#include <thread>
 
 #include <Ren/MMat.h>
 #include <Ren/Texture.h>
 #include <Ren/Utils.h>
 #include <Sys/AssetFile.h>
 #include <Sys/Log.h>
+#include <Sys/ThreadPool.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_PKM
@@ -21,7 +24,187 @@
 
 #define _abs(x) ((x) > 0.0f ? (x) : -(x))
 
+namespace LoadInternal {
+bool EndsWith(const std::string &str, const char *suffix) {
+    const size_t len = strlen(suffix);
+    if (str.length() < len) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (std::tolower(str[str.length() - len + i]) != suffix[i]) return false;
+    }
+    return true;
+}
+
+// Loads all textures referenced by scene, files are decoded in parallel, then all textures are added at once
+void LoadTextures(const JsObject &js_scene, Ray::SceneBase *scene, Sys::ThreadPool &threads, std::map<std::string, uint32_t> &textures) {
+    struct texture_t {
+        std::string name;
+        bool srgb, gen_mipmaps;
+        int w, h;
+        std::vector<Ray::pixel_color8_t> data;
+    };
+    std::vector<texture_t> new_textures;
+
+    // textures are added in order of first reference, the first reference defines texture parameters
+    auto request_texture = [&](const std::string &name, bool srgb, bool gen_mipmaps) {
+        if (textures.find(name) != textures.end()) return;
+        textures[name] = 0xffffffff;
+
+        texture_t tex;
+        tex.name = name;
+        tex.srgb = srgb;
+        tex.gen_mipmaps = gen_mipmaps;
+        new_textures.emplace_back(std::move(tex));
+    };
+
+    if (js_scene.Has("environment")) {
+        const JsObject &js_env = js_scene.at("environment");
+        if (js_env.Has("env_map")) {
+            const JsString &js_env_map = js_env.at("env_map");
+            request_texture(js_env_map.val, false, false);
+        }
+    }
+
+    const JsObject &js_materials = js_scene.at("materials");
+    for (const auto &js_mat : js_materials.elements) {
+        const JsObject &js_mat_obj = js_mat.second;
+
+        const JsString &js_type = js_mat_obj.at("type");
+        const JsString &js_main_tex = js_mat_obj.at("main_texture");
+        request_texture(js_main_tex.val, js_type.val != "mix", js_type.val != "mix");
+
+        if (js_mat_obj.Has("normal_map")) {
+            const JsString &js_normal_map = js_mat_obj.at("normal_map");
+            request_texture(js_normal_map.val, false, false);
+        }
+    }
+
+    std::vector<std::future<void>> loaded;
+    for (texture_t &tex : new_textures) {
+        loaded.push_back(threads.enqueue([&tex]() {
+            if (EndsWith(tex.name, "hdr")) {
+                tex.data = LoadHDR(tex.name, tex.w, tex.h);
+            } else {
+                tex.data = Load_stb_image(tex.name, tex.w, tex.h);
+            }
+            if (tex.data.empty()) throw std::runtime_error("error loading texture");
+        }));
+    }
+
+    // tasks reference local data, so all of them have to finish before loading errors are rethrown
+    for (std::future<void> &f : loaded) {
+        f.wait();
+    }
+    for (std::future<void> &f : loaded) {
+        f.get();
+    }
+
+    std::vector<Ray::tex_desc_t> tex_descs(new_textures.size());
+    for (size_t i = 0; i < new_textures.size(); i++) {
+        const texture_t &tex = new_textures[i];
+
+        Ray::tex_desc_t &tex_desc = tex_descs[i];
+        tex_desc.data = &tex.data[0];
+        tex_desc.w = tex.w;
+        tex_desc.h = tex.h;
+        tex_desc.is_srgb = tex.srgb;
+        tex_desc.generate_mipmaps = tex.gen_mipmaps;
+        // RGBE data cannot be compressed
+        tex_desc.allow_compression = !EndsWith(tex.name, "hdr");
+    }
+
+    std::vector<uint32_t> tex_ids(new_textures.size());
+    if (!tex_descs.empty()) {
+        scene->AddTextures(&tex_descs[0], tex_descs.size(), &tex_ids[0]);
+    }
+
+    for (size_t i = 0; i < new_textures.size(); i++) {
+        textures[new_textures[i].name] = tex_ids[i];
+    }
+}
+
+// Loads all scene meshes, files are parsed in parallel, then all meshes are added at once (BVH building is parallel as well)
+void LoadMeshes(const JsObject &js_scene, Ray::SceneBase *scene, Sys::ThreadPool &threads,
+                const std::map<std::string, uint32_t> &materials, std::map<std::string, uint32_t> &meshes) {
+    using mesh_data_t = std::tuple<std::vector<float>, std::vector<unsigned>, std::vector<unsigned>>;
+
+    const JsObject &js_meshes = js_scene.at("meshes");
+
+    std::vector<std::future<mesh_data_t>> loaded;
+    for (const auto &js_mesh : js_meshes.elements) {
+        const JsObject &js_mesh_obj = js_mesh.second;
+
+        const JsString &js_vtx_data = js_mesh_obj.at("vertex_data");
+        if (js_vtx_data.val.find(".obj") != std::string::npos) {
+            loaded.push_back(threads.enqueue(LoadOBJ, js_vtx_data.val));
+        } else if (js_vtx_data.val.find(".bin") != std::string::npos) {
+            loaded.push_back(threads.enqueue(LoadBIN, js_vtx_data.val));
+        } else {
+            throw std::runtime_error("unknown mesh type");
+        }
+    }
+
+    std::vector<mesh_data_t> mesh_data;
+    for (std::future<mesh_data_t> &f : loaded) {
+        mesh_data.push_back(f.get());
+    }
+
+    std::vector<Ray::mesh_desc_t> mesh_descs;
+    for (const auto &js_mesh : js_meshes.elements) {
+        const JsObject &js_mesh_obj = js_mesh.second;
+
+        const std::vector<float> &attrs = std::get<0>(mesh_data[mesh_descs.size()]);
+        const std::vector<unsigned> &indices = std::get<1>(mesh_data[mesh_descs.size()]),
+                                    &groups = std::get<2>(mesh_data[mesh_descs.size()]);
+
+        const JsArray &js_materials = js_mesh_obj.at("materials");
+
+        Ray::mesh_desc_t mesh_desc;
+        mesh_desc.prim_type = Ray::TriangleList;
+        mesh_desc.layout = Ray::PxyzNxyzTuv;
+        mesh_desc.vtx_attrs = &attrs[0];
+        mesh_desc.vtx_attrs_count = attrs.size() / 8;
+        mesh_desc.vtx_indices = &indices[0];
+        mesh_desc.vtx_indices_count = indices.size();
+
+        for (size_t i = 0; i < groups.size(); i += 2) {
+            const JsString &js_mat_name = js_materials.at(i / 2);
+            uint32_t mat_index = materials.at(js_mat_name.val);
+            mesh_desc.shapes.push_back({ mat_index, mat_index, groups[i], groups[i + 1] });
+        }
+
+        if (js_mesh_obj.Has("allow_spatial_splits")) {
+            JsLiteral splits = (JsLiteral)js_mesh_obj.at("allow_spatial_splits");
+            mesh_desc.allow_spatial_splits = (splits.val == JS_TRUE);
+        }
+
+        if (js_mesh_obj.Has("use_fast_bvh_build")) {
+            JsLiteral use_fast = (JsLiteral)js_mesh_obj.at("use_fast_bvh_build");
+            mesh_desc.use_fast_bvh_build = (use_fast.val == JS_TRUE);
+        }
+
+        if (js_mesh_obj.Has("bvh_bins_count")) {
+            const JsNumber &bins_count = (const JsNumber &)js_mesh_obj.at("bvh_bins_count");
+            mesh_desc.bvh_bins_count = (int)bins_count.val;
+        }
+
+        mesh_descs.push_back(mesh_desc);
+    }
+
+    std::vector<uint32_t> mesh_ids(mesh_descs.size());
+    if (!mesh_descs.empty()) {
+        scene->AddMeshes(&mesh_descs[0], mesh_descs.size(), &mesh_ids[0]);
+    }
+
+    size_t i = 0;
+    for (const auto &js_mesh : js_meshes.elements) {
+        meshes[js_mesh.first] = mesh_ids[i++];
+    }
+}
+}
+
 std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &js_scene) {
+    using namespace LoadInternal;
+
     auto new_scene = r->CreateScene();
 
     bool view_targeted = false;
@@ -34,36 +217,12 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
     std::map<std::string, uint32_t> materials;
     std::map<std::string, uint32_t> meshes;
 
-    auto get_texture = [&](const std::string &name, bool srgb, bool gen_mipmaps) {
-        auto it = textures.find(name);
-        if (it == textures.end()) {
-            int w, h;
-            std::vector<Ray::pixel_color8_t> data;
-            if (std::tolower(name[name.length() - 1]) == 'r' &&
-                std::tolower(name[name.length() - 2]) == 'd' &&
-                std::tolower(name[name.length() - 3]) == 'h') {
-                data = LoadHDR(name, w, h);
-            } else {
-                data = Load_stb_image(name, w, h);
-            }
-            if (data.empty()) throw std::runtime_error("error loading texture");
-
-            Ray::tex_desc_t tex_desc;
-            tex_desc.data = &data[0];
-            tex_desc.w = w;
-            tex_desc.h = h;
-            tex_desc.is_srgb = srgb;
-            tex_desc.generate_mipmaps = gen_mipmaps;
-
-            uint32_t tex_id = new_scene->AddTexture(tex_desc);
-            textures[name] = tex_id;
-            return tex_id;
-        } else {
-            return it->second;
-        }
-    };
+    // used to load files in parallel
+    Sys::ThreadPool threads(std::max(std::thread::hardware_concurrency(), 1u));
 
     try {
+        LoadTextures(js_scene, new_scene.get(), threads, textures);
+
         if (js_scene.Has("camera")) {
             const JsObject &js_cam = js_scene.at("camera");
             if (js_cam.Has("view_origin")) {
@@ -145,7 +304,7 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
 
                 if (js_env.Has("env_map")) {
                     const JsString &js_env_map = js_env.at("env_map");
-                    env_desc.env_map = get_texture(js_env_map.val, false, false);
+                    env_desc.env_map = textures.at(js_env_map.val);
                 }
 
                 new_scene->SetEnvironment(env_desc);
@@ -182,7 +341,7 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
             const JsString &js_type = js_mat_obj.at("type");
 
             const JsString &js_main_tex = js_mat_obj.at("main_texture");
-            mat_desc.main_texture = get_texture(js_main_tex.val, js_type.val != "mix", js_type.val != "mix");
+            mat_desc.main_texture = textures.at(js_main_tex.val);
 
             if (js_mat_obj.Has("main_color")) {
                 const JsArray &js_main_color = js_mat_obj.at("main_color");
@@ -193,7 +352,7 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
 
             if (js_mat_obj.Has("normal_map")) {
                 const JsString &js_normal_map = js_mat_obj.at("normal_map");
-                mat_desc.normal_map = get_texture(js_normal_map.val, false, false);
+                mat_desc.normal_map = textures.at(js_normal_map.val);
             }
 
             if (js_mat_obj.Has("roughness")) {
@@ -250,51 +409,7 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
             materials[js_mat_name] = new_scene->AddMaterial(mat_desc);
         }
 
-        const JsObject &js_meshes = js_scene.at("meshes");
-        for (const auto &js_mesh : js_meshes.elements) {
-            const std::string &js_mesh_name = js_mesh.first;
-            const JsObject &js_mesh_obj = js_mesh.second;
-
-            std::vector<float> attrs;
-            std::vector<unsigned> indices, groups;
-
-            const JsString &js_vtx_data = js_mesh_obj.at("vertex_data");
-            if (js_vtx_data.val.find(".obj") != std::string::npos) {
-                std::tie(attrs, indices, groups) = LoadOBJ(js_vtx_data.val);
-            } else if (js_vtx_data.val.find(".bin") != std::string::npos) {
-                std::tie(attrs, indices, groups) = LoadBIN(js_vtx_data.val);
-            } else {
-                throw std::runtime_error("unknown mesh type");
-            }
-
-            const JsArray &js_materials = js_mesh_obj.at("materials");
-
-            Ray::mesh_desc_t mesh_desc;
-            mesh_desc.prim_type = Ray::TriangleList;
-            mesh_desc.layout = Ray::PxyzNxyzTuv;
-            mesh_desc.vtx_attrs = &attrs[0];
-            mesh_desc.vtx_attrs_count = attrs.size() / 8;
-            mesh_desc.vtx_indices = &indices[0];
-            mesh_desc.vtx_indices_count = indices.size();
-
-            for (size_t i = 0; i < groups.size(); i += 2) {
-                const JsString &js_mat_name = js_materials.at(i / 2);
-                uint32_t mat_index = materials.at(js_mat_name.val);
-                mesh_desc.shapes.push_back({ mat_index, mat_index, groups[i], groups[i + 1] });
-            }
-
-            if (js_mesh_obj.Has("allow_spatial_splits")) {
-                JsLiteral splits = (JsLiteral)js_mesh_obj.at("allow_spatial_splits");
-                mesh_desc.allow_spatial_splits = (splits.val == JS_TRUE);
-            }
-
-            if (js_mesh_obj.Has("use_fast_bvh_build")) {
-                JsLiteral use_fast = (JsLiteral)js_mesh_obj.at("use_fast_bvh_build");
-                mesh_desc.use_fast_bvh_build = (use_fast.val == JS_TRUE);
-            }
-
-            meshes[js_mesh_name] = new_scene->AddMesh(mesh_desc);
-        }
+        LoadMeshes(js_scene, new_scene.get(), threads, materials, meshes);
 
         const JsArray &js_mesh_instances = js_scene.at("mesh_instances");
         for (const auto &js_mesh_instance : js_mesh_instances.elements) {
@@ -442,6 +557,53 @@ std::shared_ptr<Ray::SceneBase> LoadScene(Ray::RendererBase *r, const JsObject &
     return new_scene;
 }
 
+JsObject WriteStats(const Ray::RendererBase::stats_t &st) {
+    JsObject js_stats;
+
+    {   // stage times
+        JsObject js_time;
+        js_time.Push("primary_ray_gen_us", JsNumber{ double(st.time_primary_ray_gen_us) });
+        js_time.Push("primary_trace_us", JsNumber{ double(st.time_primary_trace_us) });
+        js_time.Push("primary_shade_us", JsNumber{ double(st.time_primary_shade_us) });
+        js_time.Push("secondary_sort_us", JsNumber{ double(st.time_secondary_sort_us) });
+        js_time.Push("secondary_gather_us", JsNumber{ double(st.time_secondary_gather_us) });
+        js_time.Push("secondary_trace_us", JsNumber{ double(st.time_secondary_trace_us) });
+        js_time.Push("secondary_shade_us", JsNumber{ double(st.time_secondary_shade_us) });
+        js_stats.Push("time", js_time);
+    }
+
+    {   // number of rays per bounce (trailing zeroes are skipped)
+        int bounces_count = Ray::RendererBase::stats_t::BouncesCount;
+        while (bounces_count > 1 && !st.rays_traced[bounces_count - 1]) {
+            bounces_count--;
+        }
+
+        JsArray js_rays;
+        for (int i = 0; i < bounces_count; i++) {
+            js_rays.Push(JsNumber{ double(st.rays_traced[i]) });
+        }
+        js_stats.Push("rays_traced", js_rays);
+    }
+
+    js_stats.Push("box_tests", JsNumber{ double(st.box_tests) });
+    js_stats.Push("tri_tests", JsNumber{ double(st.tri_tests) });
+    js_stats.Push("avg_stack_depth", JsNumber{ st.stack_pops ? double(st.stack_depth_sum) / st.stack_pops : 0.0 });
+    js_stats.Push("rays_terminated", JsNumber{ double(st.rays_terminated) });
+    js_stats.Push("lane_utilization", JsNumber{ st.total_lanes ? double(st.active_lanes) / st.total_lanes : 1.0 });
+    js_stats.Push("traversal_lane_utilization", JsNumber{ st.traversal_total_lanes ? double(st.traversal_active_lanes) / st.traversal_total_lanes : 1.0 });
+    js_stats.Push("single_ray_packets", JsNumber{ double(st.single_ray_packets) });
+
+    {   // bucket i holds tiles that took [2^i, 2^(i+1)) microseconds
+        JsArray js_hist;
+        for (unsigned long long count : st.tile_time_hist) {
+            js_hist.Push(JsNumber{ double(count) });
+        }
+        js_stats.Push("tile_time_hist_log2_us", js_hist);
+    }
+
+    return js_stats;
+}
+
 std::tuple<std::vector<float>, std::vector<unsigned>, std::vector<unsigned>> LoadOBJ(const std::string &file_name) {
     std::vector<float> attrs;
     std::vector<unsigned> indices;
@@ -813,16 +975,17 @@ std::vector<Ray::pixel_color8_t> LoadHDR(const std::string &name, int &out_w, in
 }
 
 std::vector<Ray::pixel_color8_t> Load_stb_image(const std::string &name, int &w, int &h) {
-    stbi_set_flip_vertically_on_load(1);
-    
     int channels;
     uint8_t *img_data = stbi_load(name.c_str(), &w, &h, &channels, 4);
     if (!img_data) {
         throw std::runtime_error("Cannot load image!");
     }
 
+    // image is flipped here instead of using global stb flag, so images can be loaded from several threads
     std::vector<Ray::pixel_color8_t> tex_data(w * h);
-    memcpy(&tex_data[0].r, img_data, w * h * sizeof(Ray::pixel_color8_t));
+    for (int y = 0; y < h; y++) {
+        memcpy(&tex_data[(h - y - 1) * w].r, &img_data[y * w * sizeof(Ray::pixel_color8_t)], w * sizeof(Ray::pixel_color8_t));
+    }
 
     stbi_image_free(img_data);
 
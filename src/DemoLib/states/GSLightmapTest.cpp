@@ -42,25 +42,11 @@ GSLightmapTest::GSLightmapTest(GameBase *game) : game_(game) {
 void GSLightmapTest::UpdateRegionContexts() {
     region_contexts_.clear();
 
-    const auto rt = ray_renderer_->type();
     const auto sz = ray_renderer_->size();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        const int BUCKET_SIZE = 128;
-
-        for (int y = 0; y < sz.second; y += BUCKET_SIZE) {
-            for (int x = 0; x < sz.first; x += BUCKET_SIZE) {
-                auto rect = Ray::rect_t{ x, y, 
-                    std::min(sz.first - x, BUCKET_SIZE),
-                    std::min(sz.second - y, BUCKET_SIZE) };
-
-                region_contexts_.emplace_back(rect);
-            }
-        }
-    } else {
-        auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
-        region_contexts_.emplace_back(rect);
-    }
+    // cpu renderers split region in tiles internally
+    auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
+    region_contexts_.emplace_back(rect);
 }
 
 void GSLightmapTest::UpdateEnvironment(const Ren::Vec3f &sun_dir) {
@@ -202,21 +188,7 @@ void GSLightmapTest::Draw(uint64_t dt_us) {
 
     const auto rt = ray_renderer_->type();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        auto render_job = [this](int i) { ray_renderer_->RenderScene(ray_scene_, region_contexts_[i]); };
-        
-        std::vector<std::future<void>> events;
-
-        for (int i = 0; i < (int)region_contexts_.size(); i++) {
-            events.push_back(threads_->enqueue(render_job, i));
-        }
-
-        for (const auto &e : events) {
-            e.wait();
-        }
-    } else {
-        ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
-    }
+    ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
 
     Ray::RendererBase::stats_t st;
     ray_renderer_->GetStats(st);
@@ -224,13 +196,14 @@ void GSLightmapTest::Draw(uint64_t dt_us) {
 
     //LOGI("%llu\t%llu\t%i", st.time_primary_trace_us, st.time_secondary_trace_us, region_contexts_[0].iteration);
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        st.time_primary_ray_gen_us /= threads_->num_workers();
-        st.time_primary_trace_us /= threads_->num_workers();
-        st.time_primary_shade_us /= threads_->num_workers();
-        st.time_secondary_sort_us /= threads_->num_workers();
-        st.time_secondary_trace_us /= threads_->num_workers();
-        st.time_secondary_shade_us /= threads_->num_workers();
+    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2 || rt == Ray::RendererAVX512) {
+        st.time_primary_ray_gen_us /= ray_renderer_->threads_count();
+        st.time_primary_trace_us /= ray_renderer_->threads_count();
+        st.time_primary_shade_us /= ray_renderer_->threads_count();
+        st.time_secondary_sort_us /= ray_renderer_->threads_count();
+        st.time_secondary_gather_us /= ray_renderer_->threads_count();
+        st.time_secondary_trace_us /= ray_renderer_->threads_count();
+        st.time_secondary_shade_us /= ray_renderer_->threads_count();
     }
 
     stats_.push_back(st);
@@ -24,38 +24,8 @@
 
 namespace GSRayBucketTestInternal {
 const float FORWARD_SPEED = 8.0f;
-const int BUCKET_SIZE = 48;
 const int PASSES = 1;
 const int SPP_PORTION = 256;
-
-// From wikipedia page about Hilbert curve
-
-void rot(int n, int *x, int *y, int rx, int ry) {
-    if (ry == 0) {
-        if (rx == 1) {
-            *x = n-1 - *x;
-            *y = n-1 - *y;
-        }
-
-        //Swap x and y
-        int t  = *x;
-        *x = *y;
-        *y = t;
-    }
-}
-
-void d2xy(int n, int d, int *x, int *y) {
-    int rx, ry, s, t = d;
-    *x = *y = 0;
-    for (s = 1; s < n; s *= 2) {
-        rx = 1 & (t / 2);
-        ry = 1 & (t ^ rx);
-        rot(s, x, y, rx, ry);
-        *x += s * rx;
-        *y += s * ry;
-        t /= 4;
-    }
-}
 }
 
 GSRayBucketTest::GSRayBucketTest(GameBase *game) : game_(game) {
@@ -71,82 +41,35 @@ GSRayBucketTest::GSRayBucketTest(GameBase *game) : game_(game) {
     ray_renderer_   = game->GetComponent<Ray::RendererBase>(RAY_RENDERER_KEY);
 
     threads_        = game->GetComponent<Sys::ThreadPool>(THREAD_POOL_KEY);
+
+    is_aborted_ = false;
+}
+
+void GSRayBucketTest::StopRendering() {
+    is_aborted_ = true;
+    if (render_event_.valid()) {
+        render_event_.wait();
+    }
+    is_aborted_ = false;
 }
 
 void GSRayBucketTest::UpdateRegionContexts() {
     using namespace GSRayBucketTestInternal;
 
-    for (size_t i = 0; i < is_aborted_.size(); i++) {
-        is_aborted_[i] = true;
-    }
-
-    for (const auto &e : events_) {
-        e.wait();
-    }
+    StopRendering();
 
-    is_aborted_.clear();
-    events_.clear();
+    ray_renderer_->Clear();
     region_contexts_.clear();
-    last_reg_context_ = 0;
-    cur_spp_ = 0;
 
     const auto rt = ray_renderer_->type();
     const auto sz = ray_renderer_->size();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        /*for (int y = 0; y < sz.second; y += BUCKET_SIZE) {
-            for (int x = 0; x < sz.first; x += BUCKET_SIZE) {
-                auto rect = Ray::rect_t{ x, y, 
-                    std::min(sz.first - x, BUCKET_SIZE),
-                    std::min(sz.second - y, BUCKET_SIZE) };
-
-                region_contexts_.emplace_back(rect);
-            }
-        }*/
-
-        int resx = sz.first / BUCKET_SIZE + (sz.first % BUCKET_SIZE != 0);
-        int resy = sz.second / BUCKET_SIZE + (sz.second % BUCKET_SIZE != 0);
-
-        int res =  std::max(resx, resy);
-
-        // round up to next power of two
-        res--;
-        res |= res >> 1;
-        res |= res >> 2;
-        res |= res >> 4;
-        res |= res >> 8;
-        res |= res >> 16;
-        res++;
-
-        for (int i = 0; i < res * res; i++) {
-            int x, y;
-
-            d2xy(res, i, &x, &y);
-
-            if (x > resx - 1 || y > resy - 1) continue;
-
-            x *= BUCKET_SIZE;
-            y *= BUCKET_SIZE;
-
-            auto rect = Ray::rect_t{ x, y,
-                    std::min(sz.first - x, BUCKET_SIZE),
-                    std::min(sz.second - y, BUCKET_SIZE) };
-
-            region_contexts_.emplace_back(rect);
-        }
-
-    } else {
-        auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
-        region_contexts_.emplace_back(rect);
-    }
-
-    is_active_.resize(region_contexts_.size(), false);
-    is_aborted_.resize(region_contexts_.size(), false);
-
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        auto render_job = [this](int i, int m) {
-            if (is_aborted_[i]) return;
+    // cpu renderers split region in tiles internally
+    auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
+    region_contexts_.emplace_back(rect);
 
+    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2 || rt == Ray::RendererAVX512) {
+        auto render_job = [this]() {
             {
                 auto t = std::chrono::high_resolution_clock::now();
 
@@ -156,11 +79,12 @@ void GSRayBucketTest::UpdateRegionContexts() {
                 }
             }
 
-            is_active_[i] = true;
-            for (int j = 0; j < SPP_PORTION * m; j++) {
-                ray_renderer_->RenderScene(ray_scene_, region_contexts_[i]);
+            for (int s = 0; s < PASSES; s++) {
+                for (int j = 0; j < SPP_PORTION * (1 << s); j++) {
+                    if (is_aborted_) return;
+                    ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
+                }
             }
-            is_active_[i] = false;
 
             {
                 auto t = std::chrono::high_resolution_clock::now();
@@ -170,11 +94,7 @@ void GSRayBucketTest::UpdateRegionContexts() {
             }
         };
 
-        for (int s = 0; s < PASSES; s++) {
-            for (int i = 0; i < (int)region_contexts_.size(); i++) {
-                events_.push_back(threads_->enqueue(render_job, i, (1 << s)));
-            }
-        }
+        render_event_ = threads_->enqueue(render_job);
     } else {
         //ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
     }
@@ -234,8 +154,7 @@ void GSRayBucketTest::Enter() {
 }
 
 void GSRayBucketTest::Exit() {
-    for (size_t i = 0; i < is_aborted_.size(); i++) is_aborted_[i] = true;
-    for (const auto &e : events_) e.wait();
+    StopRendering();
 }
 
 void GSRayBucketTest::Draw(uint64_t dt_us) {
@@ -259,7 +178,6 @@ void GSRayBucketTest::Draw(uint64_t dt_us) {
     uint32_t t1 = Sys::GetTimeMs();
 
     if (invalidate_preview_) {
-        ray_renderer_->Clear();
         UpdateRegionContexts();
         invalidate_preview_ = false;
     }
@@ -273,50 +191,10 @@ void GSRayBucketTest::Draw(uint64_t dt_us) {
 
 #if defined(USE_SW_RENDER)
     swBlitPixels(0, 0, 0, SW_FLOAT, SW_FRGBA, w, h, (const void *)pixel_data, 1);
-
-    float pix_row[BUCKET_SIZE][4];
-
-    for (int i = 0; i < (int)region_contexts_.size(); i++) {
-        if (!is_active_[i]) continue;
-
-        for (int j = 0; j < BUCKET_SIZE; j++) {
-            pix_row[j][0] = 1.0f;
-            pix_row[j][1] = 1.0f;
-            pix_row[j][2] = 1.0f;
-            pix_row[j][3] = 1.0f;
-        }
-
-        const auto &rc = region_contexts_[i];
-        swBlitPixels(rc.rect().x, rc.rect().y, 0, SW_FLOAT, SW_FRGBA, rc.rect().w, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + 1, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + 2, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + 3, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + 4, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + 1, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + 2, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + 3, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + 4, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-
-        swBlitPixels(rc.rect().x, rc.rect().y + BUCKET_SIZE - 1, 0, SW_FLOAT, SW_FRGBA, rc.rect().w, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + BUCKET_SIZE - 1 - 1, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + BUCKET_SIZE - 1 - 2, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + BUCKET_SIZE - 1 - 3, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x, rc.rect().y + BUCKET_SIZE - 1 - 4, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + BUCKET_SIZE - 1 - 1, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + BUCKET_SIZE - 1 - 2, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + BUCKET_SIZE - 1 - 3, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-        swBlitPixels(rc.rect().x + BUCKET_SIZE - 1, rc.rect().y + BUCKET_SIZE - 1 - 4, 0, SW_FLOAT, SW_FRGBA, 1, 1, (const void *)&pix_row[0][0], 1);
-    }
 #endif
 
-    bool ready = true;
-
-    for (size_t i = 0; i < events_.size(); i++) {
-        if (events_[i].wait_for(std::chrono::milliseconds(5)) != std::future_status::ready) {
-            ready = false;
-            break;
-        }
-    }
+    const bool ready = !render_event_.valid() ||
+                       render_event_.wait_for(std::chrono::milliseconds(5)) == std::future_status::ready;
 
     if (ready) {
         auto dt = std::chrono::duration<double>{ end_time_ - start_time_ };
@@ -497,11 +375,7 @@ void GSRayBucketTest::HandleInput(const InputManager::Event &evt) {
     }
     break;
     case InputManager::RAW_INPUT_RESIZE:
-        for (size_t i = 0; i < is_aborted_.size(); i++) is_aborted_[i] = true;
-        for (const auto &e : events_) e.wait();
-
-        is_aborted_.clear();
-        events_.clear();
+        StopRendering();
 
         ray_renderer_->Resize((int)evt.point.x, (int)evt.point.y);
         UpdateRegionContexts();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <future>
 #include <mutex>
@@ -59,17 +60,15 @@ class GSRayBucketTest : public GameState {
     int time_counter_ = 0;
 
     std::vector<Ray::RegionContext> region_contexts_;
-    std::vector<std::future<void>> events_;
 
-    // leads to race condition, but doesnt matter
-    std::vector<bool> is_active_, is_aborted_;
-
-    int last_reg_context_ = 0;
-    int cur_spp_ = 0;
+    // whole image is rendered by single job, renderer splits it in tiles and distributes them between its own threads
+    std::future<void> render_event_;
+    std::atomic_bool is_aborted_;
 
     std::mutex timers_mutex_;
     std::chrono::high_resolution_clock::time_point start_time_, end_time_;
 
+    void StopRendering();
     void UpdateRegionContexts();
     void UpdateEnvironment(const Ren::Vec3f &sun_dir);
 public:
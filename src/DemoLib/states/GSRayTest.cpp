@@ -44,25 +44,11 @@ GSRayTest::GSRayTest(GameBase *game) : game_(game) {
 void GSRayTest::UpdateRegionContexts() {
     region_contexts_.clear();
 
-    const auto rt = ray_renderer_->type();
     const auto sz = ray_renderer_->size();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        const int BUCKET_SIZE = 128;
-
-        for (int y = 0; y < sz.second; y += BUCKET_SIZE) {
-            for (int x = 0; x < sz.first; x += BUCKET_SIZE) {
-                auto rect = Ray::rect_t{ x, y,
-                    std::min(sz.first - x, BUCKET_SIZE),
-                    std::min(sz.second - y, BUCKET_SIZE) };
-
-                region_contexts_.emplace_back(rect);
-            }
-        }
-    } else {
-        auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
-        region_contexts_.emplace_back(rect);
-    }
+    // cpu renderers split region in tiles internally
+    auto rect = Ray::rect_t{ 0, 0, sz.first, sz.second };
+    region_contexts_.emplace_back(rect);
 }
 
 void GSRayTest::UpdateEnvironment(const Ren::Vec3f &sun_dir) {
@@ -102,6 +88,12 @@ void GSRayTest::Enter() {
             LOGE("%s", e.what());
         }
 
+        if (ray_scene_) {
+            Ray::SceneBase::stats_t st;
+            ray_scene_->GetStats(st);
+            LOGI("BVH build time: %llu ms", st.time_bvh_build_us / 1000);
+        }
+
         if (js_scene.Has("camera")) {
             const JsObject &js_cam = js_scene.at("camera");
             if (js_cam.Has("view_target")) {
@@ -196,33 +188,20 @@ void GSRayTest::Draw(uint64_t dt_us) {
 
     const auto rt = ray_renderer_->type();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        auto render_job = [this](int i) { ray_renderer_->RenderScene(ray_scene_, region_contexts_[i]); };
-        
-        std::vector<std::future<void>> events;
-
-        for (int i = 0; i < (int)region_contexts_.size(); i++) {
-            events.push_back(threads_->enqueue(render_job, i));
-        }
-
-        for (const auto &e : events) {
-            e.wait();
-        }
-    } else {
-        ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
-    }
+    ray_renderer_->RenderScene(ray_scene_, region_contexts_[0]);
 
     Ray::RendererBase::stats_t st;
     ray_renderer_->GetStats(st);
     ray_renderer_->ResetStats();
 
-    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2) {
-        st.time_primary_ray_gen_us /= threads_->num_workers();
-        st.time_primary_trace_us /= threads_->num_workers();
-        st.time_primary_shade_us /= threads_->num_workers();
-        st.time_secondary_sort_us /= threads_->num_workers();
-        st.time_secondary_trace_us /= threads_->num_workers();
-        st.time_secondary_shade_us /= threads_->num_workers();
+    if (rt == Ray::RendererRef || rt == Ray::RendererSSE2 || rt == Ray::RendererAVX || rt == Ray::RendererAVX2 || rt == Ray::RendererAVX512) {
+        st.time_primary_ray_gen_us /= ray_renderer_->threads_count();
+        st.time_primary_trace_us /= ray_renderer_->threads_count();
+        st.time_primary_shade_us /= ray_renderer_->threads_count();
+        st.time_secondary_sort_us /= ray_renderer_->threads_count();
+        st.time_secondary_gather_us /= ray_renderer_->threads_count();
+        st.time_secondary_trace_us /= ray_renderer_->threads_count();
+        st.time_secondary_shade_us /= ray_renderer_->threads_count();
     }
 
     //LOGI("%llu\t%llu\t%i", st.time_primary_trace_us, st.time_secondary_trace_us, region_contexts_[0].iteration);
@@ -495,6 +474,10 @@ void GSRayTest::HandleInput(const InputManager::Event &evt) {
             side_speed_ = 0;
         } else if (evt.raw_key == 'u') {
             ui_enabled_ = !ui_enabled_;
+        } else if (evt.raw_key == 'j' && !stats_.empty()) {
+            // dump stats of last frame
+            std::ofstream out_file("stats.json", std::ios::binary);
+            WriteStats(stats_.back()).Write(out_file);
         }
     }
     break;
@@ -0,0 +1,84 @@
+#include "RendererBase.h"
+
+#include <thread>
+
+#include "internal/TaskScheduler.h"
+
+static_assert(sizeof(Ray::RendererBase::stats_t) % sizeof(unsigned long long) == 0, "!");
+
+Ray::RendererBase::RendererBase() {
+    ResetStats();
+}
+
+Ray::RendererBase::RendererBase(const settings_t &s) : tile_size_(s.tile_size) {
+    ResetStats();
+
+    int threads_count = s.threads_count;
+    if (threads_count <= 0) {
+        threads_count = (int)std::thread::hardware_concurrency();
+    }
+    if (threads_count > 1) {
+        tile_scheduler_.reset(new TaskScheduler(threads_count));
+    }
+    if (tile_size_ <= 0) {
+        tile_size_ = 64;
+    }
+}
+
+Ray::RendererBase::~RendererBase() = default;
+
+int Ray::RendererBase::threads_count() const {
+    return tile_scheduler_ ? tile_scheduler_->threads_count() : 1;
+}
+
+void Ray::RendererBase::RunTiled(const rect_t &rect, const std::function<void(const rect_t &)> &job) {
+    const int tiles_x = (rect.w + tile_size_ - 1) / tile_size_,
+              tiles_y = (rect.h + tile_size_ - 1) / tile_size_;
+
+    if (!tile_scheduler_ || tiles_x * tiles_y <= 1) {
+        job(rect);
+        return;
+    }
+
+    tile_scheduler_->ParallelFor(0, tiles_x * tiles_y, [&](int i) {
+        const int tx = i % tiles_x, ty = i / tiles_x;
+
+        rect_t tile = { rect.x + tx * tile_size_, rect.y + ty * tile_size_, tile_size_, tile_size_ };
+        tile.w = std::min(tile.w, rect.x + rect.w - tile.x);
+        tile.h = std::min(tile.h, rect.y + rect.h - tile.y);
+
+        job(tile);
+    });
+}
+
+void Ray::RendererBase::GetStats(stats_t &st) {
+    auto *dst = reinterpret_cast<unsigned long long *>(&st);
+    for (size_t i = 0; i < sizeof(stats_) / sizeof(stats_[0]); i++) {
+        dst[i] = stats_[i].load(std::memory_order_relaxed);
+    }
+}
+
+void Ray::RendererBase::ResetStats() {
+    for (auto &v : stats_) {
+        v.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Ray::RendererBase::AccumulateStats(const stats_t &st) {
+    // stats struct consists of counters only, so it is added field by field
+    const auto *src = reinterpret_cast<const unsigned long long *>(&st);
+    for (size_t i = 0; i < sizeof(stats_) / sizeof(stats_[0]); i++) {
+        if (src[i]) {
+            stats_[i].fetch_add(src[i], std::memory_order_relaxed);
+        }
+    }
+}
+
+int Ray::RendererBase::TileTimeBucket(unsigned long long time_us) {
+    int bucket = 0;
+    while (time_us > 1 && bucket < stats_t::TileTimeBucketsCount - 1) {
+        time_us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <memory>
 
 #include "SceneBase.h"
@@ -18,6 +20,7 @@ enum eRendererType {
     RendererAVX2    = (1 << 3),
     RendererNEON    = (1 << 4),
     RendererOCL     = (1 << 5),
+    RendererAVX512  = (1 << 6),
 };
 
 /// Renderer settings
@@ -27,6 +30,13 @@ struct settings_t {
     int platform_index = -1, device_index = -1;
 #endif
     bool use_wide_bvh = true;
+    bool use_compressed_bvh = false;        ///< Store mesh trees with quantized bounds (only used with use_wide_bvh)
+    int threads_count = 1;                  ///< Number of threads used to render tiles (0 - use all hardware threads)
+    int tile_size = 64;                     ///< Size of tiles each rendered region is split into
+    bool use_wavefront = false;             ///< Trace secondary rays of the whole region together instead of per tile (SIMD backends only)
+    bool use_tex_compression = false;       ///< Store textures in BC3 compressed blocks (4x less memory, lossy, CPU backends only)
+    bool use_hybrid_traversal = false;      ///< Trace coherent ray packets as a whole and incoherent ones ray by ray (SIMD backends with wide BVH only)
+    float single_ray_threshold = 0.3f;      ///< Secondary bounce is traced ray by ray when packets use less than this fraction of lanes in traversal
 };
 
 /** Render region context,
@@ -50,11 +60,30 @@ public:
     }
 };
 
+class TaskScheduler;
+
 /** Base class for all renderer backends
 */
 class RendererBase {
+protected:
+    std::shared_ptr<TaskScheduler> tile_scheduler_;
+    int tile_size_ = 64;
+
+    /** @brief Splits rectangle in tiles and executes job for each of them
+        @param rect rectangle to split
+        @param job function to execute for each tile
+
+        Tiles are distributed between threads of tile scheduler (work-stealing is used
+        to balance cheap and expensive tiles), waits for all of them to finish.
+    */
+    void RunTiled(const rect_t &rect, const std::function<void(const rect_t &)> &job);
 public:
-    virtual ~RendererBase() = default;
+    RendererBase();
+    explicit RendererBase(const settings_t &s);
+    virtual ~RendererBase();
+
+    /// Number of threads used to render tiles
+    int threads_count() const;
 
     /// Type of renderer
     virtual eRendererType type() const = 0;
@@ -90,15 +119,48 @@ public:
     */
     virtual void RenderScene(const std::shared_ptr<SceneBase> &s, RegionContext &region) = 0;
 
+    /** Renderer statistics,
+        counters are gathered by each thread separately and added to renderer totals after each tile,
+        stage times are summed across threads (divide by threads_count() to get wall-clock time)
+    */
     struct stats_t {
+        static const int BouncesCount = 16;
+        static const int TileTimeBucketsCount = 24;
+
         unsigned long long time_primary_ray_gen_us;
         unsigned long long time_primary_trace_us;
         unsigned long long time_primary_shade_us;
         unsigned long long time_secondary_sort_us;
+        unsigned long long time_secondary_gather_us;   ///< Part of sorting time spent on moving rays
         unsigned long long time_secondary_trace_us;
         unsigned long long time_secondary_shade_us;
+
+        unsigned long long rays_traced[BouncesCount];  ///< Number of traced rays per bounce (0 - primary rays)
+        unsigned long long box_tests;                  ///< Number of ray-box tests (including inactive SIMD lanes, needs RAY_ENABLE_TRAVERSAL_COUNTERS)
+        unsigned long long tri_tests;                  ///< Number of ray-triangle tests (including inactive SIMD lanes, needs RAY_ENABLE_TRAVERSAL_COUNTERS)
+        unsigned long long stack_depth_sum;            ///< Sum of traversal stack depths sampled on each pop (wide BVH only, needs RAY_ENABLE_TRAVERSAL_COUNTERS)
+        unsigned long long stack_pops;                 ///< Number of traversal stack pops (wide BVH only, needs RAY_ENABLE_TRAVERSAL_COUNTERS)
+        unsigned long long rays_terminated;            ///< Number of paths terminated by russian roulette
+        unsigned long long active_lanes;               ///< Number of active lanes in traced ray packets (SIMD backends only)
+        unsigned long long total_lanes;                ///< Number of all lanes in traced ray packets (SIMD backends only)
+        unsigned long long traversal_active_lanes;     ///< Number of lanes which hit boxes tested by packet traversal (hybrid traversal only)
+        unsigned long long traversal_total_lanes;      ///< Number of all lanes in boxes tested by packet traversal (hybrid traversal only)
+        unsigned long long single_ray_packets;         ///< Number of secondary ray packets traced ray by ray (hybrid traversal only)
+        unsigned long long tile_time_hist[TileTimeBucketsCount]; ///< Tile render times, bucket i counts tiles that took [2^i, 2^(i+1)) us
     };
-    virtual void GetStats(stats_t &st) = 0;
-    virtual void ResetStats() = 0;
+    virtual void GetStats(stats_t &st);
+    virtual void ResetStats();
+protected:
+    /** @brief Adds stats gathered locally (e.g. for one tile) to renderer totals
+        @param st stats to add
+
+        Lock-free, can be called from several threads at once.
+    */
+    void AccumulateStats(const stats_t &st);
+
+    /// Returns bucket of tile time histogram for specific time
+    static int TileTimeBucket(unsigned long long time_us);
+private:
+    std::atomic<unsigned long long> stats_[sizeof(stats_t) / sizeof(unsigned long long)];
 };
 }
\ No newline at end of file
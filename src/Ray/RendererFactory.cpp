@@ -6,6 +6,7 @@
 #include "internal/RendererSSE2.h"
 #include "internal/RendererAVX.h"
 #include "internal/RendererAVX2.h"
+#include "internal/RendererAVX512.h"
 #elif defined(__ARM_NEON__) || defined(__aarch64__)
 #include "internal/RendererNEON.h"
 #elif defined(__i386__) || defined(__x86_64__)
@@ -35,6 +36,10 @@ std::shared_ptr<Ray::RendererBase> Ray::CreateRenderer(const settings_t &s, uint
 #endif
 
 #if !defined(__ANDROID__)
+    if ((flags & RendererAVX512) && features.avx512_supported) {
+        log_stream << "Ray: Creating AVX512 renderer " << s.w << "x" << s.h << std::endl;
+        return std::make_shared<Avx512::Renderer>(s);
+    }
     if ((flags & RendererAVX2) && features.avx2_supported) {
         log_stream << "Ray: Creating AVX2 renderer " << s.w << "x" << s.h << std::endl;
         return std::make_shared<Avx2::Renderer>(s);
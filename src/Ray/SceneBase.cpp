@@ -5,6 +5,26 @@
 
 #include "internal/Core.h"
 
+void Ray::SceneBase::AddTextures(const tex_desc_t *t, size_t count, uint32_t *out_indices) {
+    for (size_t i = 0; i < count; i++) {
+        out_indices[i] = AddTexture(t[i]);
+    }
+}
+
+void Ray::SceneBase::AddMeshes(const mesh_desc_t *m, size_t count, uint32_t *out_indices) {
+    for (size_t i = 0; i < count; i++) {
+        out_indices[i] = AddMesh(m[i]);
+    }
+}
+
+bool Ray::SceneBase::SaveCache(const char *) {
+    return false;
+}
+
+bool Ray::SceneBase::LoadCache(const char *) {
+    return false;
+}
+
 uint32_t Ray::SceneBase::AddCamera(const camera_desc_t &c) {
     uint32_t i;
     if (cam_first_free_ == -1) {
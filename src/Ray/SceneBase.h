@@ -92,6 +92,7 @@ struct mesh_desc_t {
     std::vector<shape_desc_t> shapes;   ///< Vector of shapes in mesh
     bool allow_spatial_splits = false;  ///< Better BVH, worse load times and memory consumption
     bool use_fast_bvh_build = false;    ///< Use faster BVH construction with less tree quality
+    int bvh_bins_count = 0;             ///< Use binned SAH with this number of bins per axis (0 - evaluate all split positions)
 };
 
 /// Texture description
@@ -101,6 +102,7 @@ struct tex_desc_t {
         h;                          ///< Texture height
     bool is_srgb = true;
     bool generate_mipmaps;
+    bool allow_compression = true;  ///< Should be false for data which cannot be lossy compressed (e.g. RGBE)
 };
 
 enum eLightType {
@@ -124,7 +126,7 @@ struct camera_desc_t {
     eDeviceType dtype = SRGB;           ///< Device type
     float origin[3];                    ///< Camera origin
     float fwd[3] = {};                  ///< Camera forward unit vector
-    float up[3];                        ///< Camera up vector (optional)
+    float up[3] = {};                   ///< Camera up vector (optional)
     float fov, gamma = 1.0f;            ///< Field of view in degrees, gamma
     float focus_distance = 1.0f;        ///< Distance to focus point
     float focus_factor = 0.0f;          ///< Depth of field strength (in non-physical units)
@@ -180,6 +182,16 @@ public:
     */
     virtual uint32_t AddTexture(const tex_desc_t &t) = 0;
 
+    /** @brief Adds several textures to scene
+        @param t array of texture descriptions
+        @param count number of textures
+        @param out_indices array which receives new texture indices (0xffffffff if texture was not added)
+
+        Indices are assigned in the same order as with sequential AddTexture calls, preparation of
+        textures (mip generation, compression) can be done in parallel.
+    */
+    virtual void AddTextures(const tex_desc_t *t, size_t count, uint32_t *out_indices);
+
     /** @brief Removes texture with specific index from scene
         @param i texture index
     */
@@ -202,6 +214,16 @@ public:
     */
     virtual uint32_t AddMesh(const mesh_desc_t &m) = 0;
 
+    /** @brief Adds several meshes to scene
+        @param m array of mesh descriptions
+        @param count number of meshes
+        @param out_indices array which receives new mesh indices
+
+        Indices are assigned in the same order as with sequential AddMesh calls, BVH building
+        and tangent basis computation can be done in parallel.
+    */
+    virtual void AddMeshes(const mesh_desc_t *m, size_t count, uint32_t *out_indices);
+
     /** @brief Removes mesh with specific index from scene
         @param i mesh index
     */
@@ -239,6 +261,13 @@ public:
     */
     virtual void RemoveMeshInstance(uint32_t mi_index) = 0;
 
+    /** @brief Defragments internal storage
+
+        Removal of meshes leaves holes in internal arrays, which are reused by new meshes.
+        This call moves remaining data to close gaps, it is not needed for correctness and can be slow.
+    */
+    virtual void Compact() = 0;
+
     /** @brief Adds camera to a scene
         @param c camera description
         @return New camera index
@@ -277,10 +306,32 @@ public:
         current_cam_ = i;
     }
 
+    /** @brief Saves scene to binary cache file
+        @param file_name cache file path
+        @return false if file cannot be written or backend does not support scene cache
+
+        Cache holds acceleration structures, textures (already placed in atlas), materials, lights and cameras
+        in the form they are stored in memory, so loading it skips BVH building and texture processing.
+    */
+    virtual bool SaveCache(const char *file_name);
+
+    /** @brief Replaces scene content with one stored in cache file
+        @param file_name cache file path
+        @return false if file is missing, has different version or was saved with different BVH settings
+                (scene is not changed in this case)
+    */
+    virtual bool LoadCache(const char *file_name);
+
     /// Overall triangle count in scene
     virtual uint32_t triangle_count() = 0;
 
     /// Overall BVH node count in scene
     virtual uint32_t node_count() = 0;
+
+    struct stats_t {
+        unsigned long long time_bvh_build_us;   ///< Time spent building mesh, macro and light BVHs
+    };
+    virtual void GetStats(stats_t &st) = 0;
+    virtual void ResetStats() = 0;
 };
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 
+#include "RendererBase.cpp"
 #include "RendererFactory.cpp"
 #include "SceneBase.cpp"
 
@@ -10,7 +11,10 @@
 #include "internal/CoreRef.cpp"
 #include "internal/FramebufferRef.cpp"
 #include "internal/RendererRef.cpp"
+#include "internal/RangeAllocator.cpp"
+#include "internal/SceneCache.cpp"
 #include "internal/SceneRef.cpp"
+#include "internal/TaskScheduler.cpp"
 #include "internal/TextureAtlasRef.cpp"
 #include "internal/TextureUtilsRef.cpp"
 
@@ -1,10 +1,15 @@
 #include "BVHSplit.h"
 
 #include <algorithm>
+#include <memory>
+
+#include "TaskScheduler.h"
 
 namespace Ray {
 const float SpatialSplitAlpha = 0.00001f;
 const int NumSpatialSplitBins = 256;
+const size_t MinParallelSplitPrims = 16 * 1024;
+const size_t MinBinnedSplitPrims = 256;
 
 struct bbox_t {
     Ref::simd_fvec3 min = { std::numeric_limits<float>::max() },
@@ -125,10 +130,16 @@ bbox_t GetClippedAABB(const Ref::simd_fvec3 &_v0, const Ref::simd_fvec3 &_v1, co
 
 Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::vector<uint32_t> &prim_indices, const float *positions, size_t stride,
                                            const Ref::simd_fvec3 &bbox_min, const Ref::simd_fvec3 &bbox_max,
-                                           const Ref::simd_fvec3 &root_min, const Ref::simd_fvec3 &root_max, const bvh_settings_t &s) {
+                                           const Ref::simd_fvec3 &root_min, const Ref::simd_fvec3 &root_max, const bvh_settings_t &s,
+                                           TaskScheduler *scheduler) {
     size_t num_tris = prim_indices.size();
     bbox_t whole_box = { bbox_min, bbox_max };
 
+    // small nodes are not worth distributing between threads
+    if (num_tris < MinParallelSplitPrims) {
+        scheduler = nullptr;
+    }
+
     std::vector<uint32_t> axis_lists[3];
     for (int axis = 0; axis < 3; axis++) {
         axis_lists[axis].reserve(num_tris);
@@ -145,27 +156,115 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
     if (s.allow_spatial_splits && positions) {
         modified_prim_bounds.resize(num_tris);
 
-        for (size_t i = 0; i < prim_indices.size(); i++) {
+        const int blocks_count = int((num_tris + MinParallelSplitPrims - 1) / MinParallelSplitPrims);
+
+        ParallelFor(scheduler, 0, blocks_count, [&](int block) {
+            const size_t beg = block * MinParallelSplitPrims,
+                         end = std::min(beg + MinParallelSplitPrims, num_tris);
+
+            for (size_t i = beg; i < end; i++) {
+                const prim_t &p = primitives[prim_indices[i]];
+
+                Ref::simd_fvec3 v0 = { &positions[p.i0 * stride] },
+                                v1 = { &positions[p.i1 * stride] },
+                                v2 = { &positions[p.i2 * stride] };
+
+                modified_prim_bounds[i] = GetClippedAABB(v0, v1, v2, whole_box);
+            }
+        });
+    }
+
+    // best split found for each axis, axes are processed independently and compared in fixed order afterwards
+    struct axis_split_t {
+        float sah = std::numeric_limits<float>::max();
+        int index = -1;
+        bbox_t left_bounds, right_bounds;
+    } axis_splits[3];
+
+    // binning is used for big nodes only, near the leaves all split positions are checked
+    const bool use_binning = s.bins_count > 0 && num_tris > MinBinnedSplitPrims;
+
+    auto get_prim_bounds = [&](uint32_t i) -> bbox_t {
+        if (modified_prim_bounds.empty()) {
             const prim_t &p = primitives[prim_indices[i]];
+            return { p.bbox_min, p.bbox_max };
+        } else {
+            return modified_prim_bounds[i];
+        }
+    };
 
-            Ref::simd_fvec3 v0 = { &positions[p.i0 * stride] },
-                            v1 = { &positions[p.i1 * stride] },
-                            v2 = { &positions[p.i2 * stride] };
+    bbox_t centroid_bounds;
+    if (use_binning) {
+        for (uint32_t i = 0; i < (uint32_t)num_tris; i++) {
+            const bbox_t b = get_prim_bounds(i);
+            const Ref::simd_fvec3 c = 0.5f * (b.min + b.max);
 
-            modified_prim_bounds[i] = GetClippedAABB(v0, v1, v2, whole_box);
+            centroid_bounds.min = min(centroid_bounds.min, c);
+            centroid_bounds.max = max(centroid_bounds.max, c);
         }
     }
 
-    std::vector<bbox_t> right_bounds(num_tris);
+    auto get_bin_index = [&](uint32_t i, int axis) -> int {
+        const bbox_t b = get_prim_bounds(i);
+        const float c = 0.5f * (b.min[axis] + b.max[axis]);
+        const float scale = s.bins_count / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+        return std::min(int((c - centroid_bounds.min[axis]) * scale), s.bins_count - 1);
+    };
 
-    float res_sah = s.oversplit_threshold * whole_box.surface_area() * num_tris;
-    int div_axis = -1;
-    uint32_t div_index = 0;
-    bbox_t res_left_bounds, res_right_bounds;
-
-    for (int axis = 0; axis < 3; axis++) {
+    ParallelFor(scheduler, 0, 3, [&](int axis) {
         std::vector<uint32_t> &list = axis_lists[axis];
 
+        if (use_binning) {
+            // skip this axis if all centroids are in the same plane
+            if (centroid_bounds.max[axis] - centroid_bounds.min[axis] < FLT_EPS) return;
+
+            struct sah_bin_t {
+                bbox_t bounds;
+                uint32_t count = 0;
+            };
+
+            std::vector<sah_bin_t> bins(s.bins_count), right_bins(s.bins_count);
+
+            for (const uint32_t i : list) {
+                const bbox_t b = get_prim_bounds(i);
+                sah_bin_t &bin = bins[get_bin_index(i, axis)];
+
+                bin.bounds.min = min(bin.bounds.min, b.min);
+                bin.bounds.max = max(bin.bounds.max, b.max);
+                bin.count++;
+            }
+
+            // right_bins[i] holds accumulated bounds of bins [i + 1, bins_count)
+            sah_bin_t cur_right;
+            for (int i = s.bins_count - 1; i > 0; i--) {
+                cur_right.bounds.min = min(cur_right.bounds.min, bins[i].bounds.min);
+                cur_right.bounds.max = max(cur_right.bounds.max, bins[i].bounds.max);
+                cur_right.count += bins[i].count;
+                right_bins[i - 1] = cur_right;
+            }
+
+            axis_split_t &res = axis_splits[axis];
+
+            sah_bin_t cur_left;
+            for (int i = 0; i < s.bins_count - 1; i++) {
+                cur_left.bounds.min = min(cur_left.bounds.min, bins[i].bounds.min);
+                cur_left.bounds.max = max(cur_left.bounds.max, bins[i].bounds.max);
+                cur_left.count += bins[i].count;
+
+                const sah_bin_t &right = right_bins[i];
+                if (!cur_left.count || !right.count) continue;
+
+                float sah = s.node_traversal_cost * whole_box.surface_area() + cur_left.bounds.surface_area() * cur_left.count + right.bounds.surface_area() * right.count;
+                if (sah < res.sah) {
+                    res.sah = sah;
+                    res.index = i;
+                    res.left_bounds = cur_left.bounds;
+                    res.right_bounds = right.bounds;
+                }
+            }
+            return;
+        }
+
         if (modified_prim_bounds.empty()) {
             std::sort(list.begin(), list.end(),
                 [axis, primitives, &prim_indices](uint32_t p1, uint32_t p2) -> bool {
@@ -178,6 +277,8 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
             });
         }
 
+        std::vector<bbox_t> right_bounds(num_tris);
+
         bbox_t cur_right_bounds;
         if (modified_prim_bounds.empty()) {
             for (size_t i = list.size() - 1; i > 0; i--) {
@@ -193,6 +294,8 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
             }
         }
 
+        axis_split_t &res = axis_splits[axis];
+
         bbox_t left_bounds;
         for (size_t i = 1; i < list.size(); i++) {
             if (modified_prim_bounds.empty()) {
@@ -204,14 +307,38 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
             }
 
             float sah = s.node_traversal_cost * whole_box.surface_area() + left_bounds.surface_area() * i + right_bounds[i - 1].surface_area() * (list.size() - i);
-            if (sah < res_sah) {
-                res_sah = sah;
-                div_axis = axis;
-                div_index = (uint32_t)i;
-                res_left_bounds = left_bounds;
-                res_right_bounds = right_bounds[i - 1];
+            if (sah < res.sah) {
+                res.sah = sah;
+                res.index = (int)i;
+                res.left_bounds = left_bounds;
+                res.right_bounds = right_bounds[i - 1];
             }
         }
+    });
+
+    float res_sah = s.oversplit_threshold * whole_box.surface_area() * num_tris;
+    int div_axis = -1;
+    uint32_t div_index = 0;
+    bbox_t res_left_bounds, res_right_bounds;
+
+    for (int axis = 0; axis < 3; axis++) {
+        const axis_split_t &split = axis_splits[axis];
+        if (split.index != -1 && split.sah < res_sah) {
+            res_sah = split.sah;
+            div_axis = axis;
+            div_index = (uint32_t)split.index;
+            res_left_bounds = split.left_bounds;
+            res_right_bounds = split.right_bounds;
+        }
+    }
+
+    if (use_binning && div_axis != -1) {
+        // move primitives of left bins to the beginning of list, so it can be split the same way as sorted one
+        std::vector<uint32_t> &list = axis_lists[div_axis];
+        const int split_bin = (int)div_index;
+
+        auto it = std::stable_partition(list.begin(), list.end(), [&](uint32_t i) { return get_bin_index(i, div_axis) <= split_bin; });
+        div_index = (uint32_t)std::distance(list.begin(), it);
     }
 
     bbox_t overlap = { max(res_left_bounds.min, res_right_bounds.min),
@@ -224,14 +351,18 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
             uint32_t enter_counter = 0, exit_counter = 0, prim_counter = 0;
         };
 
-        int spatial_split = -1;
+        struct spatial_split_t {
+            float sah = std::numeric_limits<float>::max();
+            int split = -1;
+            bbox_t left_bounds, right_bounds;
+        } spatial_splits[3];
 
-        for (int split_axis = 0; split_axis < 3; split_axis++) {
-            bin_t bins[NumSpatialSplitBins];
+        ParallelFor(scheduler, 0, 3, [&](int split_axis) {
+            std::unique_ptr<bin_t[]> bins(new bin_t[NumSpatialSplitBins]);
             double bin_size = double(whole_box.max[split_axis] - whole_box.min[split_axis]) / NumSpatialSplitBins;
-            
+
             // skip this axis if bbox is flat
-            if (bin_size < FLT_EPS) continue;
+            if (bin_size < FLT_EPS) return;
 
             for (int i = 0; i < NumSpatialSplitBins; i++) {
                 bins[i].limits.min = whole_box.min;
@@ -306,6 +437,8 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
                 }
             }
 
+            spatial_split_t &res = spatial_splits[split_axis];
+
             for (int split = 1; split < NumSpatialSplitBins; split++) {
                 bbox_t ext_left, ext_right;
                 int num_left = 0, num_right = 0;
@@ -325,15 +458,27 @@ Ray::split_data_t Ray::SplitPrimitives_SAH(const prim_t *primitives, const std::
                 }
 
                 float split_sah = s.node_traversal_cost + ext_left.surface_area() * num_left + ext_right.surface_area() * num_right;
-                if (split_sah < res_sah) {
-                    res_sah = split_sah;
-                    spatial_split = split;
-                    div_axis = split_axis;
-
-                    res_left_bounds = ext_left;
-                    res_right_bounds = ext_right;
+                if (split_sah < res.sah) {
+                    res.sah = split_sah;
+                    res.split = split;
+                    res.left_bounds = ext_left;
+                    res.right_bounds = ext_right;
                 }
             }
+        });
+
+        int spatial_split = -1;
+
+        for (int split_axis = 0; split_axis < 3; split_axis++) {
+            const spatial_split_t &split = spatial_splits[split_axis];
+            if (split.split != -1 && split.sah < res_sah) {
+                res_sah = split.sah;
+                spatial_split = split.split;
+                div_axis = split_axis;
+
+                res_left_bounds = split.left_bounds;
+                res_right_bounds = split.right_bounds;
+            }
         }
 
         if (spatial_split != -1) {
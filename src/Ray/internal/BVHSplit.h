@@ -6,6 +6,8 @@
 #include "../SceneBase.h"
 
 namespace Ray {
+class TaskScheduler;
+
 struct prim_t {
     uint32_t i0, i1, i2;
     Ref::simd_fvec3 bbox_min, bbox_max;
@@ -18,6 +20,7 @@ struct split_data_t {
 
 split_data_t SplitPrimitives_SAH(const prim_t *primitives, const std::vector<uint32_t> &prim_indices, const float *positions, size_t stride,
                                  const Ref::simd_fvec3 &bbox_min, const Ref::simd_fvec3 &bbox_max,
-                                 const Ref::simd_fvec3 &root_min, const Ref::simd_fvec3 &root_max, const bvh_settings_t &s);
+                                 const Ref::simd_fvec3 &root_min, const Ref::simd_fvec3 &root_max, const bvh_settings_t &s,
+                                 TaskScheduler *scheduler = nullptr);
 
 }
\ No newline at end of file
@@ -1,13 +1,14 @@
 #include "Core.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
 
-#include <deque>
 #include <vector>
 
 #include "BVHSplit.h"
+#include "TaskScheduler.h"
 
 namespace Ray {
 const float axis_aligned_normal_eps = 0.000001f;
@@ -39,31 +40,57 @@ struct prim_chunk_t {
 const int BitsPerDim = 10;
 const int BitsTotal = 3 * BitsPerDim;
 
-void radix_sort_prim_chunks(prim_chunk_t *begin, prim_chunk_t *end, prim_chunk_t *begin1) {
+const size_t MinParallelSortChunks = 64 * 1024;
+const size_t PrimsPerTask = 16 * 1024;
+
+void radix_sort_prim_chunks(prim_chunk_t *begin, prim_chunk_t *end, prim_chunk_t *begin1, TaskScheduler *scheduler) {
     prim_chunk_t *end1 = begin1 + (end - begin);
 
     const int bits_per_pass = 6;
     const int bucket_size = 1 << bits_per_pass;
     const int bit_mask = bucket_size - 1;
 
+    // each block is counted and scattered separately, offsets are assigned block by block so sort remains stable
+    const size_t total_count = size_t(end - begin);
+    const int blocks_count = (scheduler && total_count >= MinParallelSortChunks) ? scheduler->threads_count() : 1;
+
+    std::vector<size_t> count(blocks_count * bucket_size);
+
     for (int shift = 0; shift < BitsTotal; shift += bits_per_pass) {
-        size_t count[bucket_size] = {};
-        for (prim_chunk_t *p = begin; p != end; p++) {
-            count[(p->code >> shift) & bit_mask]++;
-        }
-        prim_chunk_t *bucket[bucket_size], *q = begin1;
-        for (int i = 0; i < bucket_size; q += count[i++]) {
-            bucket[i] = q;
-        }
-        for (prim_chunk_t *p = begin; p != end; p++) {
-            *bucket[(p->code >> shift) & bit_mask]++ = *p;
+        std::fill(count.begin(), count.end(), 0);
+
+        ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+            size_t *block_count = &count[b * bucket_size];
+            for (prim_chunk_t *p = begin + (total_count * b) / blocks_count; p != begin + (total_count * (b + 1)) / blocks_count; p++) {
+                block_count[(p->code >> shift) & bit_mask]++;
+            }
+        });
+
+        size_t offset = 0;
+        for (int i = 0; i < bucket_size; i++) {
+            for (int b = 0; b < blocks_count; b++) {
+                const size_t c = count[b * bucket_size + i];
+                count[b * bucket_size + i] = offset;
+                offset += c;
+            }
         }
+
+        ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+            prim_chunk_t *bucket[bucket_size];
+            for (int i = 0; i < bucket_size; i++) {
+                bucket[i] = begin1 + count[b * bucket_size + i];
+            }
+            for (prim_chunk_t *p = begin + (total_count * b) / blocks_count; p != begin + (total_count * (b + 1)) / blocks_count; p++) {
+                *bucket[(p->code >> shift) & bit_mask]++ = *p;
+            }
+        });
+
         std::swap(begin, begin1);
         std::swap(end, end1);
     }
 }
 
-void sort_mort_codes(uint32_t *morton_codes, size_t prims_count, uint32_t *out_indices) {
+void sort_mort_codes(uint32_t *morton_codes, size_t prims_count, uint32_t *out_indices, TaskScheduler *scheduler) {
     std::vector<prim_chunk_t> run_chunks;
     run_chunks.reserve(prims_count);
 
@@ -79,7 +106,7 @@ void sort_mort_codes(uint32_t *morton_codes, size_t prims_count, uint32_t *out_i
 
     std::vector<prim_chunk_t> run_chunks2(run_chunks.size());
 
-    radix_sort_prim_chunks(&run_chunks[0], &run_chunks[0] + run_chunks.size(), &run_chunks2[0]);
+    radix_sort_prim_chunks(&run_chunks[0], &run_chunks[0] + run_chunks.size(), &run_chunks2[0], scheduler);
     std::swap(run_chunks, run_chunks2);
 
     size_t counter = 0;
@@ -90,6 +117,113 @@ void sort_mort_codes(uint32_t *morton_codes, size_t prims_count, uint32_t *out_i
         }
     }
 }
+
+// Slack used to not cull lights because of precision issues (in radians)
+const float LightConeEps = 0.0001f;
+const float OneMinusEps = 0.99999994f;
+
+force_inline float light_power(const light_t &l) {
+    // light falloff is approximately (radius / distance)^2
+    return (0.2126f * l.col[0] + 0.7152f * l.col[1] + 0.0722f * l.col[2]) * l.radius * l.radius;
+}
+
+force_inline float safe_acos(float x) {
+    return std::acos(std::min(std::max(x, -1.0f), 1.0f));
+}
+
+// Conservative estimate of light coming from lights bounded by sphere and emission cone to point p with normal n,
+// it is zero only if none of lights can contribute (from 'Importance Sampling of Many Lights with Adaptive Tree Splitting')
+float EstimateLightImportance(const float center[3], float radius, const float axis[3], float cos_theta, float power,
+                              const Ref::simd_fvec3 &p, const Ref::simd_fvec3 &n) {
+    if (power <= 0.0f) return 0.0f;
+
+    Ref::simd_fvec3 v = Ref::simd_fvec3{ center } - p;
+    const float d2 = dot(v, v), r2 = radius * radius;
+    if (d2 <= r2) {
+        // point is inside of bounding sphere, nothing can be culled
+        return power / std::max(r2, FLT_EPS);
+    }
+
+    const float d = std::sqrt(d2);
+    v /= d;
+
+    // angle subtended by bounding sphere
+    const float theta_u = std::asin(radius / d);
+
+    const float theta_n = std::max(safe_acos(dot(n, v)) - theta_u, 0.0f);
+    if (theta_n > 0.5f * PI + LightConeEps) return 0.0f;
+
+    if (cos_theta > -1.0f) {
+        const float theta_e = safe_acos(-dot(Ref::simd_fvec3{ axis }, v));
+        if (theta_e - safe_acos(cos_theta) - theta_u > LightConeEps) return 0.0f;
+    }
+
+    return power * std::cos(std::min(theta_n, 0.5f * PI - LightConeEps)) / d2;
+}
+
+force_inline float EstimateLightImportance(const light_node_t &node, const Ref::simd_fvec3 &p, const Ref::simd_fvec3 &n) {
+    if (p[0] < node.bbox_min[0] || p[1] < node.bbox_min[1] || p[2] < node.bbox_min[2] ||
+        p[0] > node.bbox_max[0] || p[1] > node.bbox_max[1] || p[2] > node.bbox_max[2]) {
+        return 0.0f;
+    }
+    return EstimateLightImportance(node.center, node.radius, node.axis, node.cos_theta, node.power, p, n);
+}
+
+force_inline float EstimateLightImportance(const light_t &l, const Ref::simd_fvec3 &p, const Ref::simd_fvec3 &n) {
+    const float influence = l.radius * (std::sqrt(l.brightness / LIGHT_ATTEN_CUTOFF) - 1.0f);
+    const float dist = length(p - Ref::simd_fvec3{ l.pos });
+    if (std::max(dist - l.radius, 0.0f) >= influence) return 0.0f;
+
+    const float axis[3] = { -l.dir[0], -l.dir[1], -l.dir[2] };
+    return EstimateLightImportance(l.pos, l.radius, axis, l.spot, light_power(l), p, n);
+}
+
+void MergeBoundingSpheres(const float c1[3], float r1, const float c2[3], float r2, float out_c[3], float &out_r) {
+    const Ref::simd_fvec3 _c1 = { c1 }, _c2 = { c2 };
+    const float d = length(_c2 - _c1);
+    if (d + r2 <= r1) {
+        memcpy(out_c, c1, 3 * sizeof(float));
+        out_r = r1;
+    } else if (d + r1 <= r2) {
+        memcpy(out_c, c2, 3 * sizeof(float));
+        out_r = r2;
+    } else {
+        out_r = 0.5f * (d + r1 + r2);
+        const Ref::simd_fvec3 c = _c1 + (_c2 - _c1) * ((out_r - r1) / d);
+        memcpy(out_c, &c[0], 3 * sizeof(float));
+    }
+}
+
+// Cones are given by axis and half-angle (PI means all directions)
+void MergeCones(const float a1[3], float theta1, const float a2[3], float theta2, float out_a[3], float &out_theta) {
+    if (theta1 < theta2) {
+        std::swap(a1, a2);
+        std::swap(theta1, theta2);
+    }
+
+    memcpy(out_a, a1, 3 * sizeof(float));
+    out_theta = theta1;
+
+    if (theta1 >= PI) return;
+
+    const Ref::simd_fvec3 _a1 = { a1 }, _a2 = { a2 };
+    const float cos_d = dot(_a1, _a2), theta_d = safe_acos(cos_d);
+    if (std::min(theta_d + theta2, PI) <= theta1) return;
+
+    const float theta_o = 0.5f * (theta1 + theta_d + theta2);
+    const Ref::simd_fvec3 ortho = _a2 - _a1 * cos_d;
+    const float ortho_len = length(ortho);
+    if (theta_o >= PI || ortho_len < FLT_EPS) {
+        out_theta = PI;
+        return;
+    }
+
+    // rotate first axis towards second one
+    const float theta_r = theta_o - theta1;
+    const Ref::simd_fvec3 a = normalize(_a1 * std::cos(theta_r) + ortho * (std::sin(theta_r) / ortho_len));
+    memcpy(out_a, &a[0], 3 * sizeof(float));
+    out_theta = theta_o;
+}
 }
 
 const Ray::tri_accel_t Ray::InvalidTriangle = {
@@ -159,6 +293,8 @@ const int Ray::sampling_pattern[] = { 0, 1, 2, 3,   1, 2, 3, 0,
                                       3, 2, 1, 0,   3, 2, 1, 0,
                                       1, 0, 3, 2,   2, 1, 0, 3 };
 
+thread_local Ray::ray_counters_t Ray::g_ray_counters = {};
+
 bool Ray::PreprocessTri(const float *p, int stride, tri_accel_t *acc) {
     // from "Ray-Triangle Intersection Algorithm for Modern CPU Architectures" [2007]
 
@@ -228,43 +364,53 @@ void Ray::ExtractPlaneNormal(const tri_accel_t &tri, float *out_normal) {
 }
 
 uint32_t Ray::PreprocessMesh(const float *attrs, const uint32_t *vtx_indices, size_t vtx_indices_count, eVertexLayout layout, int base_vertex,
-                             const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<tri_accel_t> &out_tris, std::vector<uint32_t> &out_tri_indices) {
+                             const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<tri_accel_t> &out_tris, std::vector<uint32_t> &out_tri_indices,
+                             TaskScheduler *scheduler) {
     assert(vtx_indices_count && vtx_indices_count % 3 == 0);
 
-    std::vector<prim_t> primitives;
-
     size_t tris_start = out_tris.size();
     size_t tris_count = vtx_indices_count / 3;
     out_tris.resize(tris_start + tris_count);
 
+    std::vector<prim_t> primitives(tris_count);
+
     const float *positions = attrs;
     size_t attr_stride = AttrStrides[layout];
 
-    for (size_t j = 0; j < vtx_indices_count; j += 3) {
-        float p[9];
+    const int blocks_count = int((tris_count + PrimsPerTask - 1) / PrimsPerTask);
 
-        uint32_t i0 = vtx_indices[j + 0] + base_vertex,
-                 i1 = vtx_indices[j + 1] + base_vertex,
-                 i2 = vtx_indices[j + 2] + base_vertex;
+    ParallelFor(scheduler, 0, blocks_count, [&](int block) {
+        const size_t beg = block * PrimsPerTask,
+                     end = std::min(beg + PrimsPerTask, tris_count);
 
-        memcpy(&p[0], &positions[i0 * attr_stride], 3 * sizeof(float));
-        memcpy(&p[3], &positions[i1 * attr_stride], 3 * sizeof(float));
-        memcpy(&p[6], &positions[i2 * attr_stride], 3 * sizeof(float));
+        for (size_t tri = beg; tri < end; tri++) {
+            const size_t j = tri * 3;
 
-        PreprocessTri(&p[0], 0, &out_tris[tris_start + j / 3]);
+            float p[9];
 
-        Ref::simd_fvec3 _min = min(Ref::simd_fvec3{ &p[0] }, min(Ref::simd_fvec3{ &p[3] }, Ref::simd_fvec3{ &p[6] })),
-                        _max = max(Ref::simd_fvec3{ &p[0] }, max(Ref::simd_fvec3{ &p[3] }, Ref::simd_fvec3{ &p[6] }));
+            uint32_t i0 = vtx_indices[j + 0] + base_vertex,
+                     i1 = vtx_indices[j + 1] + base_vertex,
+                     i2 = vtx_indices[j + 2] + base_vertex;
 
-        primitives.push_back({ i0, i1, i2, _min, _max });
-    }
+            memcpy(&p[0], &positions[i0 * attr_stride], 3 * sizeof(float));
+            memcpy(&p[3], &positions[i1 * attr_stride], 3 * sizeof(float));
+            memcpy(&p[6], &positions[i2 * attr_stride], 3 * sizeof(float));
+
+            PreprocessTri(&p[0], 0, &out_tris[tris_start + tri]);
+
+            Ref::simd_fvec3 _min = min(Ref::simd_fvec3{ &p[0] }, min(Ref::simd_fvec3{ &p[3] }, Ref::simd_fvec3{ &p[6] })),
+                            _max = max(Ref::simd_fvec3{ &p[0] }, max(Ref::simd_fvec3{ &p[3] }, Ref::simd_fvec3{ &p[6] }));
+
+            primitives[tri] = { i0, i1, i2, _min, _max };
+        }
+    });
 
     size_t indices_start = out_tri_indices.size();
     uint32_t num_out_nodes;
     if (!s.use_fast_bvh_build) {
-        num_out_nodes = PreprocessPrims_SAH(&primitives[0], primitives.size(), positions, attr_stride, s, out_nodes, out_tri_indices);
+        num_out_nodes = PreprocessPrims_SAH(&primitives[0], primitives.size(), positions, attr_stride, s, out_nodes, out_tri_indices, scheduler);
     } else {
-        num_out_nodes = PreprocessPrims_HLBVH(&primitives[0], primitives.size(), out_nodes, out_tri_indices);
+        num_out_nodes = PreprocessPrims_HLBVH(&primitives[0], primitives.size(), out_nodes, out_tri_indices, scheduler);
     }
 
     for (size_t i = indices_start; i < out_tri_indices.size(); i++) {
@@ -429,7 +575,8 @@ uint32_t Ray::EmitLBVH_NonRecursive(const prim_t *prims, const uint32_t *indices
 }
 
 uint32_t Ray::PreprocessPrims_SAH(const prim_t *prims, size_t prims_count, const float *positions, size_t stride,
-                                  const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices) {
+                                  const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                                  TaskScheduler *scheduler) {
     struct prims_coll_t {
         std::vector<uint32_t> indices;
         Ref::simd_fvec3 min = { std::numeric_limits<float>::max() }, max = { std::numeric_limits<float>::lowest() };
@@ -439,97 +586,110 @@ uint32_t Ray::PreprocessPrims_SAH(const prim_t *prims, size_t prims_count, const
         }
     };
 
-    std::deque<prims_coll_t> prim_lists;
-    prim_lists.emplace_back();
+    std::vector<prims_coll_t> cur_level(1), next_level;
+    std::vector<split_data_t> split_results;
 
     size_t num_nodes = out_nodes.size();
     uint32_t root_node_index = static_cast<uint32_t>(num_nodes);
 
     for (uint32_t j = 0; j < static_cast<uint32_t>(prims_count); j++) {
-        prim_lists.back().indices.push_back(j);
-        prim_lists.back().min = min(prim_lists.back().min, prims[j].bbox_min);
-        prim_lists.back().max = max(prim_lists.back().max, prims[j].bbox_max);
+        cur_level.back().indices.push_back(j);
+        cur_level.back().min = min(cur_level.back().min, prims[j].bbox_min);
+        cur_level.back().max = max(cur_level.back().max, prims[j].bbox_max);
     }
 
-    Ref::simd_fvec3 root_min = prim_lists.back().min,
-                    root_max = prim_lists.back().max;
+    Ref::simd_fvec3 root_min = cur_level.back().min,
+                    root_max = cur_level.back().max;
+
+    // Tree is built level by level, nodes of one level are split in parallel and emitted in the same
+    // breadth-first order as sequential build would do, so output does not depend on threads count
+    while (!cur_level.empty()) {
+        split_results.resize(cur_level.size());
 
-    while (!prim_lists.empty()) {
-        split_data_t split_data = SplitPrimitives_SAH(prims, prim_lists.back().indices, positions, stride, prim_lists.back().min, prim_lists.back().max, root_min, root_max, s);
-        prim_lists.pop_back();
+        ParallelFor(scheduler, 0, (int)cur_level.size(), [&](int i) {
+            prims_coll_t &coll = cur_level[i];
+            split_results[i] = SplitPrimitives_SAH(prims, coll.indices, positions, stride, coll.min, coll.max, root_min, root_max, s, scheduler);
+            std::vector<uint32_t>().swap(coll.indices);
+        });
 
+        for (split_data_t &split_data : split_results) {
 #ifdef USE_STACKLESS_BVH_TRAVERSAL
-        uint32_t leaf_index = (uint32_t)out_nodes.size(),
-                 parent_index = 0xffffffff;
-
-        if (leaf_index) {
-            // skip bound checks in debug mode
-            const bvh_node_t *_out_nodes = &out_nodes[0];
-            for (uint32_t i = leaf_index - 1; i >= root_node_index; i--) {
-                if (!(_out_nodes[i].prim_index & LEAF_NODE_BIT) &&
-                    (_out_nodes[i].left_child == leaf_index || (_out_nodes[i].right_child & RIGHT_CHILD_BITS) == leaf_index)) {
-                    parent_index = (uint32_t)i;
-                    break;
+            uint32_t leaf_index = (uint32_t)out_nodes.size(),
+                     parent_index = 0xffffffff;
+
+            if (leaf_index) {
+                // skip bound checks in debug mode
+                const bvh_node_t *_out_nodes = &out_nodes[0];
+                for (uint32_t i = leaf_index - 1; i >= root_node_index; i--) {
+                    if (!(_out_nodes[i].prim_index & LEAF_NODE_BIT) &&
+                        (_out_nodes[i].left_child == leaf_index || (_out_nodes[i].right_child & RIGHT_CHILD_BITS) == leaf_index)) {
+                        parent_index = (uint32_t)i;
+                        break;
+                    }
                 }
             }
-        }
 #endif
 
-        if (split_data.right_indices.empty()) {
-            Ref::simd_fvec3 bbox_min = split_data.left_bounds[0],
-                            bbox_max = split_data.left_bounds[1];
+            if (split_data.right_indices.empty()) {
+                Ref::simd_fvec3 bbox_min = split_data.left_bounds[0],
+                                bbox_max = split_data.left_bounds[1];
 
-            out_nodes.emplace_back();
-            bvh_node_t &n = out_nodes.back();
+                out_nodes.emplace_back();
+                bvh_node_t &n = out_nodes.back();
 
-            n.prim_index = LEAF_NODE_BIT + (uint32_t)out_indices.size();
-            n.prim_count = (uint32_t)split_data.left_indices.size();
-            memcpy(&n.bbox_min[0], &bbox_min[0], 3 * sizeof(float));
-            memcpy(&n.bbox_max[0], &bbox_max[0], 3 * sizeof(float));
+                n.prim_index = LEAF_NODE_BIT + (uint32_t)out_indices.size();
+                n.prim_count = (uint32_t)split_data.left_indices.size();
+                memcpy(&n.bbox_min[0], &bbox_min[0], 3 * sizeof(float));
+                memcpy(&n.bbox_max[0], &bbox_max[0], 3 * sizeof(float));
 #ifdef USE_STACKLESS_BVH_TRAVERSAL
-            n.parent_index = parent_index;
+                n.parent_index = parent_index;
 #endif
-            out_indices.insert(out_indices.end(), split_data.left_indices.begin(), split_data.left_indices.end());
-        } else {
-            uint32_t index = static_cast<uint32_t>(num_nodes);
+                out_indices.insert(out_indices.end(), split_data.left_indices.begin(), split_data.left_indices.end());
+            } else {
+                uint32_t index = static_cast<uint32_t>(num_nodes);
 
-            uint32_t space_axis = 0;
-            Ref::simd_fvec3 c_left = (split_data.left_bounds[0] + split_data.left_bounds[1]) / 2,
-                            c_right = (split_data.right_bounds[0] + split_data.right_bounds[1]) / 2;
+                uint32_t space_axis = 0;
+                Ref::simd_fvec3 c_left = (split_data.left_bounds[0] + split_data.left_bounds[1]) / 2,
+                                c_right = (split_data.right_bounds[0] + split_data.right_bounds[1]) / 2;
 
-            Ref::simd_fvec3 dist = abs(c_left - c_right);
+                Ref::simd_fvec3 dist = abs(c_left - c_right);
 
-            if (dist[0] > dist[1] && dist[0] > dist[2]) {
-                space_axis = 0;
-            } else if (dist[1] > dist[0] && dist[1] > dist[2]) {
-                space_axis = 1;
-            } else {
-                space_axis = 2;
-            }
+                if (dist[0] > dist[1] && dist[0] > dist[2]) {
+                    space_axis = 0;
+                } else if (dist[1] > dist[0] && dist[1] > dist[2]) {
+                    space_axis = 1;
+                } else {
+                    space_axis = 2;
+                }
 
-            Ref::simd_fvec3 bbox_min = min(split_data.left_bounds[0], split_data.right_bounds[0]),
-                            bbox_max = max(split_data.left_bounds[1], split_data.right_bounds[1]);
+                Ref::simd_fvec3 bbox_min = min(split_data.left_bounds[0], split_data.right_bounds[0]),
+                                bbox_max = max(split_data.left_bounds[1], split_data.right_bounds[1]);
 
-            out_nodes.emplace_back();
-            bvh_node_t &n = out_nodes.back();
-            n.left_child = index + 1;
-            n.right_child = (space_axis << 30) + index + 2;
-            memcpy(&n.bbox_min[0], &bbox_min[0], 3 * sizeof(float));
-            memcpy(&n.bbox_max[0], &bbox_max[0], 3 * sizeof(float));
+                out_nodes.emplace_back();
+                bvh_node_t &n = out_nodes.back();
+                n.left_child = index + 1;
+                n.right_child = (space_axis << 30) + index + 2;
+                memcpy(&n.bbox_min[0], &bbox_min[0], 3 * sizeof(float));
+                memcpy(&n.bbox_max[0], &bbox_max[0], 3 * sizeof(float));
 #ifdef USE_STACKLESS_BVH_TRAVERSAL
-            n.parent_index = parent_index;
+                n.parent_index = parent_index;
 #endif
-            prim_lists.emplace_front(std::move(split_data.left_indices), split_data.left_bounds[0], split_data.left_bounds[1]);
-            prim_lists.emplace_front(std::move(split_data.right_indices), split_data.right_bounds[0], split_data.right_bounds[1]);
+                next_level.emplace_back(std::move(split_data.left_indices), split_data.left_bounds[0], split_data.left_bounds[1]);
+                next_level.emplace_back(std::move(split_data.right_indices), split_data.right_bounds[0], split_data.right_bounds[1]);
 
-            num_nodes += 2;
+                num_nodes += 2;
+            }
         }
+
+        std::swap(cur_level, next_level);
+        next_level.clear();
     }
 
     return (uint32_t)(out_nodes.size() - root_node_index);
 }
 
-uint32_t Ray::PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices) {
+uint32_t Ray::PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                                    TaskScheduler *scheduler) {
     std::vector<uint32_t> morton_codes(prims_count);
 
     Ref::simd_fvec3 whole_min = { std::numeric_limits<float>::max() },
@@ -549,19 +709,25 @@ uint32_t Ray::PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std
     const Ref::simd_fvec3 scale = (1 << BitsPerDim) / (whole_max - whole_min);
 
     // compute morton codes
-    for (size_t i = 0; i < prims_count; i++) {
-        Ref::simd_fvec3 center = 0.5f * (prims[i].bbox_min + prims[i].bbox_max);
-        Ref::simd_fvec3 code = (center - whole_min) * scale;
+    const int blocks_count = int((prims_count + PrimsPerTask - 1) / PrimsPerTask);
+    ParallelFor(scheduler, 0, blocks_count, [&](int block) {
+        const size_t beg = block * PrimsPerTask,
+                     end = std::min(beg + PrimsPerTask, prims_count);
 
-        uint32_t x = (uint32_t)code[0],
-                 y = (uint32_t)code[1],
-                 z = (uint32_t)code[2];
+        for (size_t i = beg; i < end; i++) {
+            Ref::simd_fvec3 center = 0.5f * (prims[i].bbox_min + prims[i].bbox_max);
+            Ref::simd_fvec3 code = (center - whole_min) * scale;
 
-        uint32_t mort = EncodeMorton3(x, y, z);
-        morton_codes[i] = mort;
-    }
+            uint32_t x = (uint32_t)code[0],
+                     y = (uint32_t)code[1],
+                     z = (uint32_t)code[2];
+
+            uint32_t mort = EncodeMorton3(x, y, z);
+            morton_codes[i] = mort;
+        }
+    });
 
-    sort_mort_codes(&morton_codes[0], morton_codes.size(), indices);
+    sort_mort_codes(&morton_codes[0], morton_codes.size(), indices, scheduler);
 
     struct treelet_t {
         uint32_t index, count;
@@ -585,10 +751,29 @@ uint32_t Ray::PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std
 
     std::vector<bvh_node_t> bottom_nodes;
 
-    // Build bottom-level hierarchy from each treelet using LBVH
+    // Build bottom-level hierarchy from each treelet using LBVH (treelets are independent and can be built in parallel)
     const int start_bit = 29 - 12;
-    for (treelet_t &tr : treelets) {
-        tr.node_index = EmitLBVH_NonRecursive(prims, indices, &morton_codes[0], tr.index, tr.count, indices_start, start_bit, bottom_nodes);
+
+    std::vector<std::vector<bvh_node_t>> treelet_nodes(treelets.size());
+    ParallelFor(scheduler, 0, (int)treelets.size(), [&](int i) {
+        treelet_t &tr = treelets[i];
+        tr.node_index = EmitLBVH_NonRecursive(prims, indices, &morton_codes[0], tr.index, tr.count, indices_start, start_bit, treelet_nodes[i]);
+    });
+
+    // Gather treelet nodes in single array
+    for (size_t i = 0; i < treelets.size(); i++) {
+        const uint32_t treelet_nodes_start = (uint32_t)bottom_nodes.size();
+
+        for (bvh_node_t &n : treelet_nodes[i]) {
+            if (!(n.prim_index & LEAF_NODE_BIT)) {
+                n.left_child += treelet_nodes_start;
+                n.right_child += treelet_nodes_start;
+            }
+        }
+        treelets[i].node_index += treelet_nodes_start;
+
+        bottom_nodes.insert(bottom_nodes.end(), treelet_nodes[i].begin(), treelet_nodes[i].end());
+        std::vector<bvh_node_t>().swap(treelet_nodes[i]);
     }
 
     std::vector<prim_t> top_prims;
@@ -818,6 +1003,268 @@ uint32_t Ray::FlattenBVH_Recursive(const bvh_node_t *nodes, uint32_t node_index,
     return new_node_index;
 }
 
+uint32_t Ray::PreprocessLights(const light_t *lights, size_t lights_count, std::vector<light_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                               TaskScheduler *scheduler) {
+    const uint32_t nodes_offset = static_cast<uint32_t>(out_nodes.size()),
+                   indices_offset = static_cast<uint32_t>(out_indices.size());
+
+    std::vector<prim_t> primitives;
+    primitives.reserve(lights_count);
+
+    for (size_t i = 0; i < lights_count; i++) {
+        const light_t &l = lights[i];
+
+        const float influence = l.radius * (std::sqrt(l.brightness / LIGHT_ATTEN_CUTOFF) - 1.0f);
+
+        // bounds are found in local space of light (Y axis points along l.dir), light is emitted towards -Y.
+        // Point is lit if it is closer than (influence + radius) to light center and inside of cone with apex
+        // somewhere inside of light sphere, so cone is made longer and expanded by light radius
+        const float ext = influence + 2.0f * l.radius;
+
+        Ref::simd_fvec3 bbox_min = { 0.0f }, bbox_max = { 0.0f };
+
+        const Ref::simd_fvec3 p1 = { 0.0f, -ext, 0.0f },
+                              p2 = { 0.0f, -l.spot * ext, 0.0f };
+
+        bbox_min = min(bbox_min, p1);
+        bbox_max = max(bbox_max, p1);
+
+        const float d = std::sqrt(std::max(1.0f - l.spot * l.spot, 0.0f)) * ext;
+
+        bbox_min = min(bbox_min, p2 - Ref::simd_fvec3{ d, 0.0f, d });
+        bbox_max = max(bbox_max, p2 + Ref::simd_fvec3{ d, 0.0f, d });
+
+        if (l.spot < 0.0f) {
+            bbox_min = min(bbox_min, p1 - Ref::simd_fvec3{ ext, 0.0f, ext });
+            bbox_max = max(bbox_max, p1 + Ref::simd_fvec3{ ext, 0.0f, ext });
+        }
+
+        bbox_min = max(bbox_min - Ref::simd_fvec3{ l.radius }, Ref::simd_fvec3{ -influence - l.radius });
+        bbox_max = min(bbox_max + Ref::simd_fvec3{ l.radius }, Ref::simd_fvec3{ influence + l.radius });
+
+        const Ref::simd_fvec3 dir = { l.dir };
+
+        // axis which is the least aligned with light direction
+        Ref::simd_fvec3 up = { 0.0f, 0.0f, 1.0f };
+        if (std::abs(l.dir[0]) <= std::abs(l.dir[1]) && std::abs(l.dir[0]) <= std::abs(l.dir[2])) {
+            up = { 1.0f, 0.0f, 0.0f };
+        } else if (std::abs(l.dir[1]) <= std::abs(l.dir[2])) {
+            up = { 0.0f, 1.0f, 0.0f };
+        }
+
+        const Ref::simd_fvec3 side = normalize(cross(dir, up));
+        up = cross(side, dir);
+
+        const float xform[16] = { side[0],  side[1],  side[2],  0.0f,
+                                  dir[0],   dir[1],   dir[2],   0.0f,
+                                  up[0],    up[1],    up[2],    0.0f,
+                                  l.pos[0], l.pos[1], l.pos[2], 1.0f };
+
+        primitives.emplace_back();
+        prim_t &prim = primitives.back();
+
+        prim.i0 = prim.i1 = prim.i2 = 0;
+        TransformBoundingBox(&bbox_min[0], &bbox_max[0], xform, &prim.bbox_min[0], &prim.bbox_max[0]);
+
+        // rotated box should not be larger than bounds of influence sphere
+        prim.bbox_min = max(prim.bbox_min, Ref::simd_fvec3{ l.pos } - Ref::simd_fvec3{ influence + l.radius });
+        prim.bbox_max = min(prim.bbox_max, Ref::simd_fvec3{ l.pos } + Ref::simd_fvec3{ influence + l.radius });
+    }
+
+    std::vector<bvh_node_t> temp_nodes;
+    std::vector<uint32_t> temp_indices;
+    PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, temp_nodes, temp_indices, scheduler);
+
+    out_indices.insert(out_indices.end(), temp_indices.begin(), temp_indices.end());
+    out_nodes.resize(nodes_offset + temp_nodes.size());
+
+    // children are always placed after their parent, so aggregates can be computed in one backward pass
+    for (uint32_t i = static_cast<uint32_t>(temp_nodes.size()); i-- > 0; ) {
+        const bvh_node_t &src = temp_nodes[i];
+        light_node_t &dst = out_nodes[nodes_offset + i];
+
+        memcpy(&dst.bbox_min[0], &src.bbox_min[0], 3 * sizeof(float));
+        memcpy(&dst.bbox_max[0], &src.bbox_max[0], 3 * sizeof(float));
+
+        float theta;
+
+        if (src.prim_index & LEAF_NODE_BIT) {
+            const uint32_t prim_index = (src.prim_index & PRIM_INDEX_BITS);
+
+            dst.prim_index = LEAF_NODE_BIT + indices_offset + prim_index;
+            dst.prim_count = (src.prim_count & PRIM_COUNT_BITS);
+
+            dst.power = 0.0f;
+            for (uint32_t j = prim_index; j < prim_index + dst.prim_count; j++) {
+                const light_t &l = lights[temp_indices[j]];
+
+                const float l_axis[3] = { -l.dir[0], -l.dir[1], -l.dir[2] },
+                            l_theta = (l.spot > -1.0f) ? safe_acos(l.spot) : PI;
+
+                if (j == prim_index) {
+                    memcpy(dst.center, l.pos, 3 * sizeof(float));
+                    dst.radius = l.radius;
+                    memcpy(dst.axis, l_axis, 3 * sizeof(float));
+                    theta = l_theta;
+                } else {
+                    MergeBoundingSpheres(dst.center, dst.radius, l.pos, l.radius, dst.center, dst.radius);
+                    MergeCones(dst.axis, theta, l_axis, l_theta, dst.axis, theta);
+                }
+                dst.power += light_power(l);
+            }
+        } else {
+            dst.left_child = nodes_offset + src.left_child;
+            dst.right_child = nodes_offset + (src.right_child & RIGHT_CHILD_BITS);
+
+            const light_node_t &ch0 = out_nodes[dst.left_child],
+                               &ch1 = out_nodes[dst.right_child];
+
+            MergeBoundingSpheres(ch0.center, ch0.radius, ch1.center, ch1.radius, dst.center, dst.radius);
+
+            const float theta0 = (ch0.cos_theta > -1.0f) ? safe_acos(ch0.cos_theta) : PI,
+                        theta1 = (ch1.cos_theta > -1.0f) ? safe_acos(ch1.cos_theta) : PI;
+            MergeCones(ch0.axis, theta0, ch1.axis, theta1, dst.axis, theta);
+
+            dst.power = ch0.power + ch1.power;
+        }
+
+        dst.cos_theta = (theta < PI) ? std::cos(theta) : -1.0f;
+    }
+
+    return static_cast<uint32_t>(temp_nodes.size());
+}
+
+uint32_t Ray::SampleLightTree(const light_node_t *nodes, uint32_t root_index, const light_t *lights, const uint32_t *li_indices,
+                              const float p[3], const float n[3], float &inout_rand, float &out_pdf) {
+    out_pdf = 0.0f;
+    if (root_index == 0xffffffff) return 0xffffffff;
+
+    const Ref::simd_fvec3 _p = { p }, _n = { n };
+
+    const light_node_t *cur = &nodes[root_index];
+    if (EstimateLightImportance(*cur, _p, _n) <= 0.0f) return 0xffffffff;
+
+    float pdf = 1.0f;
+
+    // descend choosing child proportionally to its importance
+    while (!(cur->prim_index & LEAF_NODE_BIT)) {
+        const light_node_t &ch0 = nodes[cur->left_child], &ch1 = nodes[cur->right_child];
+
+        const float importance0 = EstimateLightImportance(ch0, _p, _n),
+                    importance1 = EstimateLightImportance(ch1, _p, _n);
+        if (importance0 + importance1 <= 0.0f) return 0xffffffff;
+
+        const float prob0 = importance0 / (importance0 + importance1);
+        if (inout_rand < prob0) {
+            inout_rand = std::min(inout_rand / prob0, OneMinusEps);
+            pdf *= prob0;
+            cur = &ch0;
+        } else {
+            inout_rand = std::min((inout_rand - prob0) / (1.0f - prob0), OneMinusEps);
+            pdf *= (1.0f - prob0);
+            cur = &ch1;
+        }
+    }
+
+    // choose light inside of leaf the same way
+    const uint32_t prim_index = (cur->prim_index & PRIM_INDEX_BITS);
+
+    float total_importance = 0.0f;
+    for (uint32_t i = prim_index; i < prim_index + cur->prim_count; i++) {
+        total_importance += EstimateLightImportance(lights[li_indices[i]], _p, _n);
+    }
+    if (total_importance <= 0.0f) return 0xffffffff;
+
+    const float target = inout_rand * total_importance;
+
+    uint32_t light_index = 0xffffffff;
+    float importance_sum = 0.0f, light_importance = 0.0f;
+    for (uint32_t i = prim_index; i < prim_index + cur->prim_count; i++) {
+        const float importance = EstimateLightImportance(lights[li_indices[i]], _p, _n);
+        if (importance <= 0.0f) continue;
+
+        // last suitable light is taken if target is not reached because of precision issues
+        light_index = li_indices[i];
+        light_importance = importance;
+        if (target < importance_sum + importance) break;
+        importance_sum += importance;
+    }
+
+    inout_rand = std::min(std::max((target - importance_sum) / light_importance, 0.0f), OneMinusEps);
+    out_pdf = pdf * light_importance / total_importance;
+
+    return light_index;
+}
+
+void Ray::CompressBVH(const mbvh_node_t *nodes, uint32_t node_count, cmbvh_node_t *out_nodes) {
+    for (uint32_t n = 0; n < node_count; n++) {
+        const mbvh_node_t &node = nodes[n];
+        cmbvh_node_t &out_node = out_nodes[n];
+
+        memcpy(out_node.child, node.child, sizeof(node.child));
+
+        out_node.child_mask = 0;
+        if (node.child[0] & LEAF_NODE_BIT) {
+            // leaf keeps its own bounds in the first slot
+            out_node.child_mask = 1;
+        } else {
+            for (int i = 0; i < 8; i++) {
+                if (node.child[i] != 0x7fffffff) out_node.child_mask |= (1u << i);
+            }
+        }
+
+        for (int j = 0; j < 3; j++) {
+            float lo = MAX_DIST, hi = -MAX_DIST;
+            for (int i = 0; i < 8; i++) {
+                if (!(out_node.child_mask & (1u << i))) continue;
+                lo = std::min(lo, node.bbox_min[j][i]);
+                hi = std::max(hi, node.bbox_max[j][i]);
+            }
+
+            out_node.origin[j] = lo;
+
+            // smallest power of two scale, which allows to fit whole extent in 8 bits
+            int exp;
+            std::frexp((hi - lo) / 255.0f, &exp);
+            int biased_exp = std::min(std::max(exp + 127, 1), 254);
+
+            for (;;) {
+                const float scale = cmbvh_scale(uint8_t(biased_exp));
+
+                bool fits = true;
+                for (int i = 0; i < 8; i++) {
+                    if (!(out_node.child_mask & (1u << i))) {
+                        // inverted box, never hit (also masked out during traversal)
+                        out_node.bbox_min[j][i] = 255;
+                        out_node.bbox_max[j][i] = 0;
+                        continue;
+                    }
+
+                    // rounding is done outwards, so quantized box always contains original one
+                    int qmin = std::max(int(std::floor((node.bbox_min[j][i] - lo) / scale)), 0);
+                    while (qmin > 0 && lo + float(qmin) * scale > node.bbox_min[j][i]) qmin--;
+
+                    int qmax = int(std::ceil((node.bbox_max[j][i] - lo) / scale));
+                    while (qmax <= 255 && lo + float(qmax) * scale < node.bbox_max[j][i]) qmax++;
+
+                    if (qmax > 255) {
+                        fits = false;
+                        break;
+                    }
+
+                    out_node.bbox_min[j][i] = uint8_t(qmin);
+                    out_node.bbox_max[j][i] = uint8_t(qmax);
+                }
+
+                if (fits || biased_exp == 254) break;
+                biased_exp++;
+            }
+
+            out_node.exponent[j] = uint8_t(biased_exp);
+        }
+    }
+}
+
 bool Ray::NaiivePluckerTest(const float p[9], const float o[3], const float d[3]) {
     // plucker coordinates for edges
     float e0[6] = { p[6] - p[0], p[7] - p[1], p[8] - p[2],
@@ -2,6 +2,10 @@
 
 #include <cstdint>
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "../SceneBase.h"
 #include "../Types.h"
 
@@ -91,6 +95,27 @@ struct alignas(32) mbvh_node_t {
 };
 static_assert(sizeof(mbvh_node_t) == 224, "!");
 
+/* Compressed version of mbvh_node_t, child bounds are stored relative to node origin
+   as 8-bit integers (multiplied by power of two scale, stored separately for each axis) */
+struct alignas(32) cmbvh_node_t {
+    float origin[3];
+    uint8_t exponent[3];        // biased as in IEEE-754 float
+    uint8_t child_mask;         // bit is set for valid child (first bit only for leaf node)
+    uint8_t bbox_min[3][8];
+    uint8_t bbox_max[3][8];
+    uint32_t child[8];
+};
+static_assert(sizeof(cmbvh_node_t) == 96, "!");
+
+// Converts biased exponent of compressed node into scale value
+force_inline float cmbvh_scale(uint8_t exponent) {
+    union {
+        uint32_t i;
+        float f;
+    } ret = { uint32_t(exponent) << 23 };
+    return ret.f;
+}
+
 const int NUM_MIP_LEVELS = 14;
 const int MAX_MIP_LEVEL = NUM_MIP_LEVELS - 1;
 const int MAX_TEXTURE_SIZE = (1 << MAX_MIP_LEVEL);
@@ -137,13 +162,34 @@ struct light_t {
 };
 static_assert(sizeof(light_t) == 48, "!");
 
+// Node of light tree, bounds enclose influence of lights (point outside of node is not lit by any of its lights),
+// aggregated power and orientation are used to estimate importance of node for a given point
+struct light_node_t {
+    float bbox_min[3];
+    union {
+        uint32_t prim_index;    // First bit is used to identify leaf node
+        uint32_t left_child;
+    };
+    float bbox_max[3];
+    union {
+        uint32_t prim_count;
+        uint32_t right_child;
+    };
+    float center[3], radius;    // bounding sphere of light positions
+    float axis[3], cos_theta;   // cone of directions towards lights in which light is emitted (cos_theta == -1 for omni lights)
+    float power;
+};
+static_assert(sizeof(light_node_t) == 68, "!");
+
 struct prim_t;
+class TaskScheduler;
 
 struct bvh_settings_t {
     float oversplit_threshold = 0.95f;
     float node_traversal_cost = 0.025f;
     bool allow_spatial_splits = false;
     bool use_fast_bvh_build = false;
+    int bins_count = 0;     // number of bins per axis for approximate SAH evaluation (0 - sweep through all split positions)
 };
 
 template <typename T>
@@ -177,22 +223,45 @@ void ExtractPlaneNormal(const tri_accel_t &tri, float *out_normal);
 
 // Builds BVH for mesh and precomputes triangle data
 uint32_t PreprocessMesh(const float *attrs, const uint32_t *vtx_indices, size_t vtx_indices_count, eVertexLayout layout, int base_vertex,
-                        const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<tri_accel_t> &out_tris, std::vector<uint32_t> &out_indices);
+                        const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<tri_accel_t> &out_tris, std::vector<uint32_t> &out_indices,
+                        TaskScheduler *scheduler = nullptr);
 
 // Recursively builds linear bvh for a set of primitives
 uint32_t EmitLBVH_Recursive(const prim_t *prims, const uint32_t *indices, const uint32_t *morton_codes, uint32_t prim_index, uint32_t prim_count, uint32_t index_offset, int bit_index, std::vector<bvh_node_t> &out_nodes);
 // Iteratively builds linear bvh for a set of primitives
 uint32_t EmitLBVH_NonRecursive(const prim_t *prims, const uint32_t *indices, const uint32_t *morton_codes, uint32_t prim_index, uint32_t prim_count, uint32_t index_offset, int bit_index, std::vector<bvh_node_t> &out_nodes);
 
-// Builds SAH-based BVH for a set of primitives, slow
+// Builds SAH-based BVH for a set of primitives, slow (nodes of each tree level are split in parallel if scheduler is provided)
 uint32_t PreprocessPrims_SAH(const prim_t *prims, size_t prims_count, const float *positions, size_t stride,
-                             const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices);
+                             const bvh_settings_t &s, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                             TaskScheduler *scheduler = nullptr);
 
 // Builds linear BVH for a set of primitives, fast
-uint32_t PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices);
+uint32_t PreprocessPrims_HLBVH(const prim_t *prims, size_t prims_count, std::vector<bvh_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                               TaskScheduler *scheduler = nullptr);
 
 uint32_t FlattenBVH_Recursive(const bvh_node_t *nodes, uint32_t node_index, uint32_t parent_index, aligned_vector<mbvh_node_t> &out_nodes);
 
+// Builds light tree over influence bounds of lights, root is the first emitted node (returns number of nodes)
+uint32_t PreprocessLights(const light_t *lights, size_t lights_count, std::vector<light_node_t> &out_nodes, std::vector<uint32_t> &out_indices,
+                          TaskScheduler *scheduler = nullptr);
+// Picks one light which can affect point p (with normal n) with probability proportional to estimated contribution,
+// random value is remapped to [0, 1) range afterwards, so it can be reused. Returns light index or 0xffffffff if there is no such light
+uint32_t SampleLightTree(const light_node_t *nodes, uint32_t root_index, const light_t *lights, const uint32_t *li_indices,
+                         const float p[3], const float n[3], float &inout_rand, float &out_pdf);
+
+// Quantizes bounding boxes of wide nodes (node indices are not changed)
+void CompressBVH(const mbvh_node_t *nodes, uint32_t node_count, cmbvh_node_t *out_nodes);
+
+// Restores (conservative) bounding box of compressed node's child
+force_inline void DecompressBBox(const cmbvh_node_t &node, int i, float out_bbox_min[3], float out_bbox_max[3]) {
+    for (int j = 0; j < 3; j++) {
+        const float scale = cmbvh_scale(node.exponent[j]);
+        out_bbox_min[j] = node.origin[j] + float(node.bbox_min[j][i]) * scale;
+        out_bbox_max[j] = node.origin[j] + float(node.bbox_max[j][i]) * scale;
+    }
+}
+
 bool NaiivePluckerTest(const float p[9], const float o[3], const float d[3]);
 
 void ConstructCamera(eCamType type, eFilterType filter, eDeviceType dtype, const float origin[3], const float fwd[3], const float up[3],
@@ -266,6 +335,70 @@ struct ray_chunk_t {
     uint32_t hash, base, size;
 };
 
+struct ray_hash_t {
+    uint32_t hash, index;
+};
+
+// Triangle covering lightmap texel center, barycentrics are linear in texel space, so jittered sample is found without rasterization
+struct lm_texel_t {
+    uint32_t prim_index;        // 0xffffffff if texel is not covered
+    float u, v;                 // barycentrics at texel origin
+    float du_dx, du_dy, dv_dx, dv_dy;
+};
+
+// Triangles of a mesh sorted into square bins of texture space, used to sample lightmap regions without sweeping the whole mesh
+const int TRI_BIN_SIZE = 32;
+
+struct tri_bins_t {
+    uint32_t tris_index, tris_count;
+    int uv_layer, w, h;
+    int bins_x, bins_y;
+    std::vector<uint32_t> offsets;  // range of each bin in 'tris' (bins_x * bins_y + 1 values)
+    std::vector<uint32_t> tris;     // indices are ascending inside of each bin
+
+    // texels of each bin (TRI_BIN_SIZE * TRI_BIN_SIZE), rasterized once on first use and reused by following iterations
+    std::vector<std::unique_ptr<lm_texel_t[]>> texels;
+    std::unique_ptr<std::once_flag[]> texels_once;
+};
+
+// Counters of work done by traversal and shading code, each thread has its own copy
+// (box/triangle tests and stack depth are counted in innermost traversal loops, so they are compiled in
+//  only if RAY_ENABLE_TRAVERSAL_COUNTERS is defined, otherwise they stay zero; traversal lanes are always
+//  counted, once per interior node visited by packet traversal, as hybrid traversal relies on them)
+struct ray_counters_t {
+    unsigned long long box_tests, tri_tests;
+    unsigned long long stack_depth_sum, stack_pops;
+    unsigned long long rays_terminated;
+    unsigned long long traversal_active_lanes, traversal_total_lanes;
+};
+
+extern thread_local ray_counters_t g_ray_counters;
+
+#ifdef RAY_ENABLE_TRAVERSAL_COUNTERS
+#define RAY_TRAVERSAL_COUNTER_ADD(counter, val) (g_ray_counters.counter += (val))
+#else
+#define RAY_TRAVERSAL_COUNTER_ADD(counter, val) ((void)0)
+#endif
+
+// Adds work done by current thread since 'before' snapshot was taken (StatsType is RendererBase::stats_t,
+// template is used only to keep core code independent from renderer interface)
+template <typename StatsType>
+force_inline void AddRayCounters(const ray_counters_t &before, StatsType &st) {
+    st.box_tests += g_ray_counters.box_tests - before.box_tests;
+    st.tri_tests += g_ray_counters.tri_tests - before.tri_tests;
+    st.stack_depth_sum += g_ray_counters.stack_depth_sum - before.stack_depth_sum;
+    st.stack_pops += g_ray_counters.stack_pops - before.stack_pops;
+    st.rays_terminated += g_ray_counters.rays_terminated - before.rays_terminated;
+    st.traversal_active_lanes += g_ray_counters.traversal_active_lanes - before.traversal_active_lanes;
+    st.traversal_total_lanes += g_ray_counters.traversal_total_lanes - before.traversal_total_lanes;
+}
+
+force_inline int count_bits(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return int((((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+}
+
 struct pass_info_t {
     int index, rand_index;
     int iteration, bounce;
@@ -302,12 +435,14 @@ struct scene_data_t {
     const vertex_t          *vertices;
     const bvh_node_t        *nodes;
     const mbvh_node_t       *mnodes;
+    const cmbvh_node_t      *cmnodes;   // compressed mesh trees (if used)
     const tri_accel_t       *tris;
     const uint32_t          *tri_indices;
     const material_t        *materials;
     const texture_t         *textures;
     const light_t           *lights;
     const uint32_t          *li_indices;
+    const light_node_t      *light_nodes;
 };
 
 }
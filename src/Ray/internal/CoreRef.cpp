@@ -9,6 +9,8 @@
 namespace Ray {
 namespace Ref {
 force_inline void _IntersectTri(const ray_packet_t &r, const tri_accel_t &tri, uint32_t i, hit_data_t &inter) {
+    RAY_TRAVERSAL_COUNTER_ADD(tri_tests, 1);
+
     const int _next_u[] = { 1, 0, 0 },
               _next_v[] = { 2, 2, 1 };
 
@@ -61,7 +63,13 @@ force_inline bool is_leaf_node(const mbvh_node_t &node) {
     return (node.child[0] & LEAF_NODE_BIT) != 0;
 }
 
+force_inline bool is_leaf_node(const cmbvh_node_t &node) {
+    return (node.child[0] & LEAF_NODE_BIT) != 0;
+}
+
 force_inline bool bbox_test(const float o[3], const float inv_d[3], const float t, const float bbox_min[3], const float bbox_max[3]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 1);
+
     float lo_x = inv_d[0] * (bbox_min[0] - o[0]);
     float hi_x = inv_d[0] * (bbox_max[0] - o[0]);
     if (lo_x > hi_x) { float tmp = lo_x; lo_x = hi_x; hi_x = tmp; }
@@ -106,6 +114,8 @@ force_inline bool bbox_test_oct(const float p[3], const mbvh_node_t &node, int i
 }
 
 force_inline void bbox_test_oct(const float o[3], const float inv_d[3], const mbvh_node_t &node, int res[8], float dist[8]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 8);
+
     ITERATE_8({
         float lo_x = inv_d[0] * (node.bbox_min[0][i] - o[0]);
         float hi_x = inv_d[0] * (node.bbox_max[0][i] - o[0]);
@@ -131,6 +141,8 @@ force_inline void bbox_test_oct(const float o[3], const float inv_d[3], const mb
 }
 
 force_inline int bbox_test_oct(const float o[3], const float inv_d[3], const float t, const mbvh_node_t &node, float dist[8]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 8);
+
     int mask = 0;
 
     ITERATE_8({
@@ -159,6 +171,44 @@ force_inline int bbox_test_oct(const float o[3], const float inv_d[3], const flo
     return mask;
 }
 
+force_inline int bbox_test_oct(const float o[3], const float inv_d[3], const float t, const cmbvh_node_t &node, float dist[8]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 8);
+
+    // bounds are (origin + q * scale), so ray is transformed into quantized space of node
+    float q_inv_d[3], q_o[3];
+    ITERATE_3({
+        q_inv_d[i] = inv_d[i] * cmbvh_scale(node.exponent[i]);
+        q_o[i] = inv_d[i] * (node.origin[i] - o[i]);
+    })
+
+    int mask = 0;
+
+    ITERATE_8({
+        float lo_x = q_inv_d[0] * float(node.bbox_min[0][i]) + q_o[0];
+        float hi_x = q_inv_d[0] * float(node.bbox_max[0][i]) + q_o[0];
+        if (lo_x > hi_x) { float tmp = lo_x; lo_x = hi_x; hi_x = tmp; }
+
+        float lo_y = q_inv_d[1] * float(node.bbox_min[1][i]) + q_o[1];
+        float hi_y = q_inv_d[1] * float(node.bbox_max[1][i]) + q_o[1];
+        if (lo_y > hi_y) { float tmp = lo_y; lo_y = hi_y; hi_y = tmp; }
+
+        float lo_z = q_inv_d[2] * float(node.bbox_min[2][i]) + q_o[2];
+        float hi_z = q_inv_d[2] * float(node.bbox_max[2][i]) + q_o[2];
+        if (lo_z > hi_z) { float tmp = lo_z; lo_z = hi_z; hi_z = tmp; }
+
+        float tmin = lo_x > lo_y ? lo_x : lo_y;
+        if (lo_z > tmin) tmin = lo_z;
+        float tmax = hi_x < hi_y ? hi_x : hi_y;
+        if (hi_z < tmax) tmax = hi_z;
+        tmax *= 1.00000024f;
+
+        dist[i] = tmin;
+        mask |= ((tmin <= tmax && tmin <= t && tmax > 0) ? 1 : 0) << i;
+    })
+
+    return mask & node.child_mask;
+}
+
 enum eTraversalSource { FromParent, FromChild, FromSibling };
 
 struct stack_entry_t {
@@ -178,10 +228,14 @@ public:
     }
 
     force_inline stack_entry_t pop() {
+        RAY_TRAVERSAL_COUNTER_ADD(stack_depth_sum, stack_size);
+        RAY_TRAVERSAL_COUNTER_ADD(stack_pops, 1);
         return stack[--stack_size];
     }
 
     force_inline uint32_t pop_index() {
+        RAY_TRAVERSAL_COUNTER_ADD(stack_depth_sum, stack_size);
+        RAY_TRAVERSAL_COUNTER_ADD(stack_pops, 1);
         return stack[--stack_size].index;
     }
 
@@ -313,7 +367,8 @@ force_inline float pow5(const float v) {
     return (v * v) * (v * v) * v;
 }
 
-force_inline uint32_t get_ray_hash(const ray_packet_t &r, const float root_min[3], const float cell_size[3]) {
+template <typename T>
+force_inline uint32_t get_ray_hash(const T &r, const float root_min[3], const float cell_size[3]) {
     int x = clamp((int)((r.o[0] - root_min[0]) / cell_size[0]), 0, 255),
         y = clamp((int)((r.o[1] - root_min[1]) / cell_size[1]), 0, 255),
         z = clamp((int)((r.o[2] - root_min[2]) / cell_size[2]), 0, 255);
@@ -356,6 +411,51 @@ force_inline void radix_sort(ray_chunk_t *begin, ray_chunk_t *end, ray_chunk_t *
     _radix_sort_lsb(begin, end, begin1, 24);
 }
 
+template <typename T>
+void sort_rays_cpu(T *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
+                   uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp) {
+    // From "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing" [2010]
+
+    // compute ray hash values
+    for (size_t i = 0; i < rays_count; i++) {
+        hash_values[i] = get_ray_hash(rays[i], root_min, cell_size);
+    }
+
+    size_t chunks_count = 0;
+
+    // compress codes into spans of indentical values (makes sorting stage faster)
+    for (uint32_t start = 0, end = 1; end <= (uint32_t)rays_count; end++) {
+        if (end == (uint32_t)rays_count ||
+            (hash_values[start] != hash_values[end])) {
+            chunks[chunks_count].hash = hash_values[start];
+            chunks[chunks_count].base = start;
+            chunks[chunks_count++].size = end - start;
+            start = end;
+        }
+    }
+
+    radix_sort(&chunks[0], &chunks[0] + chunks_count, &chunks_temp[0]);
+
+    // decompress sorted spans
+    size_t counter = 0;
+    for (uint32_t i = 0; i < chunks_count; i++) {
+        for (uint32_t j = 0; j < chunks[i].size; j++) {
+            scan_values[counter++] = chunks[i].base + j;
+        }
+    }
+
+    {   // reorder rays
+        for (uint32_t i = 0; i < (uint32_t)rays_count; i++) {
+            uint32_t j;
+            while (i != (j = scan_values[i])) {
+                int k = scan_values[j];
+                std::swap(rays[j], rays[k]);
+                std::swap(scan_values[i], scan_values[j]);
+            }
+        }
+    }
+}
+
 force_inline float construct_float(uint32_t m) {
     const uint32_t ieeeMantissa = 0x007FFFFFu; // binary32 mantissa bitmask
     const uint32_t ieeeOne = 0x3F800000u;      // 1.0 in IEEE binary32
@@ -504,28 +604,30 @@ void Ray::Ref::GeneratePrimaryRays(int iteration, const camera_t &cam, const rec
     }
 }
 
-void Ray::Ref::SampleMeshInTextureSpace(int iteration, int obj_index, int uv_layer, const mesh_t &mesh, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
-                                        const rect_t &r, int width, int height, const float *halton, aligned_vector<ray_packet_t> &out_rays, aligned_vector<hit_data_t> &out_inters) {
-    out_rays.resize((size_t)r.w * r.h);
-    out_inters.resize(out_rays.size());
+void Ray::Ref::BinMeshInTextureSpace(int uv_layer, const mesh_t &mesh, const uint32_t *vtx_indices, const vertex_t *vertices, int width, int height, tri_bins_t &out_bins) {
+    out_bins.tris_index = mesh.tris_index;
+    out_bins.tris_count = mesh.tris_count;
+    out_bins.uv_layer = uv_layer;
+    out_bins.w = width;
+    out_bins.h = height;
+    out_bins.bins_x = (width + TRI_BIN_SIZE - 1) / TRI_BIN_SIZE;
+    out_bins.bins_y = (height + TRI_BIN_SIZE - 1) / TRI_BIN_SIZE;
 
-    for (int y = r.y; y < r.y + r.h; y += RayPacketDimY) {
-        for (int x = r.x; x < r.x + r.w; x += RayPacketDimX) {
-            int i = (y - r.y) * r.w + (x - r.x);
+    const int bins_count = out_bins.bins_x * out_bins.bins_y;
 
-            ray_packet_t &out_ray = out_rays[i];
-            hit_data_t &out_inter = out_inters[i];
+    out_bins.offsets.assign(bins_count + 1, 0);
+    out_bins.tris.clear();
 
-            out_ray.xy = (x << 16) | y;
-            out_ray.c[0] = out_ray.c[1] = out_ray.c[2] = 1.0f;
-            out_inter.mask_values[0] = 0;
-            out_inter.xy = out_ray.xy;
-        }
-    }
+    out_bins.texels.clear();
+    out_bins.texels.resize(bins_count);
+    out_bins.texels_once.reset(new std::once_flag[bins_count]);
+
+    const simd_ivec2 irect_min = { 0, 0 }, irect_max = { width - 1, height - 1 };
+    const simd_fvec2 size = { (float)width, (float)height };
+
+    // range of bins covered by each triangle, bounds are calculated the same way as during rasterization
+    std::vector<simd_ivec4> tri_bins(mesh.tris_count);
 
-    simd_ivec2 irect_min = { r.x, r.y }, irect_max = { r.x + r.w - 1, r.y + r.h - 1 };
-    simd_fvec2 size = { (float)width, (float)height };
-    
     for (uint32_t tri = mesh.tris_index; tri < mesh.tris_index + mesh.tris_count; tri++) {
         const vertex_t &v0 = vertices[vtx_indices[tri * 3 + 0]];
         const vertex_t &v1 = vertices[vtx_indices[tri * 3 + 1]];
@@ -535,13 +637,10 @@ void Ray::Ref::SampleMeshInTextureSpace(int iteration, int obj_index, int uv_lay
         const auto t1 = simd_fvec2{ v1.t[uv_layer][0], 1.0f - v1.t[uv_layer][1] } * size;
         const auto t2 = simd_fvec2{ v2.t[uv_layer][0], 1.0f - v2.t[uv_layer][1] } * size;
 
-        simd_fvec2 bbox_min = t0, bbox_max = t0;
+        simd_ivec4 &range = tri_bins[tri - mesh.tris_index];
+        range = { 0, 0, -1, -1 };
 
-        bbox_min = min(bbox_min, t1);
-        bbox_min = min(bbox_min, t2);
-
-        bbox_max = max(bbox_max, t1);
-        bbox_max = max(bbox_max, t2);
+        const simd_fvec2 bbox_min = min(min(t0, t1), t2), bbox_max = max(max(t0, t1), t2);
 
         simd_ivec2 ibbox_min = (simd_ivec2)(bbox_min),
                    ibbox_max = simd_ivec2{ (int)std::round(bbox_max[0]), (int)std::round(bbox_max[1]) };
@@ -549,113 +648,202 @@ void Ray::Ref::SampleMeshInTextureSpace(int iteration, int obj_index, int uv_lay
         if (ibbox_max[0] < irect_min[0] || ibbox_max[1] < irect_min[1] ||
             ibbox_min[0] > irect_max[0] || ibbox_min[1] > irect_max[1]) continue;
 
+        const simd_fvec2 d01 = t0 - t1, d20 = t2 - t0;
+
+        const float area = d01[0] * d20[1] - d20[0] * d01[1];
+        if (area < FLT_EPS) continue;
+
         ibbox_min = max(ibbox_min, irect_min);
         ibbox_max = min(ibbox_max, irect_max);
 
-        const simd_fvec2 d01 = t0 - t1, d12 = t1 - t2, d20 = t2 - t0;
+        range = { ibbox_min[0] / TRI_BIN_SIZE, ibbox_min[1] / TRI_BIN_SIZE, ibbox_max[0] / TRI_BIN_SIZE, ibbox_max[1] / TRI_BIN_SIZE };
 
-        float area = d01[0] * d20[1] - d20[0] * d01[1];
-        if (area < FLT_EPS) continue;
+        for (int by = range[1]; by <= range[3]; by++) {
+            for (int bx = range[0]; bx <= range[2]; bx++) {
+                out_bins.offsets[by * out_bins.bins_x + bx + 1]++;
+            }
+        }
+    }
+
+    for (int b = 0; b < bins_count; b++) {
+        out_bins.offsets[b + 1] += out_bins.offsets[b];
+    }
+
+    out_bins.tris.resize(out_bins.offsets[bins_count]);
+
+    // triangles are written in ascending order, so rasterization order inside of each bin stays the same as for whole mesh
+    std::vector<uint32_t> bin_counters(out_bins.offsets.begin(), out_bins.offsets.end() - 1);
+    for (uint32_t i = 0; i < mesh.tris_count; i++) {
+        const simd_ivec4 &range = tri_bins[i];
+        for (int by = range[1]; by <= range[3]; by++) {
+            for (int bx = range[0]; bx <= range[2]; bx++) {
+                out_bins.tris[bin_counters[by * out_bins.bins_x + bx]++] = mesh.tris_index + i;
+            }
+        }
+    }
+}
+
+void Ray::Ref::UpdateTexelCache(tri_bins_t &bins, const uint32_t *vtx_indices, const vertex_t *vertices, const rect_t &r) {
+    const int uv_layer = bins.uv_layer;
+    const simd_fvec2 size = { (float)bins.w, (float)bins.h };
+
+    const int bin_beg[2] = { r.x / TRI_BIN_SIZE, r.y / TRI_BIN_SIZE },
+              bin_end[2] = { std::min((r.x + r.w - 1) / TRI_BIN_SIZE, bins.bins_x - 1), std::min((r.y + r.h - 1) / TRI_BIN_SIZE, bins.bins_y - 1) };
 
-        float inv_area = 1.0f / area;
+    for (int by = bin_beg[1]; by <= bin_end[1]; by++) {
+        for (int bx = bin_beg[0]; bx <= bin_end[0]; bx++) {
+            const int b = by * bins.bins_x + bx;
 
-        for (int y = ibbox_min[1]; y <= ibbox_max[1]; y++) {
-            for (int x = ibbox_min[0]; x <= ibbox_max[0]; x++) {
-                int i = (y - r.y) * r.w + (x - r.x);
-                ray_packet_t &out_ray = out_rays[i];
-                hit_data_t &out_inter = out_inters[i];
+            // neighbouring regions can share a bin, it is rasterized only once
+            std::call_once(bins.texels_once[b], [&]() {
+                lm_texel_t *texels = new lm_texel_t[TRI_BIN_SIZE * TRI_BIN_SIZE];
+                for (int i = 0; i < TRI_BIN_SIZE * TRI_BIN_SIZE; i++) {
+                    texels[i].prim_index = 0xffffffff;
+                }
+
+                const simd_ivec2 irect_min = { bx * TRI_BIN_SIZE, by * TRI_BIN_SIZE },
+                                 irect_max = { std::min((bx + 1) * TRI_BIN_SIZE, bins.w) - 1, std::min((by + 1) * TRI_BIN_SIZE, bins.h) - 1 };
 
-                if (out_inter.mask_values[0]) continue;
+                for (uint32_t j = bins.offsets[b]; j < bins.offsets[b + 1]; j++) {
+                    const uint32_t tri = bins.tris[j];
 
-                const int index = y * width + x;
-                const int hi = (iteration & (HALTON_SEQ_LEN - 1)) * HALTON_COUNT;
+                    const vertex_t &v0 = vertices[vtx_indices[tri * 3 + 0]];
+                    const vertex_t &v1 = vertices[vtx_indices[tri * 3 + 1]];
+                    const vertex_t &v2 = vertices[vtx_indices[tri * 3 + 2]];
 
-                int hash_val = hash(index);
+                    const auto t0 = simd_fvec2{ v0.t[uv_layer][0], 1.0f - v0.t[uv_layer][1] } * size;
+                    const auto t1 = simd_fvec2{ v1.t[uv_layer][0], 1.0f - v1.t[uv_layer][1] } * size;
+                    const auto t2 = simd_fvec2{ v2.t[uv_layer][0], 1.0f - v2.t[uv_layer][1] } * size;
 
-                float _unused;
-                float _x = float(x) + std::modf(halton[hi + 0] + construct_float(hash_val), &_unused);
-                float _y = float(y) + std::modf(halton[hi + 1] + construct_float(hash(hash_val)), &_unused);
+                    const simd_fvec2 bbox_min = min(min(t0, t1), t2), bbox_max = max(max(t0, t1), t2);
 
-                float u = d01[0] * (_y - t0[1]) - d01[1] * (_x - t0[0]),
-                      v = d12[0] * (_y - t1[1]) - d12[1] * (_x - t1[0]),
-                      w = d20[0] * (_y - t2[1]) - d20[1] * (_x - t2[0]);
+                    simd_ivec2 ibbox_min = (simd_ivec2)(bbox_min),
+                               ibbox_max = simd_ivec2{ (int)std::round(bbox_max[0]), (int)std::round(bbox_max[1]) };
 
-                if (u >= -FLT_EPS && v >= -FLT_EPS && w >= -FLT_EPS) {
-                    const simd_fvec3 p0 = { v0.p }, p1 = { v1.p }, p2 = { v2.p };
-                    const simd_fvec3 n0 = { v0.n }, n1 = { v1.n }, n2 = { v2.n };
+                    ibbox_min = max(ibbox_min, irect_min);
+                    ibbox_max = min(ibbox_max, irect_max);
 
-                    u *= inv_area; v *= inv_area; w *= inv_area;
+                    const simd_fvec2 d01 = t0 - t1, d12 = t1 - t2, d20 = t2 - t0;
 
-                    const simd_fvec3 p = TransformPoint(p0 * v + p1 * w + p2 * u, tr.xform),
-                                     n = TransformNormal(n0 * v + n1 * w + n2 * u, tr.inv_xform);
+                    const float area = d01[0] * d20[1] - d20[0] * d01[1];
+                    const float inv_area = 1.0f / area;
+                    // centers lying exactly on shared edges must not be lost due to rounding
+                    const float edge_eps = -0.0001f * area;
 
-                    const simd_fvec3 o = p + n, d = -n;
+                    for (int y = ibbox_min[1]; y <= ibbox_max[1]; y++) {
+                        for (int x = ibbox_min[0]; x <= ibbox_max[0]; x++) {
+                            lm_texel_t &texel = texels[(y - irect_min[1]) * TRI_BIN_SIZE + (x - irect_min[0])];
+                            if (texel.prim_index != 0xffffffff) continue;
 
-                    memcpy(&out_ray.o[0], value_ptr(o), 3 * sizeof(float));
-                    memcpy(&out_ray.d[0], value_ptr(d), 3 * sizeof(float));
-                    out_ray.ior = 1.0f;
-                    out_ray.do_dx[0] = out_ray.do_dx[1] = out_ray.do_dx[2] = 0.0f;
-                    out_ray.dd_dx[0] = out_ray.dd_dx[1] = out_ray.dd_dx[2] = 0.0f;
-                    out_ray.do_dy[0] = out_ray.do_dy[1] = out_ray.do_dy[2] = 0.0f;
-                    out_ray.dd_dy[0] = out_ray.dd_dy[1] = out_ray.dd_dy[2] = 0.0f;
-                    out_ray.ray_depth = 0;
+                            // coverage is tested at texel center
+                            const float _x = float(x) + 0.5f, _y = float(y) + 0.5f;
 
-                    out_inter.mask_values[0] = 0xffffffff;
-                    out_inter.prim_indices[0] = tri;
-                    out_inter.obj_indices[0] = obj_index;
-                    out_inter.t = 1.0f;
-                    out_inter.u = w;
-                    out_inter.v = u;
+                            const float u = d01[0] * (_y - t0[1]) - d01[1] * (_x - t0[0]),
+                                        v = d12[0] * (_y - t1[1]) - d12[1] * (_x - t1[0]),
+                                        w = d20[0] * (_y - t2[1]) - d20[1] * (_x - t2[0]);
+
+                            if (u >= edge_eps && v >= edge_eps && w >= edge_eps) {
+                                texel.prim_index = tri;
+                                texel.u = (w - 0.5f * (d20[0] - d20[1])) * inv_area;
+                                texel.v = (u - 0.5f * (d01[0] - d01[1])) * inv_area;
+                                texel.du_dx = -d20[1] * inv_area;
+                                texel.du_dy = d20[0] * inv_area;
+                                texel.dv_dx = -d01[1] * inv_area;
+                                texel.dv_dy = d01[0] * inv_area;
+                            }
+                        }
+                    }
                 }
-            }
+
+                bins.texels[b].reset(texels);
+            });
         }
     }
 }
 
-void Ray::Ref::SortRays_CPU(ray_packet_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
-                            uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp) {
-    // From "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing" [2010]
+void Ray::Ref::SampleMeshInTextureSpace(int iteration, int obj_index, const tri_bins_t &bins, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
+                                        const rect_t &r, int width, const float *halton, aligned_vector<ray_packet_t> &out_rays, aligned_vector<hit_data_t> &out_inters) {
+    out_rays.resize((size_t)r.w * r.h);
+    out_inters.resize(out_rays.size());
 
-    // compute ray hash values
-    for (size_t i = 0; i < rays_count; i++) {
-        hash_values[i] = get_ray_hash(rays[i], root_min, cell_size);
-    }
+    const int hi = (iteration & (HALTON_SEQ_LEN - 1)) * HALTON_COUNT;
 
-    size_t chunks_count = 0;
+    for (int y = r.y; y < r.y + r.h; y += RayPacketDimY) {
+        for (int x = r.x; x < r.x + r.w; x += RayPacketDimX) {
+            int i = (y - r.y) * r.w + (x - r.x);
 
-    // compress codes into spans of indentical values (makes sorting stage faster)
-    for (uint32_t start = 0, end = 1; end <= (uint32_t)rays_count; end++) {
-        if (end == (uint32_t)rays_count ||
-            (hash_values[start] != hash_values[end])) {
-            chunks[chunks_count].hash = hash_values[start];
-            chunks[chunks_count].base = start;
-            chunks[chunks_count++].size = end - start;
-            start = end;
-        }
-    }
+            ray_packet_t &out_ray = out_rays[i];
+            hit_data_t &out_inter = out_inters[i];
 
-    radix_sort(&chunks[0], &chunks[0] + chunks_count, &chunks_temp[0]);
+            out_ray.xy = (x << 16) | y;
+            out_ray.c[0] = out_ray.c[1] = out_ray.c[2] = 1.0f;
+            out_inter.mask_values[0] = 0;
+            out_inter.xy = out_ray.xy;
 
-    // decompress sorted spans
-    size_t counter = 0;
-    for (uint32_t i = 0; i < chunks_count; i++) {
-        for (uint32_t j = 0; j < chunks[i].size; j++) {
-            scan_values[counter++] = chunks[i].base + j;
-        }
-    }
+            const int b = (y / TRI_BIN_SIZE) * bins.bins_x + (x / TRI_BIN_SIZE);
+            const lm_texel_t &texel = bins.texels[b][(y % TRI_BIN_SIZE) * TRI_BIN_SIZE + (x % TRI_BIN_SIZE)];
+            if (texel.prim_index == 0xffffffff) continue;
 
-    {   // reorder rays
-        for (uint32_t i = 0; i < (uint32_t)rays_count; i++) {
-            uint32_t j;
-            while (i != (j = scan_values[i])) {
-                int k = scan_values[j];
-                std::swap(rays[j], rays[k]);
-                std::swap(scan_values[i], scan_values[j]);
+            const int index = y * width + x;
+            int hash_val = hash(index);
+
+            float _unused;
+            const float jx = std::modf(halton[hi + 0] + construct_float(hash_val), &_unused);
+            const float jy = std::modf(halton[hi + 1] + construct_float(hash(hash_val)), &_unused);
+
+            // jittered sample is kept inside of cached triangle
+            float u = std::max(texel.u + texel.du_dx * jx + texel.du_dy * jy, 0.0f),
+                  v = std::max(texel.v + texel.dv_dx * jx + texel.dv_dy * jy, 0.0f);
+            if (u + v > 1.0f) {
+                u /= (u + v);
+                v = 1.0f - u;
             }
+
+            const uint32_t tri = texel.prim_index;
+
+            const vertex_t &v0 = vertices[vtx_indices[tri * 3 + 0]];
+            const vertex_t &v1 = vertices[vtx_indices[tri * 3 + 1]];
+            const vertex_t &v2 = vertices[vtx_indices[tri * 3 + 2]];
+
+            const simd_fvec3 p0 = { v0.p }, p1 = { v1.p }, p2 = { v2.p };
+            const simd_fvec3 n0 = { v0.n }, n1 = { v1.n }, n2 = { v2.n };
+
+            const float w = 1.0f - u - v;
+
+            const simd_fvec3 p = TransformPoint(p0 * w + p1 * u + p2 * v, tr.xform),
+                             n = TransformNormal(n0 * w + n1 * u + n2 * v, tr.inv_xform);
+
+            const simd_fvec3 o = p + n, d = -n;
+
+            memcpy(&out_ray.o[0], value_ptr(o), 3 * sizeof(float));
+            memcpy(&out_ray.d[0], value_ptr(d), 3 * sizeof(float));
+            out_ray.ior = 1.0f;
+            out_ray.do_dx[0] = out_ray.do_dx[1] = out_ray.do_dx[2] = 0.0f;
+            out_ray.dd_dx[0] = out_ray.dd_dx[1] = out_ray.dd_dx[2] = 0.0f;
+            out_ray.do_dy[0] = out_ray.do_dy[1] = out_ray.do_dy[2] = 0.0f;
+            out_ray.dd_dy[0] = out_ray.dd_dy[1] = out_ray.dd_dy[2] = 0.0f;
+            out_ray.ray_depth = 0;
+
+            out_inter.mask_values[0] = 0xffffffff;
+            out_inter.prim_indices[0] = tri;
+            out_inter.obj_indices[0] = obj_index;
+            out_inter.t = 1.0f;
+            out_inter.u = u;
+            out_inter.v = v;
         }
     }
 }
 
+void Ray::Ref::SortRays_CPU(ray_packet_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
+                            uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp) {
+    sort_rays_cpu(rays, rays_count, root_min, cell_size, hash_values, scan_values, chunks, chunks_temp);
+}
+
+void Ray::Ref::SortRays_CPU(shadow_ray_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
+                            uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp) {
+    sort_rays_cpu(rays, rays_count, root_min, cell_size, hash_values, scan_values, chunks, chunks_temp);
+}
+
 void Ray::Ref::SortRays_GPU(ray_packet_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
                             uint32_t *hash_values, int *head_flags, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp, uint32_t *skeleton) {
     // From "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing" [2010]
@@ -1130,14 +1318,14 @@ bool Ray::Ref::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, co
     return res;
 }
 
-bool Ray::Ref::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index,
-                                                       const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                       const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+namespace Ray {
+namespace Ref {
+// Traversal of wide trees is shared between full precision and compressed nodes
+template <typename OctNodeType>
+bool Traverse_MicroTree_WithStack_ClosestHit_Oct(const ray_packet_t &r, const float inv_d[3], const OctNodeType *nodes, uint32_t root_index,
+                                                 const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
     bool res = false;
 
-    float inv_d[3];
-    safe_invert(r.d, inv_d);
-
     TraversalStack<MAX_STACK_SIZE> st;
     st.push(root_index, 0.0f);
 
@@ -1202,84 +1390,18 @@ TRAVERSE:
                 goto TRAVERSE;
             }
         } else {
-            uint32_t prim_index = (nodes[cur.index].child[0] & PRIM_INDEX_BITS);
-            for (uint32_t i = prim_index; i < prim_index + nodes[cur.index].child[1]; i++) {
-                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
-                const mesh_t &m = meshes[mi.mesh_index];
-                const transform_t &tr = transforms[mi.tr_index];
-
-                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
-
-                ray_packet_t _r = TransformRay(r, tr.inv_xform);
-
-                const float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
-                res |= Traverse_MicroTree_WithStack_ClosestHit(_r, _inv_d, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
-            }
-        }
-    }
-
-    return res;
-}
-
-bool Ray::Ref::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const bvh_node_t *nodes, uint32_t root_index,
-                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
-    bool res = false;
-
-    float inv_d[3];
-    safe_invert(r.d, inv_d);
-
-    uint32_t stack[MAX_STACK_SIZE];
-    uint32_t stack_size = 0;
-
-    stack[stack_size++] = root_index;
-
-    while (stack_size) {
-        uint32_t cur = stack[--stack_size];
-
-        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
-
-        if (!is_leaf_node(nodes[cur])) {
-            stack[stack_size++] = far_child(r, nodes[cur]);
-            stack[stack_size++] = near_child(r, nodes[cur]);
-        } else {
-            uint32_t prim_index = (nodes[cur].prim_index & PRIM_INDEX_BITS);
-            for (uint32_t i = prim_index; i < prim_index + nodes[cur].prim_count; i++) {
-                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
-                const mesh_t &m = meshes[mi.mesh_index];
-                const transform_t &tr = transforms[mi.tr_index];
-
-                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
-
-                ray_packet_t _r = TransformRay(r, tr.inv_xform);
-
-                float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
-
-                bool hit_found = Traverse_MicroTree_WithStack_AnyHit(_r, _inv_d, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
-                res |= hit_found;
-                if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
-                    return true;
-                }
-            }
+            res |= IntersectTris_ClosestHit(r, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
         }
     }
 
     return res;
 }
 
-bool Ray::Ref::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index,
-                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+template <typename OctNodeType>
+bool Traverse_MicroTree_WithStack_AnyHit_Oct(const ray_packet_t &r, const float inv_d[3], const OctNodeType *nodes, uint32_t root_index,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
     bool res = false;
 
-    const int ray_dir_oct = ((r.d[2] > 0.0f) << 2) | ((r.d[1] > 0.0f) << 1) | (r.d[0] > 0.0f);
-
-    int child_order[8];
-    ITERATE_8({ child_order[i] = i ^ ray_dir_oct; })
-
-    float inv_d[3];
-    safe_invert(r.d, inv_d);
-
     TraversalStack<MAX_STACK_SIZE> st;
     st.push(root_index, 0.0f);
 
@@ -1299,7 +1421,7 @@ TRAVERSE:
                     goto TRAVERSE;
                 }
 
-                int i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
+                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
                 if (mask == 0) { // two boxes were hit
                     if (dist[i] < dist[i2]) {
                         st.push(nodes[cur.index].child[i2], dist[i2]);
@@ -1344,22 +1466,10 @@ TRAVERSE:
                 goto TRAVERSE;
             }
         } else {
-            uint32_t prim_index = (nodes[cur.index].child[0] & PRIM_INDEX_BITS);
-            for (uint32_t i = prim_index; i < prim_index + nodes[cur.index].child[1]; i++) {
-                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
-                const mesh_t &m = meshes[mi.mesh_index];
-                const transform_t &tr = transforms[mi.tr_index];
-
-                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
-
-                ray_packet_t _r = TransformRay(r, tr.inv_xform);
-
-                const float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
-                bool hit_found = Traverse_MicroTree_WithStack_ClosestHit(_r, _inv_d, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
-                res |= hit_found;
-                if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
-                    return true;
-                }
+            bool hit_found = IntersectTris_AnyHit(r, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
+            res |= hit_found;
+            if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
+                break;
             }
         }
     }
@@ -1367,34 +1477,14 @@ TRAVERSE:
     return res;
 }
 
-bool Ray::Ref::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
-                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+template <typename MeshNodeType>
+bool Traverse_MacroTree_WithStack_ClosestHit_Oct(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index, const MeshNodeType *mesh_nodes,
+                                                 const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                 const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
     bool res = false;
 
-    uint32_t stack[MAX_STACK_SIZE];
-    uint32_t stack_size = 0;
-
-    stack[stack_size++] = root_index;
-
-    while (stack_size) {
-        uint32_t cur = stack[--stack_size];
-
-        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
-
-        if (!is_leaf_node(nodes[cur])) {
-            stack[stack_size++] = far_child(r, nodes[cur]);
-            stack[stack_size++] = near_child(r, nodes[cur]);
-        } else {
-            res |= IntersectTris_ClosestHit(r, tris, &tri_indices[nodes[cur].prim_index & PRIM_INDEX_BITS], nodes[cur].prim_count, obj_index, inter);
-        }
-    }
-
-    return res;
-}
-
-bool Ray::Ref::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
-                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
-    bool res = false;
+    float inv_d[3];
+    safe_invert(r.d, inv_d);
 
     TraversalStack<MAX_STACK_SIZE> st;
     st.push(root_index, 0.0f);
@@ -1460,47 +1550,39 @@ TRAVERSE:
                 goto TRAVERSE;
             }
         } else {
-            res |= IntersectTris_ClosestHit(r, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
-        }
-    }
-
-    return res;
-}
-
-bool Ray::Ref::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
-                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
-    bool res = false;
-
-    uint32_t stack[MAX_STACK_SIZE];
-    uint32_t stack_size = 0;
-
-    stack[stack_size++] = root_index;
+            uint32_t prim_index = (nodes[cur.index].child[0] & PRIM_INDEX_BITS);
+            for (uint32_t i = prim_index; i < prim_index + nodes[cur.index].child[1]; i++) {
+                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
+                const mesh_t &m = meshes[mi.mesh_index];
+                const transform_t &tr = transforms[mi.tr_index];
 
-    while (stack_size) {
-        uint32_t cur = stack[--stack_size];
+                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
 
-        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
+                ray_packet_t _r = TransformRay(r, tr.inv_xform);
 
-        if (!is_leaf_node(nodes[cur])) {
-            stack[stack_size++] = far_child(r, nodes[cur]);
-            stack[stack_size++] = near_child(r, nodes[cur]);
-        } else {
-            bool hit_found = IntersectTris_AnyHit(r, tris, &tri_indices[nodes[cur].prim_index & PRIM_INDEX_BITS], nodes[cur].prim_count, obj_index, inter);
-            res |= hit_found;
-            if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
-                break;
+                const float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
+                res |= Traverse_MicroTree_WithStack_ClosestHit_Oct(_r, _inv_d, mesh_nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
             }
-            
         }
     }
 
     return res;
 }
 
-bool Ray::Ref::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
-                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+template <typename MeshNodeType>
+bool Traverse_MacroTree_WithStack_AnyHit_Oct(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index, const MeshNodeType *mesh_nodes,
+                                             const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
     bool res = false;
 
+    const int ray_dir_oct = ((r.d[2] > 0.0f) << 2) | ((r.d[1] > 0.0f) << 1) | (r.d[0] > 0.0f);
+
+    int child_order[8];
+    ITERATE_8({ child_order[i] = i ^ ray_dir_oct; })
+
+    float inv_d[3];
+    safe_invert(r.d, inv_d);
+
     TraversalStack<MAX_STACK_SIZE> st;
     st.push(root_index, 0.0f);
 
@@ -1520,7 +1602,7 @@ TRAVERSE:
                     goto TRAVERSE;
                 }
 
-                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
+                int i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
                 if (mask == 0) { // two boxes were hit
                     if (dist[i] < dist[i2]) {
                         st.push(nodes[cur.index].child[i2], dist[i2]);
@@ -1565,17 +1647,176 @@ TRAVERSE:
                 goto TRAVERSE;
             }
         } else {
-            bool hit_found = IntersectTris_AnyHit(r, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
+            uint32_t prim_index = (nodes[cur.index].child[0] & PRIM_INDEX_BITS);
+            for (uint32_t i = prim_index; i < prim_index + nodes[cur.index].child[1]; i++) {
+                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
+                const mesh_t &m = meshes[mi.mesh_index];
+                const transform_t &tr = transforms[mi.tr_index];
+
+                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
+
+                ray_packet_t _r = TransformRay(r, tr.inv_xform);
+
+                const float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
+                bool hit_found = Traverse_MicroTree_WithStack_ClosestHit_Oct(_r, _inv_d, mesh_nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
+                res |= hit_found;
+                if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return res;
+}
+}
+}
+
+bool Ray::Ref::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index,
+                                                       const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+    return Traverse_MacroTree_WithStack_ClosestHit_Oct(r, nodes, root_index, nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+bool Ray::Ref::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index, const cmbvh_node_t *mesh_nodes,
+                                                       const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+    return Traverse_MacroTree_WithStack_ClosestHit_Oct(r, nodes, root_index, mesh_nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+bool Ray::Ref::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const bvh_node_t *nodes, uint32_t root_index,
+                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+    bool res = false;
+
+    float inv_d[3];
+    safe_invert(r.d, inv_d);
+
+    uint32_t stack[MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    stack[stack_size++] = root_index;
+
+    while (stack_size) {
+        uint32_t cur = stack[--stack_size];
+
+        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
+
+        if (!is_leaf_node(nodes[cur])) {
+            stack[stack_size++] = far_child(r, nodes[cur]);
+            stack[stack_size++] = near_child(r, nodes[cur]);
+        } else {
+            uint32_t prim_index = (nodes[cur].prim_index & PRIM_INDEX_BITS);
+            for (uint32_t i = prim_index; i < prim_index + nodes[cur].prim_count; i++) {
+                const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
+                const mesh_t &m = meshes[mi.mesh_index];
+                const transform_t &tr = transforms[mi.tr_index];
+
+                if (!bbox_test(r.o, inv_d, inter.t, mi.bbox_min, mi.bbox_max)) continue;
+
+                ray_packet_t _r = TransformRay(r, tr.inv_xform);
+
+                float _inv_d[3] = { 1.0f / _r.d[0], 1.0f / _r.d[1], 1.0f / _r.d[2] };
+
+                bool hit_found = Traverse_MicroTree_WithStack_AnyHit(_r, _inv_d, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter);
+                res |= hit_found;
+                if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return res;
+}
+
+bool Ray::Ref::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index,
+                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+    return Traverse_MacroTree_WithStack_AnyHit_Oct(r, nodes, root_index, nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+bool Ray::Ref::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index, const cmbvh_node_t *mesh_nodes,
+                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter) {
+    return Traverse_MacroTree_WithStack_AnyHit_Oct(r, nodes, root_index, mesh_nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+bool Ray::Ref::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    bool res = false;
+
+    uint32_t stack[MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    stack[stack_size++] = root_index;
+
+    while (stack_size) {
+        uint32_t cur = stack[--stack_size];
+
+        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
+
+        if (!is_leaf_node(nodes[cur])) {
+            stack[stack_size++] = far_child(r, nodes[cur]);
+            stack[stack_size++] = near_child(r, nodes[cur]);
+        } else {
+            res |= IntersectTris_ClosestHit(r, tris, &tri_indices[nodes[cur].prim_index & PRIM_INDEX_BITS], nodes[cur].prim_count, obj_index, inter);
+        }
+    }
+
+    return res;
+}
+
+bool Ray::Ref::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    return Traverse_MicroTree_WithStack_ClosestHit_Oct(r, inv_d, nodes, root_index, tris, tri_indices, obj_index, inter);
+}
+
+bool Ray::Ref::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const cmbvh_node_t *nodes, uint32_t root_index,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    return Traverse_MicroTree_WithStack_ClosestHit_Oct(r, inv_d, nodes, root_index, tris, tri_indices, obj_index, inter);
+}
+
+bool Ray::Ref::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    bool res = false;
+
+    uint32_t stack[MAX_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    stack[stack_size++] = root_index;
+
+    while (stack_size) {
+        uint32_t cur = stack[--stack_size];
+
+        if (!bbox_test(r.o, inv_d, inter.t, nodes[cur])) continue;
+
+        if (!is_leaf_node(nodes[cur])) {
+            stack[stack_size++] = far_child(r, nodes[cur]);
+            stack[stack_size++] = near_child(r, nodes[cur]);
+        } else {
+            bool hit_found = IntersectTris_AnyHit(r, tris, &tri_indices[nodes[cur].prim_index & PRIM_INDEX_BITS], nodes[cur].prim_count, obj_index, inter);
             res |= hit_found;
             if (hit_found && (tris[inter.prim_indices[0]].ci & TRI_SOLID_BIT)) {
                 break;
             }
+            
         }
     }
 
     return res;
 }
 
+bool Ray::Ref::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    return Traverse_MicroTree_WithStack_AnyHit_Oct(r, inv_d, nodes, root_index, tris, tri_indices, obj_index, inter);
+}
+
+bool Ray::Ref::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const cmbvh_node_t *nodes, uint32_t root_index,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter) {
+    return Traverse_MicroTree_WithStack_AnyHit_Oct(r, inv_d, nodes, root_index, tris, tri_indices, obj_index, inter);
+}
+
 float Ray::Ref::BRDF_OrenNayar(const simd_fvec3 &L, const simd_fvec3 &I, const simd_fvec3 &N, const simd_fvec3 &T, float sigma) {
     float sigma_sqr = sigma * sigma;
     float A = 1.0f - (sigma_sqr / (2.0f * (sigma_sqr + 0.33f)));
@@ -1656,10 +1897,10 @@ Ray::Ref::simd_fvec4 Ray::Ref::SampleBilinear(const TextureAtlas &atlas, const t
 
     int page = t.page[lod];
 
-    const pixel_color8_t &p00 = atlas.Get(page, int(_uvs[0]) + 0, int(_uvs[1]) + 0);
-    const pixel_color8_t &p01 = atlas.Get(page, int(_uvs[0]) + 1, int(_uvs[1]) + 0);
-    const pixel_color8_t &p10 = atlas.Get(page, int(_uvs[0]) + 0, int(_uvs[1]) + 1);
-    const pixel_color8_t &p11 = atlas.Get(page, int(_uvs[0]) + 1, int(_uvs[1]) + 1);
+    pixel_color8_t p[4];
+    atlas.Get2x2(page, int(_uvs[0]), int(_uvs[1]), p);
+
+    const pixel_color8_t &p00 = p[0], &p01 = p[1], &p10 = p[2], &p11 = p[3];
 
     float kx = _uvs[0] - std::floor(_uvs[0]), ky = _uvs[1] - std::floor(_uvs[1]);
 
@@ -1678,10 +1919,10 @@ Ray::Ref::simd_fvec4 Ray::Ref::SampleBilinear(const TextureAtlas &atlas, const t
 }
 
 Ray::Ref::simd_fvec4 Ray::Ref::SampleBilinear(const TextureAtlas &atlas, const simd_fvec2 &uvs, int page) {
-    const pixel_color8_t &p00 = atlas.Get(page, int(uvs[0]) + 0, int(uvs[1]) + 0);
-    const pixel_color8_t &p01 = atlas.Get(page, int(uvs[0]) + 1, int(uvs[1]) + 0);
-    const pixel_color8_t &p10 = atlas.Get(page, int(uvs[0]) + 0, int(uvs[1]) + 1);
-    const pixel_color8_t &p11 = atlas.Get(page, int(uvs[0]) + 1, int(uvs[1]) + 1);
+    pixel_color8_t p[4];
+    atlas.Get2x2(page, int(uvs[0]), int(uvs[1]), p);
+
+    const pixel_color8_t &p00 = p[0], &p01 = p[1], &p10 = p[2], &p11 = p[3];
 
     simd_fvec2 k = uvs - floor(uvs);
     
@@ -1798,16 +2039,13 @@ Ray::Ref::simd_fvec4 Ray::Ref::SampleLatlong_RGBE(const TextureAtlas &atlas, con
     return (p1X * k[1] + p0X * (1 - k[1]));
 }
 
-float Ray::Ref::ComputeVisibility(const simd_fvec3 &p1, const simd_fvec3 &p2, const float *halton, const int hi, int rand_hash2,
-                                  const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas) {
-    simd_fvec3 dir = p2 - p1;
-    float dist = length(dir);
-    dir /= dist;
+float Ray::Ref::ComputeVisibility(const shadow_ray_t &sh_r, const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas) {
+    float dist = sh_r.dist;
 
     ray_packet_t r;
 
-    memcpy(&r.o[0], value_ptr(p1), 3 * sizeof(float));
-    memcpy(&r.d[0], value_ptr(dir), 3 * sizeof(float));
+    memcpy(&r.o[0], &sh_r.o[0], 3 * sizeof(float));
+    memcpy(&r.d[0], &sh_r.d[0], 3 * sizeof(float));
     
     float visibility = 1.0f;
 
@@ -1815,7 +2053,9 @@ float Ray::Ref::ComputeVisibility(const simd_fvec3 &p1, const simd_fvec3 &p2, co
         hit_data_t sh_inter;
         sh_inter.t = dist;
 
-        if (sc.mnodes) {
+        if (sc.cmnodes) {
+            Traverse_MacroTree_WithStack_AnyHit(r, sc.mnodes, node_index, sc.cmnodes, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter);
+        } else if (sc.mnodes) {
             Traverse_MacroTree_WithStack_AnyHit(r, sc.mnodes, node_index, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter);
         } else {
             Traverse_MacroTree_WithStack_AnyHit(r, sc.nodes, node_index, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter);
@@ -1860,22 +2100,18 @@ float Ray::Ref::ComputeVisibility(const simd_fvec3 &p1, const simd_fvec3 &p2, co
         }
 
         if (!skip) {
-            int sh_rand_hash = hash(rand_hash2);
-            float sh_rand_offset = construct_float(sh_rand_hash);
-
-            float _sh_unused;
-            float sh_r = std::modf(halton[hi] + sh_rand_offset, &_sh_unused);
+            float mix_rand = sh_r.rand;
 
             // resolve mix material
             while (mat->type == MixMaterial) {
                 float mix_val = SampleBilinear(tex_atlas, sc.textures[mat->textures[MAIN_TEXTURE]], sh_uvs, 0)[0] * mat->strength;
 
-                if (sh_r > mix_val) {
+                if (mix_rand > mix_val) {
                     mat = &sc.materials[mat->textures[MIX_MAT1]];
-                    sh_r = (sh_r - mix_val) / (1.0f - mix_val);
+                    mix_rand = (mix_rand - mix_val) / (1.0f - mix_val);
                 } else {
                     mat = &sc.materials[mat->textures[MIX_MAT2]];
-                    sh_r = sh_r / mix_val;
+                    mix_rand = mix_rand / mix_val;
                 }
             }
 
@@ -1896,18 +2132,15 @@ float Ray::Ref::ComputeVisibility(const simd_fvec3 &p1, const simd_fvec3 &p2, co
 }
 
 void Ray::Ref::AcumulateLightContribution(const light_t &l, const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
-                                          const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas,
-                                          float sigma, const float *halton, const int hi, int rand_hash2, float rand_offset, float rand_offset2, simd_fvec3 &col) {
+                                          float sigma, float rand_z, float rand_phi, float rand_vis, const simd_fvec3 &weight, int xy,
+                                          shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count) {
     simd_fvec3 L = P - simd_fvec3(l.pos);
     float distance = length(L);
     float d = std::max(distance - l.radius, 0.0f);
     L /= distance;
 
-    float _unused;
-    const float z = std::modf(halton[hi + 0] + rand_offset, &_unused);
-
-    const float dir = std::sqrt(z);
-    const float phi = 2 * PI * std::modf(halton[hi + 1] + rand_offset2, &_unused);
+    const float dir = std::sqrt(rand_z);
+    const float phi = 2 * PI * rand_phi;
 
     const float cos_phi = std::cos(phi), sin_phi = std::sin(phi);
 
@@ -1927,67 +2160,44 @@ void Ray::Ref::AcumulateLightContribution(const light_t &l, const simd_fvec3 &I,
     float _dot2 = dot(L, simd_fvec3{ l.dir });
 
     if (_dot1 > FLT_EPS && _dot2 > l.spot && (l.brightness * atten) > FLT_EPS) {
-        float visibility = ComputeVisibility(P + HIT_BIAS * plane_N, simd_fvec3(l.pos), halton, hi, rand_hash2, sc, node_index, tex_atlas);
-        col += simd_fvec3(l.col) * _dot1 * visibility * atten * BRDF_OrenNayar(L, I, N, B, sigma);
+        const simd_fvec3 o = P + HIT_BIAS * plane_N;
+        simd_fvec3 d = simd_fvec3(l.pos) - o;
+        const float dist = length(d);
+        d /= dist;
+
+        const simd_fvec3 c = weight * simd_fvec3(l.col) * _dot1 * atten * BRDF_OrenNayar(L, I, N, B, sigma);
+
+        // visibility is resolved later, when all shadow rays are traced in one batch
+        const int index = (*out_shadow_rays_count)++;
+        shadow_ray_t &sh_r = out_shadow_rays[index];
+
+        memcpy(&sh_r.o[0], value_ptr(o), 3 * sizeof(float));
+        memcpy(&sh_r.d[0], value_ptr(d), 3 * sizeof(float));
+        sh_r.dist = dist;
+        memcpy(&sh_r.c[0], value_ptr(c), 3 * sizeof(float));
+        sh_r.rand = rand_vis;
+        sh_r.xy = xy;
     }
 }
 
-Ray::Ref::simd_fvec3 Ray::Ref::ComputeDirectLighting(const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
-                                                     float sigma, const float *halton, const int hi, int rand_hash, int rand_hash2, float rand_offset, float rand_offset2,
-                                                     const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const TextureAtlas &tex_atlas) {
+void Ray::Ref::ComputeDirectLighting(const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
+                                     float sigma, const float *halton, const int hi, int rand_hash, int rand_hash2, float rand_offset, float rand_offset2,
+                                     const scene_data_t &sc, uint32_t light_node_index, const simd_fvec3 &weight, int xy,
+                                     shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count) {
     unused(rand_hash);
 
-    simd_fvec3 col = { 0.0f };
-
-    uint32_t stack[MAX_STACK_SIZE];
-    uint32_t stack_size = 0;
-
-    if (light_node_index != 0xffffffff) {
-        stack[stack_size++] = light_node_index;
-    }
-
-    if (sc.mnodes) {
-        while (stack_size) {
-            uint32_t cur = stack[--stack_size];
-
-            if (!is_leaf_node(sc.mnodes[cur])) {
-                bool res[8];
-                for (int i = 0; i < 8; i++) {
-                    res[i] = bbox_test_oct(value_ptr(P), sc.mnodes[cur], i);
-                }
-
-                for (int i = 0; i < 8; i++) {
-                    if (!res[i]) continue;
-                    stack[stack_size++] = sc.mnodes[cur].child[i];
-                }
-            } else {
-                uint32_t prim_index = (sc.mnodes[cur].child[0] & PRIM_INDEX_BITS);
-                for (uint32_t i = prim_index; i < prim_index + sc.mnodes[cur].child[1]; i++) {
-                    const light_t &l = sc.lights[sc.li_indices[i]];
-                    AcumulateLightContribution(l, I, P, N, B, plane_N, sc, node_index, tex_atlas, sigma, halton, hi, rand_hash2, rand_offset, rand_offset2, col);
-                }
-            }
-        }
-    } else {
-        while (stack_size) {
-            uint32_t cur = stack[--stack_size];
-
-            if (!bbox_test(value_ptr(P), sc.nodes[cur])) continue;
+    float _unused;
+    float u = std::modf(halton[hi + 0] + rand_offset, &_unused);
+    const float rand_phi = std::modf(halton[hi + 1] + rand_offset2, &_unused);
+    const float rand_vis = std::modf(halton[hi + 0] + construct_float(hash(rand_hash2)), &_unused);
 
-            if (!is_leaf_node(sc.nodes[cur])) {
-                stack[stack_size++] = sc.nodes[cur].left_child;
-                stack[stack_size++] = (sc.nodes[cur].right_child & RIGHT_CHILD_BITS);
-            } else {
-                uint32_t prim_index = (sc.nodes[cur].prim_index & PRIM_INDEX_BITS);
-                for (uint32_t i = prim_index; i < prim_index + sc.nodes[cur].prim_count; i++) {
-                    const light_t &l = sc.lights[sc.li_indices[i]];
-                    AcumulateLightContribution(l, I, P, N, B, plane_N, sc, node_index, tex_atlas, sigma, halton, hi, rand_hash2, rand_offset, rand_offset2, col);
-                }
-            }
-        }
-    }
+    // the same random number is used to pick the light and then point on it (it is remapped during tree descent)
+    float pdf;
+    const uint32_t light_index = SampleLightTree(sc.light_nodes, light_node_index, sc.lights, sc.li_indices, value_ptr(P), value_ptr(N), u, pdf);
+    if (light_index == 0xffffffff) return;
 
-    return col;
+    AcumulateLightContribution(sc.lights[light_index], I, P, N, B, plane_N, sigma, u, rand_phi, rand_vis, weight / pdf, xy,
+                               out_shadow_rays, out_shadow_rays_count);
 }
 
 void Ray::Ref::ComputeDerivatives(const simd_fvec3 &I, float t, const simd_fvec3 &do_dx, const simd_fvec3 &do_dy, const simd_fvec3 &dd_dx, const simd_fvec3 &dd_dy,
@@ -2053,8 +2263,9 @@ void Ray::Ref::ComputeDerivatives(const simd_fvec3 &I, float t, const simd_fvec3
 
 
 Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_t &inter, const ray_packet_t &ray, const float *halton,
-                                          const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const TextureAtlas &tex_atlas,
-                                          ray_packet_t *out_secondary_rays, int *out_secondary_rays_count) {
+                                          const scene_data_t &sc, uint32_t light_node_index, const TextureAtlas &tex_atlas,
+                                          ray_packet_t *out_secondary_rays, int *out_secondary_rays_count,
+                                          shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count) {
     if (!inter.mask_values[0]) {
         simd_fvec4 env_col = { 0.0f };
         if (pi.should_add_environment()) {
@@ -2193,12 +2404,13 @@ Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_
     // Evaluate materials
     if (mat->type == DiffuseMaterial) {
         if (pi.should_add_direct_light()) {
-            col = ComputeDirectLighting(I, P, N, B, plane_N, mat->roughness, halton, hi, rand_hash, rand_hash2, rand_offset, rand_offset2,
-                                        sc, node_index, light_node_index, tex_atlas);
-
+            simd_fvec3 weight = simd_fvec3(ray.c);
             if (pi.should_consider_albedo()) {
-                col *= simd_fvec3(&albedo[0]);
+                weight *= simd_fvec3(&albedo[0]);
             }
+
+            ComputeDirectLighting(I, P, N, B, plane_N, mat->roughness, halton, hi, rand_hash, rand_hash2, rand_offset, rand_offset2,
+                                  sc, light_node_index, weight, ray.xy, out_shadow_rays, out_shadow_rays_count);
         }
 
         if (diff_depth < pi.settings.max_diff_depth && total_depth < pi.settings.max_total_depth) {
@@ -2252,6 +2464,8 @@ Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_
                 r.c[0] /= 1.0f - q; r.c[1] /= 1.0f - q; r.c[2] /= 1.0f - q;
                 const int index = (*out_secondary_rays_count)++;
                 out_secondary_rays[index] = r;
+            } else {
+                g_ray_counters.rays_terminated++;
             }
         }
     } else if (mat->type == GlossyMaterial) {
@@ -2302,6 +2516,8 @@ Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_
                 r.c[0] /= 1.0f - q; r.c[1] /= 1.0f - q; r.c[2] /= 1.0f - q;
                 const int index = (*out_secondary_rays_count)++;
                 out_secondary_rays[index] = r;
+            } else {
+                g_ray_counters.rays_terminated++;
             }
         }
     } else if (mat->type == RefractiveMaterial) {
@@ -2354,6 +2570,8 @@ Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_
                 r.c[0] /= 1.0f - q; r.c[1] /= 1.0f - q; r.c[2] /= 1.0f - q;
                 const int index = (*out_secondary_rays_count)++;
                 out_secondary_rays[index] = r;
+            } else {
+                g_ray_counters.rays_terminated++;
             }
         }
     } else if (mat->type == EmissiveMaterial) {
@@ -2383,6 +2601,8 @@ Ray::pixel_color_t Ray::Ref::ShadeSurface(const pass_info_t &pi, const hit_data_
                 r.c[0] /= 1.0f - q; r.c[1] /= 1.0f - q; r.c[2] /= 1.0f - q;
                 const int index = (*out_secondary_rays_count)++;
                 out_secondary_rays[index] = r;
+            } else {
+                g_ray_counters.rays_terminated++;
             }
         }
     }
@@ -44,6 +44,18 @@ struct ray_packet_t {
     int ray_depth;
 };
 
+// Shadow ray emitted during shading, contribution is added to pixel if ray reaches the light
+struct shadow_ray_t {
+    // origin and direction
+    float o[3], d[3];
+    // distance to light and contribution of light
+    float dist, c[3];
+    // random number used to resolve mix materials along the way
+    float rand;
+    // 16-bit pixel coordinates of ray ((x << 16) | y)
+    int xy;
+};
+
 const int RayPacketDimX = 1;
 const int RayPacketDimY = 1;
 const int RayPacketSize = 1;
@@ -71,12 +83,17 @@ using TextureAtlas = TextureAtlasTiled;
 
 // Generation of rays
 void GeneratePrimaryRays(int iteration, const camera_t &cam, const rect_t &r, int w, int h, const float *halton, aligned_vector<ray_packet_t> &out_rays);
-void SampleMeshInTextureSpace(int iteration, int obj_index, int uv_layer, const mesh_t &mesh, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
-                              const rect_t &r, int w, int h, const float *halton, aligned_vector<ray_packet_t> &out_rays, aligned_vector<hit_data_t> &out_inters);
+void BinMeshInTextureSpace(int uv_layer, const mesh_t &mesh, const uint32_t *vtx_indices, const vertex_t *vertices, int w, int h, tri_bins_t &out_bins);
+// rasterizes texels of bins overlapped by rect (if not done before), can be called from several threads
+void UpdateTexelCache(tri_bins_t &bins, const uint32_t *vtx_indices, const vertex_t *vertices, const rect_t &r);
+void SampleMeshInTextureSpace(int iteration, int obj_index, const tri_bins_t &bins, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
+                              const rect_t &r, int w, const float *halton, aligned_vector<ray_packet_t> &out_rays, aligned_vector<hit_data_t> &out_inters);
 
 // Sorting of rays
 void SortRays_CPU(ray_packet_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
                   uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp);
+void SortRays_CPU(shadow_ray_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
+                  uint32_t *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp);
 void SortRays_GPU(ray_packet_t *rays, size_t rays_count, const float root_min[3], const float cell_size[3],
                   uint32_t *hash_values, int *head_flags, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp, uint32_t *skeleton);
 
@@ -112,21 +129,32 @@ bool Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const bvh_no
 bool Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const mbvh_node_t *oct_nodes, uint32_t root_index,
                                              const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
                                              const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter);
+// same as above, but mesh trees are stored separately in compressed form
+bool Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t &r, const mbvh_node_t *oct_nodes, uint32_t root_index, const cmbvh_node_t *mesh_nodes,
+                                             const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter);
 bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const bvh_node_t *nodes, uint32_t root_index,
                                          const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter);
 bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index,
                                          const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter);
+bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t &r, const mbvh_node_t *nodes, uint32_t root_index, const cmbvh_node_t *mesh_nodes,
+                                         const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                         const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t &inter);
 // traditional bvh traversal with stack for inner nodes
 bool Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
                                              const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
 bool Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
                                              const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
+bool Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t &r, const float inv_d[3], const cmbvh_node_t *nodes, uint32_t root_index,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
 bool Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const bvh_node_t *nodes, uint32_t root_index,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
 bool Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const mbvh_node_t *nodes, uint32_t root_index,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
+bool Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t &r, const float inv_d[3], const cmbvh_node_t *nodes, uint32_t root_index,
+                                         const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t &inter);
 
 // BRDFs
 float BRDF_OrenNayar(const simd_fvec3 &L, const simd_fvec3 &I, const simd_fvec3 &N, const simd_fvec3 &B, float sigma);
@@ -145,17 +173,19 @@ simd_fvec4 SampleTrilinear(const TextureAtlas &atlas, const texture_t &t, const
 simd_fvec4 SampleAnisotropic(const TextureAtlas &atlas, const texture_t &t, const simd_fvec2 &uvs, const simd_fvec2 &duv_dx, const simd_fvec2 &duv_dy);
 simd_fvec4 SampleLatlong_RGBE(const TextureAtlas &atlas, const texture_t &t, const simd_fvec3 &dir);
 
-// Get visibility between two points accounting for transparent materials
-float ComputeVisibility(const simd_fvec3 &p1, const simd_fvec3 &p2, const float *halton, const int hi, int rand_hash2,
-                        const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas);
+// Get visibility along shadow ray accounting for transparent materials
+float ComputeVisibility(const shadow_ray_t &r, const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas);
 
-// Compute punctual lights contribution
+// Compute punctual light contribution (rand_z and rand_phi are used to pick point on light's sphere),
+// shadow ray is emitted if light is not blocked by surface itself
 void AcumulateLightContribution(const light_t &l, const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
-                                const scene_data_t &sc, uint32_t node_index, const TextureAtlas &tex_atlas,
-                                float sigma, const float *halton, const int hi, int rand_hash2, float rand_offset, float rand_offset2, simd_fvec3 &col);
-simd_fvec3 ComputeDirectLighting(const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
-                                 float sigma, const float *halton, const int hi, int rand_hash, int rand_hash2, float rand_offset, float rand_offset2,
-                                 const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const TextureAtlas &tex_atlas);
+                                float sigma, float rand_z, float rand_phi, float rand_vis, const simd_fvec3 &weight, int xy,
+                                shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count);
+// Estimate lights contribution using one light picked from light tree
+void ComputeDirectLighting(const simd_fvec3 &I, const simd_fvec3 &P, const simd_fvec3 &N, const simd_fvec3 &B, const simd_fvec3 &plane_N,
+                           float sigma, const float *halton, const int hi, int rand_hash, int rand_hash2, float rand_offset, float rand_offset2,
+                           const scene_data_t &sc, uint32_t light_node_index, const simd_fvec3 &weight, int xy,
+                           shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count);
 
 // Compute derivatives at hit point
 void ComputeDerivatives(const simd_fvec3 &I, float t, const simd_fvec3 &do_dx, const simd_fvec3 &do_dy, const simd_fvec3 &dd_dx, const simd_fvec3 &dd_dy,
@@ -163,7 +193,8 @@ void ComputeDerivatives(const simd_fvec3 &I, float t, const simd_fvec3 &do_dx, c
 
 // Shade
 Ray::pixel_color_t ShadeSurface(const pass_info_t &pi, const hit_data_t &inter, const ray_packet_t &ray, const float *halton,
-                                const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const TextureAtlas &tex_atlas,
-                                ray_packet_t *out_secondary_rays, int *out_secondary_rays_count);
+                                const scene_data_t &sc, uint32_t light_node_index, const TextureAtlas &tex_atlas,
+                                ray_packet_t *out_secondary_rays, int *out_secondary_rays_count,
+                                shadow_ray_t *out_shadow_rays, int *out_shadow_rays_count);
 }
 }
\ No newline at end of file
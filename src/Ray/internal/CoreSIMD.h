@@ -6,6 +6,7 @@
 
 #include <vector>
 
+#include "TaskScheduler.h"
 #include "TextureAtlasRef.h"
 
 #include "simd/simd_vec.h"
@@ -45,6 +46,19 @@ struct ray_packet_t {
     simd_ivec<S> ray_depth;
 };
 
+// Shadow rays emitted during shading, contribution is added to pixel if ray reaches the light
+template <int S>
+struct shadow_ray_t {
+    // origins and directions of rays in packet
+    simd_fvec<S> o[3], d[3];
+    // distances to light and contributions of light
+    simd_fvec<S> dist, c[3];
+    // random numbers used to resolve mix materials along the way
+    simd_fvec<S> rand;
+    // 16-bit pixel coordinates of rays in packet ((x << 16) | y)
+    simd_ivec<S> xy;
+};
+
 template <int S>
 struct hit_data_t {
     simd_ivec<S> mask;
@@ -55,6 +69,8 @@ struct hit_data_t {
     simd_ivec<S> xy;
 
     hit_data_t(eUninitialize) {}
+    // containers are resized with a copied value, so that this is not called from allocator
+    // (it is compiled without AVX-512 target and can not inline it)
     force_inline hit_data_t() {
         mask = { 0 };
         obj_index = { -1 };
@@ -75,13 +91,24 @@ struct derivatives_t {
 template <int DimX, int DimY>
 void GeneratePrimaryRays(const int iteration, const camera_t &cam, const rect_t &r, int w, int h, const float *halton, aligned_vector<ray_packet_t<DimX * DimY>> &out_rays);
 template <int DimX, int DimY>
-void SampleMeshInTextureSpace(int iteration, int obj_index, int uv_layer, const mesh_t &mesh, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
-                              const rect_t &r, int w, int h, const float *halton, aligned_vector<ray_packet_t<DimX * DimY>> &out_rays, aligned_vector<hit_data_t<DimX * DimY>> &out_inters);
+void SampleMeshInTextureSpace(int iteration, int obj_index, const tri_bins_t &bins, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
+                              const rect_t &r, int w, const float *halton, aligned_vector<ray_packet_t<DimX * DimY>> &out_rays, aligned_vector<hit_data_t<DimX * DimY>> &out_inters);
 
 // Sorting rays
+// (hash, index) pairs of active lanes are sorted, rays itself are not touched, returns number of active lanes
+template <int S>
+int SortRays_CPU(const ray_packet_t<S> *rays, const simd_ivec<S> *ray_masks, int rays_count, const float root_min[3], const float cell_size[3],
+                 ray_hash_t *hashes, ray_hash_t *hashes_temp, TaskScheduler *scheduler);
+template <int S>
+int SortRays_CPU(const shadow_ray_t<S> *rays, const simd_ivec<S> *ray_masks, int rays_count, const float root_min[3], const float cell_size[3],
+                 ray_hash_t *hashes, ray_hash_t *hashes_temp, TaskScheduler *scheduler);
+// moves lanes of rays to new packets in sorted order, returns number of output packets
+template <int S>
+int GatherRays(const ray_packet_t<S> *rays, const simd_ivec<S> *ray_masks, const ray_hash_t *hashes, int hashes_count,
+               ray_packet_t<S> *out_rays, simd_ivec<S> *out_ray_masks, TaskScheduler *scheduler);
 template <int S>
-void SortRays_CPU(ray_packet_t<S> *rays, simd_ivec<S> *ray_masks, int &secondary_rays_count, const float root_min[3], const float cell_size[3],
-                  simd_ivec<S> *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp);
+int GatherRays(const shadow_ray_t<S> *rays, const simd_ivec<S> *ray_masks, const ray_hash_t *hashes, int hashes_count,
+               shadow_ray_t<S> *out_rays, simd_ivec<S> *out_ray_masks, TaskScheduler *scheduler);
 template <int S>
 void SortRays_GPU(ray_packet_t<S> *rays, simd_ivec<S> *ray_masks, int &secondary_rays_count, const float root_min[3], const float cell_size[3],
                   simd_ivec<S> *hash_values, int *head_flags, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp, uint32_t *skeleton);
@@ -122,6 +149,20 @@ template <int S>
 bool Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index,
                                              const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
                                              const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter);
+// same as above, but mesh trees are stored separately in compressed form
+template <int S>
+bool Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                             const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter);
+// wide bvh traversal of the whole packet at once (for coherent rays, functions above trace lanes of packet one by one)
+template <int S>
+bool Traverse_MacroTree_WithPacketStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index,
+                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter);
+template <int S>
+bool Traverse_MacroTree_WithPacketStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                                   const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                   const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter);
 template <int S>
 bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const bvh_node_t *nodes, uint32_t node_index,
                                          const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
@@ -130,6 +171,10 @@ template <int S>
 bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index,
                                          const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit);
+template <int S>
+bool Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *mnodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                         const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                         const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit);
 // traditional bvh traversal with stack for inner nodes
 template <int S>
 bool Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const bvh_node_t *nodes, uint32_t node_index,
@@ -138,11 +183,17 @@ template <int S>
 bool Traverse_MicroTree_WithStack_ClosestHit(const float ro[3], const float rd[3], int i, const mbvh_node_t *mnodes, uint32_t node_index,
                                              const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter);
 template <int S>
+bool Traverse_MicroTree_WithStack_ClosestHit(const float ro[3], const float rd[3], int i, const cmbvh_node_t *mnodes, uint32_t node_index,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter);
+template <int S>
 bool Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const bvh_node_t *nodes, uint32_t node_index,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit);
 template <int S>
 bool Traverse_MicroTree_WithStack_AnyHit(const float ro[3], const float rd[3], int i, const mbvh_node_t *mnodes, uint32_t node_index,
                                          const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit);
+template <int S>
+bool Traverse_MicroTree_WithStack_AnyHit(const float ro[3], const float rd[3], int i, const cmbvh_node_t *mnodes, uint32_t node_index,
+                                         const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit);
 
 // BRDFs
 template <int S>
@@ -174,18 +225,17 @@ void SampleAnisotropic(const Ref::TextureAtlas &atlas, const texture_t &t, const
 template <int S>
 void SampleLatlong_RGBE(const Ref::TextureAtlas &atlas, const texture_t &t, const simd_fvec<S> dir[3], const simd_ivec<S> &mask, simd_fvec<S> out_rgb[3]);
 
-// Get visibility between two points accounting for transparent materials
+// Get visibility along shadow rays accounting for transparent materials
 template <int S>
-simd_fvec<S> ComputeVisibility(const simd_fvec<S> p1[3], const simd_fvec<S> p2[3], const simd_ivec<S> &mask,
-                               const float *halton, const int hi, const simd_ivec<S> &rand_hash2,
-                               const scene_data_t &sc, uint32_t node_index, const Ref::TextureAtlas &tex_atlas);
+simd_fvec<S> ComputeVisibility(const shadow_ray_t<S> &r, const simd_ivec<S> &mask, const scene_data_t &sc, uint32_t node_index, const Ref::TextureAtlas &tex_atlas);
 
-// Compute punctual lights contribution
+// Compute punctual lights contribution, lanes of shadow ray packet are filled for lights which are not blocked by surface itself
 template <int S>
 void ComputeDirectLighting(const simd_fvec<S> I[3], const simd_fvec<S> P[3], const simd_fvec<S> N[3], const simd_fvec<S> B[3], const simd_fvec<S> plane_N[3], const simd_fvec<S> &sigma,
                            const float *halton, const int hi, const simd_ivec<S> &rand_hash, const simd_ivec<S> &rand_hash2,
-                           const simd_fvec<S> &rand_offset, const simd_fvec<S> &rand_offset2, const scene_data_t &sc, uint32_t node_index,
-                           uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas, const simd_ivec<S> &ray_mask, simd_fvec<S> *out_col);
+                           const simd_fvec<S> &rand_offset, const simd_fvec<S> &rand_offset2, const scene_data_t &sc,
+                           uint32_t light_node_index, const simd_fvec<S> weight[3], const simd_ivec<S> &ray_mask,
+                           shadow_ray_t<S> &out_shadow_ray, simd_ivec<S> &out_shadow_mask);
 
 // Compute derivatives at hit point
 template <int S>
@@ -196,8 +246,9 @@ void ComputeDerivatives(const simd_fvec<S> I[3], const simd_fvec<S> &t, const si
 // Shade
 template <int S>
 void ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi, const float *halton, const hit_data_t<S> &inter, const ray_packet_t<S> &ray,
-                  const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas,
-                  simd_fvec<S> out_rgba[4], simd_ivec<S> *out_secondary_masks, ray_packet_t<S> *out_secondary_rays, int *out_secondary_rays_count);
+                  const scene_data_t &sc, uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas,
+                  simd_fvec<S> out_rgba[4], simd_ivec<S> *out_secondary_masks, ray_packet_t<S> *out_secondary_rays, int *out_secondary_rays_count,
+                  simd_ivec<S> *out_shadow_masks, shadow_ray_t<S> *out_shadow_rays, int *out_shadow_rays_count);
 }
 }
 
@@ -209,6 +260,8 @@ namespace Ray {
 namespace NS {
 template <int S>
 force_inline simd_ivec<S> _IntersectTri(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const tri_accel_t &tri, uint32_t prim_index, hit_data_t<S> &inter) {
+    RAY_TRAVERSAL_COUNTER_ADD(tri_tests, S);
+
     const int _next_u[] = { 1, 0, 0 },
               _next_v[] = { 2, 2, 1 };
 
@@ -261,6 +314,8 @@ force_inline simd_ivec<S> _IntersectTri(const ray_packet_t<S> &r, const simd_ive
 
 template <int S>
 force_inline bool _IntersectTri(const float o[3], const float d[3], int i, const tri_accel_t &tri, uint32_t prim_index, hit_data_t<S> &inter) {
+    RAY_TRAVERSAL_COUNTER_ADD(tri_tests, 1);
+
     const int _next_u[] = { 1, 0, 0 },
               _next_v[] = { 2, 2, 1 };
 
@@ -298,6 +353,8 @@ force_inline bool _IntersectTri(const float o[3], const float d[3], int i, const
 
 template <int S>
 force_inline simd_ivec<S> bbox_test(const simd_fvec<S> o[3], const simd_fvec<S> inv_d[3], const simd_fvec<S> &t, const float _bbox_min[3], const float _bbox_max[3]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, S);
+
     simd_fvec<S> low, high, tmin, tmax;
     
     low = inv_d[0] * (_bbox_min[0] - o[0]);
@@ -323,6 +380,8 @@ force_inline simd_ivec<S> bbox_test(const simd_fvec<S> o[3], const simd_fvec<S>
 
 template <int S>
 force_inline simd_ivec<S> bbox_test_fma(const simd_fvec<S> inv_d[3], const simd_fvec<S> neg_inv_d_o[3], const simd_fvec<S> &t, const float _bbox_min[3], const float _bbox_max[3]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, S);
+
     simd_fvec<S> low, high, tmin, tmax;
 
     low = fma(inv_d[0], _bbox_min[0], neg_inv_d_o[0]);
@@ -348,6 +407,8 @@ force_inline simd_ivec<S> bbox_test_fma(const simd_fvec<S> inv_d[3], const simd_
 
 template <int S>
 force_inline void bbox_test_oct(const float inv_d[3], const float neg_inv_d_o[3], const float t, const simd_fvec<S> bbox_min[3], const simd_fvec<S> bbox_max[3], simd_ivec<S> &out_mask, simd_fvec<S> &out_dist) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, S);
+
     simd_fvec<S> low, high, tmin, tmax;
 
     low = fma(inv_d[0], bbox_min[0], neg_inv_d_o[0]);
@@ -373,37 +434,67 @@ force_inline void bbox_test_oct(const float inv_d[3], const float neg_inv_d_o[3]
 
 template <int S>
 force_inline long bbox_test_oct(const float inv_d[3], const float neg_inv_d_o[3], const float t, const float bbox_min[3][8], const float bbox_max[3][8], float out_dist[8]) {
-    simd_fvec<S> low, high, tmin, tmax;
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 8);
+
+    // node has only 8 children, so wider packets use 8-wide vectors here
+    const int W = S > 8 ? 8 : S;
+
+    simd_fvec<W> low, high, tmin, tmax;
     long res = 0;
     
-    const int LanesCount = 8 / S;
+    const int LanesCount = 8 / W;
 
     ITERATE_R(LanesCount, {
-        low = fma(inv_d[0], simd_fvec<S>{ &bbox_min[0][S * i], simd_mem_aligned }, neg_inv_d_o[0]);
-        high = fma(inv_d[0], simd_fvec<S>{ &bbox_max[0][S * i], simd_mem_aligned }, neg_inv_d_o[0]);
+        low = fma(inv_d[0], simd_fvec<W>{ &bbox_min[0][W * i], simd_mem_aligned }, neg_inv_d_o[0]);
+        high = fma(inv_d[0], simd_fvec<W>{ &bbox_max[0][W * i], simd_mem_aligned }, neg_inv_d_o[0]);
         tmin = min(low, high);
         tmax = max(low, high);
 
-        low = fma(inv_d[1], simd_fvec<S>{ &bbox_min[1][S * i], simd_mem_aligned }, neg_inv_d_o[1]);
-        high = fma(inv_d[1], simd_fvec<S>{ &bbox_max[1][S * i], simd_mem_aligned }, neg_inv_d_o[1]);
+        low = fma(inv_d[1], simd_fvec<W>{ &bbox_min[1][W * i], simd_mem_aligned }, neg_inv_d_o[1]);
+        high = fma(inv_d[1], simd_fvec<W>{ &bbox_max[1][W * i], simd_mem_aligned }, neg_inv_d_o[1]);
         tmin = max(tmin, min(low, high));
         tmax = min(tmax, max(low, high));
 
-        low = fma(inv_d[2], simd_fvec<S>{ &bbox_min[2][S * i], simd_mem_aligned }, neg_inv_d_o[2]);
-        high = fma(inv_d[2], simd_fvec<S>{ &bbox_max[2][S * i], simd_mem_aligned }, neg_inv_d_o[2]);
+        low = fma(inv_d[2], simd_fvec<W>{ &bbox_min[2][W * i], simd_mem_aligned }, neg_inv_d_o[2]);
+        high = fma(inv_d[2], simd_fvec<W>{ &bbox_max[2][W * i], simd_mem_aligned }, neg_inv_d_o[2]);
         tmin = max(tmin, min(low, high));
         tmax = min(tmax, max(low, high));
         tmax *= 1.00000024f;
 
-        simd_fvec<S> fmask = (tmin <= tmax) & (tmin <= t) & (tmax > 0.0f);
-        res <<= S;
-        res |= reinterpret_cast<const simd_ivec<S>&>(fmask).movemask();
-        tmin.copy_to(&out_dist[S * i], simd_mem_aligned);
+        simd_fvec<W> fmask = (tmin <= tmax) & (tmin <= t) & (tmax > 0.0f);
+        res <<= W;
+        res |= reinterpret_cast<const simd_ivec<W>&>(fmask).movemask();
+        tmin.copy_to(&out_dist[W * i], simd_mem_aligned);
     })
 
     return res;
 }
 
+template <int S>
+force_inline long bbox_test_oct(const float inv_d[3], const float neg_inv_d_o[3], const float t, const mbvh_node_t &node, float out_dist[8]) {
+    return bbox_test_oct<S>(inv_d, neg_inv_d_o, t, node.bbox_min, node.bbox_max, out_dist);
+}
+
+template <int S>
+force_inline long bbox_test_oct(const float inv_d[3], const float neg_inv_d_o[3], const float t, const cmbvh_node_t &node, float out_dist[8]) {
+    // bounds are (origin + q * scale), so ray is transformed into quantized space of node
+    float q_inv_d[3], q_neg_inv_d_o[3];
+    ITERATE_3({
+        q_inv_d[i] = inv_d[i] * cmbvh_scale(node.exponent[i]);
+        q_neg_inv_d_o[i] = inv_d[i] * node.origin[i] + neg_inv_d_o[i];
+    })
+
+    alignas(32) float q_bbox_min[3][8], q_bbox_max[3][8];
+    for (int j = 0; j < 3; j++) {
+        ITERATE_8({
+            q_bbox_min[j][i] = float(node.bbox_min[j][i]);
+            q_bbox_max[j][i] = float(node.bbox_max[j][i]);
+        })
+    }
+
+    return bbox_test_oct<S>(q_inv_d, q_neg_inv_d_o, t, q_bbox_min, q_bbox_max, out_dist) & node.child_mask;
+}
+
 template <int S>
 force_inline void bbox_test_oct(const float p[3], const simd_fvec<S> bbox_min[3], const simd_fvec<S> bbox_max[3], simd_ivec<S> &out_mask) {
     simd_fvec<S> mask = (bbox_min[0] < p[0]) & (bbox_max[0] > p[0]) &
@@ -413,6 +504,8 @@ force_inline void bbox_test_oct(const float p[3], const simd_fvec<S> bbox_min[3]
 }
 
 force_inline bool bbox_test(const float inv_d[3], const float neg_inv_do[3], const float t, const float bbox_min[3], const float bbox_max[3]) {
+    RAY_TRAVERSAL_COUNTER_ADD(box_tests, 1);
+
     float lo_x = inv_d[0] * bbox_min[0] + neg_inv_do[0];
     float hi_x = inv_d[0] * bbox_max[0] + neg_inv_do[0];
     if (lo_x > hi_x) { float tmp = lo_x; lo_x = hi_x; hi_x = tmp; }
@@ -481,6 +574,10 @@ force_inline bool is_leaf_node(const mbvh_node_t &node) {
     return (node.child[0] & LEAF_NODE_BIT) != 0;
 }
 
+force_inline bool is_leaf_node(const cmbvh_node_t &node) {
+    return (node.child[0] & LEAF_NODE_BIT) != 0;
+}
+
 enum eTraversalSource { FromParent, FromChild, FromSibling };
 
 template <int S>
@@ -573,11 +670,15 @@ public:
     }
 
     force_inline stack_entry_t pop() {
+        RAY_TRAVERSAL_COUNTER_ADD(stack_depth_sum, stack_size);
+        RAY_TRAVERSAL_COUNTER_ADD(stack_pops, 1);
         return stack[--stack_size];
         assert(stack_size >= 0 && "Traversal stack underflow!");
     }
 
     force_inline uint32_t pop_index() {
+        RAY_TRAVERSAL_COUNTER_ADD(stack_depth_sum, stack_size);
+        RAY_TRAVERSAL_COUNTER_ADD(stack_pops, 1);
         return stack[--stack_size].index;
     }
 
@@ -846,8 +947,8 @@ force_inline float pow5(const float v) {
     return (v * v) * (v * v) * v;
 }
 
-template <int S>
-force_inline simd_ivec<S> get_ray_hash(const ray_packet_t<S> &r, const simd_ivec<S> &mask, const float root_min[3], const float cell_size[3]) {
+template <int S, typename RayType>
+force_inline simd_ivec<S> get_ray_hash(const RayType &r, const simd_ivec<S> &mask, const float root_min[3], const float cell_size[3]) {
     simd_ivec<S> x = clamp((simd_ivec<S>)((r.o[0] - root_min[0]) / cell_size[0]), 0, 255),
                  y = clamp((simd_ivec<S>)((r.o[1] - root_min[1]) / cell_size[1]), 0, 255),
                  z = clamp((simd_ivec<S>)((r.o[2] - root_min[2]) / cell_size[2]), 0, 255);
@@ -898,6 +999,167 @@ force_inline void radix_sort(ray_chunk_t *begin, ray_chunk_t *end, ray_chunk_t *
     _radix_sort_lsb(begin, end, begin1, 24);
 }
 
+const int RaySortBlocksCount = 32;
+const int RaySortMinBlockSize = 1024;
+
+// Stable LSB radix sort, array is split in blocks with separate histograms to process them in parallel
+inline void radix_sort_parallel(ray_hash_t *begin, ray_hash_t *begin1, int count, TaskScheduler *scheduler) {
+    const int blocks_count = std::max(std::min(RaySortBlocksCount, count / RaySortMinBlockSize), 1);
+    const int block_size = (count + blocks_count - 1) / blocks_count;
+
+    uint32_t offsets[RaySortBlocksCount][0x100];
+
+    ray_hash_t *const out = begin;
+
+    for (unsigned shift = 0; shift < 32; shift += 8) {
+        ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+            uint32_t *counts = offsets[b];
+            memset(counts, 0, sizeof(offsets[b]));
+
+            const int end = std::min((b + 1) * block_size, count);
+            for (int i = b * block_size; i < end; i++) {
+                counts[(begin[i].hash >> shift) & 0xFF]++;
+            }
+        });
+
+        // offsets are assigned in digit-major order to keep sort stable
+        bool single_digit = false;
+        uint32_t sum = 0;
+        for (int d = 0; d < 0x100; d++) {
+            const uint32_t digit_start = sum;
+            for (int b = 0; b < blocks_count; b++) {
+                const uint32_t c = offsets[b][d];
+                offsets[b][d] = sum;
+                sum += c;
+            }
+            single_digit |= (sum - digit_start) == uint32_t(count);
+        }
+
+        // all values are in one bucket, nothing to do
+        if (single_digit) continue;
+
+        ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+            uint32_t *block_offsets = offsets[b];
+
+            const int end = std::min((b + 1) * block_size, count);
+            for (int i = b * block_size; i < end; i++) {
+                begin1[block_offsets[(begin[i].hash >> shift) & 0xFF]++] = begin[i];
+            }
+        });
+
+        std::swap(begin, begin1);
+    }
+
+    if (begin != out) {
+        std::copy(begin, begin + count, out);
+    }
+}
+
+template <int S, typename RayType>
+int sort_rays_cpu(const RayType *rays, const simd_ivec<S> *ray_masks, int rays_count, const float root_min[3], const float cell_size[3],
+                  ray_hash_t *hashes, ray_hash_t *hashes_temp, TaskScheduler *scheduler) {
+    // From "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing" [2010]
+    // Only (hash, index) pairs are sorted, rays are moved once afterwards (see GatherRays)
+
+    const int blocks_count = std::max(std::min(RaySortBlocksCount, (rays_count * S) / RaySortMinBlockSize), 1);
+    const int block_size = (rays_count + blocks_count - 1) / blocks_count;
+
+    int block_offsets[RaySortBlocksCount + 1] = {};
+
+    // compute hash values of active lanes, each block writes them to its own part of temp array
+    ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+        ray_hash_t *out = &hashes_temp[b * block_size * S];
+
+        const int end = std::min((b + 1) * block_size, rays_count);
+        for (int i = b * block_size; i < end; i++) {
+            const simd_ivec<S> hash = get_ray_hash(rays[i], ray_masks[i], root_min, cell_size);
+
+            for (int j = 0; j < S; j++) {
+                if (!ray_masks[i][j]) continue;
+                *out++ = { (uint32_t)hash[j], uint32_t(i * S + j) };
+            }
+        }
+
+        block_offsets[b + 1] = int(out - &hashes_temp[b * block_size * S]);
+    });
+
+    for (int b = 0; b < blocks_count; b++) {
+        block_offsets[b + 1] += block_offsets[b];
+    }
+
+    // remove gaps left by inactive lanes
+    ParallelFor(scheduler, 0, blocks_count, [&](int b) {
+        const ray_hash_t *src = &hashes_temp[b * block_size * S];
+        std::copy(src, src + (block_offsets[b + 1] - block_offsets[b]), &hashes[block_offsets[b]]);
+    });
+
+    const int hashes_count = block_offsets[blocks_count];
+    radix_sort_parallel(hashes, hashes_temp, hashes_count, scheduler);
+
+    return hashes_count;
+}
+
+template <int S>
+force_inline void copy_ray_lane(const ray_packet_t<S> &sr, int sj, ray_packet_t<S> &r, int j) {
+    ITERATE_3({
+        r.d[i][j] = sr.d[i][sj];
+        r.o[i][j] = sr.o[i][sj];
+        r.c[i][j] = sr.c[i][sj];
+        r.do_dx[i][j] = sr.do_dx[i][sj];
+        r.dd_dx[i][j] = sr.dd_dx[i][sj];
+        r.do_dy[i][j] = sr.do_dy[i][sj];
+        r.dd_dy[i][j] = sr.dd_dy[i][sj];
+    })
+    r.ior[j] = sr.ior[sj];
+    r.xy[j] = sr.xy[sj];
+    r.ray_depth[j] = sr.ray_depth[sj];
+}
+
+template <int S>
+force_inline void copy_ray_lane(const shadow_ray_t<S> &sr, int sj, shadow_ray_t<S> &r, int j) {
+    ITERATE_3({
+        r.o[i][j] = sr.o[i][sj];
+        r.d[i][j] = sr.d[i][sj];
+        r.c[i][j] = sr.c[i][sj];
+    })
+    r.dist[j] = sr.dist[sj];
+    r.rand[j] = sr.rand[sj];
+    r.xy[j] = sr.xy[sj];
+}
+
+template <int S, typename RayType>
+int gather_rays(const RayType *rays, const simd_ivec<S> *ray_masks, const ray_hash_t *hashes, int hashes_count,
+                RayType *out_rays, simd_ivec<S> *out_ray_masks, TaskScheduler *scheduler) {
+    const int out_rays_count = (hashes_count + S - 1) / S;
+    const int GatherBlockSize = 64;
+
+    ParallelFor(scheduler, 0, (out_rays_count + GatherBlockSize - 1) / GatherBlockSize, [&](int b) {
+        const int end = std::min((b + 1) * GatherBlockSize, out_rays_count);
+        for (int ri = b * GatherBlockSize; ri < end; ri++) {
+            // packet is assembled locally and written at once
+            RayType r;
+            simd_ivec<S> mask = { 0 };
+
+            for (int j = 0; j < S; j++) {
+                // unused lanes of last packet are filled with copy of last ray (masked out)
+                const int k = std::min(ri * S + j, hashes_count - 1);
+                const uint32_t src = hashes[k].index;
+
+                copy_ray_lane(rays[src / S], src % S, r, j);
+
+                if (ri * S + j < hashes_count) {
+                    mask[j] = ray_masks[src / S][src % S];
+                }
+            }
+
+            out_rays[ri] = r;
+            out_ray_masks[ri] = mask;
+        }
+    });
+
+    return out_rays_count;
+}
+
 template <int S>
 force_inline simd_fvec<S> construct_float(const simd_ivec<S> &_m) {
     const simd_ivec<S> ieeeMantissa = { 0x007FFFFF }; // binary32 mantissa bitmask
@@ -1078,18 +1340,22 @@ void Ray::NS::GeneratePrimaryRays(const int iteration, const camera_t &cam, cons
 }
 
 template <int DimX, int DimY>
-void Ray::NS::SampleMeshInTextureSpace(int iteration, int obj_index, int uv_layer, const mesh_t &mesh, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
-                                       const rect_t &r, int width, int height, const float *halton, aligned_vector<ray_packet_t<DimX * DimY>> &out_rays, aligned_vector<hit_data_t<DimX * DimY>> &out_inters) {
+void Ray::NS::SampleMeshInTextureSpace(int iteration, int obj_index, const tri_bins_t &bins, const transform_t &tr, const uint32_t *vtx_indices, const vertex_t *vertices,
+                                       const rect_t &r, int width, const float *halton, aligned_vector<ray_packet_t<DimX * DimY>> &out_rays, aligned_vector<hit_data_t<DimX * DimY>> &out_inters) {
     const int S = DimX * DimY;
     static_assert(S <= 16, "!");
+    // bin size is a multiple of packet size, so each packet lies within one bin
+    static_assert(TRI_BIN_SIZE % DimX == 0 && TRI_BIN_SIZE % DimY == 0, "!");
 
     out_rays.resize(r.w * r.h / S + ((r.w * r.h) % S != 0));
-    out_inters.resize(out_rays.size());
+    out_inters.resize(out_rays.size(), hit_data_t<S>{});
 
     simd_ivec<S>
         off_x = { ray_packet_layout_x },
         off_y = { ray_packet_layout_y };
 
+    const int hi = (iteration & (HALTON_SEQ_LEN - 1)) * HALTON_COUNT;
+
     size_t count = 0;
     for (int y = r.y; y < r.y + r.h - (r.h & (DimY - 1)); y += DimY) {
         for (int x = r.x; x < r.x + r.w - (r.w & (DimX - 1)); x += DimX) {
@@ -1107,202 +1373,96 @@ void Ray::NS::SampleMeshInTextureSpace(int iteration, int obj_index, int uv_laye
             out_ray.dd_dy[0] = out_ray.dd_dy[1] = out_ray.dd_dy[2] = 0.0f;
             out_inter.mask = 0;
             out_inter.xy = out_ray.xy;
-        }
-    }
-
-    simd_ivec2 irect_min = { r.x, r.y }, irect_max = { r.x + r.w - 1, r.y + r.h - 1 };
-    simd_fvec2 size = { (float)width, (float)height };
-
-    for (uint32_t tri = mesh.tris_index; tri < mesh.tris_index + mesh.tris_count; tri++) {
-        const vertex_t &v0 = vertices[vtx_indices[tri * 3 + 0]];
-        const vertex_t &v1 = vertices[vtx_indices[tri * 3 + 1]];
-        const vertex_t &v2 = vertices[vtx_indices[tri * 3 + 2]];
-
-        const auto t0 = simd_fvec2{ v0.t[uv_layer][0], 1.0f - v0.t[uv_layer][1] } * size;
-        const auto t1 = simd_fvec2{ v1.t[uv_layer][0], 1.0f - v1.t[uv_layer][1] } * size;
-        const auto t2 = simd_fvec2{ v2.t[uv_layer][0], 1.0f - v2.t[uv_layer][1] } * size;
-
-        simd_fvec2 bbox_min = t0, bbox_max = t0;
-
-        bbox_min = min(bbox_min, t1);
-        bbox_min = min(bbox_min, t2);
-
-        bbox_max = max(bbox_max, t1);
-        bbox_max = max(bbox_max, t2);
-
-        simd_ivec2 ibbox_min = (simd_ivec2)(bbox_min),
-                   ibbox_max = simd_ivec2{ (int)std::round(bbox_max[0]), (int)std::round(bbox_max[1]) };
 
-        if (ibbox_max[0] < irect_min[0] || ibbox_max[1] < irect_min[1] ||
-            ibbox_min[0] > irect_max[0] || ibbox_min[1] > irect_max[1]) continue;
+            const lm_texel_t *bin_texels = bins.texels[(y / TRI_BIN_SIZE) * bins.bins_x + (x / TRI_BIN_SIZE)].get();
 
-        ibbox_min = max(ibbox_min, irect_min);
-        ibbox_max = min(ibbox_max, irect_max);
+            simd_ivec<S> imask = { 0 }, prim_index = { 0 };
+            simd_fvec<S> u = { 0.0f }, v = { 0.0f };
+            simd_fvec<S> _p[3] = { 0.0f, 0.0f, 0.0f }, _n[3] = { 0.0f, 0.0f, 0.0f };
 
-        ibbox_min[0] -= ibbox_min[0] % DimX;
-        ibbox_min[1] -= ibbox_min[1] % DimY;
-        ibbox_max[0] += ((ibbox_max[0] + 1) % DimX) ? (DimX - (ibbox_max[0] + 1) % DimX) : 0;
-        ibbox_max[1] += ((ibbox_max[1] + 1) % DimY) ? (DimY - (ibbox_max[1] + 1) % DimY) : 0;
+            const simd_ivec<S> index = iyy * width + ixx;
+            const simd_ivec<S> hash_val = hash(index);
+            const simd_fvec<S> rxx = construct_float(hash_val),
+                               ryy = construct_float(hash(hash_val));
 
-        const simd_fvec2 d01 = t0 - t1, d12 = t1 - t2, d20 = t2 - t0;
-
-        float area = d01[0] * d20[1] - d20[0] * d01[1];
-        if (area < FLT_EPS) continue;
-
-        float inv_area = 1.0f / area;
-
-        for (int y = ibbox_min[1]; y <= ibbox_max[1]; y += DimY) {
-            for (int x = ibbox_min[0]; x <= ibbox_max[0]; x += DimX) {
-                simd_ivec<S> ixx = x + off_x, iyy = simd_ivec<S>(y) + off_y;
-
-                int ndx = ((y - r.y) / DimY) * (r.w / DimX) + (x - r.x) / DimX;
-                ray_packet_t<S> &out_ray = out_rays[ndx];
-                hit_data_t<S> &out_inter = out_inters[ndx];
-
-                simd_ivec<S> index = iyy * width + ixx;
-                const int hi = (iteration & (HALTON_SEQ_LEN - 1)) * HALTON_COUNT;
-
-                simd_ivec<S> hash_val = hash(index);
-                simd_fvec<S> rxx = construct_float(hash_val);
-                simd_fvec<S> ryy = construct_float(hash(hash_val));
+            for (int i = 0; i < S; i++) {
+                const lm_texel_t &texel = bin_texels[(iyy[i] % TRI_BIN_SIZE) * TRI_BIN_SIZE + (ixx[i] % TRI_BIN_SIZE)];
+                if (texel.prim_index == 0xffffffff) continue;
 
-                for (int i = 0; i < S; i++) {
-                    float _unused;
-                    rxx[i] = std::modf(halton[hi + 0] + rxx[i], &_unused);
-                    ryy[i] = std::modf(halton[hi + 1] + ryy[i], &_unused);
+                float _unused;
+                const float jx = std::modf(halton[hi + 0] + rxx[i], &_unused),
+                            jy = std::modf(halton[hi + 1] + ryy[i], &_unused);
+
+                // jittered sample is kept inside of cached triangle
+                float _u = std::max(texel.u + texel.du_dx * jx + texel.du_dy * jy, 0.0f),
+                      _v = std::max(texel.v + texel.dv_dx * jx + texel.dv_dy * jy, 0.0f);
+                if (_u + _v > 1.0f) {
+                    _u /= (_u + _v);
+                    _v = 1.0f - _u;
                 }
+                const float _w = 1.0f - _u - _v;
 
-                simd_fvec<S> fxx = (simd_fvec<S>)ixx + rxx,
-                             fyy = (simd_fvec<S>)iyy + ryy;
+                const vertex_t &v0 = vertices[vtx_indices[texel.prim_index * 3 + 0]];
+                const vertex_t &v1 = vertices[vtx_indices[texel.prim_index * 3 + 1]];
+                const vertex_t &v2 = vertices[vtx_indices[texel.prim_index * 3 + 2]];
 
-                simd_fvec<S> u = d01[0] * (fyy - t0[1]) - d01[1] * (fxx - t0[0]),
-                             v = d12[0] * (fyy - t1[1]) - d12[1] * (fxx - t1[0]),
-                             w = d20[0] * (fyy - t2[1]) - d20[1] * (fxx - t2[0]);
+                for (int j = 0; j < 3; j++) {
+                    _p[j][i] = v0.p[j] * _w + v1.p[j] * _u + v2.p[j] * _v;
+                    _n[j][i] = v0.n[j] * _w + v1.n[j] * _u + v2.n[j] * _v;
+                }
 
-                const simd_fvec<S> fmask = (u >= -FLT_EPS) & (v >= -FLT_EPS) & (w >= -FLT_EPS);
-                const auto &imask = reinterpret_cast<const simd_ivec<S> &>(fmask);
+                imask[i] = -1;
+                prim_index[i] = (int)texel.prim_index;
+                u[i] = _u;
+                v[i] = _v;
+            }
 
-                if (imask.not_all_zeros()) {
-                    u *= inv_area; v *= inv_area; w *= inv_area;
+            if (imask.all_zeros()) continue;
 
-                    simd_fvec<S> _p[3] = { v0.p[0] * v + v1.p[0] * w + v2.p[0] * u,
-                                           v0.p[1] * v + v1.p[1] * w + v2.p[1] * u,
-                                           v0.p[2] * v + v1.p[2] * w + v2.p[2] * u },
-                                 _n[3] = { v0.n[0] * v + v1.n[0] * w + v2.n[0] * u,
-                                           v0.n[1] * v + v1.n[1] * w + v2.n[1] * u,
-                                           v0.n[2] * v + v1.n[2] * w + v2.n[2] * u };
+            const auto &fmask = reinterpret_cast<const simd_fvec<S> &>(imask);
 
-                    simd_fvec<S> p[3], n[3];
+            simd_fvec<S> p[3], n[3];
 
-                    TransformPoint(_p, tr.xform, p);
-                    TransformNormal(_n, tr.inv_xform, n);
+            TransformPoint(_p, tr.xform, p);
+            TransformNormal(_n, tr.inv_xform, n);
 
-                    ITERATE_3({ where(fmask, out_ray.o[i]) = p[i] + n[i]; })
-                    ITERATE_3({ where(fmask, out_ray.d[i]) = -n[i]; })
-                    where(fmask, out_ray.ior) = 1.0f;
-                    where(reinterpret_cast<const simd_ivec<S>&>(fmask), out_ray.ray_depth) = { 0 };
+            ITERATE_3({ where(fmask, out_ray.o[i]) = p[i] + n[i]; })
+            ITERATE_3({ where(fmask, out_ray.d[i]) = -n[i]; })
+            where(fmask, out_ray.ior) = 1.0f;
+            where(imask, out_ray.ray_depth) = { 0 };
 
-                    out_inter.mask = out_inter.mask | imask;
-                    where(imask, out_inter.prim_index) = tri;
-                    where(imask, out_inter.obj_index) = obj_index;
-                    where(fmask, out_inter.t) = 1.0f;
-                    where(fmask, out_inter.u) = w;
-                    where(fmask, out_inter.v) = u;
-                }
-            }
+            out_inter.mask = imask;
+            where(imask, out_inter.prim_index) = prim_index;
+            where(imask, out_inter.obj_index) = obj_index;
+            where(fmask, out_inter.t) = 1.0f;
+            where(fmask, out_inter.u) = u;
+            where(fmask, out_inter.v) = v;
         }
     }
 }
 
 template <int S>
-void Ray::NS::SortRays_CPU(ray_packet_t<S> *rays, simd_ivec<S> *ray_masks, int &rays_count, const float root_min[3], const float cell_size[3],
-                           simd_ivec<S> *hash_values, uint32_t *scan_values, ray_chunk_t *chunks, ray_chunk_t *chunks_temp) {
-    // From "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing" [2010]
-
-    // compute ray hash values
-    for (int i = 0; i < rays_count; i++) {
-        hash_values[i] = get_ray_hash(rays[i], ray_masks[i], root_min, cell_size);
-    }
-
-    size_t chunks_count = 0;
-
-    // compress codes into spans of indentical values (makes sorting stage faster)
-    for (int start = 0, end = 1; end <= rays_count * S; end++) {
-        if (end == (rays_count * S) ||
-            (hash_values[start / S][start % S] != hash_values[end / S][end % S])) {
-            chunks[chunks_count].hash = hash_values[start / S][start % S];
-            chunks[chunks_count].base = start;
-            chunks[chunks_count++].size = end - start;
-            start = end;
-        }
-    }
-
-    radix_sort(&chunks[0], &chunks[0] + chunks_count, &chunks_temp[0]);
-
-    // decompress sorted spans
-    size_t counter = 0;
-    for (uint32_t i = 0; i < chunks_count; i++) {
-        for (uint32_t j = 0; j < chunks[i].size; j++) {
-            scan_values[counter++] = chunks[i].base + j;
-        }
-    }
-
-    {   // reorder rays
-        for (int i = 0; i < rays_count * S; i++) {
-            int j;
-            while (i != (j = scan_values[i])) {
-                int k = scan_values[j];
-
-                {
-                    int jj = j / S, _jj = j % S,
-                        kk = k / S, _kk = k % S;
-
-                    std::swap(hash_values[jj][_jj], hash_values[kk][_kk]);
-
-                    std::swap(rays[jj].d[0][_jj], rays[kk].d[0][_kk]);
-                    std::swap(rays[jj].d[1][_jj], rays[kk].d[1][_kk]);
-                    std::swap(rays[jj].d[2][_jj], rays[kk].d[2][_kk]);
-
-                    std::swap(rays[jj].o[0][_jj], rays[kk].o[0][_kk]);
-                    std::swap(rays[jj].o[1][_jj], rays[kk].o[1][_kk]);
-                    std::swap(rays[jj].o[2][_jj], rays[kk].o[2][_kk]);
-
-                    std::swap(rays[jj].c[0][_jj], rays[kk].c[0][_kk]);
-                    std::swap(rays[jj].c[1][_jj], rays[kk].c[1][_kk]);
-                    std::swap(rays[jj].c[2][_jj], rays[kk].c[2][_kk]);
-
-                    std::swap(rays[jj].ior[_jj], rays[kk].ior[_kk]);
-
-                    std::swap(rays[jj].do_dx[0][_jj], rays[kk].do_dx[0][_kk]);
-                    std::swap(rays[jj].do_dx[1][_jj], rays[kk].do_dx[1][_kk]);
-                    std::swap(rays[jj].do_dx[2][_jj], rays[kk].do_dx[2][_kk]);
-
-                    std::swap(rays[jj].dd_dx[0][_jj], rays[kk].dd_dx[0][_kk]);
-                    std::swap(rays[jj].dd_dx[1][_jj], rays[kk].dd_dx[1][_kk]);
-                    std::swap(rays[jj].dd_dx[2][_jj], rays[kk].dd_dx[2][_kk]);
-
-                    std::swap(rays[jj].do_dy[0][_jj], rays[kk].do_dy[0][_kk]);
-                    std::swap(rays[jj].do_dy[1][_jj], rays[kk].do_dy[1][_kk]);
-                    std::swap(rays[jj].do_dy[2][_jj], rays[kk].do_dy[2][_kk]);
-
-                    std::swap(rays[jj].dd_dy[0][_jj], rays[kk].dd_dy[0][_kk]);
-                    std::swap(rays[jj].dd_dy[1][_jj], rays[kk].dd_dy[1][_kk]);
-                    std::swap(rays[jj].dd_dy[2][_jj], rays[kk].dd_dy[2][_kk]);
-
-                    std::swap(rays[jj].xy[_jj], rays[kk].xy[_kk]);
+int Ray::NS::SortRays_CPU(const ray_packet_t<S> *rays, const simd_ivec<S> *ray_masks, int rays_count, const float root_min[3], const float cell_size[3],
+                          ray_hash_t *hashes, ray_hash_t *hashes_temp, TaskScheduler *scheduler) {
+    return sort_rays_cpu(rays, ray_masks, rays_count, root_min, cell_size, hashes, hashes_temp, scheduler);
+}
 
-                    std::swap(ray_masks[jj][_jj], ray_masks[kk][_kk]);
-                }
+template <int S>
+int Ray::NS::SortRays_CPU(const shadow_ray_t<S> *rays, const simd_ivec<S> *ray_masks, int rays_count, const float root_min[3], const float cell_size[3],
+                          ray_hash_t *hashes, ray_hash_t *hashes_temp, TaskScheduler *scheduler) {
+    return sort_rays_cpu(rays, ray_masks, rays_count, root_min, cell_size, hashes, hashes_temp, scheduler);
+}
 
-                std::swap(scan_values[i], scan_values[j]);
-            }
-        }
-    }
+template <int S>
+int Ray::NS::GatherRays(const ray_packet_t<S> *rays, const simd_ivec<S> *ray_masks, const ray_hash_t *hashes, int hashes_count,
+                        ray_packet_t<S> *out_rays, simd_ivec<S> *out_ray_masks, TaskScheduler *scheduler) {
+    return gather_rays(rays, ray_masks, hashes, hashes_count, out_rays, out_ray_masks, scheduler);
+}
 
-    // remove non-active rays
-    while (rays_count && ray_masks[rays_count - 1].all_zeros()) {
-        rays_count--;
-    }
+template <int S>
+int Ray::NS::GatherRays(const shadow_ray_t<S> *rays, const simd_ivec<S> *ray_masks, const ray_hash_t *hashes, int hashes_count,
+                        shadow_ray_t<S> *out_rays, simd_ivec<S> *out_ray_masks, TaskScheduler *scheduler) {
+    return gather_rays(rays, ray_masks, hashes, hashes_count, out_rays, out_ray_masks, scheduler);
 }
 
 template <int S>
@@ -1865,41 +2025,206 @@ bool Ray::NS::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r,
     return res;
 }
 
-template <int S>
-bool Ray::NS::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index,
-                                                      const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                      const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+namespace Ray {
+namespace NS {
+// Traversal of wide trees is shared between full precision and compressed nodes
+template <int S, typename OctNodeType>
+bool Traverse_MicroTree_WithStack_ClosestHit_Oct(const float ro[3], const float rd[3], int ri, const OctNodeType *nodes, uint32_t node_index,
+                                                 const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter) {
     bool res = false;
 
-    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
-    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
-
-    for (int ri = 0; ri < S; ri++) {
-        if (!ray_mask[ri]) continue;
-
-        // recombine in AoS layout
-        const float r_o[3] = { r.o[0][ri], r.o[1][ri], r.o[2][ri] },
-                    r_d[3] = { r.d[0][ri], r.d[1][ri], r.d[2][ri] };
-        const float _inv_d[3] = { inv_d[0][ri], inv_d[1][ri], inv_d[2][ri] },
-                    _neg_inv_d_o[3] = { neg_inv_d_o[0][ri], neg_inv_d_o[1][ri], neg_inv_d_o[2][ri] };
-
-        TraversalStateStack_Single<MAX_STACK_SIZE> st;
-        st.push(node_index, 0.0f);
+    float _inv_d[3], _neg_inv_d_o[3];
+    comp_aux_inv_values(ro, rd, _inv_d, _neg_inv_d_o);
+        
+    TraversalStateStack_Single<MAX_STACK_SIZE> st;
+    st.push(node_index, 0.0f);
 
-        while (!st.empty()) {
-            stack_entry_t cur = st.pop();
+    while (!st.empty()) {
+        stack_entry_t cur = st.pop();
 
-            if (cur.dist > inter.t[ri]) continue;
+        if (cur.dist > inter.t[ri]) continue;
 
 TRAVERSE:
-            if (!is_leaf_node(nodes[cur.index])) {
-                alignas(S * 4) float res_dist[8];
-                long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index].bbox_min, nodes[cur.index].bbox_max, res_dist);
-                if (mask) {
-                    long i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                    if (mask == 0) { // only one box was hit
+        if (!is_leaf_node(nodes[cur.index])) {
+            alignas(S * 4) float res_dist[8];
+            long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index], res_dist);
+            if (mask) {
+                long i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                if (mask == 0) { // only one box was hit
+                    cur.index = nodes[cur.index].child[i];
+                    goto TRAVERSE;
+                }
+
+                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
+                if (mask == 0) { // two boxes were hit
+                    if (res_dist[i] < res_dist[i2]) {
+                        st.push(nodes[cur.index].child[i2], res_dist[i2]);
                         cur.index = nodes[cur.index].child[i];
-                        goto TRAVERSE;
+                    } else {
+                        st.push(nodes[cur.index].child[i], res_dist[i]);
+                        cur.index = nodes[cur.index].child[i2];
+                    }
+                    goto TRAVERSE;
+                }
+
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                st.push(nodes[cur.index].child[i2], res_dist[i2]);
+
+                i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                if (mask == 0) { // three boxes were hit
+                    st.sort_top3();
+                    cur.index = st.pop_index();
+                    goto TRAVERSE;
+                }
+
+                i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                if (mask == 0) { // four boxes were hit
+                    st.sort_top4();
+                    cur.index = st.pop_index();
+                    goto TRAVERSE;
+                }
+
+                uint32_t size_before = st.stack_size;
+
+                // from five to eight boxes were hit
+                do {
+                    i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                    st.push(nodes[cur.index].child[i], res_dist[i]);
+                } while (mask != 0);
+
+                int count = int(st.stack_size - size_before + 4);
+                st.sort_topN(count);
+                cur.index = st.pop_index();
+                goto TRAVERSE;
+            }
+        } else {
+            res |= IntersectTris_ClosestHit(ro, rd, ri, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
+        }
+    }
+
+    return res;
+}
+
+template <int S, typename OctNodeType>
+bool Traverse_MicroTree_WithStack_AnyHit_Oct(const float ro[3], const float rd[3], int ri, const OctNodeType *nodes, uint32_t node_index,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+    bool res = false;
+
+    float _inv_d[3], _neg_inv_d_o[3];
+    comp_aux_inv_values(ro, rd, _inv_d, _neg_inv_d_o);
+
+    TraversalStateStack_Single<MAX_STACK_SIZE> st;
+    st.push(node_index, 0.0f);
+
+    while (!st.empty()) {
+        stack_entry_t cur = st.pop();
+
+        if (cur.dist > inter.t[ri]) continue;
+
+TRAVERSE:
+        if (!is_leaf_node(nodes[cur.index])) {
+            alignas(S * 4) float res_dist[8];
+            long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index], res_dist);
+            if (mask) {
+                long i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                if (mask == 0) { // only one box was hit
+                    cur.index = nodes[cur.index].child[i];
+                    goto TRAVERSE;
+                }
+
+                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
+                if (mask == 0) { // two boxes were hit
+                    if (res_dist[i] < res_dist[i2]) {
+                        st.push(nodes[cur.index].child[i2], res_dist[i2]);
+                        cur.index = nodes[cur.index].child[i];
+                    } else {
+                        st.push(nodes[cur.index].child[i], res_dist[i]);
+                        cur.index = nodes[cur.index].child[i2];
+                    }
+                    goto TRAVERSE;
+                }
+
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                st.push(nodes[cur.index].child[i2], res_dist[i2]);
+
+                i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                if (mask == 0) { // three boxes were hit
+                    st.sort_top3();
+                    cur.index = st.pop_index();
+                    goto TRAVERSE;
+                }
+
+                i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                st.push(nodes[cur.index].child[i], res_dist[i]);
+                if (mask == 0) { // four boxes were hit
+                    st.sort_top4();
+                    cur.index = st.pop_index();
+                    goto TRAVERSE;
+                }
+
+                uint32_t size_before = st.stack_size;
+
+                // from five to eight boxes were hit
+                do {
+                    i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                    st.push(nodes[cur.index].child[i], res_dist[i]);
+                } while (mask != 0);
+
+                int count = int(st.stack_size - size_before + 4);
+                st.sort_topN(count);
+                cur.index = st.pop_index();
+                goto TRAVERSE;
+            }
+        } else {
+            bool hit_found = IntersectTris_AnyHit(ro, rd, ri, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter, is_solid_hit);
+            res |= hit_found;
+            if (hit_found && is_solid_hit[ri]) {
+                break;
+            }
+        }
+    }
+
+    return res;
+}
+
+template <int S, typename MeshNodeType>
+bool Traverse_MacroTree_WithStack_ClosestHit_Oct(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const MeshNodeType *mesh_nodes,
+                                                 const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                 const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    bool res = false;
+
+    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
+    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
+
+    for (int ri = 0; ri < S; ri++) {
+        if (!ray_mask[ri]) continue;
+
+        // recombine in AoS layout
+        const float r_o[3] = { r.o[0][ri], r.o[1][ri], r.o[2][ri] },
+                    r_d[3] = { r.d[0][ri], r.d[1][ri], r.d[2][ri] };
+        const float _inv_d[3] = { inv_d[0][ri], inv_d[1][ri], inv_d[2][ri] },
+                    _neg_inv_d_o[3] = { neg_inv_d_o[0][ri], neg_inv_d_o[1][ri], neg_inv_d_o[2][ri] };
+
+        TraversalStateStack_Single<MAX_STACK_SIZE> st;
+        st.push(node_index, 0.0f);
+
+        while (!st.empty()) {
+            stack_entry_t cur = st.pop();
+
+            if (cur.dist > inter.t[ri]) continue;
+
+TRAVERSE:
+            if (!is_leaf_node(nodes[cur.index])) {
+                alignas(S * 4) float res_dist[8];
+                long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index], res_dist);
+                if (mask) {
+                    long i = GetFirstBit(mask); mask = ClearBit(mask, i);
+                    if (mask == 0) { // only one box was hit
+                        cur.index = nodes[cur.index].child[i];
+                        goto TRAVERSE;
                     }
 
                     long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
@@ -1958,7 +2283,7 @@ TRAVERSE:
                     float tr_ro[3], tr_rd[3];
                     TransformRay(r_o, r_d, tr.inv_xform, tr_ro, tr_rd);
 
-                    res |= Traverse_MicroTree_WithStack_ClosestHit(tr_ro, tr_rd, ri, nodes, m.node_index, tris, tri_indices, (int)mi_indices[j], inter);
+                    res |= Traverse_MicroTree_WithStack_ClosestHit_Oct<S>(tr_ro, tr_rd, ri, mesh_nodes, m.node_index, tris, tri_indices, (int)mi_indices[j], inter);
                 }
             }
         }
@@ -1967,72 +2292,10 @@ TRAVERSE:
     return res;
 }
 
-template <int S>
-bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const bvh_node_t *nodes, uint32_t node_index,
-                                                  const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                  const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
-    bool res = false;
-
-    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
-    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
-
-    TraversalStateStack_Multi<S, MAX_STACK_SIZE> st;
-
-    st.queue[0].mask = ray_mask;
-    st.queue[0].stack_size = 0;
-    st.queue[0].stack[st.queue[0].stack_size++] = node_index;
-
-    while (st.index < st.num) {
-        uint32_t *stack = &st.queue[st.index].stack[0];
-        uint32_t &stack_size = st.queue[st.index].stack_size;
-        while (stack_size) {
-            uint32_t cur = stack[--stack_size];
-
-            simd_ivec<S> mask1 = bbox_test_fma(inv_d, neg_inv_d_o, inter.t, nodes[cur]) & st.queue[st.index].mask;
-            if (mask1.all_zeros()) {
-                continue;
-            }
-
-            simd_ivec<S> mask2 = and_not(mask1, st.queue[st.index].mask);
-            if (mask2.not_all_zeros()) {
-                st.queue[st.num].mask = mask2;
-                st.queue[st.num].stack_size = stack_size;
-                memcpy(st.queue[st.num].stack, st.queue[st.index].stack, sizeof(uint32_t) * stack_size);
-                st.num++;
-                st.queue[st.index].mask = mask1;
-            }
-
-            if (!is_leaf_node(nodes[cur])) {
-                st.push_children(r, nodes[cur]);
-            } else {
-                uint32_t prim_index = (nodes[cur].prim_index & PRIM_INDEX_BITS);
-                for (uint32_t i = prim_index; i < prim_index + nodes[cur].prim_count; i++) {
-                    const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
-                    const mesh_t &m = meshes[mi.mesh_index];
-                    const transform_t &tr = transforms[mi.tr_index];
-
-                    simd_ivec<S> bbox_mask = bbox_test_fma(inv_d, neg_inv_d_o, inter.t, mi.bbox_min, mi.bbox_max) & st.queue[st.index].mask;
-                    if (bbox_mask.all_zeros()) continue;
-
-                    ray_packet_t<S> _r = TransformRay(r, tr.inv_xform);
-                    bool hit_found = Traverse_MicroTree_WithStack_AnyHit(_r, bbox_mask, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter, is_solid_hit);
-                    res |= hit_found;
-                    if (hit_found && is_equal(is_solid_hit, bbox_mask)) {
-                        break;
-                    }
-                }
-            }
-        }
-        st.index++;
-    }
-
-    return res;
-}
-
-template <int S>
-bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index,
-                                                  const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
-                                                  const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+template <int S, typename MeshNodeType>
+bool Traverse_MacroTree_WithStack_AnyHit_Oct(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const MeshNodeType *mesh_nodes,
+                                             const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                             const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
     bool res = false;
 
     simd_fvec<S> inv_d[3], neg_inv_d_o[3];
@@ -2058,7 +2321,7 @@ bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, cons
 TRAVERSE:
             if (!is_leaf_node(nodes[cur.index])) {
                 alignas(S * 4) float res_dist[8];
-                long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index].bbox_min, nodes[cur.index].bbox_max, res_dist);
+                long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index], res_dist);
                 if (mask) {
                     long i = GetFirstBit(mask); mask = ClearBit(mask, i);
                     if (mask == 0) { // only one box was hit
@@ -2122,7 +2385,7 @@ TRAVERSE:
                     float tr_ro[3], tr_rd[3];
                     TransformRay(r_o, r_d, tr.inv_xform, tr_ro, tr_rd);
 
-                    bool hit_found = Traverse_MicroTree_WithStack_AnyHit(tr_ro, tr_rd, ri, nodes, m.node_index, tris, tri_indices, (int)mi_indices[j], inter, is_solid_hit);
+                    bool hit_found = Traverse_MicroTree_WithStack_AnyHit_Oct<S>(tr_ro, tr_rd, ri, mesh_nodes, m.node_index, tris, tri_indices, (int)mi_indices[j], inter, is_solid_hit);
                     res |= hit_found;
                     if (hit_found && is_solid_hit[ri]) {
                         break;
@@ -2132,7 +2395,238 @@ TRAVERSE:
         }
     }
 
-    return res;
+    return res;
+}
+
+// Packet traversal of wide trees visits children hit by any lane of packet, lanes which did not hit are
+// still processed (masked out), fraction of lanes that hit visited nodes is gathered to measure packet efficiency
+
+// Union of boxes hit by a packet grows faster than per-ray one, so its stack is made deeper
+const int MAX_PACKET_STACK_SIZE = 4 * MAX_STACK_SIZE;
+
+force_inline bool get_child_bbox(const mbvh_node_t &node, int i, float out_bbox_min[3], float out_bbox_max[3]) {
+    if (node.child[i] == 0x7fffffff) return false;
+    for (int j = 0; j < 3; j++) {
+        out_bbox_min[j] = node.bbox_min[j][i];
+        out_bbox_max[j] = node.bbox_max[j][i];
+    }
+    return true;
+}
+
+force_inline bool get_child_bbox(const cmbvh_node_t &node, int i, float out_bbox_min[3], float out_bbox_max[3]) {
+    if ((node.child_mask & (1u << i)) == 0) return false;
+    DecompressBBox(node, i, out_bbox_min, out_bbox_max);
+    return true;
+}
+
+// Children of wide node are placed by octant of their centroid, so direction signs of packet give approximate front-to-back order
+template <int S>
+force_inline int get_ray_octant(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask) {
+    const long ri = GetFirstBit(long(ray_mask.movemask()));
+    return (r.d[0][ri] < 0.0f ? 1 : 0) | (r.d[1][ri] < 0.0f ? 2 : 0) | (r.d[2][ri] < 0.0f ? 4 : 0);
+}
+
+template <int S, typename OctNodeType>
+force_inline void push_children_packet(const OctNodeType &node, int octant, const simd_fvec<S> inv_d[3], const simd_fvec<S> neg_inv_d_o[3], const simd_fvec<S> &t,
+                                       const simd_ivec<S> &ray_mask, uint32_t *stack, uint32_t &stack_size) {
+    // children will be visited by the whole packet, while only hit lanes would visit them when traced one by one
+    int active_lanes = 0, pushed_count = 0;
+
+    // pushed in reverse order, so the nearest child is popped first
+    for (int k = 7; k >= 0; k--) {
+        const int i = k ^ octant;
+
+        float bbox_min[3], bbox_max[3];
+        if (!get_child_bbox(node, i, bbox_min, bbox_max)) continue;
+
+        const simd_ivec<S> mask = bbox_test_fma(inv_d, neg_inv_d_o, t, bbox_min, bbox_max) & ray_mask;
+        const int hit_lanes = count_bits(uint32_t(mask.movemask()));
+
+        if (hit_lanes) {
+            active_lanes += hit_lanes;
+            pushed_count++;
+
+            stack[stack_size++] = node.child[i];
+            assert(stack_size < MAX_PACKET_STACK_SIZE && "Traversal stack overflow!");
+        }
+    }
+
+    g_ray_counters.traversal_active_lanes += active_lanes;
+    g_ray_counters.traversal_total_lanes += pushed_count * S;
+}
+
+template <int S, typename OctNodeType>
+bool Traverse_MicroTree_WithPacketStack_ClosestHit_Oct(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const OctNodeType *nodes, uint32_t node_index,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter) {
+    bool res = false;
+
+    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
+    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
+
+    const int octant = get_ray_octant(r, ray_mask);
+
+    uint32_t stack[MAX_PACKET_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = node_index;
+
+    while (stack_size) {
+        const uint32_t cur = stack[--stack_size];
+
+        if (!is_leaf_node(nodes[cur])) {
+            push_children_packet(nodes[cur], octant, inv_d, neg_inv_d_o, inter.t, ray_mask, stack, stack_size);
+        } else {
+            res |= IntersectTris_ClosestHit(r, ray_mask, tris, &tri_indices[nodes[cur].child[0] & PRIM_INDEX_BITS], nodes[cur].child[1], obj_index, inter);
+        }
+    }
+
+    return res;
+}
+
+template <int S, typename MeshNodeType>
+bool Traverse_MacroTree_WithPacketStack_ClosestHit_Oct(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const MeshNodeType *mesh_nodes,
+                                                       const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                       const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    if (ray_mask.all_zeros()) return false;
+
+    bool res = false;
+
+    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
+    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
+
+    const int octant = get_ray_octant(r, ray_mask);
+
+    uint32_t stack[MAX_PACKET_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = node_index;
+
+    while (stack_size) {
+        const uint32_t cur = stack[--stack_size];
+
+        if (!is_leaf_node(nodes[cur])) {
+            push_children_packet(nodes[cur], octant, inv_d, neg_inv_d_o, inter.t, ray_mask, stack, stack_size);
+        } else {
+            uint32_t prim_index = (nodes[cur].child[0] & PRIM_INDEX_BITS);
+            for (uint32_t j = prim_index; j < prim_index + nodes[cur].child[1]; j++) {
+                const mesh_instance_t &mi = mesh_instances[mi_indices[j]];
+                const mesh_t &m = meshes[mi.mesh_index];
+                const transform_t &tr = transforms[mi.tr_index];
+
+                const simd_ivec<S> bbox_mask = bbox_test_fma(inv_d, neg_inv_d_o, inter.t, mi.bbox_min, mi.bbox_max) & ray_mask;
+                if (bbox_mask.all_zeros()) continue;
+
+                const ray_packet_t<S> _r = TransformRay(r, tr.inv_xform);
+                res |= Traverse_MicroTree_WithPacketStack_ClosestHit_Oct<S>(_r, bbox_mask, mesh_nodes, m.node_index, tris, tri_indices, (int)mi_indices[j], inter);
+            }
+        }
+    }
+
+    return res;
+}
+}
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index,
+                                                      const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                      const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    return Traverse_MacroTree_WithStack_ClosestHit_Oct<S>(r, ray_mask, nodes, node_index, nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                                      const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                      const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    return Traverse_MacroTree_WithStack_ClosestHit_Oct<S>(r, ray_mask, nodes, node_index, mesh_nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithPacketStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index,
+                                                            const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                            const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    return Traverse_MacroTree_WithPacketStack_ClosestHit_Oct<S>(r, ray_mask, nodes, node_index, nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithPacketStack_ClosestHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                                            const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                            const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter) {
+    return Traverse_MacroTree_WithPacketStack_ClosestHit_Oct<S>(r, ray_mask, nodes, node_index, mesh_nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter);
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const bvh_node_t *nodes, uint32_t node_index,
+                                                  const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                  const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+    bool res = false;
+
+    simd_fvec<S> inv_d[3], neg_inv_d_o[3];
+    comp_aux_inv_values(r.o, r.d, inv_d, neg_inv_d_o);
+
+    TraversalStateStack_Multi<S, MAX_STACK_SIZE> st;
+
+    st.queue[0].mask = ray_mask;
+    st.queue[0].stack_size = 0;
+    st.queue[0].stack[st.queue[0].stack_size++] = node_index;
+
+    while (st.index < st.num) {
+        uint32_t *stack = &st.queue[st.index].stack[0];
+        uint32_t &stack_size = st.queue[st.index].stack_size;
+        while (stack_size) {
+            uint32_t cur = stack[--stack_size];
+
+            simd_ivec<S> mask1 = bbox_test_fma(inv_d, neg_inv_d_o, inter.t, nodes[cur]) & st.queue[st.index].mask;
+            if (mask1.all_zeros()) {
+                continue;
+            }
+
+            simd_ivec<S> mask2 = and_not(mask1, st.queue[st.index].mask);
+            if (mask2.not_all_zeros()) {
+                st.queue[st.num].mask = mask2;
+                st.queue[st.num].stack_size = stack_size;
+                memcpy(st.queue[st.num].stack, st.queue[st.index].stack, sizeof(uint32_t) * stack_size);
+                st.num++;
+                st.queue[st.index].mask = mask1;
+            }
+
+            if (!is_leaf_node(nodes[cur])) {
+                st.push_children(r, nodes[cur]);
+            } else {
+                uint32_t prim_index = (nodes[cur].prim_index & PRIM_INDEX_BITS);
+                for (uint32_t i = prim_index; i < prim_index + nodes[cur].prim_count; i++) {
+                    const mesh_instance_t &mi = mesh_instances[mi_indices[i]];
+                    const mesh_t &m = meshes[mi.mesh_index];
+                    const transform_t &tr = transforms[mi.tr_index];
+
+                    simd_ivec<S> bbox_mask = bbox_test_fma(inv_d, neg_inv_d_o, inter.t, mi.bbox_min, mi.bbox_max) & st.queue[st.index].mask;
+                    if (bbox_mask.all_zeros()) continue;
+
+                    ray_packet_t<S> _r = TransformRay(r, tr.inv_xform);
+                    bool hit_found = Traverse_MicroTree_WithStack_AnyHit(_r, bbox_mask, nodes, m.node_index, tris, tri_indices, (int)mi_indices[i], inter, is_solid_hit);
+                    res |= hit_found;
+                    if (hit_found && is_equal(is_solid_hit, bbox_mask)) {
+                        break;
+                    }
+                }
+            }
+        }
+        st.index++;
+    }
+
+    return res;
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index,
+                                                  const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                  const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+    return Traverse_MacroTree_WithStack_AnyHit_Oct<S>(r, ray_mask, nodes, node_index, nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter, is_solid_hit);
+}
+
+template <int S>
+bool Ray::NS::Traverse_MacroTree_WithStack_AnyHit(const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, const mbvh_node_t *nodes, uint32_t node_index, const cmbvh_node_t *mesh_nodes,
+                                                  const mesh_instance_t *mesh_instances, const uint32_t *mi_indices, const mesh_t *meshes, const transform_t *transforms,
+                                                  const tri_accel_t *tris, const uint32_t *tri_indices, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+    return Traverse_MacroTree_WithStack_AnyHit_Oct<S>(r, ray_mask, nodes, node_index, mesh_nodes, mesh_instances, mi_indices, meshes, transforms, tris, tri_indices, inter, is_solid_hit);
 }
 
 template <int S>
@@ -2184,80 +2678,13 @@ bool Ray::NS::Traverse_MicroTree_WithStack_ClosestHit(const ray_packet_t<S> &r,
 template <int S>
 bool Ray::NS::Traverse_MicroTree_WithStack_ClosestHit(const float ro[3], const float rd[3], int ri, const mbvh_node_t *nodes, uint32_t node_index,
                                                       const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter) {
-    bool res = false;
-
-    float _inv_d[3], _neg_inv_d_o[3];
-    comp_aux_inv_values(ro, rd, _inv_d, _neg_inv_d_o);
-        
-    TraversalStateStack_Single<MAX_STACK_SIZE> st;
-    st.push(node_index, 0.0f);
-
-    while (!st.empty()) {
-        stack_entry_t cur = st.pop();
-
-        if (cur.dist > inter.t[ri]) continue;
-
-TRAVERSE:
-        if (!is_leaf_node(nodes[cur.index])) {
-            alignas(S * 4) float res_dist[8];
-            long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index].bbox_min, nodes[cur.index].bbox_max, res_dist);
-            if (mask) {
-                long i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                if (mask == 0) { // only one box was hit
-                    cur.index = nodes[cur.index].child[i];
-                    goto TRAVERSE;
-                }
-
-                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
-                if (mask == 0) { // two boxes were hit
-                    if (res_dist[i] < res_dist[i2]) {
-                        st.push(nodes[cur.index].child[i2], res_dist[i2]);
-                        cur.index = nodes[cur.index].child[i];
-                    } else {
-                        st.push(nodes[cur.index].child[i], res_dist[i]);
-                        cur.index = nodes[cur.index].child[i2];
-                    }
-                    goto TRAVERSE;
-                }
-
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                st.push(nodes[cur.index].child[i2], res_dist[i2]);
-
-                i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                if (mask == 0) { // three boxes were hit
-                    st.sort_top3();
-                    cur.index = st.pop_index();
-                    goto TRAVERSE;
-                }
-
-                i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                if (mask == 0) { // four boxes were hit
-                    st.sort_top4();
-                    cur.index = st.pop_index();
-                    goto TRAVERSE;
-                }
-
-                uint32_t size_before = st.stack_size;
-
-                // from five to eight boxes were hit
-                do {
-                    i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                    st.push(nodes[cur.index].child[i], res_dist[i]);
-                } while (mask != 0);
-
-                int count = int(st.stack_size - size_before + 4);
-                st.sort_topN(count);
-                cur.index = st.pop_index();
-                goto TRAVERSE;
-            }
-        } else {
-            res |= IntersectTris_ClosestHit(ro, rd, ri, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter);
-        }
-    }
+    return Traverse_MicroTree_WithStack_ClosestHit_Oct<S>(ro, rd, ri, nodes, node_index, tris, tri_indices, obj_index, inter);
+}
 
-    return res;
+template <int S>
+bool Ray::NS::Traverse_MicroTree_WithStack_ClosestHit(const float ro[3], const float rd[3], int ri, const cmbvh_node_t *nodes, uint32_t node_index,
+                                                      const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter) {
+    return Traverse_MicroTree_WithStack_ClosestHit_Oct<S>(ro, rd, ri, nodes, node_index, tris, tri_indices, obj_index, inter);
 }
 
 template <int S>
@@ -2313,84 +2740,13 @@ bool Ray::NS::Traverse_MicroTree_WithStack_AnyHit(const ray_packet_t<S> &r, cons
 template <int S>
 bool Ray::NS::Traverse_MicroTree_WithStack_AnyHit(const float ro[3], const float rd[3], int ri, const mbvh_node_t *nodes, uint32_t node_index,
                                                   const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
-    bool res = false;
-
-    float _inv_d[3], _neg_inv_d_o[3];
-    comp_aux_inv_values(ro, rd, _inv_d, _neg_inv_d_o);
-
-    TraversalStateStack_Single<MAX_STACK_SIZE> st;
-    st.push(node_index, 0.0f);
-
-    while (!st.empty()) {
-        stack_entry_t cur = st.pop();
-
-        if (cur.dist > inter.t[ri]) continue;
-
-TRAVERSE:
-        if (!is_leaf_node(nodes[cur.index])) {
-            alignas(S * 4) float res_dist[8];
-            long mask = bbox_test_oct<S>(_inv_d, _neg_inv_d_o, inter.t[ri], nodes[cur.index].bbox_min, nodes[cur.index].bbox_max, res_dist);
-            if (mask) {
-                long i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                if (mask == 0) { // only one box was hit
-                    cur.index = nodes[cur.index].child[i];
-                    goto TRAVERSE;
-                }
-
-                long i2 = GetFirstBit(mask); mask = ClearBit(mask, i2);
-                if (mask == 0) { // two boxes were hit
-                    if (res_dist[i] < res_dist[i2]) {
-                        st.push(nodes[cur.index].child[i2], res_dist[i2]);
-                        cur.index = nodes[cur.index].child[i];
-                    } else {
-                        st.push(nodes[cur.index].child[i], res_dist[i]);
-                        cur.index = nodes[cur.index].child[i2];
-                    }
-                    goto TRAVERSE;
-                }
-
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                st.push(nodes[cur.index].child[i2], res_dist[i2]);
-
-                i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                if (mask == 0) { // three boxes were hit
-                    st.sort_top3();
-                    cur.index = st.pop_index();
-                    goto TRAVERSE;
-                }
-
-                i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                st.push(nodes[cur.index].child[i], res_dist[i]);
-                if (mask == 0) { // four boxes were hit
-                    st.sort_top4();
-                    cur.index = st.pop_index();
-                    goto TRAVERSE;
-                }
-
-                uint32_t size_before = st.stack_size;
-
-                // from five to eight boxes were hit
-                do {
-                    i = GetFirstBit(mask); mask = ClearBit(mask, i);
-                    st.push(nodes[cur.index].child[i], res_dist[i]);
-                } while (mask != 0);
-
-                int count = int(st.stack_size - size_before + 4);
-                st.sort_topN(count);
-                cur.index = st.pop_index();
-                goto TRAVERSE;
-            }
-        } else {
-            bool hit_found = IntersectTris_AnyHit(ro, rd, ri, tris, &tri_indices[nodes[cur.index].child[0] & PRIM_INDEX_BITS], nodes[cur.index].child[1], obj_index, inter, is_solid_hit);
-            res |= hit_found;
-            if (hit_found && is_solid_hit[ri]) {
-                break;
-            }
-        }
-    }
+    return Traverse_MicroTree_WithStack_AnyHit_Oct<S>(ro, rd, ri, nodes, node_index, tris, tri_indices, obj_index, inter, is_solid_hit);
+}
 
-    return res;
+template <int S>
+bool Ray::NS::Traverse_MicroTree_WithStack_AnyHit(const float ro[3], const float rd[3], int ri, const cmbvh_node_t *nodes, uint32_t node_index,
+                                                  const tri_accel_t *tris, const uint32_t *tri_indices, int obj_index, hit_data_t<S> &inter, simd_ivec<S> &is_solid_hit) {
+    return Traverse_MicroTree_WithStack_AnyHit_Oct<S>(ro, rd, ri, nodes, node_index, tris, tri_indices, obj_index, inter, is_solid_hit);
 }
 
 template <int S>
@@ -2511,10 +2867,11 @@ void Ray::NS::SampleBilinear(const Ref::TextureAtlas &atlas, const texture_t &t,
 
         int page = t.page[lod[i]];
 
-        const pixel_color8_t &p00 = atlas.Get(page, int(_uvs[0][i]), int(_uvs[1][i]));
-        const pixel_color8_t &p01 = atlas.Get(page, int(_uvs[0][i] + 1), int(_uvs[1][i]));
-        const pixel_color8_t &p10 = atlas.Get(page, int(_uvs[0][i]), int(_uvs[1][i] + 1));
-        const pixel_color8_t &p11 = atlas.Get(page, int(_uvs[0][i] + 1), int(_uvs[1][i] + 1));
+        // compressed blocks are decoded once per lane for all four texels
+        pixel_color8_t p[4];
+        atlas.Get2x2(page, int(_uvs[0][i]), int(_uvs[1][i]), p);
+
+        const pixel_color8_t &p00 = p[0], &p01 = p[1], &p10 = p[2], &p11 = p[3];
 
         p0[0][i] = p01.r * k[0][i] + p00.r * (1 - k[0][i]);
         p0[1][i] = p01.g * k[0][i] + p00.g * (1 - k[0][i]);
@@ -2544,10 +2901,10 @@ void Ray::NS::SampleBilinear(const Ref::TextureAtlas &atlas, const simd_fvec<S>
     for (int i = 0; i < S; i++) {
         if (!mask[i]) continue;
 
-        const pixel_color8_t &p00 = atlas.Get(page[i], int(uvs[0][i] + 0), int(uvs[1][i] + 0));
-        const pixel_color8_t &p01 = atlas.Get(page[i], int(uvs[0][i] + 1), int(uvs[1][i] + 0));
-        const pixel_color8_t &p10 = atlas.Get(page[i], int(uvs[0][i] + 0), int(uvs[1][i] + 1));
-        const pixel_color8_t &p11 = atlas.Get(page[i], int(uvs[0][i] + 1), int(uvs[1][i] + 1));
+        pixel_color8_t p[4];
+        atlas.Get2x2(page[i], int(uvs[0][i]), int(uvs[1][i]), p);
+
+        const pixel_color8_t &p00 = p[0], &p01 = p[1], &p10 = p[2], &p11 = p[3];
 
         _p00[0][i] = to_norm_float(p00.r);
         _p00[1][i] = to_norm_float(p00.g);
@@ -2765,17 +3122,13 @@ void Ray::NS::SampleLatlong_RGBE(const Ref::TextureAtlas &atlas, const texture_t
 }
 
 template <int S>
-Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const simd_fvec<S> p1[3], const simd_fvec<S> p2[3], const simd_ivec<S> &mask,
-                                                 const float *halton, const int hi, const simd_ivec<S> &rand_hash2,
-                                                 const scene_data_t &sc, uint32_t node_index, const Ref::TextureAtlas &tex_atlas) {
-    simd_fvec<S> dir[] = { p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2] };
-    simd_fvec<S> distance = length(dir);
-    ITERATE_3({ dir[i] /= distance; })
+Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const shadow_ray_t<S> &r, const simd_ivec<S> &mask, const scene_data_t &sc, uint32_t node_index, const Ref::TextureAtlas &tex_atlas) {
+    simd_fvec<S> distance = r.dist;
 
     ray_packet_t<S> sh_r;
 
-    ITERATE_3({ sh_r.o[i] = p1[i]; })
-    ITERATE_3({ sh_r.d[i] = dir[i]; })
+    ITERATE_3({ sh_r.o[i] = r.o[i]; })
+    ITERATE_3({ sh_r.d[i] = r.d[i]; })
 
     simd_fvec<S> visibility = 1.0f;
 
@@ -2787,7 +3140,9 @@ Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const simd_fvec<S> p1[3], const
 
         simd_ivec<S> is_solid_hit = { 0 };
 
-        if (sc.mnodes) {
+        if (sc.cmnodes) {
+            Traverse_MacroTree_WithStack_AnyHit(sh_r, ikeep_going, sc.mnodes, node_index, sc.cmnodes, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter, is_solid_hit);
+        } else if (sc.mnodes) {
             Traverse_MacroTree_WithStack_AnyHit(sh_r, ikeep_going, sc.mnodes, node_index, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter, is_solid_hit);
         } else {
             Traverse_MacroTree_WithStack_AnyHit(sh_r, ikeep_going, sc.nodes, node_index, sc.mesh_instances, sc.mi_indices, sc.meshes, sc.transforms, sc.tris, sc.tri_indices, sh_inter, is_solid_hit);
@@ -2858,9 +3213,6 @@ Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const simd_fvec<S> p1[3], const
         simd_fvec<S> sh_uvs[2] = { u1[0] * w + u2[0] * sh_inter.u + u3[0] * sh_inter.v,
             u1[1] * w + u2[1] * sh_inter.u + u3[1] * sh_inter.v };
 
-        simd_ivec<S> sh_rand_hash = hash(rand_hash2);
-        simd_fvec<S> sh_rand_offset = construct_float(sh_rand_hash);
-
         {
             simd_ivec<S> ray_queue[S];
             int index = 0;
@@ -2896,12 +3248,7 @@ Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const simd_fvec<S> p1[3], const
 
                         first_mi = 0xffffffff;
 
-                        simd_fvec<S> sh_rand;
-
-                        for (int i = 0; i < S; i++) {
-                            float _unused;
-                            sh_rand[i] = std::modf(halton[hi + 0] + sh_rand_offset[i], &_unused);
-                        }
+                        simd_fvec<S> sh_rand = r.rand;
 
                         for (int i = 0; i < S; i++) {
                             if (!same_mi[i]) continue;
@@ -2961,225 +3308,120 @@ Ray::NS::simd_fvec<S> Ray::NS::ComputeVisibility(const simd_fvec<S> p1[3], const
 template <int S>
 void Ray::NS::ComputeDirectLighting(const simd_fvec<S> I[3], const simd_fvec<S> P[3], const simd_fvec<S> N[3], const simd_fvec<S> B[3], const simd_fvec<S> plane_N[3], const simd_fvec<S> &sigma,
                                     const float *halton, const int hi, const simd_ivec<S> &rand_hash, const simd_ivec<S> &rand_hash2,
-                                    const simd_fvec<S> &rand_offset, const simd_fvec<S> &rand_offset2, const scene_data_t &sc, uint32_t node_index,
-                                    uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas, const simd_ivec<S> &ray_mask, simd_fvec<S> *out_col) {
+                                    const simd_fvec<S> &rand_offset, const simd_fvec<S> &rand_offset2, const scene_data_t &sc,
+                                    uint32_t light_node_index, const simd_fvec<S> weight[3], const simd_ivec<S> &ray_mask,
+                                    shadow_ray_t<S> &out_shadow_ray, simd_ivec<S> &out_shadow_mask) {
     unused(rand_hash);
 
-    const simd_fvec<S> P_biased[] = { P[0] + HIT_BIAS * plane_N[0],
-                                      P[1] + HIT_BIAS * plane_N[1],
-                                      P[2] + HIT_BIAS * plane_N[2] };
-
-    if (sc.mnodes) {
-        const int LanesCount = 8 / S;
-
-        for (int ri = 0; ri < S; ri++) {
-            if (!ray_mask[ri]) continue;
-
-            // recombine in AoS layout
-            const float _P[3] = { P[0][ri], P[1][ri], P[2][ri] };
-
-            uint32_t stack[MAX_STACK_SIZE];
-            uint32_t stack_size = 0;
-
-            if (light_node_index != 0xffffffff) {
-                stack[stack_size++] = light_node_index;
-            }
-
-            while (stack_size) {
-                uint32_t cur = stack[--stack_size];
-
-                if (!is_leaf_node(sc.mnodes[cur])) {
-                    simd_fvec<S> bbox_min[LanesCount][3], bbox_max[LanesCount][3];
-
-                    ITERATE(LanesCount, {
-                        bbox_min[i][0] = simd_fvec<S>(sc.mnodes[cur].bbox_min[0] + i * S, simd_mem_aligned);
-                        bbox_min[i][1] = simd_fvec<S>(sc.mnodes[cur].bbox_min[1] + i * S, simd_mem_aligned);
-                        bbox_min[i][2] = simd_fvec<S>(sc.mnodes[cur].bbox_min[2] + i * S, simd_mem_aligned);
-                        bbox_max[i][0] = simd_fvec<S>(sc.mnodes[cur].bbox_max[0] + i * S, simd_mem_aligned);
-                        bbox_max[i][1] = simd_fvec<S>(sc.mnodes[cur].bbox_max[1] + i * S, simd_mem_aligned);
-                        bbox_max[i][2] = simd_fvec<S>(sc.mnodes[cur].bbox_max[2] + i * S, simd_mem_aligned);
-                    })
-
-                    simd_ivec<S> res_mask[LanesCount];
-                    ITERATE(LanesCount, { bbox_test_oct(_P, bbox_min[i], bbox_max[i], res_mask[i]); })
-
-                    const int *_res_mask = &res_mask[0][0];
-
-                    ITERATE_8({
-                        stack[stack_size] = sc.mnodes[cur].child[i];
-                        stack_size -= _res_mask[i];
-                    })
-
-                    assert(stack_size < MAX_STACK_SIZE);
-                    for (uint32_t i = 0; i < stack_size; i++) {
-                        assert(stack[i] != 0x7fffffff && "Invalid index!");
-                    }
-                } else {
-                    uint32_t prim_index = (sc.mnodes[cur].child[0] & PRIM_INDEX_BITS);
-                    for (uint32_t li = prim_index; li < prim_index + sc.mnodes[cur].child[1]; li++) {
-                        const light_t &l = sc.lights[sc.li_indices[li]];
-
-                        simd_fvec<S> L = { 0.0f };
-                        ITERATE_3({ L[i] = _P[i] - l.pos[i]; })
-
-                        float distance = length(L);
-                        float d = std::max(distance - l.radius, 0.0f);
-
-                        ITERATE_3({ L[i] /= distance; })
-
-                        simd_fvec<S> V, TT, BB;
-
-                        BB[0] = B[0][ri];
-                        BB[1] = B[1][ri];
-                        BB[2] = B[2][ri];
-
-                        cross(L, BB, TT);
-                        cross(L, TT, BB);
-
-                        {
-                            float _unused;
-                            const float z = std::modf(halton[hi + 0] + rand_offset[ri], &_unused);
+    simd_ivec<S> mask = ray_mask;
 
-                            const float dir = std::sqrt(z);
-                            const float phi = 2 * PI * std::modf(halton[hi + 1] + rand_offset2[ri], &_unused);
+    // one light is picked from light tree for each ray, its parameters are gathered to process all rays at once
+    simd_fvec<S> l_pos[3] = { 0.0f, 0.0f, 0.0f }, l_col[3] = { 0.0f, 0.0f, 0.0f }, l_dir[3] = { 0.0f, 0.0f, 0.0f },
+                 l_radius = { 1.0f }, l_brightness = { 1.0f }, l_spot = { 0.0f }, pdf = { 1.0f };
+    simd_fvec<S> rand_z = { 0.0f }, rand_phi = { 0.0f };
 
-                            const float cos_phi = std::cos(phi);
-                            const float sin_phi = std::sin(phi);
-
-                            V[0] = dir * sin_phi * BB[0] + std::sqrt(1.0f - dir) * L[0] + dir * cos_phi * TT[0];
-                            V[1] = dir * sin_phi * BB[1] + std::sqrt(1.0f - dir) * L[1] + dir * cos_phi * TT[1];
-                            V[2] = dir * sin_phi * BB[2] + std::sqrt(1.0f - dir) * L[2] + dir * cos_phi * TT[2];
-                        }
-
-                        ITERATE_3({ L[i] = l.pos[i] + V[i] * l.radius - _P[i]; })
-                        float len = std::sqrt(L[0] * L[0] + L[1] * L[1] + L[2] * L[2]);
-                        ITERATE_3({ L[i] /= len; })
-
-                        float denom = d / l.radius + 1.0f;
-                        float atten = 1.0f / (denom * denom);
-
-                        atten = (atten - LIGHT_ATTEN_CUTOFF / l.brightness) / (1.0f - LIGHT_ATTEN_CUTOFF);
-                        atten = std::max(atten, 0.0f);
-
-                        float _dot1 = std::max(L[0] * N[0][ri] + L[1] * N[1][ri] + L[2] * N[2][ri], 0.0f);
-                        float _dot2 = L[0] * l.dir[0] + L[1] * l.dir[1] + L[2] * l.dir[2];
-
-                        if ((_dot1 > FLT_EPS) && (_dot2 > l.spot) && (l.brightness * atten > FLT_EPS)) {
-                            const simd_fvec<S> p2[] = { l.pos[0], l.pos[1], l.pos[2] };
-
-                            // Setup to check only one ray in lane (not very effective, should be changed later)
-                            simd_ivec<S> imask = { 0 };
-                            imask[ri] = 0xffffffff;
-
-                            simd_fvec<S> visibility = ComputeVisibility(P_biased, p2, imask, halton, hi, rand_hash2, sc, node_index, tex_atlas);
+    for (int ri = 0; ri < S; ri++) {
+        if (!mask[ri]) continue;
 
-                            simd_fvec<S> _L[3];
-                            _L[0][ri] = L[0]; _L[1][ri] = L[1]; _L[2][ri] = L[2];
-                            simd_fvec<S> diff_k = BRDF_OrenNayar(_L, I, N, B, sigma);
+        float _unused;
+        float u = std::modf(halton[hi + 0] + rand_offset[ri], &_unused);
+        rand_phi[ri] = std::modf(halton[hi + 1] + rand_offset2[ri], &_unused);
 
-                            out_col[0][ri] = out_col[0][ri] + l.col[0] * _dot1 * visibility[ri] * atten * diff_k[ri];
-                            out_col[1][ri] = out_col[1][ri] + l.col[1] * _dot1 * visibility[ri] * atten * diff_k[ri];
-                            out_col[2][ri] = out_col[2][ri] + l.col[2] * _dot1 * visibility[ri] * atten * diff_k[ri];
-                        }
-                    }
-                }
-            }
+        // recombine in AoS layout
+        const float _P[3] = { P[0][ri], P[1][ri], P[2][ri] },
+                    _N[3] = { N[0][ri], N[1][ri], N[2][ri] };
+
+        float _pdf;
+        const uint32_t light_index = SampleLightTree(sc.light_nodes, light_node_index, sc.lights, sc.li_indices, _P, _N, u, _pdf);
+        if (light_index == 0xffffffff) {
+            mask[ri] = 0;
+            continue;
         }
-    } else {
-        TraversalStateStack_Multi<S, MAX_STACK_SIZE> st;
 
-        st.queue[0].mask = ray_mask;
-        st.queue[0].stack_size = 0;
-
-        if (light_node_index != 0xffffffff) {
-            st.queue[0].stack[st.queue[0].stack_size++] = light_node_index;
-        }
+        // the same random number is used to pick point on light (it is remapped during tree descent)
+        rand_z[ri] = u;
+        pdf[ri] = _pdf;
+
+        const light_t &l = sc.lights[light_index];
+        ITERATE_3({
+            l_pos[i][ri] = l.pos[i];
+            l_col[i][ri] = l.col[i];
+            l_dir[i][ri] = l.dir[i];
+        })
+        l_radius[ri] = l.radius;
+        l_brightness[ri] = l.brightness;
+        l_spot[ri] = l.spot;
+    }
 
-        while (st.index < st.num) {
-            uint32_t *stack = &st.queue[st.index].stack[0];
-            uint32_t &stack_size = st.queue[st.index].stack_size;
-            while (stack_size) {
-                uint32_t cur = stack[--stack_size];
+    if (mask.all_zeros()) return;
 
-                simd_ivec<S> mask1 = bbox_test(P, sc.nodes[cur]) & st.queue[st.index].mask;
-                if (mask1.all_zeros()) {
-                    continue;
-                }
+    simd_fvec<S> L[3] = { P[0] - l_pos[0], P[1] - l_pos[1], P[2] - l_pos[2] };
+    const simd_fvec<S> distance = length(L);
+    const simd_fvec<S> d = max(distance - l_radius, simd_fvec<S>{ 0.0f });
+    ITERATE_3({ L[i] /= distance; })
 
-                simd_ivec<S> mask2 = and_not(mask1, st.queue[st.index].mask);
-                if (mask2.not_all_zeros()) {
-                    st.queue[st.num].mask = mask2;
-                    st.queue[st.num].stack_size = stack_size;
-                    memcpy(st.queue[st.num].stack, st.queue[st.index].stack, sizeof(uint32_t) * stack_size);
-                    st.num++;
-                    st.queue[st.index].mask = mask1;
-                }
+    simd_fvec<S> V[3], TT[3], BB[3];
 
-                if (!is_leaf_node(sc.nodes[cur])) {
-                    st.push_children(sc.nodes[cur]);
-                } else {
-                    uint32_t prim_index = (sc.nodes[cur].prim_index & PRIM_INDEX_BITS);
-                    for (uint32_t li = prim_index; li < prim_index + sc.nodes[cur].prim_count; li++) {
-                        const light_t &l = sc.lights[sc.li_indices[li]];
+    cross(L, B, TT);
+    cross(L, TT, BB);
 
-                        simd_fvec<S> L[3] = { { P[0] - l.pos[0] }, { P[1] - l.pos[1] }, { P[2] - l.pos[2] } };
-                        simd_fvec<S> distance = length(L);
-                        simd_fvec<S> d = max(distance - l.radius, simd_fvec<S>{ 0.0f });
-                        ITERATE_3({ L[i] /= distance; })
+    for (int ri = 0; ri < S; ri++) {
+        if (!mask[ri]) continue;
 
-                        simd_fvec<S> V[3], TT[3], BB[3];
+        const float dir = std::sqrt(rand_z[ri]);
+        const float phi = 2 * PI * rand_phi[ri];
 
-                        cross(L, B, TT);
-                        cross(L, TT, BB);
+        const float cos_phi = std::cos(phi);
+        const float sin_phi = std::sin(phi);
 
-                        for (int i = 0; i < S; i++) {
-                            if (!mask1[i]) continue;
+        V[0][ri] = dir * sin_phi * BB[0][ri] + std::sqrt(1.0f - dir) * L[0][ri] + dir * cos_phi * TT[0][ri];
+        V[1][ri] = dir * sin_phi * BB[1][ri] + std::sqrt(1.0f - dir) * L[1][ri] + dir * cos_phi * TT[1][ri];
+        V[2][ri] = dir * sin_phi * BB[2][ri] + std::sqrt(1.0f - dir) * L[2][ri] + dir * cos_phi * TT[2][ri];
+    }
 
-                            float _unused;
-                            const float z = std::modf(halton[hi + 0] + rand_offset[i], &_unused);
+    ITERATE_3({ L[i] = l_pos[i] + V[i] * l_radius - P[i]; })
+    normalize(L);
 
-                            const float dir = std::sqrt(z);
-                            const float phi = 2 * PI * std::modf(halton[hi + 1] + rand_offset2[i], &_unused);
+    simd_fvec<S> denom = d / l_radius + 1.0f;
+    simd_fvec<S> atten = 1.0f / (denom * denom);
 
-                            const float cos_phi = std::cos(phi);
-                            const float sin_phi = std::sin(phi);
+    atten = (atten - LIGHT_ATTEN_CUTOFF / l_brightness) / (1.0f - LIGHT_ATTEN_CUTOFF);
+    atten = max(atten, simd_fvec<S>{ 0.0f });
 
-                            V[0][i] = dir * sin_phi * BB[0][i] + std::sqrt(1.0f - dir) * L[0][i] + dir * cos_phi * TT[0][i];
-                            V[1][i] = dir * sin_phi * BB[1][i] + std::sqrt(1.0f - dir) * L[1][i] + dir * cos_phi * TT[1][i];
-                            V[2][i] = dir * sin_phi * BB[2][i] + std::sqrt(1.0f - dir) * L[2][i] + dir * cos_phi * TT[2][i];
-                        }
+    simd_fvec<S> _dot1 = max(dot(L, N), simd_fvec<S>{ 0.0f });
+    simd_fvec<S> _dot2 = dot(L, l_dir);
 
-                        ITERATE_3({ L[i] = l.pos[i] + V[i] * l.radius - P[i]; })
-                        normalize(L);
+    auto fmask = reinterpret_cast<const simd_fvec<S> &>(mask) & (_dot1 > FLT_EPS) & (_dot2 > l_spot) & (l_brightness * atten > FLT_EPS);
+    const auto &imask = reinterpret_cast<const simd_ivec<S> &>(fmask);
+    if (imask.all_zeros()) return;
 
-                        simd_fvec<S> denom = d / l.radius + 1.0f;
-                        simd_fvec<S> atten = 1.0f / (denom * denom);
+    const simd_fvec<S> P_biased[] = { P[0] + HIT_BIAS * plane_N[0],
+                                      P[1] + HIT_BIAS * plane_N[1],
+                                      P[2] + HIT_BIAS * plane_N[2] };
 
-                        atten = (atten - LIGHT_ATTEN_CUTOFF / l.brightness) / (1.0f - LIGHT_ATTEN_CUTOFF);
-                        atten = max(atten, simd_fvec<S>{ 0.0f });
+    simd_fvec<S> sh_d[3] = { l_pos[0] - P_biased[0], l_pos[1] - P_biased[1], l_pos[2] - P_biased[2] };
+    const simd_fvec<S> sh_dist = length(sh_d);
+    ITERATE_3({ sh_d[i] /= sh_dist; })
 
-                        simd_fvec<S> _dot1 = max(dot(L, N), simd_fvec<S>{ 0.0f });
-                        simd_fvec<S> _dot2 = dot(L, l.dir);
+    const simd_fvec<S> sh_rand_offset = construct_float(hash(rand_hash2));
+    simd_fvec<S> sh_rand;
+    for (int i = 0; i < S; i++) {
+        float _unused;
+        sh_rand[i] = std::modf(halton[hi + 0] + sh_rand_offset[i], &_unused);
+    }
 
-                        auto fmask = reinterpret_cast<const simd_fvec<S> &>(mask1) & (_dot1 > FLT_EPS) & (_dot2 > l.spot) & (l.brightness * atten > FLT_EPS);
-                        const auto &imask = reinterpret_cast<const simd_ivec<S> &>(fmask);
-                        if (imask.not_all_zeros()) {
-                            const simd_fvec<S> p2[] = { l.pos[0], l.pos[1], l.pos[2] };
+    simd_fvec<S> diff_k = BRDF_OrenNayar(L, I, N, B, sigma);
 
+    const simd_fvec<S> k = _dot1 * atten * diff_k / pdf;
 
-                            simd_fvec<S> visibility = ComputeVisibility(P_biased, p2, imask, halton, hi, rand_hash2, sc, node_index, tex_atlas);
-                            simd_fvec<S> diff_k = BRDF_OrenNayar(L, I, N, B, sigma);
+    // visibility is resolved later, when all shadow rays are traced in one batch
+    ITERATE_3({ where(fmask, out_shadow_ray.o[i]) = P_biased[i]; })
+    ITERATE_3({ where(fmask, out_shadow_ray.d[i]) = sh_d[i]; })
+    where(fmask, out_shadow_ray.dist) = sh_dist;
+    ITERATE_3({ where(fmask, out_shadow_ray.c[i]) = weight[i] * l_col[i] * k; })
+    where(fmask, out_shadow_ray.rand) = sh_rand;
 
-                            where(fmask, out_col[0]) = out_col[0] + l.col[0] * _dot1 * visibility * atten * diff_k;
-                            where(fmask, out_col[1]) = out_col[1] + l.col[1] * _dot1 * visibility * atten * diff_k;
-                            where(fmask, out_col[2]) = out_col[2] + l.col[2] * _dot1 * visibility * atten * diff_k;
-                        }
-                    }
-                }
-            }
-            st.index++;
-        }
-    }
+    out_shadow_mask = out_shadow_mask | imask;
 }
 
 template <int S>
@@ -3275,8 +3517,9 @@ void Ray::NS::ComputeDerivatives(const simd_fvec<S> I[3], const simd_fvec<S> &t,
 
 template <int S>
 void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi, const float *halton, const hit_data_t<S> &inter, const ray_packet_t<S> &ray,
-                           const scene_data_t &sc, uint32_t node_index, uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas,
-                           simd_fvec<S> out_rgba[4], simd_ivec<S> *out_secondary_masks, ray_packet_t<S> *out_secondary_rays, int *out_secondary_rays_count) {
+                           const scene_data_t &sc, uint32_t light_node_index, const Ref::TextureAtlas &tex_atlas,
+                           simd_fvec<S> out_rgba[4], simd_ivec<S> *out_secondary_masks, ray_packet_t<S> *out_secondary_rays, int *out_secondary_rays_count,
+                           simd_ivec<S> *out_shadow_masks, shadow_ray_t<S> *out_shadow_rays, int *out_shadow_rays_count) {
     out_rgba[3] = { 1.0f };
     
     simd_ivec<S> ino_hit = inter.mask ^ simd_ivec<S>(-1);
@@ -3407,7 +3650,7 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
 
     simd_ivec<S> itotal_depth_mask = total_depth < int(pi.settings.max_total_depth);
 
-    simd_ivec<S> secondary_mask = { 0 };
+    simd_ivec<S> secondary_mask = { 0 }, shadow_mask = { 0 };
 
     {
         simd_ivec<S> ray_queue[S];
@@ -3556,15 +3799,13 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
 
             if (mat->type == DiffuseMaterial) {
                 if (pi.should_add_direct_light()) {
-                    ComputeDirectLighting(I, P, __N, __B, plane_N, { mat->roughness }, halton, hi, rand_hash, rand_hash2, rand_offset, rand_offset2, sc, node_index, light_node_index, tex_atlas, same_mi, out_rgba);
-
+                    simd_fvec<S> weight[3] = { 1.0f, 1.0f, 1.0f };
                     if (pi.should_consider_albedo()) {
-                        const auto &mask = reinterpret_cast<const simd_fvec<S>&>(same_mi);
-
-                        where(mask, out_rgba[0]) = ray.c[0] * tex_albedo[0] * out_rgba[0];
-                        where(mask, out_rgba[1]) = ray.c[1] * tex_albedo[1] * out_rgba[1];
-                        where(mask, out_rgba[2]) = ray.c[2] * tex_albedo[2] * out_rgba[2];
+                        ITERATE_3({ weight[i] = ray.c[i] * tex_albedo[i]; })
                     }
+
+                    ComputeDirectLighting(I, P, __N, __B, plane_N, { mat->roughness }, halton, hi, rand_hash, rand_hash2, rand_offset, rand_offset2, sc,
+                                          light_node_index, weight, same_mi, out_shadow_rays[*out_shadow_rays_count], shadow_mask);
                 }
 
                 simd_fvec<S> rc[3] = { ray.c[0], ray.c[1], ray.c[2] };
@@ -3617,6 +3858,15 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
                     reinterpret_cast<const simd_fvec<S>&>(idiff_depth_mask) &
                     reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
 
+                // lanes which would continue tracing if russian roulette did not terminate them
+                const simd_fvec<S> rr_terminated_mask =
+                    (p < q) &
+                    reinterpret_cast<const simd_fvec<S>&>(same_mi) &
+                    reinterpret_cast<const simd_fvec<S>&>(ray_queue[index]) &
+                    reinterpret_cast<const simd_fvec<S>&>(idiff_depth_mask) &
+                    reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
+                g_ray_counters.rays_terminated += count_bits(uint32_t(reinterpret_cast<const simd_ivec<S>&>(rr_terminated_mask).movemask()));
+
                 if (reinterpret_cast<const simd_ivec<S>&>(new_ray_mask).not_all_zeros()) {
                     const int out_index = *out_secondary_rays_count;
                     ray_packet_t<S> &r = out_secondary_rays[out_index];
@@ -3709,6 +3959,15 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
                     reinterpret_cast<const simd_fvec<S>&>(igloss_depth_mask) &
                     reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
 
+                // lanes which would continue tracing if russian roulette did not terminate them
+                const simd_fvec<S> rr_terminated_mask =
+                    (p < q) &
+                    reinterpret_cast<const simd_fvec<S>&>(same_mi) &
+                    reinterpret_cast<const simd_fvec<S>&>(ray_queue[index]) &
+                    reinterpret_cast<const simd_fvec<S>&>(igloss_depth_mask) &
+                    reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
+                g_ray_counters.rays_terminated += count_bits(uint32_t(reinterpret_cast<const simd_ivec<S>&>(rr_terminated_mask).movemask()));
+
                 if (reinterpret_cast<const simd_ivec<S>&>(new_ray_mask).not_all_zeros()) {
                     const int out_index = *out_secondary_rays_count;
                     ray_packet_t<S> &r = out_secondary_rays[out_index];
@@ -3808,6 +4067,16 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
                     reinterpret_cast<const simd_fvec<S>&>(irefr_depth_mask) &
                     reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
 
+                // lanes which would continue tracing if russian roulette did not terminate them
+                const simd_fvec<S> rr_terminated_mask =
+                    (cost2 >= 0.0f) &
+                    (p < q) &
+                    reinterpret_cast<const simd_fvec<S>&>(same_mi) &
+                    reinterpret_cast<const simd_fvec<S>&>(ray_queue[index]) &
+                    reinterpret_cast<const simd_fvec<S>&>(irefr_depth_mask) &
+                    reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
+                g_ray_counters.rays_terminated += count_bits(uint32_t(reinterpret_cast<const simd_ivec<S>&>(rr_terminated_mask).movemask()));
+
                 if (reinterpret_cast<const simd_ivec<S>&>(new_ray_mask).not_all_zeros()) {
                     const int out_index = *out_secondary_rays_count;
                     ray_packet_t<S> &r = out_secondary_rays[out_index];
@@ -3874,6 +4143,15 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
                     reinterpret_cast<const simd_fvec<S>&>(itransp_depth_mask) &
                     reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
 
+                // lanes which would continue tracing if russian roulette did not terminate them
+                const simd_fvec<S> rr_terminated_mask =
+                    (p < q) &
+                    reinterpret_cast<const simd_fvec<S>&>(same_mi) &
+                    reinterpret_cast<const simd_fvec<S>&>(ray_queue[index]) &
+                    reinterpret_cast<const simd_fvec<S>&>(itransp_depth_mask) &
+                    reinterpret_cast<const simd_fvec<S>&>(itotal_depth_mask);
+                g_ray_counters.rays_terminated += count_bits(uint32_t(reinterpret_cast<const simd_ivec<S>&>(rr_terminated_mask).movemask()));
+
                 if (reinterpret_cast<const simd_ivec<S>&>(new_ray_mask).not_all_zeros()) {
                     const int out_index = *out_secondary_rays_count;
                     ray_packet_t<S> &r = out_secondary_rays[out_index];
@@ -3926,6 +4204,12 @@ void Ray::NS::ShadeSurface(const simd_ivec<S> &px_index, const pass_info_t &pi,
         out_secondary_masks[index] = secondary_mask;
         out_secondary_rays[index].xy = ray.xy;
     }
+
+    if (shadow_mask.not_all_zeros()) {
+        const int index = (*out_shadow_rays_count)++;
+        out_shadow_masks[index] = shadow_mask;
+        out_shadow_rays[index].xy = ray.xy;
+    }
 }
 
 #pragma warning(pop)
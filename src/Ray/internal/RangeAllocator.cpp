@@ -0,0 +1,99 @@
+#include "RangeAllocator.h"
+
+#include <cassert>
+
+#include <algorithm>
+
+uint32_t Ray::RangeAllocator::Alloc(uint32_t size) {
+    if (!size) return size_;
+
+    // first fit
+    for (auto it = free_ranges_.begin(); it != free_ranges_.end(); ++it) {
+        if (it->size < size) continue;
+
+        const uint32_t offset = it->offset;
+        if (it->size == size) {
+            free_ranges_.erase(it);
+        } else {
+            it->offset += size;
+            it->size -= size;
+        }
+        free_size_ -= size;
+        return offset;
+    }
+
+    const uint32_t offset = size_;
+    size_ += size;
+    return offset;
+}
+
+void Ray::RangeAllocator::Free(uint32_t offset, uint32_t size) {
+    if (!size) return;
+
+    assert(offset + size <= size_);
+
+    auto it = std::lower_bound(free_ranges_.begin(), free_ranges_.end(), offset, [](const range_t &r, uint32_t offset) {
+        return r.offset < offset;
+    });
+
+    assert(it == free_ranges_.end() || it->offset >= offset + size);
+    assert(it == free_ranges_.begin() || std::prev(it)->offset + std::prev(it)->size <= offset);
+
+    range_t r = { offset, size };
+
+    // merge with neighbours
+    if (it != free_ranges_.begin() && std::prev(it)->offset + std::prev(it)->size == offset) {
+        --it;
+        r.offset = it->offset;
+        r.size += it->size;
+        free_size_ -= it->size;
+        it = free_ranges_.erase(it);
+    }
+
+    if (it != free_ranges_.end() && r.offset + r.size == it->offset) {
+        r.size += it->size;
+        free_size_ -= it->size;
+        it = free_ranges_.erase(it);
+    }
+
+    if (r.offset + r.size == size_) {
+        // range is at the end of storage, just shrink it
+        size_ = r.offset;
+    } else {
+        free_ranges_.insert(it, r);
+        free_size_ += r.size;
+    }
+}
+
+void Ray::RangeAllocator::GetState(std::vector<uint32_t> &out_state) const {
+    out_state.clear();
+    out_state.reserve(2 + 2 * free_ranges_.size());
+    out_state.push_back(size_);
+    out_state.push_back(free_size_);
+    for (const range_t &r : free_ranges_) {
+        out_state.push_back(r.offset);
+        out_state.push_back(r.size);
+    }
+}
+
+bool Ray::RangeAllocator::SetState(const uint32_t *state, size_t count) {
+    if (count < 2 || (count % 2)) return false;
+
+    std::vector<range_t> free_ranges((count - 2) / 2);
+
+    uint64_t free_size = 0, end = 0;
+    for (size_t i = 0; i < free_ranges.size(); i++) {
+        const range_t r = { state[2 + 2 * i], state[2 + 2 * i + 1] };
+        // ranges must be sorted, separated and lie inside of storage
+        if (!r.size || (i && r.offset <= end) || uint64_t(r.offset) + r.size >= state[0]) return false;
+        free_ranges[i] = r;
+        free_size += r.size;
+        end = uint64_t(r.offset) + r.size;
+    }
+    if (free_size != state[1]) return false;
+
+    free_ranges_ = std::move(free_ranges);
+    size_ = state[0];
+    free_size_ = state[1];
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace Ray {
+/** Allocates contiguous ranges of elements inside of linear storage.
+    Freed ranges are kept in sorted list (neighbouring ranges are merged) and reused by later allocations,
+    so indices of other ranges remain valid after removal.
+*/
+class RangeAllocator {
+    struct range_t {
+        uint32_t offset, size;
+    };
+
+    std::vector<range_t> free_ranges_;  ///< sorted by offset, never adjacent to each other or to the end of storage
+    uint32_t size_ = 0, free_size_ = 0;
+public:
+    /// Size of storage required to hold all allocated ranges
+    uint32_t size() const { return size_; }
+
+    /// Number of allocated elements
+    uint32_t used_size() const { return size_ - free_size_; }
+
+    /// Number of free ranges (storage is not fragmented if zero)
+    uint32_t free_ranges_count() const { return (uint32_t)free_ranges_.size(); }
+
+    /** @brief Allocates range of elements
+        @param size number of elements
+        @return Offset of the first element (storage size can grow after this call)
+    */
+    uint32_t Alloc(uint32_t size);
+
+    /** @brief Frees range of elements
+        @param offset offset of the first element
+        @param size number of elements
+
+        Storage size shrinks if range was at the end of it.
+    */
+    void Free(uint32_t offset, uint32_t size);
+
+    /** @brief Saves allocator state
+        @param out_state receives size, free size and sorted list of free ranges (offset, size)
+    */
+    void GetState(std::vector<uint32_t> &out_state) const;
+
+    /** @brief Restores allocator state previously saved with GetState
+        @return false if state is malformed (allocator is not changed)
+    */
+    bool SetState(const uint32_t *state, size_t count);
+
+    /// Frees all ranges
+    void Clear() {
+        free_ranges_.clear();
+        size_ = free_size_ = 0;
+    }
+};
+}
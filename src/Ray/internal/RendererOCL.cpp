@@ -3,7 +3,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#include <chrono>
 #include <random>
 #include <sstream>
 #include <string>
@@ -110,7 +109,7 @@ Ray::Ocl::Renderer::Renderer(int w, int h, int platform_index, int device_index)
         cl_int error = CL_SUCCESS;
         context_ = cl::Context(devices, nullptr, nullptr, nullptr, &error);
         if (error != CL_SUCCESS) throw std::runtime_error("Cannot create OpenCL renderer!");
-        queue_ = cl::CommandQueue(context_, device_, cl::QueueProperties::None, &error);
+        queue_ = cl::CommandQueue(context_, device_, cl::QueueProperties::Profiling, &error);
         if (error != CL_SUCCESS) throw std::runtime_error("Cannot create OpenCL renderer!");
     }
 
@@ -348,9 +347,17 @@ Ray::Ocl::Renderer::Renderer(int w, int h, int platform_index, int device_index)
     permutations_ = Ray::ComputeRadicalInversePermutations(g_primes, PrimesCount, rand_func);
 }
 
+Ray::Ocl::Renderer::~Renderer() {
+    // pending reads write into host memory
+    queue_.finish();
+}
+
 void Ray::Ocl::Renderer::Resize(int w, int h) {
     if (w_ == w && h_ == h) return;
 
+    WaitForReadback(0);
+    WaitForReadback(1);
+
     const int num_pixels = w * h;
 
     cl_int error = CL_SUCCESS;
@@ -408,7 +415,8 @@ void Ray::Ocl::Renderer::Resize(int w, int h) {
     final_buf_ = cl::Image2D(context_, CL_MEM_READ_WRITE, cl::ImageFormat { CL_RGBA, CL_FLOAT }, (size_t)w, (size_t)h, 0, nullptr, &error);
     if (error != CL_SUCCESS) throw std::runtime_error("Cannot create OpenCL renderer!");
 
-    frame_pixels_.resize((size_t)w * h);
+    frame_pixels_[0].resize((size_t)w * h);
+    frame_pixels_[1].resize((size_t)w * h);
 
     w_ = w; h_ = h;
 }
@@ -430,6 +438,9 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
     auto s = std::dynamic_pointer_cast<Ocl::Scene>(_s);
     if (!s) return;
 
+    // collect stats of already finished frames
+    ResolveStats(false);
+
     uint32_t macro_tree_root = s->macro_nodes_start_;
     bvh_node_t root_node;
 
@@ -443,11 +454,16 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
 
     region.iteration++;
     if (!region.halton_seq || region.iteration % HALTON_SEQ_LEN == 0) {
+        // previous upload may still read from sequence
+        if (halton_upload_event_()) {
+            halton_upload_event_.wait();
+        }
         UpdateHaltonSequence(region.iteration, region.halton_seq);
     }
 
     if (region.iteration != loaded_halton_) {
-        if (CL_SUCCESS != queue_.enqueueWriteBuffer(halton_seq_buf_, CL_TRUE, 0, sizeof(float) * HALTON_COUNT * HALTON_SEQ_LEN, &region.halton_seq[0])) {
+        if (CL_SUCCESS != queue_.enqueueWriteBuffer(halton_seq_buf_, CL_FALSE, 0, sizeof(float) * HALTON_COUNT * HALTON_SEQ_LEN,
+                                                    &region.halton_seq[0], nullptr, &halton_upload_event_)) {
             return;
         }
         loaded_halton_ = region.iteration;
@@ -466,15 +482,20 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
 
     cl_int error = CL_SUCCESS;
 
-    const auto time_start = std::chrono::high_resolution_clock::now();
+    // Stages are delimited with markers, their durations are taken from profiling info once frame is finished,
+    // so device is not stalled to measure time
+    pending_stats_t frame_stats;
+    auto add_stage = [&frame_stats](eStage stage, const cl::Event &beg, const cl::Event &end) {
+        frame_stats.stages.push_back({ stage, beg, end });
+    };
 
-    std::chrono::time_point<std::chrono::high_resolution_clock> time_after_ray_gen;
+    cl::Event ev_start, ev_after_ray_gen, ev_after_prim_trace, ev_after_prim_shade;
+    if (!EnqueueTimestamp(ev_start)) return;
 
     if (cam.type != Geo) {
         if (!kernel_GeneratePrimaryRays((cl_int)region.iteration, cl_cam, region.rect(), w_, h_, halton_seq_buf_, prim_rays_buf_)) return;
 
-        queue_.finish();
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
+        if (!EnqueueTimestamp(ev_after_ray_gen)) return;
 
         if (s->nodes_.img_buf().get() != nullptr) {
             if (!kernel_TracePrimaryRaysImg(prim_rays_buf_, region.rect(), w_, h_,
@@ -504,15 +525,13 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
                                            s->vertices_.buf(), (cl_int)w_, (cl_int)h_, halton_seq_buf_, tri_bin_buf_,
                                            prim_rays_buf_, prim_inters_buf_)) return;
 
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
+        if (!EnqueueTimestamp(ev_after_ray_gen)) return;
     }
 
     cl_int secondary_rays_count = 0;
-    if (queue_.enqueueWriteBuffer(secondary_rays_count_buf_, CL_TRUE, 0, sizeof(cl_int),
-                                  &secondary_rays_count) != CL_SUCCESS) return;
+    if (queue_.enqueueFillBuffer(secondary_rays_count_buf_, secondary_rays_count, 0, sizeof(cl_int)) != CL_SUCCESS) return;
 
-    queue_.finish();
-    const auto time_after_prim_trace = std::chrono::high_resolution_clock::now();
+    if (!EnqueueTimestamp(ev_after_prim_trace)) return;
 
     if (!kernel_ShadePrimary(pass_info, halton_seq_buf_, region.rect(), w_, h_,
                              prim_inters_buf_, prim_rays_buf_,
@@ -523,12 +542,22 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
                              s->lights_.buf(), s->li_indices_.buf(), (cl_uint)s->light_nodes_start_,
                              temp_buf_, secondary_rays_buf_, secondary_rays_count_buf_)) return;
 
+    if (!EnqueueTimestamp(ev_after_prim_shade)) return;
+
+    // number of secondary rays defines size of next dispatch, this is the only point where host waits for device
     if (queue_.enqueueReadBuffer(secondary_rays_count_buf_, CL_TRUE, 0, sizeof(cl_int),
                                  &secondary_rays_count) != CL_SUCCESS) return;
 
-    queue_.finish();
-    const auto time_after_prim_shade = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_trace_time{}, secondary_shade_time{};
+    add_stage(StagePrimaryRayGen, ev_start, ev_after_ray_gen);
+    add_stage(StagePrimaryTrace, ev_after_ray_gen, ev_after_prim_trace);
+    add_stage(StagePrimaryShade, ev_after_prim_trace, ev_after_prim_shade);
+
+    // traversal counters are not available on gpu, only number of rays is known
+    stats_t &st = frame_stats.st;
+    st = {};
+    if (cam.type != Geo) {
+        st.rays_traced[0] = (unsigned long long)region.rect().w * region.rect().h;
+    }
 
     if (cam.pass_settings.flags & OutputSH) {
         if (sh_data_size_ != w_ * h_) {
@@ -542,7 +571,6 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
             error = queue_.enqueueFillBuffer(sh_data_clean_, zero, 0, sizeof(shl1_data_t) * new_size);
             if (error != CL_SUCCESS) return;
 
-            sh_data_host_.resize(new_size);
             sh_data_size_ = new_size;
         }
         if (!kernel_ResetSampleData(sh_data_temp_, (cl_int)sh_data_size_)) return;
@@ -550,7 +578,8 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
     }
 
     for (int bounce = 0; bounce < pass_info.settings.max_total_depth && secondary_rays_count && !(pass_info.settings.flags & SkipIndirectLight); bounce++) {
-        auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
+        cl::Event ev_sort_start, ev_trace_start, ev_shade_start, ev_shade_end;
+        if (!EnqueueTimestamp(ev_sort_start)) return;
 
         if (secondary_rays_count > (cl_int)scan_portion_ * 64) {
             if (!SortRays(secondary_rays_buf_, secondary_rays_count, root_min, cell_size, ray_hashes_buf_, head_flags_buf_,
@@ -560,8 +589,9 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
             std::swap(prim_rays_buf_, secondary_rays_buf_);
         }
 
-        queue_.finish();
-        auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
+        if (!EnqueueTimestamp(ev_trace_start)) return;
+
+        st.rays_traced[std::min(bounce + 1, stats_t::BouncesCount - 1)] += (unsigned long long)secondary_rays_count;
 
         if (s->nodes_.img_buf().get() != nullptr) {
             if (!kernel_TraceSecondaryRaysImg(secondary_rays_buf_, secondary_rays_count,
@@ -574,14 +604,13 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
         }
 
         cl_int new_secondary_rays_count = 0;
-        if (queue_.enqueueWriteBuffer(secondary_rays_count_buf_, CL_TRUE, 0, sizeof(cl_int), &new_secondary_rays_count) != CL_SUCCESS) return;
+        if (queue_.enqueueFillBuffer(secondary_rays_count_buf_, new_secondary_rays_count, 0, sizeof(cl_int)) != CL_SUCCESS) return;
 
 #if 0
         pixel_color_t c = { 0, 0, 0, 0 };
         queue_.enqueueFillImage(temp_buf_, *(cl_float4 *)&c, {}, { (size_t)w_, (size_t)h_, 1 });
 #endif
-        queue_.finish();
-        auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
+        if (!EnqueueTimestamp(ev_shade_start)) return;
 
         if (queue_.enqueueCopyImage(temp_buf_, final_buf_, { 0, 0, 0 }, { 0, 0, 0 },
         { (size_t)w_, (size_t)h_, 1 }) != CL_SUCCESS) return;
@@ -596,27 +625,19 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
                                    s->lights_.buf(), s->li_indices_.buf(), (cl_uint)s->light_nodes_start_,
                                    final_buf_, temp_buf_, prim_rays_buf_, secondary_rays_count_buf_)) return;
 
+        if (!EnqueueTimestamp(ev_shade_end)) return;
+
         if (queue_.enqueueReadBuffer(secondary_rays_count_buf_, CL_TRUE, 0, sizeof(cl_int),
                                      &secondary_rays_count) != CL_SUCCESS) return;
 
-        queue_.finish();
-        auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
-
-        secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
-        secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
-        secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
+        add_stage(StageSecondarySort, ev_sort_start, ev_trace_start);
+        add_stage(StageSecondaryTrace, ev_trace_start, ev_shade_start);
+        add_stage(StageSecondaryShade, ev_shade_start, ev_shade_end);
 
         std::swap(final_buf_, temp_buf_);
         std::swap(secondary_rays_buf_, prim_rays_buf_);
     }
 
-    stats_.time_primary_ray_gen_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
-    stats_.time_primary_trace_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
-    stats_.time_primary_shade_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
-    stats_.time_secondary_sort_us += (unsigned long long)secondary_sort_time.count();
-    stats_.time_secondary_trace_us += (unsigned long long)secondary_trace_time.count();
-    stats_.time_secondary_shade_us += (unsigned long long)secondary_shade_time.count();
-
     // factor used to compute incremental average
     float mix_factor = 1.0f / region.iteration;
 
@@ -631,14 +652,88 @@ void Ray::Ocl::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
     cl_int _clamp = (cam.pass_settings.flags & Clamp) ? 1 : 0, _srgb = (cam.dtype == SRGB) ? 1 : 0;
     if (!kernel_Postprocess(clean_buf_, w_, h_, (cl_float)(1.0f / cam.gamma), _clamp, _srgb, final_buf_)) return;
 
-    error = queue_.enqueueReadImage(final_buf_, CL_TRUE, {}, { (size_t)w_, (size_t)h_, 1 }, 0, 0, &frame_pixels_[0]);
+    // Read into buffer which is not exposed to user, it was last written two frames ago and is not in use.
+    // Buffers are switched right away, get_pixels_ref() waits for the copy only if it is accessed too early.
+    const int next_index = (frame_index_ + 1) % 2;
+    WaitForReadback(next_index);
+
+    cl::Event readback_event;
+    error = queue_.enqueueReadImage(final_buf_, CL_FALSE, {}, { (size_t)w_, (size_t)h_, 1 }, 0, 0,
+                                    &frame_pixels_[next_index][0], nullptr, &readback_event);
     if (error != CL_SUCCESS) return;
 
     if (sh_data_size_ && (cam.pass_settings.flags & OutputSH)) {
-        error = queue_.enqueueReadBuffer(sh_data_clean_, CL_TRUE, 0, sizeof(shl1_data_t) * sh_data_size_, &sh_data_host_[0]);
+        sh_data_host_[next_index].resize(sh_data_size_);
+        // queue is in-order, so waiting for the last read is enough
+        error = queue_.enqueueReadBuffer(sh_data_clean_, CL_FALSE, 0, sizeof(shl1_data_t) * sh_data_size_,
+                                         &sh_data_host_[next_index][0], nullptr, &readback_event);
+        if (error != CL_SUCCESS) return;
+    }
+
+    readback_events_[next_index] = readback_event;
+    frame_index_ = next_index;
+
+    pending_stats_.push_back(std::move(frame_stats));
+
+    // start execution of submitted work without waiting for it
+    queue_.flush();
+}
+
+bool Ray::Ocl::Renderer::EnqueueTimestamp(cl::Event &out_event) {
+    return queue_.enqueueMarkerWithWaitList(nullptr, &out_event) == CL_SUCCESS;
+}
+
+void Ray::Ocl::Renderer::ResolveStats(const bool wait) {
+    size_t resolved_count = 0;
+    for (pending_stats_t &frame : pending_stats_) {
+        if (!frame.stages.empty()) {
+            const cl::Event &last = frame.stages.back().end;
+            if (wait) {
+                last.wait();
+            } else if (last.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+                // frames finish in order
+                break;
+            }
+        }
+
+        unsigned long long *stage_times[StagesCount] = {
+            &frame.st.time_primary_ray_gen_us, &frame.st.time_primary_trace_us, &frame.st.time_primary_shade_us,
+            &frame.st.time_secondary_sort_us, &frame.st.time_secondary_trace_us, &frame.st.time_secondary_shade_us
+        };
+
+        for (const timed_stage_t &stage : frame.stages) {
+            // end of marker command is the point where all preceding commands are completed
+            cl_ulong t_beg = 0, t_end = 0;
+            if (stage.beg.getProfilingInfo(CL_PROFILING_COMMAND_END, &t_beg) == CL_SUCCESS &&
+                stage.end.getProfilingInfo(CL_PROFILING_COMMAND_END, &t_end) == CL_SUCCESS && t_end > t_beg) {
+                *stage_times[stage.stage] += (unsigned long long)((t_end - t_beg) / 1000);
+            }
+        }
+
+        AccumulateStats(frame.st);
+        resolved_count++;
+    }
+
+    pending_stats_.erase(pending_stats_.begin(), pending_stats_.begin() + resolved_count);
+}
+
+void Ray::Ocl::Renderer::WaitForReadback(const int i) const {
+    if (readback_events_[i]()) {
+        readback_events_[i].wait();
+        readback_events_[i] = cl::Event();
     }
 }
 
+void Ray::Ocl::Renderer::GetStats(stats_t &st) {
+    ResolveStats(true);
+    RendererBase::GetStats(st);
+}
+
+void Ray::Ocl::Renderer::ResetStats() {
+    pending_stats_.clear();
+    RendererBase::ResetStats();
+}
+
 bool Ray::Ocl::Renderer::kernel_GeneratePrimaryRays(const cl_int iteration, const Ray::Ocl::camera_t &cam, const Ray::rect_t &rect, cl_int w, cl_int h, const cl::Buffer &halton, const cl::Buffer &out_rays) {
     if (queue_.enqueueWriteBuffer(uniform_buf_, CL_FALSE, 0, sizeof(cam), &cam) != CL_SUCCESS) {
         return false;
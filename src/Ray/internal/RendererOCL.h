@@ -67,10 +67,34 @@ protected:
 
     cl::Buffer uniform_buf_;
 
-    std::vector<pixel_color_t> frame_pixels_;
-    std::vector<shl1_data_t> sh_data_host_;
-
-    stats_t stats_ = { 0 };
+    // Results are read back into one of two host buffers without blocking, so next frame can be
+    // submitted while copy is in flight. Pointer returned by get_pixels_ref() stays valid until next frame is read.
+    std::vector<pixel_color_t> frame_pixels_[2];
+    std::vector<shl1_data_t> sh_data_host_[2];
+    mutable cl::Event readback_events_[2];
+    int frame_index_ = 0;
+
+    // Halton sequence is uploaded from host memory that is owned by RegionContext
+    cl::Event halton_upload_event_;
+
+    enum eStage { StagePrimaryRayGen, StagePrimaryTrace, StagePrimaryShade,
+                  StageSecondarySort, StageSecondaryTrace, StageSecondaryShade, StagesCount };
+
+    struct timed_stage_t {
+        eStage stage;
+        cl::Event beg, end; // markers enqueued around stage
+    };
+
+    // Stats of submitted frame, stage times are known only after device has finished it
+    struct pending_stats_t {
+        stats_t st;
+        std::vector<timed_stage_t> stages;
+    };
+    std::vector<pending_stats_t> pending_stats_;
+
+    bool EnqueueTimestamp(cl::Event &out_event);
+    void ResolveStats(bool wait);
+    void WaitForReadback(int i) const;
 
     bool kernel_GeneratePrimaryRays(cl_int iteration, const Ray::Ocl::camera_t &cam, const Ray::rect_t &rect, cl_int w, cl_int h, const cl::Buffer &halton, const cl::Buffer &out_rays);
     bool kernel_SampleMesh_ResetBins(cl_int w, cl_int h, const cl::Buffer &tri_bin_buf);
@@ -161,7 +185,7 @@ protected:
                   const cl::Buffer &chunks, const cl::Buffer &chunks2, const cl::Buffer &counters, const cl::Buffer &skeleton, const cl::Buffer &out_rays);
 public:
     Renderer(int w, int h, int platform_index = -1, int device_index = -1);
-    ~Renderer() override = default;
+    ~Renderer() override;
 
     eRendererType type() const override { return RendererOCL; }
 
@@ -170,11 +194,13 @@ public:
     }
 
     const pixel_color_t *get_pixels_ref() const override {
-        return (const pixel_color_t *)&frame_pixels_[0];
+        WaitForReadback(frame_index_);
+        return frame_pixels_[frame_index_].data();
     }
 
     const shl1_data_t *get_sh_data_ref() const override {
-        return &sh_data_host_[0];
+        WaitForReadback(frame_index_);
+        return sh_data_host_[frame_index_].data();
     }
 
     void Resize(int w, int h) override;
@@ -183,8 +209,8 @@ public:
     std::shared_ptr<SceneBase> CreateScene() override;
     void RenderScene(const std::shared_ptr<SceneBase> &s, RegionContext &region) override;
 
-    void GetStats(stats_t &st) override { st = stats_; }
-    void ResetStats() override { stats_ = { 0 }; }
+    void GetStats(stats_t &st) override;
+    void ResetStats() override;
 
     static std::vector<Platform> QueryPlatforms();
 };
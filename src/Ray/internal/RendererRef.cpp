@@ -7,13 +7,13 @@
 #include "Halton.h"
 #include "SceneRef.h"
 
-Ray::Ref::Renderer::Renderer(const settings_t &s) : use_wide_bvh_(s.use_wide_bvh), clean_buf_(s.w, s.h), final_buf_(s.w, s.h), temp_buf_(s.w, s.h) {
+Ray::Ref::Renderer::Renderer(const settings_t &s) : RendererBase(s), use_wide_bvh_(s.use_wide_bvh), use_compressed_bvh_(s.use_compressed_bvh), use_tex_compression_(s.use_tex_compression), clean_buf_(s.w, s.h), final_buf_(s.w, s.h), temp_buf_(s.w, s.h) {
     auto rand_func = std::bind(std::uniform_int_distribution<int>(), std::mt19937(0));
     permutations_ = Ray::ComputeRadicalInversePermutations(g_primes, PrimesCount, rand_func);
 }
 
 std::shared_ptr<Ray::SceneBase> Ray::Ref::Renderer::CreateScene() {
-    return std::make_shared<Ref::Scene>(use_wide_bvh_);
+    return std::make_shared<Ref::Scene>(use_wide_bvh_, use_compressed_bvh_, use_tex_compression_, tile_scheduler_);
 }
 
 void Ray::Ref::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, RegionContext &region) {
@@ -33,12 +33,14 @@ void Ray::Ref::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
     sc_data.vertices = s->vertices_.empty() ? nullptr : &s->vertices_[0];
     sc_data.nodes = s->nodes_.empty() ? nullptr : &s->nodes_[0];
     sc_data.mnodes = s->mnodes_.empty() ? nullptr : &s->mnodes_[0];
+    sc_data.cmnodes = s->cmnodes_.empty() ? nullptr : &s->cmnodes_[0];
     sc_data.tris = s->tris_.empty() ? nullptr : &s->tris_[0];
     sc_data.tri_indices = s->tri_indices_.empty() ? nullptr : &s->tri_indices_[0];
     sc_data.materials = s->materials_.empty() ? nullptr : &s->materials_[0];
     sc_data.textures = s->textures_.empty() ? nullptr : &s->textures_[0];
     sc_data.lights = s->lights_.empty() ? nullptr : &s->lights_[0];
     sc_data.li_indices = s->li_indices_.empty() ? nullptr : &s->li_indices_[0];
+    sc_data.light_nodes = s->light_nodes_.empty() ? nullptr : &s->light_nodes_[0];
 
     const uint32_t macro_tree_root = s->macro_nodes_root_;
     const uint32_t light_tree_root = s->light_nodes_root_;
@@ -78,9 +80,9 @@ void Ray::Ref::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
 
     const int w = final_buf_.w(), h = final_buf_.h();
 
-    rect_t rect = region.rect();
-    if (rect.w == 0 || rect.h == 0) {
-        rect = { 0, 0, w, h };
+    rect_t region_rect = region.rect();
+    if (region_rect.w == 0 || region_rect.h == 0) {
+        region_rect = { 0, 0, w, h };
     }
 
     region.iteration++;
@@ -88,14 +90,8 @@ void Ray::Ref::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
         UpdateHaltonSequence(region.iteration, region.halton_seq);
     }
 
-    PassData p;
-
     {
         std::lock_guard<std::mutex> _(pass_cache_mtx_);
-        if (!pass_cache_.empty()) {
-            p = std::move(pass_cache_.back());
-            pass_cache_.pop_back();
-        }
 
         // allocate sh data on demand
         if (cam.pass_settings.flags & OutputSH) {
@@ -104,224 +100,294 @@ void Ray::Ref::Renderer::RenderScene(const std::shared_ptr<SceneBase> &_s, Regio
         }
     }
 
-    pass_info_t pass_info;
+    std::shared_ptr<tri_bins_t> tri_bins;
+    if (cam.type == Geo) {
+        tri_bins = s->GetTriBins(s->mesh_instances_[cam.mi_index].mesh_index, cam.uv_index, w, h);
+    }
+
+    RunTiled(region_rect, [&](const rect_t &rect) {
+        PassData p;
+
+        {
+            std::lock_guard<std::mutex> _(pass_cache_mtx_);
+            if (!pass_cache_.empty()) {
+                p = std::move(pass_cache_.back());
+                pass_cache_.pop_back();
+            }
+        }
 
-    pass_info.iteration = region.iteration;
-    pass_info.bounce = 2;
-    pass_info.settings = cam.pass_settings;
-    pass_info.settings.max_total_depth = std::min(pass_info.settings.max_total_depth, (uint8_t)MAX_BOUNCES);
+        pass_info_t pass_info;
 
-    const auto time_start = std::chrono::high_resolution_clock::now();
-    std::chrono::time_point<std::chrono::high_resolution_clock> time_after_ray_gen;
+        pass_info.iteration = region.iteration;
+        pass_info.bounce = 2;
+        pass_info.settings = cam.pass_settings;
+        pass_info.settings.max_total_depth = std::min(pass_info.settings.max_total_depth, (uint8_t)MAX_BOUNCES);
 
-    if (cam.type != Geo) {
-        GeneratePrimaryRays(region.iteration, cam, rect, w, h, &region.halton_seq[0], p.primary_rays);
+        stats_t st = {};
+        const ray_counters_t counters_before = g_ray_counters;
 
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
+        const auto time_start = std::chrono::high_resolution_clock::now();
+        std::chrono::time_point<std::chrono::high_resolution_clock> time_after_ray_gen;
 
-        p.intersections.resize(p.primary_rays.size());
+        if (cam.type != Geo) {
+            GeneratePrimaryRays(region.iteration, cam, rect, w, h, &region.halton_seq[0], p.primary_rays);
 
-        for (size_t i = 0; i < p.primary_rays.size(); i++) {
-            const ray_packet_t &r = p.primary_rays[i];
-            hit_data_t &inter = p.intersections[i];
+            time_after_ray_gen = std::chrono::high_resolution_clock::now();
 
-            inter = {};
-            inter.xy = r.xy;
+            st.rays_traced[0] = (unsigned long long)p.primary_rays.size();
 
-            if (macro_tree_root != 0xffffffff) {
-                if (sc_data.mnodes) {
-                    Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices, sc_data.meshes,
-                                                            sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
-                } else {
-                    Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.nodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices, sc_data.meshes,
-                                                            sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+            p.intersections.resize(p.primary_rays.size());
+
+            for (size_t i = 0; i < p.primary_rays.size(); i++) {
+                const ray_packet_t &r = p.primary_rays[i];
+                hit_data_t &inter = p.intersections[i];
+
+                inter = {};
+                inter.xy = r.xy;
+
+                if (macro_tree_root != 0xffffffff) {
+                    if (sc_data.cmnodes) {
+                        Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.cmnodes, sc_data.mesh_instances, sc_data.mi_indices, sc_data.meshes,
+                                                                sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                    } else if (sc_data.mnodes) {
+                        Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices, sc_data.meshes,
+                                                                sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                    } else {
+                        Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.nodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices, sc_data.meshes,
+                                                                sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                    }
                 }
             }
+        } else {
+            const mesh_instance_t &mi = sc_data.mesh_instances[cam.mi_index];
+            UpdateTexelCache(*tri_bins, sc_data.vtx_indices, sc_data.vertices, rect);
+            SampleMeshInTextureSpace(region.iteration, cam.mi_index,
+                                     *tri_bins, sc_data.transforms[mi.tr_index], sc_data.vtx_indices, sc_data.vertices,
+                                     rect, w, &region.halton_seq[0], p.primary_rays, p.intersections);
+
+            time_after_ray_gen = std::chrono::high_resolution_clock::now();
         }
-    } else {
-        const mesh_instance_t &mi = sc_data.mesh_instances[cam.mi_index];
-        SampleMeshInTextureSpace(region.iteration, cam.mi_index, cam.uv_index,
-                                 sc_data.meshes[mi.mesh_index], sc_data.transforms[mi.tr_index], sc_data.vtx_indices, sc_data.vertices,
-                                 rect, w, h, &region.halton_seq[0], p.primary_rays, p.intersections);
 
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
-    }
+        const auto time_after_prim_trace = std::chrono::high_resolution_clock::now();
 
-    const auto time_after_prim_trace = std::chrono::high_resolution_clock::now();
+        p.secondary_rays.resize(p.intersections.size());
+        int secondary_rays_count = 0;
 
-    p.secondary_rays.resize(p.intersections.size());
-    int secondary_rays_count = 0;
+        p.shadow_rays.resize(p.intersections.size());
+        int shadow_rays_count = 0;
 
-    for (size_t i = 0; i < p.intersections.size(); i++) {
-        const ray_packet_t &r = p.primary_rays[i];
-        const hit_data_t &inter = p.intersections[i];
+        // shadow rays are traced in one batch after shading, sorting makes them more coherent
+        auto resolve_shadow_rays = [&]() {
+            if (!shadow_rays_count) return;
 
-        const int x = (inter.xy >> 16) & 0x0000ffff;
-        const int y = inter.xy & 0x0000ffff;
+            p.hash_values.resize(std::max(p.hash_values.size(), (size_t)shadow_rays_count));
+            p.scan_values.resize(std::max(p.scan_values.size(), (size_t)shadow_rays_count));
+            p.chunks.resize(std::max(p.chunks.size(), (size_t)shadow_rays_count));
+            p.chunks_temp.resize(std::max(p.chunks_temp.size(), (size_t)shadow_rays_count));
 
-        pass_info.index = y * w + x;
-        pass_info.rand_index = pass_info.index;
+            SortRays_CPU(&p.shadow_rays[0], (size_t)shadow_rays_count, root_min, cell_size,
+                         &p.hash_values[0], &p.scan_values[0], &p.chunks[0], &p.chunks_temp[0]);
+
+            for (int i = 0; i < shadow_rays_count; i++) {
+                const shadow_ray_t &sh_r = p.shadow_rays[i];
+
+                const float visibility = ComputeVisibility(sh_r, sc_data, macro_tree_root, tex_atlas);
+                if (visibility > 0.0f) {
+                    const int x = (sh_r.xy >> 16) & 0x0000ffff;
+                    const int y = sh_r.xy & 0x0000ffff;
+
+                    temp_buf_.AddPixel(x, y, { sh_r.c[0] * visibility, sh_r.c[1] * visibility, sh_r.c[2] * visibility, 0.0f });
+                }
+            }
+
+            shadow_rays_count = 0;
+        };
+
+        for (size_t i = 0; i < p.intersections.size(); i++) {
+            const ray_packet_t &r = p.primary_rays[i];
+            const hit_data_t &inter = p.intersections[i];
+
+            const int x = (inter.xy >> 16) & 0x0000ffff;
+            const int y = inter.xy & 0x0000ffff;
+
+            pass_info.index = y * w + x;
+            pass_info.rand_index = pass_info.index;
         
-        if (cam.pass_settings.flags & UseCoherentSampling) {
-            const int blck_x = x % 8, blck_y = y % 8;
-            pass_info.rand_index = sampling_pattern[blck_y * 8 + blck_x];
+            if (cam.pass_settings.flags & UseCoherentSampling) {
+                const int blck_x = x % 8, blck_y = y % 8;
+                pass_info.rand_index = sampling_pattern[blck_y * 8 + blck_x];
+            }
+
+            pixel_color_t col = ShadeSurface(pass_info, inter, r, &region.halton_seq[0], sc_data, light_tree_root, tex_atlas,
+                                             &p.secondary_rays[0], &secondary_rays_count, &p.shadow_rays[0], &shadow_rays_count);
+            temp_buf_.SetPixel(x, y, col);
         }
 
-        pixel_color_t col = ShadeSurface(pass_info, inter, r, &region.halton_seq[0], sc_data, macro_tree_root, light_tree_root,
-                                         tex_atlas, &p.secondary_rays[0], &secondary_rays_count);
-        temp_buf_.SetPixel(x, y, col);
-    }
+        resolve_shadow_rays();
 
-    const auto time_after_prim_shade = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_trace_time{}, secondary_shade_time{};
+        const auto time_after_prim_shade = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_trace_time{}, secondary_shade_time{};
 
-    p.hash_values.resize(secondary_rays_count);
-    //p.head_flags.resize(secondary_rays_count);
-    p.scan_values.resize(secondary_rays_count);
-    p.chunks.resize(secondary_rays_count);
-    p.chunks_temp.resize(secondary_rays_count);
-    //p.skeleton.resize(secondary_rays_count);
+        p.hash_values.resize(secondary_rays_count);
+        //p.head_flags.resize(secondary_rays_count);
+        p.scan_values.resize(secondary_rays_count);
+        p.chunks.resize(secondary_rays_count);
+        p.chunks_temp.resize(secondary_rays_count);
+        //p.skeleton.resize(secondary_rays_count);
 
-    if (cam.pass_settings.flags & OutputSH) {
-        temp_buf_.ResetSampleData(rect);
-        for (int i = 0; i < secondary_rays_count; i++) {
-            const ray_packet_t &r = p.secondary_rays[i];
+        if (cam.pass_settings.flags & OutputSH) {
+            temp_buf_.ResetSampleData(rect);
+            for (int i = 0; i < secondary_rays_count; i++) {
+                const ray_packet_t &r = p.secondary_rays[i];
 
-            const int x = (r.xy >> 16) & 0x0000ffff;
-            const int y = r.xy & 0x0000ffff;
+                const int x = (r.xy >> 16) & 0x0000ffff;
+                const int y = r.xy & 0x0000ffff;
 
-            temp_buf_.SetSampleDir(x, y, r.d[0], r.d[1], r.d[2]);
-            // sample weight for indirect lightmap has all r.c[0..2]'s set to same value
-            temp_buf_.SetSampleWeight(x, y, r.c[0]);
+                temp_buf_.SetSampleDir(x, y, r.d[0], r.d[1], r.d[2]);
+                // sample weight for indirect lightmap has all r.c[0..2]'s set to same value
+                temp_buf_.SetSampleWeight(x, y, r.c[0]);
+            }
         }
-    }
 
-    for (int bounce = 0; bounce < pass_info.settings.max_total_depth && secondary_rays_count && !(pass_info.settings.flags & SkipIndirectLight); bounce++) {
-        auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
+        for (int bounce = 0; bounce < pass_info.settings.max_total_depth && secondary_rays_count && !(pass_info.settings.flags & SkipIndirectLight); bounce++) {
+            auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
 
-        SortRays_CPU(&p.secondary_rays[0], (size_t)secondary_rays_count, root_min, cell_size,
-                     &p.hash_values[0], &p.scan_values[0], &p.chunks[0], &p.chunks_temp[0]);
+            SortRays_CPU(&p.secondary_rays[0], (size_t)secondary_rays_count, root_min, cell_size,
+                         &p.hash_values[0], &p.scan_values[0], &p.chunks[0], &p.chunks_temp[0]);
 
 #if 0   // debug hash values
-        static std::vector<simd_fvec3> color_table;
-        if (color_table.empty()) {
-            for (int i = 0; i < 1024; i++) {
-                color_table.emplace_back(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX);
+            static std::vector<simd_fvec3> color_table;
+            if (color_table.empty()) {
+                for (int i = 0; i < 1024; i++) {
+                    color_table.emplace_back(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX);
+                }
             }
-        }
 
-        for (int i = 0; i < secondary_rays_count; i++) {
-            const ray_packet_t &r = p.secondary_rays[i];
+            for (int i = 0; i < secondary_rays_count; i++) {
+                const ray_packet_t &r = p.secondary_rays[i];
 
-            const int x = r.id.x;
-            const int y = r.id.y;
+                const int x = r.id.x;
+                const int y = r.id.y;
 
-            const simd_fvec3 &c = color_table[hash(p.hash_values[i]) % 1024];
+                const simd_fvec3 &c = color_table[hash(p.hash_values[i]) % 1024];
 
-            pixel_color_t col = { c[0], c[1], c[2], 1.0f };
-            temp_buf_.SetPixel(x, y, col);
-        }
+                pixel_color_t col = { c[0], c[1], c[2], 1.0f };
+                temp_buf_.SetPixel(x, y, col);
+            }
 #endif
 
-        auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
+            auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
 
-        for (int i = 0; i < secondary_rays_count; i++) {
-            const ray_packet_t &r = p.secondary_rays[i];
-            hit_data_t &inter = p.intersections[i];
+            st.rays_traced[std::min(bounce + 1, stats_t::BouncesCount - 1)] += (unsigned long long)secondary_rays_count;
 
-            inter = {};
-            inter.xy = r.xy;
+            for (int i = 0; i < secondary_rays_count; i++) {
+                const ray_packet_t &r = p.secondary_rays[i];
+                hit_data_t &inter = p.intersections[i];
 
-            if (sc_data.mnodes) {
-                Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances,
-                                                        sc_data.mi_indices, sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
-            } else {
-                Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.nodes, macro_tree_root, sc_data.mesh_instances,
-                                                        sc_data.mi_indices, sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                inter = {};
+                inter.xy = r.xy;
+
+                if (sc_data.cmnodes) {
+                    Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.cmnodes, sc_data.mesh_instances,
+                                                            sc_data.mi_indices, sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                } else if (sc_data.mnodes) {
+                    Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances,
+                                                            sc_data.mi_indices, sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                } else {
+                    Traverse_MacroTree_WithStack_ClosestHit(r, sc_data.nodes, macro_tree_root, sc_data.mesh_instances,
+                                                            sc_data.mi_indices, sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+                }
             }
-        }
 
-        auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
+            auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
 
-        int rays_count = secondary_rays_count;
-        secondary_rays_count = 0;
-        std::swap(p.primary_rays, p.secondary_rays);
+            int rays_count = secondary_rays_count;
+            secondary_rays_count = 0;
+            std::swap(p.primary_rays, p.secondary_rays);
 
-        pass_info.bounce = bounce + 3;
+            pass_info.bounce = bounce + 3;
 
-        for (int i = 0; i < rays_count; i++) {
-            const ray_packet_t &r = p.primary_rays[i];
-            const hit_data_t &inter = p.intersections[i];
+            for (int i = 0; i < rays_count; i++) {
+                const ray_packet_t &r = p.primary_rays[i];
+                const hit_data_t &inter = p.intersections[i];
 
-            const int x = (inter.xy >> 16) & 0x0000ffff;
-            const int y = inter.xy & 0x0000ffff;
+                const int x = (inter.xy >> 16) & 0x0000ffff;
+                const int y = inter.xy & 0x0000ffff;
 
-            pass_info.index = y * w + x;
-            pass_info.rand_index = pass_info.index;
+                pass_info.index = y * w + x;
+                pass_info.rand_index = pass_info.index;
 
-            if (cam.pass_settings.flags & UseCoherentSampling) {
-                const int blck_x = x % 8, blck_y = y % 8;
-                pass_info.rand_index = sampling_pattern[blck_y * 8 + blck_x];
+                if (cam.pass_settings.flags & UseCoherentSampling) {
+                    const int blck_x = x % 8, blck_y = y % 8;
+                    pass_info.rand_index = sampling_pattern[blck_y * 8 + blck_x];
+                }
+
+                pixel_color_t col = ShadeSurface(pass_info, inter, r, &region.halton_seq[0], sc_data, light_tree_root, tex_atlas,
+                                                 &p.secondary_rays[0], &secondary_rays_count, &p.shadow_rays[0], &shadow_rays_count);
+                col.a = 0.0f;
+
+                temp_buf_.AddPixel(x, y, col);
             }
 
-            pixel_color_t col = ShadeSurface(pass_info, inter, r, &region.halton_seq[0], sc_data, macro_tree_root, light_tree_root,
-                                             tex_atlas, &p.secondary_rays[0], &secondary_rays_count);
-            col.a = 0.0f;
+            resolve_shadow_rays();
 
-            temp_buf_.AddPixel(x, y, col);
+            auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
+            secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
+            secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
+            secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
         }
 
-        auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
-        secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
-        secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
-        secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
-    }
-
-    {
-        std::lock_guard<std::mutex> _(pass_cache_mtx_);
-        pass_cache_.emplace_back(std::move(p));
-
-        stats_.time_primary_ray_gen_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
-        stats_.time_primary_trace_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
-        stats_.time_primary_shade_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
-        stats_.time_secondary_sort_us += (unsigned long long)secondary_sort_time.count();
-        stats_.time_secondary_trace_us += (unsigned long long)secondary_trace_time.count();
-        stats_.time_secondary_shade_us += (unsigned long long)secondary_shade_time.count();
-    }
+        {
+            std::lock_guard<std::mutex> _(pass_cache_mtx_);
+            pass_cache_.emplace_back(std::move(p));
+        }
 
-    // factor used to compute incremental average
-    const float mix_factor = 1.0f / region.iteration;
+        const auto time_end = std::chrono::high_resolution_clock::now();
 
-    clean_buf_.MixWith(temp_buf_, rect, mix_factor);
-    if (cam.pass_settings.flags & OutputSH) {
-        temp_buf_.ComputeSHData(rect);
-        clean_buf_.MixWith_SH(temp_buf_, rect, mix_factor);
-    }
+        st.time_primary_ray_gen_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
+        st.time_primary_trace_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
+        st.time_primary_shade_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
+        st.time_secondary_sort_us = (unsigned long long)secondary_sort_time.count();
+        st.time_secondary_trace_us = (unsigned long long)secondary_trace_time.count();
+        st.time_secondary_shade_us = (unsigned long long)secondary_shade_time.count();
+        st.tile_time_hist[TileTimeBucket((unsigned long long)std::chrono::duration<double, std::micro>{ time_end - time_start }.count())]++;
+        AddRayCounters(counters_before, st);
+        AccumulateStats(st);
 
-    auto clamp_and_gamma_correct = [&cam](const pixel_color_t &p) {
-        simd_fvec4 c = { &p.r };
+        // factor used to compute incremental average
+        const float mix_factor = 1.0f / region.iteration;
 
-        if (cam.dtype == SRGB) {
-            ITERATE_3({
-                if (c[i] > 0.0031308f) {
-                    c[i] = std::pow(1.055f * c[i], (1.0f / 2.4f)) - 0.055f;
-                } else {
-                    c[i] = 12.92f * c[i];
-                }
-            })
+        clean_buf_.MixWith(temp_buf_, rect, mix_factor);
+        if (cam.pass_settings.flags & OutputSH) {
+            temp_buf_.ComputeSHData(rect);
+            clean_buf_.MixWith_SH(temp_buf_, rect, mix_factor);
         }
 
-        if (cam.gamma != 1.0f) {
-            c = pow(c, simd_fvec4{ 1.0f / cam.gamma });
-        }
+        auto clamp_and_gamma_correct = [&cam](const pixel_color_t &p) {
+            simd_fvec4 c = { &p.r };
+
+            if (cam.dtype == SRGB) {
+                ITERATE_3({
+                    if (c[i] > 0.0031308f) {
+                        c[i] = std::pow(1.055f * c[i], (1.0f / 2.4f)) - 0.055f;
+                    } else {
+                        c[i] = 12.92f * c[i];
+                    }
+                })
+            }
 
-        if (cam.pass_settings.flags & Clamp) {
-            c = clamp(c, 0.0f, 1.0f);
-        }
-        return pixel_color_t{ c[0], c[1], c[2], c[3] };
-    };
+            if (cam.gamma != 1.0f) {
+                c = pow(c, simd_fvec4{ 1.0f / cam.gamma });
+            }
+
+            if (cam.pass_settings.flags & Clamp) {
+                c = clamp(c, 0.0f, 1.0f);
+            }
+            return pixel_color_t{ c[0], c[1], c[2], c[3] };
+        };
 
-    final_buf_.CopyFrom(clean_buf_, rect, clamp_and_gamma_correct);
+        final_buf_.CopyFrom(clean_buf_, rect, clamp_and_gamma_correct);
+    });
 }
 
 void Ray::Ref::Renderer::UpdateHaltonSequence(int iteration, std::unique_ptr<float[]> &seq) {
@@ -12,6 +12,7 @@ namespace Ref {
 struct PassData {
     aligned_vector<ray_packet_t> primary_rays;
     aligned_vector<ray_packet_t> secondary_rays;
+    aligned_vector<shadow_ray_t> shadow_rays;
     aligned_vector<hit_data_t> intersections;
 
     std::vector<uint32_t> hash_values;
@@ -30,6 +31,7 @@ struct PassData {
     PassData &operator=(PassData &&rhs) noexcept {
         primary_rays = std::move(rhs.primary_rays);
         secondary_rays = std::move(rhs.secondary_rays);
+        shadow_rays = std::move(rhs.shadow_rays);
         intersections = std::move(rhs.intersections);
         head_flags = std::move(rhs.head_flags);
         return *this;
@@ -37,13 +39,12 @@ struct PassData {
 };
 
 class Renderer : public RendererBase {
-    bool use_wide_bvh_;
+    bool use_wide_bvh_, use_compressed_bvh_, use_tex_compression_;
     Ref::Framebuffer clean_buf_, final_buf_, temp_buf_;
 
     std::mutex pass_cache_mtx_;
     std::vector<PassData> pass_cache_;
 
-    stats_t stats_ = { 0 };
     int w_ = 0, h_ = 0;
 
     std::vector<uint16_t> permutations_;
@@ -81,9 +82,6 @@ public:
 
     std::shared_ptr<SceneBase> CreateScene() override;
     void RenderScene(const std::shared_ptr<SceneBase> &s, RegionContext &region) override;
-
-    void GetStats(stats_t &st) override { st = stats_; }
-    void ResetStats() override { stats_ = { 0 }; }
 };
 }
 }
\ No newline at end of file
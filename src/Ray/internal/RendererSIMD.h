@@ -7,6 +7,7 @@
 #include "CoreSIMD.h"
 #include "FramebufferRef.h"
 #include "Halton.h"
+#include "TaskScheduler.h"
 #include "../RendererBase.h"
 
 namespace Ray {
@@ -17,13 +18,11 @@ struct PassData {
     aligned_vector<simd_ivec<S>>    primary_masks;
     aligned_vector<ray_packet_t<S>> secondary_rays;
     aligned_vector<simd_ivec<S>>    secondary_masks;
+    aligned_vector<shadow_ray_t<S>> shadow_rays, sorted_shadow_rays;
+    aligned_vector<simd_ivec<S>>    shadow_masks, sorted_shadow_masks;
     aligned_vector<hit_data_t<S>>   intersections;
 
-    aligned_vector<simd_ivec<S>>    hash_values;
-    std::vector<int>                head_flags;
-    std::vector<uint32_t>           scan_values;
-    std::vector<ray_chunk_t>        chunks, chunks_temp;
-    std::vector<uint32_t>           skeleton;
+    std::vector<ray_hash_t>         ray_hashes, ray_hashes_temp;
 
     PassData() = default;
 
@@ -35,13 +34,14 @@ struct PassData {
         primary_rays = std::move(rhs.primary_rays);
         primary_masks = std::move(rhs.primary_masks);
         secondary_rays = std::move(rhs.secondary_rays);
+        secondary_masks = std::move(rhs.secondary_masks);
+        shadow_rays = std::move(rhs.shadow_rays);
+        sorted_shadow_rays = std::move(rhs.sorted_shadow_rays);
+        shadow_masks = std::move(rhs.shadow_masks);
+        sorted_shadow_masks = std::move(rhs.sorted_shadow_masks);
         intersections = std::move(rhs.intersections);
-        hash_values = std::move(rhs.hash_values);
-        head_flags = std::move(rhs.head_flags);
-        scan_values = std::move(rhs.scan_values);
-        chunks = std::move(rhs.chunks);
-        chunks_temp = std::move(rhs.chunks_temp);
-        skeleton = std::move(rhs.skeleton);
+        ray_hashes = std::move(rhs.ray_hashes);
+        ray_hashes_temp = std::move(rhs.ray_hashes_temp);
         return *this;
     }
 };
@@ -53,8 +53,8 @@ class RendererSIMD : public RendererBase {
     std::mutex pass_cache_mtx_;
     std::vector<PassData<DimX * DimY>> pass_cache_;
 
-    bool use_wide_bvh_;
-    stats_t stats_ = { 0 };
+    bool use_wide_bvh_, use_compressed_bvh_, use_wavefront_, use_tex_compression_, use_hybrid_traversal_;
+    float single_ray_threshold_;
     int w_ = 0, h_ = 0;
 
     std::vector<uint16_t> permutations_;
@@ -89,9 +89,6 @@ public:
 
     std::shared_ptr<SceneBase> CreateScene() override;
     void RenderScene(const std::shared_ptr<SceneBase> &s, RegionContext &region) override;
-
-    virtual void GetStats(stats_t &st) override { st = stats_; }
-    virtual void ResetStats() override { stats_ = { 0 }; }
 };
 }
 }
@@ -101,14 +98,14 @@ public:
 #include "SceneRef.h"
 
 template <int DimX, int DimY>
-Ray::NS::RendererSIMD<DimX, DimY>::RendererSIMD(const settings_t &s) : clean_buf_(s.w, s.h), final_buf_(s.w, s.h), temp_buf_(s.w, s.h), use_wide_bvh_(s.use_wide_bvh) {
+Ray::NS::RendererSIMD<DimX, DimY>::RendererSIMD(const settings_t &s) : RendererBase(s), clean_buf_(s.w, s.h), final_buf_(s.w, s.h), temp_buf_(s.w, s.h), use_wide_bvh_(s.use_wide_bvh), use_compressed_bvh_(s.use_compressed_bvh), use_wavefront_(s.use_wavefront), use_tex_compression_(s.use_tex_compression), use_hybrid_traversal_(s.use_hybrid_traversal), single_ray_threshold_(s.single_ray_threshold) {
     auto rand_func = std::bind(std::uniform_int_distribution<int>(), std::mt19937(0));
     permutations_ = Ray::ComputeRadicalInversePermutations(g_primes, PrimesCount, rand_func);
 }
 
 template <int DimX, int DimY>
 std::shared_ptr<Ray::SceneBase> Ray::NS::RendererSIMD<DimX, DimY>::CreateScene() {
-    return std::make_shared<Ref::Scene>(use_wide_bvh_);
+    return std::make_shared<Ref::Scene>(use_wide_bvh_, use_compressed_bvh_, use_tex_compression_, tile_scheduler_);
 }
 
 template <int DimX, int DimY>
@@ -131,12 +128,14 @@ void Ray::NS::RendererSIMD<DimX, DimY>::RenderScene(const std::shared_ptr<SceneB
     sc_data.vertices = s->vertices_.empty() ? nullptr : &s->vertices_[0];
     sc_data.nodes = s->nodes_.empty() ? nullptr : &s->nodes_[0];
     sc_data.mnodes = s->mnodes_.empty() ? nullptr : &s->mnodes_[0];
+    sc_data.cmnodes = s->cmnodes_.empty() ? nullptr : &s->cmnodes_[0];
     sc_data.tris = s->tris_.empty() ? nullptr : &s->tris_[0];
     sc_data.tri_indices = s->tri_indices_.empty() ? nullptr : &s->tri_indices_[0];
     sc_data.materials = s->materials_.empty() ? nullptr : &s->materials_[0];
     sc_data.textures = s->textures_.empty() ? nullptr : &s->textures_[0];
     sc_data.lights = s->lights_.empty() ? nullptr : &s->lights_[0];
     sc_data.li_indices = s->li_indices_.empty() ? nullptr : &s->li_indices_[0];
+    sc_data.light_nodes = s->light_nodes_.empty() ? nullptr : &s->light_nodes_[0];
 
     const uint32_t macro_tree_root = s->macro_nodes_root_;
     const uint32_t light_tree_root = s->light_nodes_root_;
@@ -176,9 +175,9 @@ void Ray::NS::RendererSIMD<DimX, DimY>::RenderScene(const std::shared_ptr<SceneB
 
     const int w = final_buf_.w(), h = final_buf_.h();
 
-    rect_t rect = region.rect();
-    if (rect.w == 0 || rect.h == 0) {
-        rect = { 0, 0, w, h };
+    rect_t region_rect = region.rect();
+    if (region_rect.w == 0 || region_rect.h == 0) {
+        region_rect = { 0, 0, w, h };
     }
 
     region.iteration++;
@@ -186,14 +185,8 @@ void Ray::NS::RendererSIMD<DimX, DimY>::RenderScene(const std::shared_ptr<SceneB
         UpdateHaltonSequence(region.iteration, region.halton_seq);
     }
 
-    PassData<S> p;
-
     {
         std::lock_guard<std::mutex> _(pass_cache_mtx_);
-        if (!pass_cache_.empty()) {
-            p = std::move(pass_cache_.back());
-            pass_cache_.pop_back();
-        }
 
         // allocate sh data on demand
         if (cam.pass_settings.flags & OutputSH) {
@@ -202,65 +195,60 @@ void Ray::NS::RendererSIMD<DimX, DimY>::RenderScene(const std::shared_ptr<SceneB
         }
     }
 
-    pass_info_t pass_info;
-
-    pass_info.iteration = region.iteration;
-    pass_info.bounce = 2;
-    pass_info.settings = cam.pass_settings;
-    pass_info.settings.max_total_depth = std::min(pass_info.settings.max_total_depth, (uint8_t)MAX_BOUNCES);
-
-    const auto time_start = std::chrono::high_resolution_clock::now();
-    std::chrono::time_point<std::chrono::high_resolution_clock> time_after_ray_gen;
-
-    if (cam.type != Geo) {
-        GeneratePrimaryRays<DimX, DimY>(region.iteration, cam, rect, w, h, &region.halton_seq[0], p.primary_rays);
-
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
-
-        p.primary_masks.resize(p.primary_rays.size());
-        p.intersections.resize(p.primary_rays.size());
-
-        for (size_t i = 0; i < p.primary_rays.size(); i++) {
-            const ray_packet_t<S> &r = p.primary_rays[i];
-            hit_data_t<S> &inter = p.intersections[i];
-
-            inter = {};
-            inter.xy = r.xy;
-
-            if (macro_tree_root != 0xffffffff) {
-                if (sc_data.mnodes) {
-                    NS::Traverse_MacroTree_WithStack_ClosestHit(r, { -1 }, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
-                                                                sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
-                } else {
-                    NS::Traverse_MacroTree_WithStack_ClosestHit(r, { -1 }, sc_data.nodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
-                                                                sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
-                }
-            }
+    // wide trees can be traversed by whole packet (while its rays are coherent) or ray by ray
+    const bool use_hybrid_traversal = use_hybrid_traversal_ && sc_data.mnodes;
+
+    // number of packets traced as a whole to decide how the rest of bounce is traced
+    const int ProbePacketsCount = 8;
+
+    auto trace_packet = [&](const ray_packet_t<S> &r, const simd_ivec<S> &ray_mask, bool whole_packet, hit_data_t<S> &inter) {
+        if (whole_packet && sc_data.cmnodes) {
+            NS::Traverse_MacroTree_WithPacketStack_ClosestHit(r, ray_mask, sc_data.mnodes, macro_tree_root, sc_data.cmnodes, sc_data.mesh_instances, sc_data.mi_indices,
+                                                              sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+        } else if (whole_packet && sc_data.mnodes) {
+            NS::Traverse_MacroTree_WithPacketStack_ClosestHit(r, ray_mask, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
+                                                              sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+        } else if (sc_data.cmnodes) {
+            NS::Traverse_MacroTree_WithStack_ClosestHit(r, ray_mask, sc_data.mnodes, macro_tree_root, sc_data.cmnodes, sc_data.mesh_instances, sc_data.mi_indices,
+                                                        sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+        } else if (sc_data.mnodes) {
+            NS::Traverse_MacroTree_WithStack_ClosestHit(r, ray_mask, sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
+                                                        sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+        } else {
+            NS::Traverse_MacroTree_WithStack_ClosestHit(r, ray_mask, sc_data.nodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
+                                                        sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
         }
-    } else {
-        const mesh_instance_t &mi = sc_data.mesh_instances[cam.mi_index];
-        SampleMeshInTextureSpace<DimX, DimY>(region.iteration, cam.mi_index, cam.uv_index,
-                                             sc_data.meshes[mi.mesh_index], sc_data.transforms[mi.tr_index], sc_data.vtx_indices, sc_data.vertices,
-                                             rect, w, h, &region.halton_seq[0], p.primary_rays, p.intersections);
-
-        p.primary_masks.resize(p.primary_rays.size());
+    };
 
-        time_after_ray_gen = std::chrono::high_resolution_clock::now();
-    }
+    // counts active lanes of traced packets
+    auto count_traced_rays = [](const simd_ivec<S> *masks, int count, int bounce, stats_t &st) {
+        unsigned long long active_lanes = 0;
+        for (int i = 0; i < count; i++) {
+            active_lanes += count_bits(uint32_t(masks[i].movemask()));
+        }
+        st.rays_traced[std::min(bounce, stats_t::BouncesCount - 1)] += active_lanes;
+        st.active_lanes += active_lanes;
+        st.total_lanes += (unsigned long long)count * S;
+    };
 
-    const auto time_after_prim_trace = std::chrono::high_resolution_clock::now();
+    // traces first packets of bounce as a whole and measures fraction of lanes that stay active in traversal,
+    // returns true if the rest of bounce should be traced the same way (otherwise rays are traced one by one)
+    auto probe_packet_traversal = [&](const ray_packet_t<S> *rays, const simd_ivec<S> *masks, hit_data_t<S> *inters, int count) {
+        const ray_counters_t counters_before = g_ray_counters;
 
-    p.secondary_rays.resize(p.intersections.size());
-    p.secondary_masks.resize(p.intersections.size());
-    int secondary_rays_count = 0;
+        for (int i = 0; i < count; i++) {
+            inters[i] = {};
+            inters[i].xy = rays[i].xy;
 
-    for (size_t i = 0; i < p.intersections.size(); i++) {
-        const ray_packet_t<S> &r = p.primary_rays[i];
-        const hit_data_t<S> &inter = p.intersections[i];
+            trace_packet(rays[i], masks[i], true, inters[i]);
+        }
 
-        simd_ivec<S> x = inter.xy >> 16,
-                     y = inter.xy & 0x0000FFFF;
+        const unsigned long long active_lanes = g_ray_counters.traversal_active_lanes - counters_before.traversal_active_lanes,
+                                 total_lanes = g_ray_counters.traversal_total_lanes - counters_before.traversal_total_lanes;
+        return double(active_lanes) >= single_ray_threshold_ * double(total_lanes);
+    };
 
+    auto pixel_index = [&](const simd_ivec<S> &x, const simd_ivec<S> &y) {
         simd_ivec<S> index;
 
         if (cam.pass_settings.flags & UseCoherentSampling) {
@@ -272,157 +260,520 @@ void Ray::NS::RendererSIMD<DimX, DimY>::RenderScene(const std::shared_ptr<SceneB
             index = y * w + x;
         }
 
-        p.secondary_masks[i] = { 0 };
+        return index;
+    };
 
-        simd_fvec<S> out_rgba[4] = { 0.0f };
-        NS::ShadeSurface(index, pass_info, &region.halton_seq[0], inter, r, sc_data, macro_tree_root, light_tree_root,
-                         tex_atlas, out_rgba, &p.secondary_masks[0], &p.secondary_rays[0], &secondary_rays_count);
+    // shades hits of secondary rays and accumulates result, returns number of newly generated ray packets
+    auto shade_secondary = [&](const pass_info_t &pass_info, const ray_packet_t<S> *rays, const simd_ivec<S> *masks, const hit_data_t<S> *inters, int rays_count,
+                               simd_ivec<S> *out_masks, ray_packet_t<S> *out_rays, simd_ivec<S> *out_shadow_masks, shadow_ray_t<S> *out_shadow_rays, int *out_shadow_rays_count) {
+        int out_rays_count = 0;
 
-        for (int j = 0; j < S; j++) {
-            temp_buf_.SetPixel(x[j], y[j], { out_rgba[0][j], out_rgba[1][j], out_rgba[2][j], out_rgba[3][j] });
+        for (int i = 0; i < rays_count; i++) {
+            const ray_packet_t<S> &r = rays[i];
+            const hit_data_t<S> &inter = inters[i];
+
+            simd_ivec<S> x = inter.xy >> 16,
+                         y = inter.xy & 0x0000FFFF;
+
+            simd_fvec<S> out_rgba[4] = { 0.0f };
+            NS::ShadeSurface(pixel_index(x, y), pass_info, &region.halton_seq[0], inter, r, sc_data, light_tree_root, tex_atlas,
+                             out_rgba, out_masks, out_rays, &out_rays_count, out_shadow_masks, out_shadow_rays, out_shadow_rays_count);
+            out_rgba[3] = 0.0f;
+
+            for (int j = 0; j < S; j++) {
+                if (!masks[i][j]) continue;
+
+                temp_buf_.AddPixel(x[j], y[j], { out_rgba[0][j], out_rgba[1][j], out_rgba[2][j], out_rgba[3][j] });
+            }
         }
-    }
 
-    const auto time_after_prim_shade = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_trace_time{}, secondary_shade_time{};
+        return out_rays_count;
+    };
 
-    p.hash_values.resize(secondary_rays_count);
-    //p.head_flags.resize(secondary_rays_count * S);
-    p.scan_values.resize(secondary_rays_count * S);
-    p.chunks.resize(secondary_rays_count * S);
-    p.chunks_temp.resize(secondary_rays_count * S);
-    //p.skeleton.resize(secondary_rays_count * S);
+    // shadow rays are sorted and traced in one batch after shading, unoccluded ones add light contribution to their pixels
+    // (each pixel has at most one shadow ray per bounce, so lanes can be processed in parallel)
+    auto resolve_shadow_rays = [&](PassData<S> &p, int shadow_rays_count, TaskScheduler *scheduler) {
+        if (!shadow_rays_count) return;
 
-    if (cam.pass_settings.flags & OutputSH) {
-        temp_buf_.ResetSampleData(rect);
-        for (int i = 0; i < secondary_rays_count; i++) {
-            const ray_packet_t<S> &r = p.secondary_rays[i];
+        p.ray_hashes.resize(std::max(p.ray_hashes.size(), size_t(shadow_rays_count * S)));
+        p.ray_hashes_temp.resize(std::max(p.ray_hashes_temp.size(), size_t(shadow_rays_count * S)));
 
-            simd_ivec<S> x = r.xy >> 16,
-                         y = r.xy & 0x0000FFFF;
+        const int hashes_count = SortRays_CPU(&p.shadow_rays[0], &p.shadow_masks[0], shadow_rays_count, root_min, cell_size,
+                                              &p.ray_hashes[0], &p.ray_hashes_temp[0], scheduler);
 
-            for (int j = 0; j < S; j++) {
-                temp_buf_.SetSampleDir(x[j], y[j], r.d[0][j], r.d[1][j], r.d[2][j]);
-                // sample weight for indirect lightmap has all r.c[0..2]`s set to same value
-                temp_buf_.SetSampleWeight(x[j], y[j], r.c[0][j]);
+        p.sorted_shadow_rays.resize(shadow_rays_count);
+        p.sorted_shadow_masks.resize(shadow_rays_count);
+
+        const int sorted_count = GatherRays(&p.shadow_rays[0], &p.shadow_masks[0], &p.ray_hashes[0], hashes_count,
+                                            &p.sorted_shadow_rays[0], &p.sorted_shadow_masks[0], scheduler);
+
+        const int ShadowChunkSize = 64;
+        ParallelFor(scheduler, 0, (sorted_count + ShadowChunkSize - 1) / ShadowChunkSize, [&](int c) {
+            stats_t st = {};
+            const ray_counters_t counters_before = g_ray_counters;
+
+            const int end = std::min((c + 1) * ShadowChunkSize, sorted_count);
+            for (int i = c * ShadowChunkSize; i < end; i++) {
+                const shadow_ray_t<S> &sh_r = p.sorted_shadow_rays[i];
+                const simd_ivec<S> &mask = p.sorted_shadow_masks[i];
+
+                const simd_fvec<S> visibility = ComputeVisibility(sh_r, mask, sc_data, macro_tree_root, tex_atlas);
+
+                for (int j = 0; j < S; j++) {
+                    if (!mask[j] || visibility[j] == 0.0f) continue;
+
+                    const int x = (sh_r.xy[j] >> 16) & 0x0000FFFF,
+                              y = sh_r.xy[j] & 0x0000FFFF;
+
+                    temp_buf_.AddPixel(x, y, { sh_r.c[0][j] * visibility[j], sh_r.c[1][j] * visibility[j], sh_r.c[2][j] * visibility[j], 0.0f });
+                }
+            }
+
+            // when called per tile (without scheduler) counters are gathered by tile itself
+            if (scheduler) {
+                AddRayCounters(counters_before, st);
+                AccumulateStats(st);
             }
+        });
+    };
+
+    auto resolve_tile = [&](const rect_t &rect) {
+        // factor used to compute incremental average
+        const float mix_factor = 1.0f / region.iteration;
+
+        clean_buf_.MixWith(temp_buf_, rect, mix_factor);
+        if (cam.pass_settings.flags & OutputSH) {
+            temp_buf_.ComputeSHData(rect);
+            clean_buf_.MixWith_SH(temp_buf_, rect, mix_factor);
         }
+
+        auto clamp_and_gamma_correct = [&cam](const pixel_color_t &p) {
+            auto c = simd_fvec4{ &p.r };
+
+            if (cam.dtype == SRGB) {
+                ITERATE_3({
+                    if (c[i] > 0.0031308f) {
+                        c[i] = std::pow(1.055f * c[i], (1.0f / 2.4f)) - 0.055f;
+                    } else {
+                        c[i] = 12.92f * c[i];
+                    }
+                })
+            }
+
+            if (cam.gamma != 1.0f) {
+                c = pow(c, simd_fvec4{ 1.0f / cam.gamma });
+            }
+
+            if (cam.pass_settings.flags & Clamp) {
+                c = clamp(c, 0.0f, 1.0f);
+            }
+            return pixel_color_t{ c[0], c[1], c[2], c[3] };
+        };
+
+        final_buf_.CopyFrom(clean_buf_, rect, clamp_and_gamma_correct);
+    };
+
+    pass_info_t base_pass_info;
+
+    base_pass_info.iteration = region.iteration;
+    base_pass_info.bounce = 2;
+    base_pass_info.settings = cam.pass_settings;
+    base_pass_info.settings.max_total_depth = std::min(base_pass_info.settings.max_total_depth, (uint8_t)MAX_BOUNCES);
+
+    const bool trace_secondary = !(base_pass_info.settings.flags & SkipIndirectLight);
+
+    auto get_pass_data = [this]() {
+        PassData<S> p;
+
+        std::lock_guard<std::mutex> _(pass_cache_mtx_);
+        if (!pass_cache_.empty()) {
+            p = std::move(pass_cache_.back());
+            pass_cache_.pop_back();
+        }
+        return p;
+    };
+
+    // in wavefront mode tiles keep their secondary rays, they are merged and traced together after all tiles are done
+    // (geometry camera can put several samples in one pixel, so it is always traced per tile)
+    const bool use_wavefront = use_wavefront_ && cam.type != Geo;
+
+    std::shared_ptr<tri_bins_t> tri_bins;
+    if (cam.type == Geo) {
+        tri_bins = s->GetTriBins(s->mesh_instances_[cam.mi_index].mesh_index, cam.uv_index, w, h);
     }
 
-    for (int bounce = 0; bounce < pass_info.settings.max_total_depth && secondary_rays_count && !(pass_info.settings.flags & SkipIndirectLight); bounce++) {
-        auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
+    const int tiles_x = (region_rect.w + tile_size_ - 1) / tile_size_,
+              tiles_y = (region_rect.h + tile_size_ - 1) / tile_size_;
+    std::vector<PassData<S>> tile_passes(use_wavefront ? tiles_x * tiles_y : 0);
+    std::vector<int> tile_rays_count(tile_passes.size(), 0);
 
-        SortRays_CPU(&p.secondary_rays[0], &p.secondary_masks[0], secondary_rays_count, root_min, cell_size,
-                     &p.hash_values[0], &p.scan_values[0], &p.chunks[0], &p.chunks_temp[0]);
+    RunTiled(region_rect, [&](const rect_t &rect) {
+        PassData<S> p = get_pass_data();
 
-        auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
+        pass_info_t pass_info = base_pass_info;
 
-        for (int i = 0; i < secondary_rays_count; i++) {
-            const ray_packet_t<S> &r = p.secondary_rays[i];
-            hit_data_t<S> &inter = p.intersections[i];
+        stats_t st = {};
+        const ray_counters_t counters_before = g_ray_counters;
 
-            inter = {};
-            inter.xy = r.xy;
+        const auto time_start = std::chrono::high_resolution_clock::now();
+        std::chrono::time_point<std::chrono::high_resolution_clock> time_after_ray_gen;
 
-            if (sc_data.mnodes) {
-                NS::Traverse_MacroTree_WithStack_ClosestHit(r, p.secondary_masks[i], sc_data.mnodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
-                                                            sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
-            } else {
-                NS::Traverse_MacroTree_WithStack_ClosestHit(r, p.secondary_masks[i], sc_data.nodes, macro_tree_root, sc_data.mesh_instances, sc_data.mi_indices,
-                                                            sc_data.meshes, sc_data.transforms, sc_data.tris, sc_data.tri_indices, inter);
+        if (cam.type != Geo) {
+            GeneratePrimaryRays<DimX, DimY>(region.iteration, cam, rect, w, h, &region.halton_seq[0], p.primary_rays);
+
+            time_after_ray_gen = std::chrono::high_resolution_clock::now();
+
+            // primary packets are always traced with all lanes active
+            st.rays_traced[0] = st.active_lanes = st.total_lanes = (unsigned long long)p.primary_rays.size() * S;
+
+            p.primary_masks.resize(p.primary_rays.size());
+            p.intersections.resize(p.primary_rays.size(), hit_data_t<S>{});
+
+            for (size_t i = 0; i < p.primary_rays.size(); i++) {
+                const ray_packet_t<S> &r = p.primary_rays[i];
+                hit_data_t<S> &inter = p.intersections[i];
+
+                inter = {};
+                inter.xy = r.xy;
+
+                if (macro_tree_root != 0xffffffff) {
+                    trace_packet(r, { -1 }, use_hybrid_traversal, inter);
+                }
             }
+        } else {
+            const mesh_instance_t &mi = sc_data.mesh_instances[cam.mi_index];
+            Ref::UpdateTexelCache(*tri_bins, sc_data.vtx_indices, sc_data.vertices, rect);
+            SampleMeshInTextureSpace<DimX, DimY>(region.iteration, cam.mi_index,
+                                                 *tri_bins, sc_data.transforms[mi.tr_index], sc_data.vtx_indices, sc_data.vertices,
+                                                 rect, w, &region.halton_seq[0], p.primary_rays, p.intersections);
+
+            p.primary_masks.resize(p.primary_rays.size());
+
+            time_after_ray_gen = std::chrono::high_resolution_clock::now();
         }
 
-        auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
+        const auto time_after_prim_trace = std::chrono::high_resolution_clock::now();
 
-        int rays_count = secondary_rays_count;
-        secondary_rays_count = 0;
-        std::swap(p.primary_rays, p.secondary_rays);
-        std::swap(p.primary_masks, p.secondary_masks);
+        p.secondary_rays.resize(p.intersections.size());
+        p.secondary_masks.resize(p.intersections.size());
+        int secondary_rays_count = 0;
 
-        pass_info.bounce = bounce + 3;
+        p.shadow_rays.resize(p.intersections.size());
+        p.shadow_masks.resize(p.intersections.size());
+        int shadow_rays_count = 0;
 
-        for (int i = 0; i < rays_count; i++) {
+        for (size_t i = 0; i < p.intersections.size(); i++) {
             const ray_packet_t<S> &r = p.primary_rays[i];
             const hit_data_t<S> &inter = p.intersections[i];
 
             simd_ivec<S> x = inter.xy >> 16,
                          y = inter.xy & 0x0000FFFF;
 
-            simd_ivec<S> index;
+            p.secondary_masks[i] = { 0 };
+
+            simd_fvec<S> out_rgba[4] = { 0.0f };
+            NS::ShadeSurface(pixel_index(x, y), pass_info, &region.halton_seq[0], inter, r, sc_data, light_tree_root, tex_atlas,
+                             out_rgba, &p.secondary_masks[0], &p.secondary_rays[0], &secondary_rays_count,
+                             &p.shadow_masks[0], &p.shadow_rays[0], &shadow_rays_count);
+
+            for (int j = 0; j < S; j++) {
+                temp_buf_.SetPixel(x[j], y[j], { out_rgba[0][j], out_rgba[1][j], out_rgba[2][j], out_rgba[3][j] });
+            }
+        }
+
+        resolve_shadow_rays(p, shadow_rays_count, nullptr);
+
+        const auto time_after_prim_shade = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_gather_time{}, secondary_trace_time{}, secondary_shade_time{};
+
+        if (cam.pass_settings.flags & OutputSH) {
+            temp_buf_.ResetSampleData(rect);
+            for (int i = 0; i < secondary_rays_count; i++) {
+                const ray_packet_t<S> &r = p.secondary_rays[i];
+
+                simd_ivec<S> x = r.xy >> 16,
+                             y = r.xy & 0x0000FFFF;
 
-            if (cam.pass_settings.flags & UseCoherentSampling) {
                 for (int j = 0; j < S; j++) {
-                    const int blck_x = x[j] % 8, blck_y = y[j] % 8;
-                    index[j] = sampling_pattern[blck_y * 8 + blck_x];
+                    temp_buf_.SetSampleDir(x[j], y[j], r.d[0][j], r.d[1][j], r.d[2][j]);
+                    // sample weight for indirect lightmap has all r.c[0..2]`s set to same value
+                    temp_buf_.SetSampleWeight(x[j], y[j], r.c[0][j]);
                 }
-            } else {
-                index = y * w + x;
             }
+        }
 
-            simd_fvec<S> out_rgba[4] = { 0.0f };
-            NS::ShadeSurface(index, pass_info, &region.halton_seq[0], inter, r, sc_data, macro_tree_root, light_tree_root,
-                             tex_atlas, out_rgba, &p.secondary_masks[0], &p.secondary_rays[0], &secondary_rays_count);
-            out_rgba[3] = 0.0f;
+        if (use_wavefront) {
+            const int tile_index = ((rect.y - region_rect.y) / tile_size_) * tiles_x + (rect.x - region_rect.x) / tile_size_;
+            tile_rays_count[tile_index] = secondary_rays_count;
+            tile_passes[tile_index] = std::move(p);
+
+            st.time_primary_ray_gen_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
+            st.time_primary_trace_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
+            st.time_primary_shade_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
+            st.tile_time_hist[TileTimeBucket((unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_start }.count())]++;
+            AddRayCounters(counters_before, st);
+            AccumulateStats(st);
+            return;
+        }
 
-            for (int j = 0; j < S; j++) {
-                if (!p.primary_masks[i][j]) continue;
+        p.ray_hashes.resize(secondary_rays_count * S);
+        p.ray_hashes_temp.resize(secondary_rays_count * S);
 
-                temp_buf_.AddPixel(x[j], y[j], { out_rgba[0][j], out_rgba[1][j], out_rgba[2][j], out_rgba[3][j] });
+        for (int bounce = 0; bounce < pass_info.settings.max_total_depth && secondary_rays_count && trace_secondary; bounce++) {
+            auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
+
+            const int hashes_count = SortRays_CPU(&p.secondary_rays[0], &p.secondary_masks[0], secondary_rays_count, root_min, cell_size,
+                                                  &p.ray_hashes[0], &p.ray_hashes_temp[0], nullptr);
+
+            auto time_secondary_gather_start = std::chrono::high_resolution_clock::now();
+
+            // primary rays are not needed anymore, so their storage is used as destination
+            secondary_rays_count = GatherRays(&p.secondary_rays[0], &p.secondary_masks[0], &p.ray_hashes[0], hashes_count,
+                                              &p.primary_rays[0], &p.primary_masks[0], nullptr);
+            std::swap(p.primary_rays, p.secondary_rays);
+            std::swap(p.primary_masks, p.secondary_masks);
+
+            auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
+
+            count_traced_rays(&p.secondary_masks[0], secondary_rays_count, bounce + 1, st);
+
+            int probed_count = 0;
+            bool whole_packets = false;
+            if (use_hybrid_traversal) {
+                probed_count = std::min(secondary_rays_count, ProbePacketsCount);
+                whole_packets = probe_packet_traversal(&p.secondary_rays[0], &p.secondary_masks[0], &p.intersections[0], probed_count);
+                if (!whole_packets) {
+                    st.single_ray_packets += secondary_rays_count - probed_count;
+                }
             }
+
+            for (int i = probed_count; i < secondary_rays_count; i++) {
+                const ray_packet_t<S> &r = p.secondary_rays[i];
+                hit_data_t<S> &inter = p.intersections[i];
+
+                inter = {};
+                inter.xy = r.xy;
+
+                trace_packet(r, p.secondary_masks[i], whole_packets, inter);
+            }
+
+            auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
+
+            int rays_count = secondary_rays_count;
+            std::swap(p.primary_rays, p.secondary_rays);
+            std::swap(p.primary_masks, p.secondary_masks);
+
+            pass_info.bounce = bounce + 3;
+
+            shadow_rays_count = 0;
+            secondary_rays_count = shade_secondary(pass_info, &p.primary_rays[0], &p.primary_masks[0], &p.intersections[0], rays_count,
+                                                   &p.secondary_masks[0], &p.secondary_rays[0], &p.shadow_masks[0], &p.shadow_rays[0], &shadow_rays_count);
+            resolve_shadow_rays(p, shadow_rays_count, nullptr);
+
+            auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
+            secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
+            secondary_gather_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_gather_start };
+            secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
+            secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
         }
 
-        auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
-        secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
-        secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
-        secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
+        {
+            std::lock_guard<std::mutex> _(pass_cache_mtx_);
+            pass_cache_.emplace_back(std::move(p));
+        }
+
+        const auto time_end = std::chrono::high_resolution_clock::now();
+
+        st.time_primary_ray_gen_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
+        st.time_primary_trace_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
+        st.time_primary_shade_us = (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
+        st.time_secondary_sort_us = (unsigned long long)secondary_sort_time.count();
+        st.time_secondary_gather_us = (unsigned long long)secondary_gather_time.count();
+        st.time_secondary_trace_us = (unsigned long long)secondary_trace_time.count();
+        st.time_secondary_shade_us = (unsigned long long)secondary_shade_time.count();
+        st.tile_time_hist[TileTimeBucket((unsigned long long)std::chrono::duration<double, std::micro>{ time_end - time_start }.count())]++;
+        AddRayCounters(counters_before, st);
+        AccumulateStats(st);
+
+        resolve_tile(rect);
+    });
+
+    if (!use_wavefront) return;
+
+    TaskScheduler *scheduler = tile_scheduler_.get();
+
+    // rays are processed in chunks of packets, each chunk writes new rays to its own part of temp buffer,
+    // after that they are moved to the queue for next bounce (this keeps order of rays deterministic)
+    const int ChunkSize = 64;
+
+    // secondary rays of current bounce are kept in q, temp is used as output of shading stage
+    PassData<S> q = get_pass_data(), temp = get_pass_data();
+
+    std::vector<int> offsets(tile_passes.size() + 1, 0);
+    for (size_t i = 0; i < tile_passes.size(); i++) {
+        offsets[i + 1] = offsets[i] + tile_rays_count[i];
     }
 
+    int rays_count = offsets.back();
+    q.secondary_rays.resize(rays_count);
+    q.secondary_masks.resize(rays_count);
+
+    ParallelFor(scheduler, 0, (int)tile_passes.size(), [&](int i) {
+        PassData<S> &p = tile_passes[i];
+        if (tile_rays_count[i]) {
+            std::copy(p.secondary_rays.begin(), p.secondary_rays.begin() + tile_rays_count[i], q.secondary_rays.begin() + offsets[i]);
+            std::copy(p.secondary_masks.begin(), p.secondary_masks.begin() + tile_rays_count[i], q.secondary_masks.begin() + offsets[i]);
+        }
+    });
+
     {
         std::lock_guard<std::mutex> _(pass_cache_mtx_);
-        pass_cache_.emplace_back(std::move(p));
-
-        stats_.time_primary_ray_gen_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_ray_gen - time_start }.count();
-        stats_.time_primary_trace_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_trace - time_after_ray_gen }.count();
-        stats_.time_primary_shade_us += (unsigned long long)std::chrono::duration<double, std::micro>{ time_after_prim_shade - time_after_prim_trace }.count();
-        stats_.time_secondary_sort_us += (unsigned long long)secondary_sort_time.count();
-        stats_.time_secondary_trace_us += (unsigned long long)secondary_trace_time.count();
-        stats_.time_secondary_shade_us += (unsigned long long)secondary_shade_time.count();
+        for (PassData<S> &p : tile_passes) {
+            pass_cache_.emplace_back(std::move(p));
+        }
     }
+    tile_passes.clear();
 
-    // factor used to compute incremental average
-    const float mix_factor = 1.0f / region.iteration;
+    pass_info_t pass_info = base_pass_info;
+    std::chrono::duration<double, std::micro> secondary_sort_time{}, secondary_gather_time{}, secondary_trace_time{}, secondary_shade_time{};
 
-    clean_buf_.MixWith(temp_buf_, rect, mix_factor);
-    if (cam.pass_settings.flags & OutputSH) {
-        temp_buf_.ComputeSHData(rect);
-        clean_buf_.MixWith_SH(temp_buf_, rect, mix_factor);
-    }
+    for (int bounce = 0; bounce < pass_info.settings.max_total_depth && rays_count && trace_secondary; bounce++) {
+        auto time_secondary_sort_start = std::chrono::high_resolution_clock::now();
 
-    auto clamp_and_gamma_correct = [&cam](const pixel_color_t &p) {
-        auto c = simd_fvec4{ &p.r };
+        q.ray_hashes.resize(rays_count * S);
+        q.ray_hashes_temp.resize(rays_count * S);
 
-        if (cam.dtype == SRGB) {
-            ITERATE_3({
-                if (c[i] > 0.0031308f) {
-                    c[i] = std::pow(1.055f * c[i], (1.0f / 2.4f)) - 0.055f;
-                } else {
-                    c[i] = 12.92f * c[i];
-                }
-            })
-        }
+        const int hashes_count = SortRays_CPU(&q.secondary_rays[0], &q.secondary_masks[0], rays_count, root_min, cell_size,
+                                              &q.ray_hashes[0], &q.ray_hashes_temp[0], scheduler);
+
+        auto time_secondary_gather_start = std::chrono::high_resolution_clock::now();
+
+        temp.secondary_rays.resize(rays_count);
+        temp.secondary_masks.resize(rays_count);
+
+        rays_count = GatherRays(&q.secondary_rays[0], &q.secondary_masks[0], &q.ray_hashes[0], hashes_count,
+                                &temp.secondary_rays[0], &temp.secondary_masks[0], scheduler);
+        std::swap(q.secondary_rays, temp.secondary_rays);
+        std::swap(q.secondary_masks, temp.secondary_masks);
+
+        auto time_secondary_trace_start = std::chrono::high_resolution_clock::now();
+
+        const int chunks_count = (rays_count + ChunkSize - 1) / ChunkSize;
+        q.intersections.resize(rays_count, hit_data_t<S>{});
+
+        int probed_count = 0;
+        bool whole_packets = false;
+        if (use_hybrid_traversal) {
+            stats_t st = {};
+            const ray_counters_t counters_before = g_ray_counters;
 
-        if (cam.gamma != 1.0f) {
-            c = pow(c, simd_fvec4{ 1.0f / cam.gamma });
+            probed_count = std::min(rays_count, ProbePacketsCount);
+            whole_packets = probe_packet_traversal(&q.secondary_rays[0], &q.secondary_masks[0], &q.intersections[0], probed_count);
+            if (!whole_packets) {
+                st.single_ray_packets = rays_count - probed_count;
+            }
+
+            AddRayCounters(counters_before, st);
+            AccumulateStats(st);
         }
 
-        if (cam.pass_settings.flags & Clamp) {
-            c = clamp(c, 0.0f, 1.0f);
+        ParallelFor(scheduler, 0, chunks_count, [&](int c) {
+            stats_t st = {};
+            const ray_counters_t counters_before = g_ray_counters;
+
+            const int beg = c * ChunkSize, end = std::min(beg + ChunkSize, rays_count);
+            for (int i = std::max(beg, probed_count); i < end; i++) {
+                hit_data_t<S> &inter = q.intersections[i];
+
+                inter = {};
+                inter.xy = q.secondary_rays[i].xy;
+
+                trace_packet(q.secondary_rays[i], q.secondary_masks[i], whole_packets, inter);
+            }
+
+            count_traced_rays(&q.secondary_masks[beg], end - beg, bounce + 1, st);
+            AddRayCounters(counters_before, st);
+            AccumulateStats(st);
+        });
+
+        auto time_secondary_shade_start = std::chrono::high_resolution_clock::now();
+
+        std::swap(q.primary_rays, q.secondary_rays);
+        std::swap(q.primary_masks, q.secondary_masks);
+
+        // each packet produces at most one new packet and one shadow packet
+        temp.secondary_rays.resize(rays_count);
+        temp.secondary_masks.resize(rays_count);
+        temp.shadow_rays.resize(rays_count);
+        temp.shadow_masks.resize(rays_count);
+        std::vector<int> chunk_offsets(chunks_count + 1, 0), shadow_chunk_offsets(chunks_count + 1, 0);
+
+        pass_info.bounce = bounce + 3;
+
+        ParallelFor(scheduler, 0, chunks_count, [&](int c) {
+            stats_t st = {};
+            const ray_counters_t counters_before = g_ray_counters;
+
+            const int beg = c * ChunkSize, end = std::min(beg + ChunkSize, rays_count);
+            chunk_offsets[c + 1] = shade_secondary(pass_info, &q.primary_rays[beg], &q.primary_masks[beg], &q.intersections[beg], end - beg,
+                                                   &temp.secondary_masks[beg], &temp.secondary_rays[beg],
+                                                   &temp.shadow_masks[beg], &temp.shadow_rays[beg], &shadow_chunk_offsets[c + 1]);
+
+            // shading applies russian roulette, its counters are gathered here
+            AddRayCounters(counters_before, st);
+            AccumulateStats(st);
+        });
+
+        for (int c = 0; c < chunks_count; c++) {
+            chunk_offsets[c + 1] += chunk_offsets[c];
+            shadow_chunk_offsets[c + 1] += shadow_chunk_offsets[c];
         }
-        return pixel_color_t{ c[0], c[1], c[2], c[3] };
-    };
 
-    final_buf_.CopyFrom(clean_buf_, rect, clamp_and_gamma_correct);
+        const int new_rays_count = chunk_offsets.back(), shadow_rays_count = shadow_chunk_offsets.back();
+        q.secondary_rays.resize(new_rays_count);
+        q.secondary_masks.resize(new_rays_count);
+        q.shadow_rays.resize(shadow_rays_count);
+        q.shadow_masks.resize(shadow_rays_count);
+
+        ParallelFor(scheduler, 0, chunks_count, [&](int c) {
+            const int beg = c * ChunkSize, count = chunk_offsets[c + 1] - chunk_offsets[c];
+            std::copy(temp.secondary_rays.begin() + beg, temp.secondary_rays.begin() + beg + count, q.secondary_rays.begin() + chunk_offsets[c]);
+            std::copy(temp.secondary_masks.begin() + beg, temp.secondary_masks.begin() + beg + count, q.secondary_masks.begin() + chunk_offsets[c]);
+
+            const int shadow_count = shadow_chunk_offsets[c + 1] - shadow_chunk_offsets[c];
+            std::copy(temp.shadow_rays.begin() + beg, temp.shadow_rays.begin() + beg + shadow_count, q.shadow_rays.begin() + shadow_chunk_offsets[c]);
+            std::copy(temp.shadow_masks.begin() + beg, temp.shadow_masks.begin() + beg + shadow_count, q.shadow_masks.begin() + shadow_chunk_offsets[c]);
+        });
+
+        resolve_shadow_rays(q, shadow_rays_count, scheduler);
+
+        rays_count = new_rays_count;
+
+        auto time_secondary_shade_end = std::chrono::high_resolution_clock::now();
+        secondary_sort_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_sort_start };
+        secondary_gather_time += std::chrono::duration<double, std::micro>{ time_secondary_trace_start - time_secondary_gather_start };
+        secondary_trace_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_start - time_secondary_trace_start };
+        secondary_shade_time += std::chrono::duration<double, std::micro>{ time_secondary_shade_end - time_secondary_shade_start };
+    }
+
+    {
+        std::lock_guard<std::mutex> _(pass_cache_mtx_);
+        pass_cache_.emplace_back(std::move(q));
+        pass_cache_.emplace_back(std::move(temp));
+    }
+
+    // stages above are measured once, while all threads work on them, so wall-clock time is converted
+    // to thread time to stay comparable with per-tile times of tiled mode
+    const double threads = threads_count();
+
+    stats_t st = {};
+    st.time_secondary_sort_us = (unsigned long long)(secondary_sort_time.count() * threads);
+    st.time_secondary_gather_us = (unsigned long long)(secondary_gather_time.count() * threads);
+    st.time_secondary_trace_us = (unsigned long long)(secondary_trace_time.count() * threads);
+    st.time_secondary_shade_us = (unsigned long long)(secondary_shade_time.count() * threads);
+    AccumulateStats(st);
+
+    RunTiled(region_rect, resolve_tile);
 }
 
 template <int DimX, int DimY>
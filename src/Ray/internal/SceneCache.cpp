@@ -0,0 +1,157 @@
+#include "SceneCache.h"
+
+#include <cstring>
+
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void Ray::SceneCache::Writer::AddChunk(uint32_t id, const void *data, size_t elem_size, size_t count) {
+    pending_chunk_t ch;
+    ch.chunk.id = id;
+    ch.chunk.elem_size = (uint32_t)elem_size;
+    ch.chunk.offset = 0;
+    ch.chunk.size = uint64_t(elem_size) * count;
+    ch.data = data;
+    chunks_.push_back(ch);
+}
+
+bool Ray::SceneCache::Writer::Write(const char *file_name, const header_t &_header) const {
+    header_t header = _header;
+    header.chunk_count = (uint32_t)chunks_.size();
+
+    std::vector<chunk_t> table;
+    table.reserve(chunks_.size());
+
+    uint64_t offset = sizeof(header_t) + chunks_.size() * sizeof(chunk_t);
+    for (const pending_chunk_t &ch : chunks_) {
+        offset = ChunkAlignment * ((offset + ChunkAlignment - 1) / ChunkAlignment);
+        table.push_back(ch.chunk);
+        table.back().offset = offset;
+        offset += ch.chunk.size;
+    }
+
+    std::ofstream out_file(file_name, std::ios::binary);
+    if (!out_file) return false;
+
+    out_file.write((const char *)&header, sizeof(header_t));
+    if (!table.empty()) {
+        out_file.write((const char *)&table[0], table.size() * sizeof(chunk_t));
+    }
+
+    static const char zeroes[ChunkAlignment] = {};
+
+    uint64_t pos = sizeof(header_t) + table.size() * sizeof(chunk_t);
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        out_file.write(zeroes, std::streamsize(table[i].offset - pos));
+        // each array is written at once
+        if (table[i].size) {
+            out_file.write((const char *)chunks_[i].data, std::streamsize(table[i].size));
+        }
+        pos = table[i].offset + table[i].size;
+    }
+
+    return bool(out_file);
+}
+
+bool Ray::SceneCache::Reader::Open(const char *file_name) {
+    Close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    file_ = file;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(header_t)) {
+        Close();
+        return false;
+    }
+    size_ = (size_t)file_size.QuadPart;
+
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+        Close();
+        return false;
+    }
+
+    data_ = (const uint8_t *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+#else
+    fd_ = open(file_name, O_RDONLY);
+    if (fd_ == -1) return false;
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size < (off_t)sizeof(header_t)) {
+        Close();
+        return false;
+    }
+    size_ = (size_t)st.st_size;
+
+    void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapping != MAP_FAILED) {
+        // whole file is going to be copied
+        madvise(mapping, size_, MADV_WILLNEED);
+        data_ = (const uint8_t *)mapping;
+    }
+#endif
+    if (!data_) {
+        Close();
+        return false;
+    }
+
+    header_ = (const header_t *)data_;
+    if (header_->magic != FileMagic || header_->version != FileVersion ||
+        sizeof(header_t) + uint64_t(header_->chunk_count) * sizeof(chunk_t) > size_) {
+        Close();
+        return false;
+    }
+
+    const auto *table = (const chunk_t *)(data_ + sizeof(header_t));
+    for (uint32_t i = 0; i < header_->chunk_count; i++) {
+        const chunk_t &ch = table[i];
+        if (ch.offset % ChunkAlignment || ch.offset > size_ || ch.size > size_ - ch.offset || !ch.elem_size || ch.size % ch.elem_size) {
+            Close();
+            return false;
+        }
+        // unknown chunks are skipped
+        if (ch.id < ChCount) chunks_[ch.id] = &ch;
+    }
+
+    return true;
+}
+
+void Ray::SceneCache::Reader::Close() {
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_) CloseHandle(file_);
+    file_ = mapping_ = nullptr;
+#else
+    if (data_) munmap((void *)data_, size_);
+    if (fd_ != -1) close(fd_);
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+    memset(chunks_, 0, sizeof(chunks_));
+}
+
+const void *Ray::SceneCache::Reader::GetChunk(uint32_t id, size_t elem_size, size_t &out_count) const {
+    if (id >= ChCount || !chunks_[id] || chunks_[id]->elem_size != elem_size) return nullptr;
+    out_count = size_t(chunks_[id]->size / elem_size);
+    return data_ + chunks_[id]->offset;
+}
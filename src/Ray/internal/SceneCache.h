@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+namespace Ray {
+/** Binary scene cache.
+    File holds scene storage arrays exactly as they are laid out in memory, so it is loaded with single mapping
+    of file and bulk copy of each array (no parsing of individual elements). Pointers (e.g. atlas page tables)
+    are stored as indices and fixed up after loading.
+
+    Layout: header_t, chunk_t table, chunk data (each chunk starts at 64 bytes aligned offset).
+*/
+namespace SceneCache {
+const uint32_t FileMagic = 0x4e435352; // 'RSCN'
+const uint32_t FileVersion = 1;
+const uint64_t ChunkAlignment = 64;
+
+enum eChunkId : uint32_t {
+    ChSceneParams,
+    ChNodes,
+    ChMeshNodes,
+    ChCompressedMeshNodes,
+    ChTris,
+    ChTriIndices,
+    ChTransforms,
+    ChMeshes,
+    ChMeshInstances,
+    ChMiIndices,
+    ChVertices,
+    ChVtxIndices,
+    ChMeshRanges,
+    ChAllocators,
+    ChMaterials,
+    ChTextures,
+    ChLights,
+    ChLiIndices,
+    ChLightNodes,
+    ChCameras,
+    ChAtlasPages,
+    ChAtlasPageTables,
+    ChAtlasTileRefs,
+    ChAtlasSplitters,
+    ChAtlasTiles,
+    ChAtlasCompressedTiles,
+    ChCount
+};
+
+enum eFileFlags : uint32_t {
+    UseWideBVH = (1 << 0),
+    UseCompressedBVH = (1 << 1),
+};
+
+struct header_t {
+    uint32_t magic, version;
+    uint32_t flags;
+    uint32_t chunk_count;
+};
+static_assert(sizeof(header_t) == 16, "!");
+
+struct chunk_t {
+    uint32_t id, elem_size; ///< size of stored structure, chunk is rejected if it does not match
+    uint64_t offset, size;
+};
+static_assert(sizeof(chunk_t) == 24, "!");
+
+/// Collects chunks and writes them to file, data is referenced (not copied) until Write is called
+class Writer {
+    struct pending_chunk_t {
+        chunk_t chunk;
+        const void *data;
+    };
+    std::vector<pending_chunk_t> chunks_;
+    std::vector<std::unique_ptr<uint8_t[]>> owned_data_;
+public:
+    void AddChunk(uint32_t id, const void *data, size_t elem_size, size_t count);
+
+    template <typename T, typename Alloc>
+    void AddChunk(uint32_t id, const std::vector<T, Alloc> &v) {
+        AddChunk(id, v.data(), sizeof(T), v.size());
+    }
+
+    /// Adds chunk with storage owned by writer (for data converted before writing)
+    template <typename T>
+    T *AddOwnedChunk(uint32_t id, size_t count) {
+        owned_data_.emplace_back(new uint8_t[count * sizeof(T)]);
+        AddChunk(id, owned_data_.back().get(), sizeof(T), count);
+        return reinterpret_cast<T *>(owned_data_.back().get());
+    }
+
+    bool Write(const char *file_name, const header_t &header) const;
+};
+
+/// Maps cache file into memory and provides access to its chunks
+class Reader {
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void *file_ = nullptr, *mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    const header_t *header_ = nullptr;
+    const chunk_t *chunks_[ChCount] = {};
+public:
+    Reader() = default;
+    Reader(const Reader &rhs) = delete;
+    Reader &operator=(const Reader &rhs) = delete;
+    ~Reader() { Close(); }
+
+    /// Maps file and validates header and chunk table (chunk data is not touched)
+    bool Open(const char *file_name);
+    void Close();
+
+    const header_t &header() const { return *header_; }
+
+    /** @brief Returns chunk data
+        @param elem_size expected size of single element
+        @param out_count receives number of elements
+        @return Pointer to data inside of mapping, nullptr if chunk is missing or has different element size
+    */
+    const void *GetChunk(uint32_t id, size_t elem_size, size_t &out_count) const;
+
+    template <typename T>
+    const T *GetChunk(uint32_t id, size_t &out_count) const {
+        return reinterpret_cast<const T *>(GetChunk(id, sizeof(T), out_count));
+    }
+
+    /// Bulk-copies chunk into vector, returns false if chunk is missing
+    template <typename T, typename Alloc>
+    bool ReadChunk(uint32_t id, std::vector<T, Alloc> &out_v) const {
+        size_t count;
+        const T *data = GetChunk<T>(id, count);
+        if (!data) return false;
+        out_v.assign(data, data + count);
+        return true;
+    }
+};
+}
+}
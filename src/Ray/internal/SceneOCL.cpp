@@ -2,6 +2,8 @@
 
 #include <cassert>
 
+#include <chrono>
+
 #include "BVHSplit.h"
 #include "TextureUtilsRef.h"
 
@@ -108,11 +110,14 @@ uint32_t Ray::Ocl::Scene::AddTexture(const tex_desc_t &_t) {
 
         mip++;
 
-        if (_t.generate_mipmaps) {
-            tex_data = Ref::DownsampleTexture(tex_data, res);
+        if (_t.generate_mipmaps && res[0] > 1 && res[1] > 1) {
+            const int new_res[2] = { res[0] / 2, res[1] / 2 };
+            std::vector<pixel_color8_t> new_data(new_res[0] * new_res[1]);
+            Ref::DownsampleTexture(&tex_data[0], res, _t.is_srgb, &new_data[0], 0, new_res[1]);
 
-            res[0] /= 2;
-            res[1] /= 2;
+            tex_data = std::move(new_data);
+            res[0] = new_res[0];
+            res[1] = new_res[1];
         } else {
             break;
         }
@@ -177,8 +182,14 @@ uint32_t Ray::Ocl::Scene::AddMesh(const mesh_desc_t &_m) {
     bvh_settings_t s;
     s.allow_spatial_splits = _m.allow_spatial_splits;
     s.use_fast_bvh_build = _m.use_fast_bvh_build;
+    s.bins_count = _m.bvh_bins_count;
+
+    const auto time_start = std::chrono::high_resolution_clock::now();
 
     PreprocessMesh(_m.vtx_attrs, _m.vtx_indices, _m.vtx_indices_count, _m.layout, _m.base_vertex, s, new_nodes, new_tris, new_tri_indices);
+
+    stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+
     for (size_t i = 0; i < _m.vtx_indices_count; i++) {
         new_vtx_indices.push_back(_m.vtx_indices[i] + _m.base_vertex + (uint32_t)vertices_.size());
     }
@@ -436,8 +447,12 @@ void Ray::Ocl::Scene::RebuildMacroBVH() {
     std::vector<bvh_node_t> bvh_nodes;
     std::vector<uint32_t> mi_indices;
 
+    const auto time_start = std::chrono::high_resolution_clock::now();
+
     macro_nodes_start_ = (uint32_t)nodes_.size();
     macro_nodes_count_ = PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, bvh_nodes, mi_indices);
+
+    stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
     
     // offset nodes
     for (bvh_node_t &n : bvh_nodes) {
@@ -517,9 +532,13 @@ void Ray::Ocl::Scene::RebuildLightBVH() {
     std::vector<bvh_node_t> bvh_nodes;
     std::vector<uint32_t> li_indices;
 
+    const auto time_start = std::chrono::high_resolution_clock::now();
+
     light_nodes_start_ = (uint32_t)nodes_.size();
     light_nodes_count_ = PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, bvh_nodes, li_indices);
 
+    stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+
     // offset nodes
     for (bvh_node_t &n : bvh_nodes) {
 #ifdef USE_STACKLESS_BVH_TRAVERSAL
@@ -41,6 +41,8 @@ protected:
     uint32_t default_env_texture_;
     uint32_t default_normals_texture_;
 
+    stats_t stats_ = { 0 };
+
     void RemoveNodes(uint32_t node_index, uint32_t node_count);
     void RebuildMacroBVH();
     void RebuildLightBVH();
@@ -66,12 +68,18 @@ public:
     void SetMeshInstanceTransform(uint32_t mi_index, const float *xform) override;
     void RemoveMeshInstance(uint32_t) override;
 
+    // storage is kept compact on removal
+    void Compact() override {}
+
     uint32_t triangle_count() override {
         return (uint32_t)tris_.size();
     }
     uint32_t node_count() override {
         return (uint32_t)nodes_.size();
     }
+
+    void GetStats(stats_t &st) override { st = stats_; }
+    void ResetStats() override { stats_ = { 0 }; }
 };
 }
 }
\ No newline at end of file
@@ -3,9 +3,116 @@
 #include <cassert>
 #include <cstring>
 
+#include <algorithm>
+#include <chrono>
+
+#include "SceneCache.h"
+#include "TaskScheduler.h"
 #include "TextureUtilsRef.h"
 
-Ray::Ref::Scene::Scene(bool use_wide_bvh) : use_wide_bvh_(use_wide_bvh), texture_atlas_(TEXTURE_ATLAS_SIZE, TEXTURE_ATLAS_SIZE) {
+namespace Ray {
+namespace Ref {
+// macro tree is rebuilt from scratch when its cost grows this much after refitting
+const float MacroBVHRebuildThreshold = 1.5f;
+
+force_inline float half_surface_area(const float bbox_min[3], const float bbox_max[3]) {
+    const float d[3] = { bbox_max[0] - bbox_min[0], bbox_max[1] - bbox_min[1], bbox_max[2] - bbox_min[2] };
+    return d[0] * d[1] + d[0] * d[2] + d[1] * d[2];
+}
+
+// Copies nodes adding offsets to child and primitive indices (offsets can 'wrap' to move data backwards),
+// overlapping is allowed if destination is placed before source
+void CopyNodes(const bvh_node_t *src, uint32_t node_count, uint32_t node_offset, uint32_t prim_offset, bvh_node_t *dst) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        bvh_node_t n = src[i];
+
+        if (n.prim_index & LEAF_NODE_BIT) {
+            n.prim_index += prim_offset;
+        } else {
+            n.left_child += node_offset;
+            // separation axis bits are not touched as long as index fits
+            n.right_child += node_offset;
+        }
+#ifdef USE_STACKLESS_BVH_TRAVERSAL
+        if (n.parent != 0xffffffff) n.parent += node_offset;
+#endif
+        dst[i] = n;
+    }
+}
+
+void CopyNodes(const mbvh_node_t *src, uint32_t node_count, uint32_t node_offset, uint32_t prim_offset, mbvh_node_t *dst) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        mbvh_node_t n = src[i];
+
+        if (n.child[0] & LEAF_NODE_BIT) {
+            n.child[0] += prim_offset;
+        } else {
+            for (int j = 0; j < 8; j++) {
+                if (n.child[j] != 0x7fffffff) n.child[j] += node_offset;
+            }
+        }
+
+        dst[i] = n;
+    }
+}
+
+void CopyNodes(const cmbvh_node_t *src, uint32_t node_count, uint32_t node_offset, uint32_t prim_offset, cmbvh_node_t *dst) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        cmbvh_node_t n = src[i];
+
+        if (n.child[0] & LEAF_NODE_BIT) {
+            n.child[0] += prim_offset;
+        } else {
+            for (int j = 0; j < 8; j++) {
+                if (n.child[j] != 0x7fffffff) n.child[j] += node_offset;
+            }
+        }
+
+        dst[i] = n;
+    }
+}
+
+// scalar scene state stored in cache
+struct scene_params_t {
+    environment_t env;
+    uint32_t macro_nodes_root, macro_nodes_count;
+    float macro_nodes_build_cost;
+    uint32_t light_nodes_root;
+    uint32_t default_normals_texture, default_env_texture;
+    uint32_t cam_first_free, current_cam;
+    uint32_t allocator_state_sizes[5];
+};
+
+struct range_ref_t {
+    uint32_t offset, count, owner;
+};
+
+// Closes gaps between ranges, move_range is called for each range that changes its position
+template <typename F>
+uint32_t CompactRanges(std::vector<range_ref_t> &ranges, F &&move_range) {
+    std::sort(ranges.begin(), ranges.end(), [](const range_ref_t &r1, const range_ref_t &r2) {
+        return r1.offset < r2.offset;
+    });
+
+    uint32_t offset = 0;
+    for (const range_ref_t &r : ranges) {
+        if (r.offset != offset) {
+            move_range(r, offset);
+        }
+        offset += r.count;
+    }
+    return offset;
+}
+
+// Cache header flags, cache can be loaded only by scene with the same tree layout
+uint32_t GetCacheFlags(bool use_wide_bvh, bool use_compressed_bvh) {
+    return (use_wide_bvh ? uint32_t(SceneCache::UseWideBVH) : 0u) | (use_compressed_bvh ? uint32_t(SceneCache::UseCompressedBVH) : 0u);
+}
+}
+}
+
+Ray::Ref::Scene::Scene(bool use_wide_bvh, bool use_compressed_bvh, bool use_tex_compression, std::shared_ptr<TaskScheduler> scheduler)
+    : use_wide_bvh_(use_wide_bvh), use_compressed_bvh_(use_wide_bvh && use_compressed_bvh), use_tex_compression_(use_tex_compression), texture_atlas_(TEXTURE_ATLAS_SIZE, TEXTURE_ATLAS_SIZE), scheduler_(std::move(scheduler)) {
     {   // add default environment map (white)
         static const pixel_color8_t default_env_map = { 255, 255, 255, 128 };
 
@@ -14,6 +121,7 @@ Ray::Ref::Scene::Scene(bool use_wide_bvh) : use_wide_bvh_(use_wide_bvh), texture
         t.w = 1;
         t.h = 1;
         t.generate_mipmaps = false;
+        t.allow_compression = false;
 
         default_env_texture_ = AddTexture(t);
 
@@ -35,6 +143,7 @@ Ray::Ref::Scene::Scene(bool use_wide_bvh) : use_wide_bvh_(use_wide_bvh), texture
         t.w = 1;
         t.h = 1;
         t.generate_mipmaps = false;
+        t.allow_compression = false;
 
         default_normals_texture_ = AddTexture(t);
 
@@ -60,9 +169,29 @@ void Ray::Ref::Scene::SetEnvironment(const environment_desc_t &env) {
 }
 
 uint32_t Ray::Ref::Scene::AddTexture(const tex_desc_t &_t) {
-    uint32_t tex_index = (uint32_t)textures_.size();
+    prepared_texture_t tex;
+    PrepareTexture(_t, tex);
+    return CommitTexture(tex);
+}
+
+void Ray::Ref::Scene::AddTextures(const tex_desc_t *t, size_t count, uint32_t *out_indices) {
+    std::unique_ptr<prepared_texture_t[]> textures(new prepared_texture_t[count]);
+
+    auto prepare = [&](int i) { PrepareTexture(t[i], textures[i]); };
+    if (scheduler_) {
+        scheduler_->ParallelFor(0, (int)count, prepare);
+    } else {
+        for (int i = 0; i < (int)count; i++) prepare(i);
+    }
 
-    texture_t t;
+    for (size_t i = 0; i < count; i++) {
+        out_indices[i] = CommitTexture(textures[i]);
+        textures[i] = {};
+    }
+}
+
+void Ray::Ref::Scene::PrepareTexture(const tex_desc_t &_t, prepared_texture_t &tex) const {
+    texture_t &t = tex.t;
     t.width = (uint16_t)_t.w;
     t.height = (uint16_t)_t.h;
 
@@ -70,17 +199,63 @@ uint32_t Ray::Ref::Scene::AddTexture(const tex_desc_t &_t) {
         t.width |= TEXTURE_SRGB_BIT;
     }
 
-    int mip = 0;
-    int res[2] = { _t.w, _t.h };
+    // whole mip chain is generated into one buffer, each level is filtered from the previous one
+    tex.mip_count = 1;
+    tex.mip_res[0][0] = _t.w;
+    tex.mip_res[0][1] = _t.h;
+    tex.mip_data[0] = _t.data;
+
+    size_t mip_offset[NUM_MIP_LEVELS] = { 0 }, mip_chain_size = 0;
+
+    if (_t.generate_mipmaps) {
+        int &mip_count = tex.mip_count;
+        while (mip_count < NUM_MIP_LEVELS && tex.mip_res[mip_count - 1][0] > 1 && tex.mip_res[mip_count - 1][1] > 1) {
+            tex.mip_res[mip_count][0] = tex.mip_res[mip_count - 1][0] / 2;
+            tex.mip_res[mip_count][1] = tex.mip_res[mip_count - 1][1] / 2;
+            mip_offset[mip_count] = mip_chain_size;
+            mip_chain_size += tex.mip_res[mip_count][0] * tex.mip_res[mip_count][1];
+            mip_count++;
+        }
+    }
+
+    tex.mip_chain.reset(new pixel_color8_t[mip_chain_size]);
 
-    std::vector<pixel_color8_t> tex_data(_t.data, _t.data + _t.w * _t.h);
+    for (int mip = 1; mip < tex.mip_count; mip++) {
+        const pixel_color8_t *src = tex.mip_data[mip - 1];
+        pixel_color8_t *dst = &tex.mip_chain[mip_offset[mip]];
+        tex.mip_data[mip] = dst;
 
-    while (res[0] >= 1 && res[1] >= 1) {
+        // large levels are split between threads by blocks of rows
+        const int RowsPerTask = 16;
+        const int rows_count = tex.mip_res[mip][1], tasks_count = (rows_count + RowsPerTask - 1) / RowsPerTask;
+        if (scheduler_ && tasks_count > 1 && tex.mip_res[mip][0] * RowsPerTask >= 4096) {
+            scheduler_->ParallelFor(0, tasks_count, [&](int i) {
+                DownsampleTexture(src, tex.mip_res[mip - 1], _t.is_srgb, dst, i * RowsPerTask, std::min((i + 1) * RowsPerTask, rows_count));
+            });
+        } else {
+            DownsampleTexture(src, tex.mip_res[mip - 1], _t.is_srgb, dst, 0, rows_count);
+        }
+    }
+
+    tex.compressed = use_tex_compression_ && _t.allow_compression;
+    if (tex.compressed) {
+        for (int mip = 0; mip < tex.mip_count; mip++) {
+            TextureAtlas::EncodeBlocks(tex.mip_data[mip], tex.mip_res[mip], tex.mip_blocks[mip]);
+        }
+    }
+}
+
+uint32_t Ray::Ref::Scene::CommitTexture(prepared_texture_t &tex) {
+    texture_t &t = tex.t;
+
+    int mip = 0;
+    for (; mip < tex.mip_count; mip++) {
         int pos[2];
-        int page = texture_atlas_.Allocate(&tex_data[0], res, pos);
+        int page = tex.compressed ? texture_atlas_.AllocateEncoded(&tex.mip_blocks[mip][0], tex.mip_res[mip], pos)
+                                  : texture_atlas_.Allocate(tex.mip_data[mip], tex.mip_res[mip], pos);
         if (page == -1) {
             // release allocated mip levels on fail
-            for (int i = mip; i >= 0; i--) {
+            for (int i = mip - 1; i >= 0; i--) {
                 int _pos[2] = { t.pos[i][0], t.pos[i][1] };
                 texture_atlas_.Free(t.page[i], _pos);
             }
@@ -90,17 +265,6 @@ uint32_t Ray::Ref::Scene::AddTexture(const tex_desc_t &_t) {
         t.page[mip] = (uint8_t)page;
         t.pos[mip][0] = (uint16_t)pos[0];
         t.pos[mip][1] = (uint16_t)pos[1];
-
-        mip++;
-
-        if (_t.generate_mipmaps) {
-            tex_data = Ref::DownsampleTexture(tex_data, res);
-
-            res[0] /= 2;
-            res[1] /= 2;
-        } else {
-            break;
-        }
     }
 
     // fill remaining mip levels with the last one
@@ -112,7 +276,7 @@ uint32_t Ray::Ref::Scene::AddTexture(const tex_desc_t &_t) {
 
     textures_.push_back(t);
 
-    return tex_index;
+    return (uint32_t)(textures_.size() - 1);
 }
 
 uint32_t Ray::Ref::Scene::AddMaterial(const mat_desc_t &m) {
@@ -154,32 +318,127 @@ uint32_t Ray::Ref::Scene::AddMaterial(const mat_desc_t &m) {
 }
 
 uint32_t Ray::Ref::Scene::AddMesh(const mesh_desc_t &_m) {
-    meshes_.emplace_back();
-    mesh_t &m = meshes_.back();
-    
-    const uint32_t tris_start = (uint32_t)tris_.size();
-    //const uint32_t tri_index_start = (uint32_t)tri_indices_.size();
+    prepared_mesh_t mesh;
+    PrepareMesh(_m, mesh);
+    return CommitMesh(_m, mesh);
+}
+
+void Ray::Ref::Scene::AddMeshes(const mesh_desc_t *m, size_t count, uint32_t *out_indices) {
+    std::unique_ptr<prepared_mesh_t[]> meshes(new prepared_mesh_t[count]);
+
+    auto prepare = [&](int i) { PrepareMesh(m[i], meshes[i]); };
+    if (scheduler_) {
+        scheduler_->ParallelFor(0, (int)count, prepare);
+    } else {
+        for (int i = 0; i < (int)count; i++) prepare(i);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        out_indices[i] = CommitMesh(m[i], meshes[i]);
+        meshes[i] = {};
+    }
+}
 
+void Ray::Ref::Scene::PrepareMesh(const mesh_desc_t &_m, prepared_mesh_t &mesh) const {
     bvh_settings_t s;
     s.node_traversal_cost = 0.025f;
     s.oversplit_threshold = 0.95f;
     s.allow_spatial_splits = _m.allow_spatial_splits;
     s.use_fast_bvh_build = _m.use_fast_bvh_build;
+    s.bins_count = _m.bvh_bins_count;
+
+    const auto time_start = std::chrono::high_resolution_clock::now();
 
-    m.node_index = (uint32_t)nodes_.size();
-    m.node_count = PreprocessMesh(_m.vtx_attrs, _m.vtx_indices, _m.vtx_indices_count, _m.layout, _m.base_vertex, s, nodes_, tris_, tri_indices_);
+    // mesh is built in separate arrays and then placed into free ranges of scene storage
+    PreprocessMesh(_m.vtx_attrs, _m.vtx_indices, _m.vtx_indices_count, _m.layout, _m.base_vertex, s, mesh.nodes, mesh.tris, mesh.tri_indices, scheduler_.get());
 
     if (use_wide_bvh_) {
-        uint32_t before_count = (uint32_t)mnodes_.size();
-        uint32_t new_root = FlattenBVH_Recursive(nodes_.data(), m.node_index, 0xffffffff, mnodes_);
+        FlattenBVH_Recursive(mesh.nodes.data(), 0, 0xffffffff, mesh.mnodes);
+
+        if (use_compressed_bvh_) {
+            mesh.cmnodes.resize(mesh.mnodes.size());
+            CompressBVH(mesh.mnodes.data(), (uint32_t)mesh.mnodes.size(), mesh.cmnodes.data());
+        }
+    }
+
+    mesh.time_bvh_build_us = (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+
+    mesh.vtx_indices.reserve(_m.vtx_indices_count);
+    for (size_t i = 0; i < _m.vtx_indices_count; i++) {
+        mesh.vtx_indices.push_back(_m.vtx_indices[i] + _m.base_vertex);
+    }
+
+    size_t stride = AttrStrides[_m.layout];
+
+    // add attributes
+    std::vector<vertex_t> &new_vertices = mesh.vertices;
+    new_vertices.resize(_m.vtx_attrs_count);
+    for (size_t i = 0; i < _m.vtx_attrs_count; i++) {
+        vertex_t &v = new_vertices[i];
+
+        memcpy(&v.p[0], (_m.vtx_attrs + i * stride), 3 * sizeof(float));
+        memcpy(&v.n[0], (_m.vtx_attrs + i * stride + 3), 3 * sizeof(float));
+        
+        if (_m.layout == PxyzNxyzTuv) {
+            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 6), 2 * sizeof(float));
+            v.t[1][0] = v.t[1][1] = 0.0f;
+            v.b[0] = v.b[1] = v.b[2] = 0.0f;
+        } else if (_m.layout == PxyzNxyzTuvTuv) {
+            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 6), 2 * sizeof(float));
+            memcpy(&v.t[1][0], (_m.vtx_attrs + i * stride + 8), 2 * sizeof(float));
+            v.b[0] = v.b[1] = v.b[2] = 0.0f;
+        } else if (_m.layout == PxyzNxyzBxyzTuv) {
+            memcpy(&v.b[0], (_m.vtx_attrs + i * stride + 6), 3 * sizeof(float));
+            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 9), 2 * sizeof(float));
+            v.t[1][0] = v.t[1][1] = 0.0f;
+        } else if (_m.layout == PxyzNxyzBxyzTuvTuv) {
+            memcpy(&v.b[0], (_m.vtx_attrs + i * stride + 6), 3 * sizeof(float));
+            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 9), 2 * sizeof(float));
+            memcpy(&v.t[1][0], (_m.vtx_attrs + i * stride + 11), 2 * sizeof(float));
+        }
+    }
+
+    if (_m.layout == PxyzNxyzTuv || _m.layout == PxyzNxyzTuvTuv) {
+        ComputeTangentBasis(0, 0, new_vertices, mesh.vtx_indices, &mesh.vtx_indices[0], mesh.vtx_indices.size());
+    }
+}
+
+uint32_t Ray::Ref::Scene::CommitMesh(const mesh_desc_t &_m, prepared_mesh_t &mesh) {
+    meshes_.emplace_back();
+    mesh_t &m = meshes_.back();
+
+    mesh_ranges_.emplace_back();
+    mesh_ranges_t &mr = mesh_ranges_.back();
+
+    const std::vector<tri_accel_t> &new_tris = mesh.tris;
+    const std::vector<uint32_t> &new_tri_indices = mesh.tri_indices;
 
-        m.node_index = new_root;
-        m.node_count = (uint32_t)(mnodes_.size() - before_count);
+    m.tris_index = tris_alloc_.Alloc((uint32_t)new_tris.size());
+    m.tris_count = (uint32_t)new_tris.size();
+    tris_.resize(tris_alloc_.size());
+    std::copy(new_tris.begin(), new_tris.end(), tris_.begin() + m.tris_index);
 
-        // nodes_ is treated as temporary storage
-        nodes_.clear();
+    mr.tri_indices_index = tri_indices_alloc_.Alloc((uint32_t)new_tri_indices.size());
+    mr.tri_indices_count = (uint32_t)new_tri_indices.size();
+    tri_indices_.resize(tri_indices_alloc_.size());
+    for (uint32_t i = 0; i < mr.tri_indices_count; i++) {
+        tri_indices_[mr.tri_indices_index + i] = new_tri_indices[i] + m.tris_index;
     }
 
+    if (use_wide_bvh_) {
+        if (use_compressed_bvh_) {
+            m.node_index = AddNodes(mesh.cmnodes.data(), (uint32_t)mesh.cmnodes.size(), mr.tri_indices_index);
+        } else {
+            m.node_index = AddNodes(mesh.mnodes.data(), (uint32_t)mesh.mnodes.size(), mr.tri_indices_index);
+        }
+        m.node_count = (uint32_t)mesh.mnodes.size();
+    } else {
+        m.node_index = AddNodes(mesh.nodes.data(), (uint32_t)mesh.nodes.size(), mr.tri_indices_index);
+        m.node_count = (uint32_t)mesh.nodes.size();
+    }
+
+    stats_.time_bvh_build_us += mesh.time_bvh_build_us;
+
     // init triangle materials
     for (const shape_desc_t &s : _m.shapes) {
         bool is_solid = true;
@@ -201,7 +460,7 @@ uint32_t Ray::Ref::Scene::AddMesh(const mesh_desc_t &_m) {
         }
 
         for (size_t i = s.vtx_start; i < s.vtx_start + s.vtx_count; i += 3) {
-            tri_accel_t &tri = tris_[tris_start + i / 3];
+            tri_accel_t &tri = tris_[m.tris_index + i / 3];
 
             if (is_solid) {
                 tri.ci = (tri.ci | uint32_t(TRI_SOLID_BIT));
@@ -214,56 +473,29 @@ uint32_t Ray::Ref::Scene::AddMesh(const mesh_desc_t &_m) {
         }
     }
 
-    m.tris_index = tris_start;
-    m.tris_count = (uint32_t)tris_.size() - tris_start;
+    const std::vector<vertex_t> &new_vertices = mesh.vertices;
+    const std::vector<uint32_t> &new_vtx_indices = mesh.vtx_indices;
 
-    std::vector<uint32_t> new_vtx_indices;
-    new_vtx_indices.reserve(_m.vtx_indices_count);
-    for (size_t i = 0; i < _m.vtx_indices_count; i++) {
-        new_vtx_indices.push_back(_m.vtx_indices[i] + _m.base_vertex + (uint32_t)vertices_.size());
-    }
-
-    size_t stride = AttrStrides[_m.layout];
+    mr.vtx_index = vertices_alloc_.Alloc((uint32_t)new_vertices.size());
+    mr.vtx_count = (uint32_t)new_vertices.size();
+    vertices_.resize(vertices_alloc_.size());
+    std::copy(new_vertices.begin(), new_vertices.end(), vertices_.begin() + mr.vtx_index);
 
-    // add attributes
-    size_t new_vertices_start = vertices_.size();
-    vertices_.resize(new_vertices_start + _m.vtx_attrs_count);
-    for (size_t i = 0; i < _m.vtx_attrs_count; i++) {
-        vertex_t &v = vertices_[new_vertices_start + i];
-
-        memcpy(&v.p[0], (_m.vtx_attrs + i * stride), 3 * sizeof(float));
-        memcpy(&v.n[0], (_m.vtx_attrs + i * stride + 3), 3 * sizeof(float));
-        
-        if (_m.layout == PxyzNxyzTuv) {
-            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 6), 2 * sizeof(float));
-            v.t[1][0] = v.t[1][1] = 0.0f;
-            v.b[0] = v.b[1] = v.b[2] = 0.0f;
-        } else if (_m.layout == PxyzNxyzTuvTuv) {
-            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 6), 2 * sizeof(float));
-            memcpy(&v.t[1][0], (_m.vtx_attrs + i * stride + 8), 2 * sizeof(float));
-            v.b[0] = v.b[1] = v.b[2] = 0.0f;
-        } else if (_m.layout == PxyzNxyzBxyzTuv) {
-            memcpy(&v.b[0], (_m.vtx_attrs + i * stride + 6), 3 * sizeof(float));
-            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 9), 2 * sizeof(float));
-            v.t[1][0] = v.t[1][1] = 0.0f;
-        } else if (_m.layout == PxyzNxyzBxyzTuvTuv) {
-            memcpy(&v.b[0], (_m.vtx_attrs + i * stride + 6), 3 * sizeof(float));
-            memcpy(&v.t[0][0], (_m.vtx_attrs + i * stride + 9), 2 * sizeof(float));
-            memcpy(&v.t[1][0], (_m.vtx_attrs + i * stride + 11), 2 * sizeof(float));
-        }
+    // vertex indices are stored per triangle
+    vtx_indices_.resize(3 * size_t(tris_alloc_.size()));
+    for (size_t i = 0; i < new_vtx_indices.size(); i++) {
+        vtx_indices_[3 * size_t(m.tris_index) + i] = new_vtx_indices[i] + mr.vtx_index;
     }
 
-    if (_m.layout == PxyzNxyzTuv || _m.layout == PxyzNxyzTuvTuv) {
-        ComputeTangentBasis(0, new_vertices_start, vertices_, new_vtx_indices, &new_vtx_indices[0], new_vtx_indices.size());
-    }
-
-    vtx_indices_.insert(vtx_indices_.end(), new_vtx_indices.begin(), new_vtx_indices.end());
-
     return (uint32_t)(meshes_.size() - 1);
 }
 
 void Ray::Ref::Scene::RemoveMesh(uint32_t i) {
     const mesh_t &m = meshes_[i];
+    const mesh_ranges_t &mr = mesh_ranges_[i];
+
+    // freed triangles can be reused by another mesh
+    tri_bins_.clear();
 
     uint32_t node_index = m.node_index,
              node_count = m.node_count;
@@ -271,31 +503,42 @@ void Ray::Ref::Scene::RemoveMesh(uint32_t i) {
     uint32_t tris_index = m.tris_index,
              tris_count = m.tris_count;
 
+    tri_indices_alloc_.Free(mr.tri_indices_index, mr.tri_indices_count);
+    tri_indices_.resize(tri_indices_alloc_.size());
+
+    vertices_alloc_.Free(mr.vtx_index, mr.vtx_count);
+    vertices_.resize(vertices_alloc_.size());
+
     auto last_mesh_index = static_cast<uint32_t>(meshes_.size() - 1);
 
     std::swap(meshes_[i], meshes_[last_mesh_index]);
+    std::swap(mesh_ranges_[i], mesh_ranges_[last_mesh_index]);
 
     meshes_.pop_back();
+    mesh_ranges_.pop_back();
 
     bool rebuild_needed = false;
 
     for (auto it = mesh_instances_.begin(); it != mesh_instances_.end(); ) {
         mesh_instance_t &mi = *it;
 
-        if (mi.mesh_index == last_mesh_index) {
-            mi.mesh_index = i;
-        }
-
         if (mi.mesh_index == i) {
             it = mesh_instances_.erase(it);
             rebuild_needed = true;
         } else {
+            if (mi.mesh_index == last_mesh_index) {
+                mi.mesh_index = i;
+            }
             ++it;
         }
     }
 
     RemoveTris(tris_index, tris_count);
-    RemoveNodes(node_index, node_count);
+    if (use_compressed_bvh_) {
+        RemoveMeshNodes(node_index, node_count);
+    } else {
+        RemoveNodes(node_index, node_count);
+    }
 
     if (rebuild_needed) {
         RebuildMacroBVH();
@@ -379,6 +622,25 @@ void Ray::Ref::Scene::SetMeshInstanceTransform(uint32_t mi_index, const float *x
     if (!use_wide_bvh_) {
         const bvh_node_t &n = nodes_[m.node_index];
         TransformBoundingBox(n.bbox_min, n.bbox_max, xform, mi.bbox_min, mi.bbox_max);
+    } else if (use_compressed_bvh_) {
+        const cmbvh_node_t &n = cmnodes_[m.node_index];
+
+        float bbox_min[3] = { MAX_DIST, MAX_DIST, MAX_DIST },
+              bbox_max[3] = { -MAX_DIST, -MAX_DIST, -MAX_DIST };
+
+        for (int i = 0; i < 8; i++) {
+            if (!(n.child_mask & (1u << i))) continue;
+
+            float ch_min[3], ch_max[3];
+            DecompressBBox(n, i, ch_min, ch_max);
+
+            for (int j = 0; j < 3; j++) {
+                bbox_min[j] = std::min(bbox_min[j], ch_min[j]);
+                bbox_max[j] = std::max(bbox_max[j], ch_max[j]);
+            }
+        }
+
+        TransformBoundingBox(bbox_min, bbox_max, xform, mi.bbox_min, mi.bbox_max);
     } else {
         const mbvh_node_t &n = mnodes_[m.node_index];
 
@@ -410,7 +672,20 @@ void Ray::Ref::Scene::SetMeshInstanceTransform(uint32_t mi_index, const float *x
         TransformBoundingBox(bbox_min, bbox_max, xform, mi.bbox_min, mi.bbox_max);
     }
 
-    RebuildMacroBVH();
+    if (macro_nodes_root_ != 0xffffffff && mi_indices_.size() == mesh_instances_.size()) {
+        // instance is already in the tree, only bounds need to be updated
+        const auto time_start = std::chrono::high_resolution_clock::now();
+
+        const float cost = RefitMacroBVH();
+
+        stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+
+        if (cost > macro_nodes_build_cost_ * MacroBVHRebuildThreshold) {
+            RebuildMacroBVH();
+        }
+    } else {
+        RebuildMacroBVH();
+    }
 }
 
 void Ray::Ref::Scene::RemoveMeshInstance(uint32_t i) {
@@ -419,76 +694,334 @@ void Ray::Ref::Scene::RemoveMeshInstance(uint32_t i) {
     RebuildMacroBVH();
 }
 
+uint32_t Ray::Ref::Scene::AddNodes(const bvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset) {
+    const uint32_t node_index = nodes_alloc_.Alloc(node_count);
+    nodes_.resize(nodes_alloc_.size());
+
+    CopyNodes(nodes, node_count, node_index, prim_offset, &nodes_[node_index]);
+
+    return node_index;
+}
+
+uint32_t Ray::Ref::Scene::AddNodes(const mbvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset) {
+    const uint32_t node_index = nodes_alloc_.Alloc(node_count);
+    mnodes_.resize(nodes_alloc_.size());
+
+    CopyNodes(nodes, node_count, node_index, prim_offset, &mnodes_[node_index]);
+
+    return node_index;
+}
+
+uint32_t Ray::Ref::Scene::AddNodes(const cmbvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset) {
+    const uint32_t node_index = mesh_nodes_alloc_.Alloc(node_count);
+    cmnodes_.resize(mesh_nodes_alloc_.size());
+
+    CopyNodes(nodes, node_count, node_index, prim_offset, &cmnodes_[node_index]);
+
+    return node_index;
+}
+
 void Ray::Ref::Scene::RemoveTris(uint32_t tris_index, uint32_t tris_count) {
     if (!tris_count) return;
 
-    tris_.erase(std::next(tris_.begin(), tris_index),
-                std::next(tris_.begin(), tris_index + tris_count));
-
-    if (tris_index != tris_.size()) {
-        for (mesh_t &m : meshes_) {
-            if (m.tris_index > tris_index) {
-                m.tris_index -= tris_count;
-            }
-        }
-    }
+    tris_alloc_.Free(tris_index, tris_count);
+    tris_.resize(tris_alloc_.size());
+    vtx_indices_.resize(3 * size_t(tris_alloc_.size()));
 }
 
 void Ray::Ref::Scene::RemoveNodes(uint32_t node_index, uint32_t node_count) {
     if (!node_count) return;
 
+    nodes_alloc_.Free(node_index, node_count);
+
     if (!use_wide_bvh_) {
-        nodes_.erase(std::next(nodes_.begin(), node_index),
-                     std::next(nodes_.begin(), node_index + node_count));
+        nodes_.resize(nodes_alloc_.size());
     } else {
-        mnodes_.erase(std::next(mnodes_.begin(), node_index),
-                         std::next(mnodes_.begin(), node_index + node_count));
+        mnodes_.resize(nodes_alloc_.size());
     }
+}
+
+void Ray::Ref::Scene::RemoveMeshNodes(uint32_t node_index, uint32_t node_count) {
+    if (!node_count) return;
 
-    if ((!use_wide_bvh_ && node_index != nodes_.size()) || (use_wide_bvh_ && node_index != mnodes_.size())) {
-        for (mesh_t &m : meshes_) {
-            if (m.node_index > node_index) {
-                m.node_index -= node_count;
+    mesh_nodes_alloc_.Free(node_index, node_count);
+    cmnodes_.resize(mesh_nodes_alloc_.size());
+}
+
+void Ray::Ref::Scene::Compact() {
+    const auto mesh_count = (uint32_t)meshes_.size();
+
+    // bins keep absolute triangle indices
+    tri_bins_.clear();
+
+    std::vector<range_ref_t> ranges;
+
+    {   // vertices
+        for (uint32_t i = 0; i < mesh_count; i++) {
+            ranges.push_back({ mesh_ranges_[i].vtx_index, mesh_ranges_[i].vtx_count, i });
+        }
+
+        const uint32_t total = CompactRanges(ranges, [this](const range_ref_t &r, uint32_t new_offset) {
+            const mesh_t &m = meshes_[r.owner];
+            mesh_ranges_t &mr = mesh_ranges_[r.owner];
+
+            std::copy(vertices_.begin() + r.offset, vertices_.begin() + r.offset + r.count, vertices_.begin() + new_offset);
+            for (size_t i = 3 * size_t(m.tris_index); i < 3 * size_t(m.tris_index + m.tris_count); i++) {
+                vtx_indices_[i] -= (r.offset - new_offset);
             }
+            mr.vtx_index = new_offset;
+        });
+
+        vertices_alloc_.Clear();
+        vertices_alloc_.Alloc(total);
+        vertices_.resize(total);
+        ranges.clear();
+    }
+
+    {   // triangles (with vertex indices)
+        for (uint32_t i = 0; i < mesh_count; i++) {
+            ranges.push_back({ meshes_[i].tris_index, meshes_[i].tris_count, i });
         }
 
-        for (uint32_t i = node_index; i < nodes_.size(); i++) {
-            bvh_node_t &n = nodes_[i];
+        const uint32_t total = CompactRanges(ranges, [this](const range_ref_t &r, uint32_t new_offset) {
+            mesh_t &m = meshes_[r.owner];
+            const mesh_ranges_t &mr = mesh_ranges_[r.owner];
 
-#ifdef USE_STACKLESS_BVH_TRAVERSAL
-            if (n.parent != 0xffffffff && n.parent > node_index) n.parent -= node_count;
-#endif
-            if ((n.prim_index & LEAF_NODE_BIT) == 0) {
-                if (n.left_child > node_index) n.left_child -= node_count;
-                if ((n.right_child & RIGHT_CHILD_BITS) > node_index) n.right_child -= node_count;
+            std::copy(tris_.begin() + r.offset, tris_.begin() + r.offset + r.count, tris_.begin() + new_offset);
+            std::copy(vtx_indices_.begin() + 3 * size_t(r.offset), vtx_indices_.begin() + 3 * size_t(r.offset + r.count),
+                      vtx_indices_.begin() + 3 * size_t(new_offset));
+            for (uint32_t i = mr.tri_indices_index; i < mr.tri_indices_index + mr.tri_indices_count; i++) {
+                tri_indices_[i] -= (r.offset - new_offset);
             }
+            m.tris_index = new_offset;
+        });
+
+        tris_alloc_.Clear();
+        tris_alloc_.Alloc(total);
+        tris_.resize(total);
+        vtx_indices_.resize(3 * size_t(total));
+        ranges.clear();
+    }
+
+    // leaf nodes are updated together with other node indices below
+    std::vector<uint32_t> prim_offsets(mesh_count + 1, 0);
+
+    {   // triangle indices
+        for (uint32_t i = 0; i < mesh_count; i++) {
+            ranges.push_back({ mesh_ranges_[i].tri_indices_index, mesh_ranges_[i].tri_indices_count, i });
         }
 
-        for (uint32_t i = node_index; i < mnodes_.size(); i++) {
-            mbvh_node_t &n = mnodes_[i];
-
-            if ((n.child[0] & LEAF_NODE_BIT) == 0) {
-                if (n.child[0] > node_index) n.child[0] -= node_count;
-                if (n.child[1] > node_index) n.child[1] -= node_count;
-                if (n.child[2] > node_index) n.child[2] -= node_count;
-                if (n.child[3] > node_index) n.child[3] -= node_count;
-                if (n.child[4] > node_index) n.child[4] -= node_count;
-                if (n.child[5] > node_index) n.child[5] -= node_count;
-                if (n.child[6] > node_index) n.child[6] -= node_count;
-                if (n.child[7] > node_index) n.child[7] -= node_count;
+        const uint32_t total = CompactRanges(ranges, [this, &prim_offsets](const range_ref_t &r, uint32_t new_offset) {
+            std::copy(tri_indices_.begin() + r.offset, tri_indices_.begin() + r.offset + r.count, tri_indices_.begin() + new_offset);
+            prim_offsets[r.owner] = new_offset - r.offset;
+            mesh_ranges_[r.owner].tri_indices_index = new_offset;
+        });
+
+        tri_indices_alloc_.Clear();
+        tri_indices_alloc_.Alloc(total);
+        tri_indices_.resize(total);
+        ranges.clear();
+    }
+
+    if (use_compressed_bvh_) {   // compressed nodes of mesh trees
+        for (uint32_t i = 0; i < mesh_count; i++) {
+            ranges.push_back({ meshes_[i].node_index, meshes_[i].node_count, i });
+        }
+
+        const uint32_t total = CompactRanges(ranges, [this](const range_ref_t &r, uint32_t new_offset) {
+            meshes_[r.owner].node_index = new_offset;
+        });
+
+        for (const range_ref_t &r : ranges) {
+            const uint32_t new_offset = meshes_[r.owner].node_index;
+            const uint32_t node_offset = new_offset - r.offset, prim_offset = prim_offsets[r.owner];
+            if (!node_offset && !prim_offset) continue;
+
+            CopyNodes(&cmnodes_[r.offset], r.count, node_offset, prim_offset, &cmnodes_[new_offset]);
+        }
+
+        mesh_nodes_alloc_.Clear();
+        mesh_nodes_alloc_.Alloc(total);
+        cmnodes_.resize(total);
+        ranges.clear();
+    }
+
+    {   // nodes of mesh (if not compressed), and macro tree
+        if (!use_compressed_bvh_) {
+            for (uint32_t i = 0; i < mesh_count; i++) {
+                ranges.push_back({ meshes_[i].node_index, meshes_[i].node_count, i });
             }
         }
+        ranges.push_back({ macro_nodes_root_, macro_nodes_count_, mesh_count });
+
+        // empty trees do not occupy storage
+        ranges.erase(std::remove_if(ranges.begin(), ranges.end(), [](const range_ref_t &r) { return r.count == 0; }), ranges.end());
 
-        if (macro_nodes_root_ > node_index) {
-            macro_nodes_root_ -= node_count;
+        const uint32_t total = CompactRanges(ranges, [this, mesh_count](const range_ref_t &r, uint32_t new_offset) {
+            if (r.owner < mesh_count) {
+                meshes_[r.owner].node_index = new_offset;
+            } else {
+                macro_nodes_root_ = new_offset;
+            }
+        });
+
+        for (const range_ref_t &r : ranges) {
+            const uint32_t new_offset = (r.owner < mesh_count) ? meshes_[r.owner].node_index : macro_nodes_root_;
+            const uint32_t node_offset = new_offset - r.offset, prim_offset = prim_offsets[r.owner];
+            if (!node_offset && !prim_offset) continue;
+
+            // ranges are processed in order of increasing offset, so data is never overwritten before it is moved
+            if (!use_wide_bvh_) {
+                CopyNodes(&nodes_[r.offset], r.count, node_offset, prim_offset, &nodes_[new_offset]);
+            } else {
+                CopyNodes(&mnodes_[r.offset], r.count, node_offset, prim_offset, &mnodes_[new_offset]);
+            }
         }
 
-        if (light_nodes_root_ > node_index) {
-            light_nodes_root_ -= node_count;
+        nodes_alloc_.Clear();
+        nodes_alloc_.Alloc(total);
+        if (!use_wide_bvh_) {
+            nodes_.resize(total);
+        } else {
+            mnodes_.resize(total);
         }
     }
 }
 
+bool Ray::Ref::Scene::SaveCache(const char *file_name) {
+    using namespace SceneCache;
+
+    Writer w;
+
+    RangeAllocator *allocators[] = { &nodes_alloc_, &mesh_nodes_alloc_, &tris_alloc_, &tri_indices_alloc_, &vertices_alloc_ };
+    std::vector<uint32_t> allocators_state, temp_state;
+
+    auto *params = w.AddOwnedChunk<scene_params_t>(ChSceneParams, 1);
+    params->env = env_;
+    params->macro_nodes_root = macro_nodes_root_;
+    params->macro_nodes_count = macro_nodes_count_;
+    params->macro_nodes_build_cost = macro_nodes_build_cost_;
+    params->light_nodes_root = light_nodes_root_;
+    params->default_normals_texture = default_normals_texture_;
+    params->default_env_texture = default_env_texture_;
+    params->cam_first_free = cam_first_free_;
+    params->current_cam = current_cam_;
+    for (int i = 0; i < 5; i++) {
+        allocators[i]->GetState(temp_state);
+        params->allocator_state_sizes[i] = (uint32_t)temp_state.size();
+        allocators_state.insert(allocators_state.end(), temp_state.begin(), temp_state.end());
+    }
+
+    w.AddChunk(ChNodes, nodes_);
+    w.AddChunk(ChMeshNodes, mnodes_);
+    w.AddChunk(ChCompressedMeshNodes, cmnodes_);
+    w.AddChunk(ChTris, tris_);
+    w.AddChunk(ChTriIndices, tri_indices_);
+    w.AddChunk(ChTransforms, transforms_);
+    w.AddChunk(ChMeshes, meshes_);
+    w.AddChunk(ChMeshInstances, mesh_instances_);
+    w.AddChunk(ChMiIndices, mi_indices_);
+    w.AddChunk(ChVertices, vertices_);
+    w.AddChunk(ChVtxIndices, vtx_indices_);
+    w.AddChunk(ChMeshRanges, mesh_ranges_);
+    w.AddChunk(ChAllocators, allocators_state);
+    w.AddChunk(ChMaterials, materials_);
+    w.AddChunk(ChTextures, textures_);
+    w.AddChunk(ChLights, lights_);
+    w.AddChunk(ChLiIndices, li_indices_);
+    w.AddChunk(ChLightNodes, light_nodes_);
+    w.AddChunk(ChCameras, cams_);
+
+    texture_atlas_.Save(w);
+
+    header_t header = {};
+    header.magic = FileMagic;
+    header.version = FileVersion;
+    header.flags = GetCacheFlags(use_wide_bvh_, use_compressed_bvh_);
+
+    return w.Write(file_name, header);
+}
+
+bool Ray::Ref::Scene::LoadCache(const char *file_name) {
+    using namespace SceneCache;
+
+    Reader r;
+    if (!r.Open(file_name)) return false;
+
+    // tree layout is chosen by renderer, cache made for another layout is useless
+    if (r.header().flags != GetCacheFlags(use_wide_bvh_, use_compressed_bvh_)) return false;
+
+    size_t count;
+    const auto *params = r.GetChunk<scene_params_t>(ChSceneParams, count);
+    if (!params || count != 1) return false;
+
+    const uint32_t *allocators_state = r.GetChunk<uint32_t>(ChAllocators, count);
+    if (!allocators_state) return false;
+
+    // everything that can fail is checked before scene is touched
+    RangeAllocator allocators[5];
+    for (int i = 0; i < 5; i++) {
+        const uint32_t state_size = params->allocator_state_sizes[i];
+        if (state_size > count || !allocators[i].SetState(allocators_state, state_size)) return false;
+        allocators_state += state_size;
+        count -= state_size;
+    }
+
+    const uint32_t array_chunks[] = { ChNodes, ChMeshNodes, ChCompressedMeshNodes, ChTris, ChTriIndices, ChTransforms,
+                                      ChMeshes, ChMeshInstances, ChMiIndices, ChVertices, ChVtxIndices, ChMeshRanges,
+                                      ChMaterials, ChTextures, ChLights, ChLiIndices, ChLightNodes, ChCameras };
+    const size_t elem_sizes[] = { sizeof(bvh_node_t), sizeof(mbvh_node_t), sizeof(cmbvh_node_t), sizeof(tri_accel_t), sizeof(uint32_t), sizeof(transform_t),
+                                  sizeof(mesh_t), sizeof(mesh_instance_t), sizeof(uint32_t), sizeof(vertex_t), sizeof(uint32_t), sizeof(mesh_ranges_t),
+                                  sizeof(material_t), sizeof(texture_t), sizeof(light_t), sizeof(uint32_t), sizeof(light_node_t), sizeof(cam_storage_t) };
+    static_assert(sizeof(array_chunks) / sizeof(array_chunks[0]) == sizeof(elem_sizes) / sizeof(elem_sizes[0]), "!");
+
+    for (size_t i = 0; i < sizeof(array_chunks) / sizeof(array_chunks[0]); i++) {
+        if (!r.GetChunk(array_chunks[i], elem_sizes[i], count)) return false;
+    }
+
+    if (!texture_atlas_.Load(r)) return false;
+
+    r.ReadChunk(ChNodes, nodes_);
+    r.ReadChunk(ChMeshNodes, mnodes_);
+    r.ReadChunk(ChCompressedMeshNodes, cmnodes_);
+    r.ReadChunk(ChTris, tris_);
+    r.ReadChunk(ChTriIndices, tri_indices_);
+    r.ReadChunk(ChTransforms, transforms_);
+    r.ReadChunk(ChMeshes, meshes_);
+    r.ReadChunk(ChMeshInstances, mesh_instances_);
+    r.ReadChunk(ChMiIndices, mi_indices_);
+    r.ReadChunk(ChVertices, vertices_);
+    r.ReadChunk(ChVtxIndices, vtx_indices_);
+    r.ReadChunk(ChMeshRanges, mesh_ranges_);
+    r.ReadChunk(ChMaterials, materials_);
+    r.ReadChunk(ChTextures, textures_);
+    r.ReadChunk(ChLights, lights_);
+    r.ReadChunk(ChLiIndices, li_indices_);
+    r.ReadChunk(ChLightNodes, light_nodes_);
+    r.ReadChunk(ChCameras, cams_);
+
+    nodes_alloc_ = allocators[0];
+    mesh_nodes_alloc_ = allocators[1];
+    tris_alloc_ = allocators[2];
+    tri_indices_alloc_ = allocators[3];
+    vertices_alloc_ = allocators[4];
+
+    env_ = params->env;
+    macro_nodes_root_ = params->macro_nodes_root;
+    macro_nodes_count_ = params->macro_nodes_count;
+    macro_nodes_build_cost_ = params->macro_nodes_build_cost;
+    light_nodes_root_ = params->light_nodes_root;
+    default_normals_texture_ = params->default_normals_texture;
+    default_env_texture_ = params->default_env_texture;
+    cam_first_free_ = params->cam_first_free;
+    current_cam_ = params->current_cam;
+
+    // bins refer to old triangles, they will be rebuilt on demand
+    tri_bins_.clear();
+
+    return true;
+}
+
 void Ray::Ref::Scene::RebuildMacroBVH() {
     RemoveNodes(macro_nodes_root_, macro_nodes_count_);
     mi_indices_.clear();
@@ -500,88 +1033,154 @@ void Ray::Ref::Scene::RebuildMacroBVH() {
         primitives.push_back({ 0, 0, 0, Ref::simd_fvec3{ mi.bbox_min }, Ref::simd_fvec3{ mi.bbox_max } });
     }
 
-    macro_nodes_root_ = static_cast<uint32_t>(nodes_.size());
-    macro_nodes_count_ = PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, nodes_, mi_indices_);
+    const auto time_start = std::chrono::high_resolution_clock::now();
 
-    if (use_wide_bvh_) {
-        uint32_t before_count = static_cast<uint32_t>(mnodes_.size());
-        uint32_t new_root = FlattenBVH_Recursive(nodes_.data(), macro_nodes_root_, 0xffffffff, mnodes_);
+    std::vector<bvh_node_t> new_nodes;
+    PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, new_nodes, mi_indices_, scheduler_.get());
 
-        macro_nodes_root_ = new_root;
-        macro_nodes_count_ = static_cast<uint32_t>(mnodes_.size() - before_count);
+    if (use_wide_bvh_) {
+        aligned_vector<mbvh_node_t> new_mnodes;
+        FlattenBVH_Recursive(new_nodes.data(), 0, 0xffffffff, new_mnodes);
 
-        // nodes_ is temporary storage when wide BVH is used
-        nodes_.clear();
+        macro_nodes_root_ = AddNodes(new_mnodes.data(), static_cast<uint32_t>(new_mnodes.size()), 0);
+        macro_nodes_count_ = static_cast<uint32_t>(new_mnodes.size());
+    } else {
+        macro_nodes_root_ = AddNodes(new_nodes.data(), static_cast<uint32_t>(new_nodes.size()), 0);
+        macro_nodes_count_ = static_cast<uint32_t>(new_nodes.size());
     }
-}
 
-void Ray::Ref::Scene::RebuildLightBVH() {
-    RemoveNodes(light_nodes_root_, light_nodes_count_);
-    li_indices_.clear();
+    // remember cost of fresh tree to be able to detect degradation after refitting
+    macro_nodes_build_cost_ = RefitMacroBVH();
 
-    std::vector<prim_t> primitives;
-    primitives.reserve(lights_.size());
+    stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+}
 
-    for (const light_t &l : lights_) {
-        float influence = l.radius * (std::sqrt(l.brightness / LIGHT_ATTEN_CUTOFF) - 1.0f);
+float Ray::Ref::Scene::RefitMacroBVH() {
+    if (!macro_nodes_count_) return 0.0f;
 
-        simd_fvec3 bbox_min = { 0.0f }, bbox_max = { 0.0f };
+    // parent nodes are always placed before their children (both for binary and flattened tree),
+    // so bounds can be updated bottom-up with single backward pass.
+    // Returned cost is area of interior nodes relative to area of leaves, it does not depend on scene extents
+    // and grows when instances that are close in the tree get apart
+    float interior_area = 0.0f, leaves_area = 0.0f;
 
-        simd_fvec3 p1 = { -l.dir[0] * influence,
-                          -l.dir[1] * influence,
-                          -l.dir[2] * influence };
+    if (!use_wide_bvh_) {
+        for (uint32_t i = macro_nodes_root_ + macro_nodes_count_; i-- > macro_nodes_root_; ) {
+            bvh_node_t &n = nodes_[i];
 
-        bbox_min = min(bbox_min, p1);
-        bbox_max = max(bbox_max, p1);
+            simd_fvec3 bbox_min = { MAX_DIST }, bbox_max = { -MAX_DIST };
 
-        simd_fvec3 p2 = { -l.dir[0] * l.spot * influence,
-                          -l.dir[1] * l.spot * influence,
-                          -l.dir[2] * l.spot * influence };
+            if (n.prim_index & LEAF_NODE_BIT) {
+                const uint32_t prim_index = n.prim_index & PRIM_INDEX_BITS;
+                for (uint32_t j = prim_index; j < prim_index + n.prim_count; j++) {
+                    const mesh_instance_t &mi = mesh_instances_[mi_indices_[j]];
 
-        float d = std::sqrt(1.0f - l.spot * l.spot) * influence;
+                    bbox_min = min(bbox_min, simd_fvec3{ mi.bbox_min });
+                    bbox_max = max(bbox_max, simd_fvec3{ mi.bbox_max });
+                }
+            } else {
+                const bvh_node_t &left = nodes_[n.left_child],
+                                 &right = nodes_[n.right_child & RIGHT_CHILD_BITS];
 
-        bbox_min = min(bbox_min, p2 - simd_fvec3{ d, 0.0f, d });
-        bbox_max = max(bbox_max, p2 + simd_fvec3{ d, 0.0f, d });
+                bbox_min = min(simd_fvec3{ left.bbox_min }, simd_fvec3{ right.bbox_min });
+                bbox_max = max(simd_fvec3{ left.bbox_max }, simd_fvec3{ right.bbox_max });
+            }
 
-        if (l.spot < 0.0f) {
-            bbox_min = min(bbox_min, p1 - simd_fvec3{ influence, 0.0f, influence });
-            bbox_max = max(bbox_max, p1 + simd_fvec3{ influence, 0.0f, influence });
-        }
+            memcpy(&n.bbox_min[0], &bbox_min[0], 3 * sizeof(float));
+            memcpy(&n.bbox_max[0], &bbox_max[0], 3 * sizeof(float));
 
-        simd_fvec3 up = { 1.0f, 0.0f, 0.0f };
-        if (std::abs(l.dir[1]) < std::abs(l.dir[2]) && std::abs(l.dir[1]) < std::abs(l.dir[0])) {
-            up = { 0.0f, 1.0f, 0.0f };
-        } else if (std::abs(l.dir[2]) < std::abs(l.dir[0]) && std::abs(l.dir[2]) < std::abs(l.dir[1])) {
-            up = { 0.0f, 0.0f, 1.0f };
+            if (n.prim_index & LEAF_NODE_BIT) {
+                leaves_area += half_surface_area(n.bbox_min, n.bbox_max) * n.prim_count;
+            } else {
+                interior_area += half_surface_area(n.bbox_min, n.bbox_max);
+            }
         }
+    } else {
+        for (uint32_t n_index = macro_nodes_root_ + macro_nodes_count_; n_index-- > macro_nodes_root_; ) {
+            mbvh_node_t &n = mnodes_[n_index];
+
+            float bbox_min[3] = { MAX_DIST, MAX_DIST, MAX_DIST },
+                  bbox_max[3] = { -MAX_DIST, -MAX_DIST, -MAX_DIST };
+
+            if (n.child[0] & LEAF_NODE_BIT) {
+                const uint32_t prim_index = n.child[0] & PRIM_INDEX_BITS;
+                for (uint32_t j = prim_index; j < prim_index + n.child[1]; j++) {
+                    const mesh_instance_t &mi = mesh_instances_[mi_indices_[j]];
+
+                    ITERATE_3({ bbox_min[i] = std::min(bbox_min[i], mi.bbox_min[i]); })
+                    ITERATE_3({ bbox_max[i] = std::max(bbox_max[i], mi.bbox_max[i]); })
+                }
+
+                ITERATE_3({ n.bbox_min[i][0] = bbox_min[i]; })
+                ITERATE_3({ n.bbox_max[i][0] = bbox_max[i]; })
+
+                leaves_area += half_surface_area(bbox_min, bbox_max) * n.child[1];
+            } else {
+                for (int j = 0; j < 8; j++) {
+                    if (n.child[j] == 0x7fffffff) continue;
 
-        simd_fvec3 side = { -l.dir[1] * up[2] + l.dir[2] * up[1],
-                            -l.dir[2] * up[0] + l.dir[0] * up[2],
-                            -l.dir[0] * up[1] + l.dir[1] * up[0] };
+                    const mbvh_node_t &ch = mnodes_[n.child[j]];
 
-        float xform[16] = { side[0],  l.dir[0], up[0],    0.0f,
-                            side[1],  l.dir[1], up[1],    0.0f,
-                            side[2],  l.dir[2], up[2],    0.0f,
-                            l.pos[0], l.pos[1], l.pos[2], 1.0f };
+                    float ch_min[3] = { MAX_DIST, MAX_DIST, MAX_DIST },
+                          ch_max[3] = { -MAX_DIST, -MAX_DIST, -MAX_DIST };
 
-        primitives.emplace_back();
-        prim_t &prim = primitives.back();
+                    if (ch.child[0] & LEAF_NODE_BIT) {
+                        ITERATE_3({ ch_min[i] = ch.bbox_min[i][0]; })
+                        ITERATE_3({ ch_max[i] = ch.bbox_max[i][0]; })
+                    } else {
+                        for (int k = 0; k < 8; k++) {
+                            if (ch.child[k] == 0x7fffffff) continue;
 
-        prim.i0 = prim.i1 = prim.i2 = 0;
-        TransformBoundingBox(&bbox_min[0], &bbox_max[0], xform, &prim.bbox_min[0], &prim.bbox_max[0]);
+                            ITERATE_3({ ch_min[i] = std::min(ch_min[i], ch.bbox_min[i][k]); })
+                            ITERATE_3({ ch_max[i] = std::max(ch_max[i], ch.bbox_max[i][k]); })
+                        }
+                    }
+
+                    ITERATE_3({ n.bbox_min[i][j] = ch_min[i]; })
+                    ITERATE_3({ n.bbox_max[i][j] = ch_max[i]; })
+
+                    ITERATE_3({ bbox_min[i] = std::min(bbox_min[i], ch_min[i]); })
+                    ITERATE_3({ bbox_max[i] = std::max(bbox_max[i], ch_max[i]); })
+                }
+
+                interior_area += half_surface_area(bbox_min, bbox_max);
+            }
+        }
     }
 
-    light_nodes_root_ = static_cast<uint32_t>(nodes_.size());
-    light_nodes_count_ = PreprocessPrims_SAH(&primitives[0], primitives.size(), nullptr, 0, {}, nodes_, li_indices_);
+    return leaves_area > 0.0f ? interior_area / leaves_area : 0.0f;
+}
 
-    if (use_wide_bvh_) {
-        uint32_t before_count = static_cast<uint32_t>(mnodes_.size());
-        uint32_t new_root = FlattenBVH_Recursive(nodes_.data(), light_nodes_root_, 0xffffffff, mnodes_);
+void Ray::Ref::Scene::RebuildLightBVH() {
+    light_nodes_.clear();
+    li_indices_.clear();
+    light_nodes_root_ = 0xffffffff;
 
-        light_nodes_root_ = new_root;
-        light_nodes_count_ = static_cast<uint32_t>(mnodes_.size() - before_count);
+    if (lights_.empty()) return;
 
-        // nodes_ is temporary storage when wide BVH is used
-        nodes_.clear();
+    const auto time_start = std::chrono::high_resolution_clock::now();
+
+    light_nodes_root_ = 0;
+    PreprocessLights(&lights_[0], lights_.size(), light_nodes_, li_indices_, scheduler_.get());
+
+    stats_.time_bvh_build_us += (unsigned long long)std::chrono::duration<double, std::micro>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+}
+
+std::shared_ptr<Ray::tri_bins_t> Ray::Ref::Scene::GetTriBins(uint32_t mesh_index, int uv_layer, int w, int h) {
+    const mesh_t &m = meshes_[mesh_index];
+
+    std::lock_guard<std::mutex> _(tri_bins_mtx_);
+
+    for (const auto &bins : tri_bins_) {
+        if (bins->tris_index == m.tris_index && bins->tris_count == m.tris_count &&
+            bins->uv_layer == uv_layer && bins->w == w && bins->h == h) {
+            return bins;
+        }
     }
+
+    auto new_bins = std::make_shared<tri_bins_t>();
+    BinMeshInTextureSpace(uv_layer, m, &vtx_indices_[0], &vertices_[0], w, h, *new_bins);
+    tri_bins_.push_back(new_bins);
+
+    return new_bins;
 }
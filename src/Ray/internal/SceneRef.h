@@ -1,13 +1,18 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "BVHSplit.h"
 #include "CoreRef.h"
+#include "RangeAllocator.h"
 #include "TextureAtlasRef.h"
 #include "../SceneBase.h"
 
 namespace Ray {
+class TaskScheduler;
+
 namespace ref2 {
 template <int DimX, int DimY>
 class RendererSIMD;
@@ -24,6 +29,10 @@ namespace Avx2 {
     template <int DimX, int DimY>
     class RendererSIMD;
 }
+namespace Avx512 {
+template <int DimX, int DimY>
+class RendererSIMD;
+}
 
 namespace Neon {
 template <int DimX, int DimY>
@@ -43,11 +52,14 @@ protected:
     template <int DimX, int DimY>
     friend class Avx2::RendererSIMD;
     template <int DimX, int DimY>
+    friend class Avx512::RendererSIMD;
+    template <int DimX, int DimY>
     friend class Neon::RendererSIMD;
 
-    bool                        use_wide_bvh_;
+    bool                        use_wide_bvh_, use_compressed_bvh_, use_tex_compression_;
     std::vector<bvh_node_t>     nodes_;
     aligned_vector<mbvh_node_t> mnodes_;
+    aligned_vector<cmbvh_node_t> cmnodes_;  // mesh trees (if compressed), macro and light trees stay in mnodes_
     std::vector<tri_accel_t>    tris_;
     std::vector<uint32_t>       tri_indices_;
     std::vector<transform_t>    transforms_;
@@ -57,37 +69,95 @@ protected:
     std::vector<vertex_t>       vertices_;
     std::vector<uint32_t>       vtx_indices_;
 
+    // ranges of storage arrays owned by each mesh (in addition to nodes and triangles stored in mesh_t)
+    struct mesh_ranges_t {
+        uint32_t tri_indices_index, tri_indices_count;
+        uint32_t vtx_index, vtx_count;
+    };
+    std::vector<mesh_ranges_t>  mesh_ranges_;
+
+    // freed ranges are reused instead of shifting the rest of data, so indices remain stable
+    RangeAllocator              nodes_alloc_, mesh_nodes_alloc_, tris_alloc_, tri_indices_alloc_, vertices_alloc_;
+
     std::vector<material_t>     materials_;
     std::vector<texture_t>      textures_;
     TextureAtlas                texture_atlas_;
 
     std::vector<light_t>        lights_;
     std::vector<uint32_t>       li_indices_;
+    std::vector<light_node_t>   light_nodes_;
 
     environment_t               env_;
 
     uint32_t macro_nodes_root_ = 0xffffffff, macro_nodes_count_ = 0;
-    uint32_t light_nodes_root_ = 0xffffffff, light_nodes_count_ = 0;
+    float macro_nodes_build_cost_ = 0.0f;
+    uint32_t light_nodes_root_ = 0xffffffff;
 
     uint32_t default_normals_texture_, default_env_texture_;
 
+    std::shared_ptr<TaskScheduler> scheduler_;
+    stats_t stats_ = { 0 };
+
+    // triangle bins and texel cache used by lightmap (Geo) cameras, built on first use and dropped when mesh storage changes
+    std::mutex tri_bins_mtx_;
+    std::vector<std::shared_ptr<tri_bins_t>> tri_bins_;
+
+    uint32_t AddNodes(const bvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset);
+    uint32_t AddNodes(const mbvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset);
+    uint32_t AddNodes(const cmbvh_node_t *nodes, uint32_t node_count, uint32_t prim_offset);
     void RemoveTris(uint32_t tris_index, uint32_t tris_count);
     void RemoveNodes(uint32_t node_index, uint32_t node_count);
+    void RemoveMeshNodes(uint32_t node_index, uint32_t node_count);
     void RebuildMacroBVH();
+    float RefitMacroBVH();
     void RebuildLightBVH();
+
+    // safe to call from several threads during rendering
+    std::shared_ptr<tri_bins_t> GetTriBins(uint32_t mesh_index, int uv_layer, int w, int h);
+
+    // textures and meshes are added in two steps: preparation does not touch scene data and can run in parallel,
+    // commit places prepared data into scene storage
+    struct prepared_texture_t {
+        texture_t t;
+        int mip_count;
+        int mip_res[NUM_MIP_LEVELS][2];
+        const pixel_color8_t *mip_data[NUM_MIP_LEVELS];
+        std::unique_ptr<pixel_color8_t[]> mip_chain;
+        std::vector<uint8_t> mip_blocks[NUM_MIP_LEVELS];  // used when texture is compressed
+        bool compressed;
+    };
+
+    struct prepared_mesh_t {
+        std::vector<bvh_node_t> nodes;
+        aligned_vector<mbvh_node_t> mnodes;
+        aligned_vector<cmbvh_node_t> cmnodes;
+        std::vector<tri_accel_t> tris;
+        std::vector<uint32_t> tri_indices;
+        std::vector<vertex_t> vertices;
+        std::vector<uint32_t> vtx_indices;
+        unsigned long long time_bvh_build_us;
+    };
+
+    void PrepareTexture(const tex_desc_t &t, prepared_texture_t &out_tex) const;
+    uint32_t CommitTexture(prepared_texture_t &tex);
+
+    void PrepareMesh(const mesh_desc_t &m, prepared_mesh_t &out_mesh) const;
+    uint32_t CommitMesh(const mesh_desc_t &m, prepared_mesh_t &mesh);
 public:
-    Scene(bool use_wide_bvh);
+    Scene(bool use_wide_bvh, bool use_compressed_bvh, bool use_tex_compression, std::shared_ptr<TaskScheduler> scheduler);
 
     void GetEnvironment(environment_desc_t &env) override;
     void SetEnvironment(const environment_desc_t &env) override;
 
     uint32_t AddTexture(const tex_desc_t &t) override;
+    void AddTextures(const tex_desc_t *t, size_t count, uint32_t *out_indices) override;
     void RemoveTexture(uint32_t) override {}
 
     uint32_t AddMaterial(const mat_desc_t &m) override;
     void RemoveMaterial(uint32_t) override {}
 
     uint32_t AddMesh(const mesh_desc_t &m) override;
+    void AddMeshes(const mesh_desc_t *m, size_t count, uint32_t *out_indices) override;
     void RemoveMesh(uint32_t) override;
 
     uint32_t AddLight(const light_desc_t &l) override;
@@ -97,12 +167,20 @@ public:
     void SetMeshInstanceTransform(uint32_t mi_index, const float *xform) override;
     void RemoveMeshInstance(uint32_t) override;
 
+    void Compact() override;
+
+    bool SaveCache(const char *file_name) override;
+    bool LoadCache(const char *file_name) override;
+
     uint32_t triangle_count() override {
-        return (uint32_t)tris_.size();
+        return tris_alloc_.used_size();
     }
     uint32_t node_count() override {
-        return (uint32_t)(use_wide_bvh_ ? mnodes_.size() : nodes_.size());
+        return nodes_alloc_.used_size() + mesh_nodes_alloc_.used_size();
     }
+
+    void GetStats(stats_t &st) override { st = stats_; }
+    void ResetStats() override { stats_ = { 0 }; }
 };
 }
 }
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace Ray {
+namespace TaskSchedulerInternal {
+// used to find own queue when ParallelFor is called from inside of a task
+thread_local const TaskScheduler *g_current_scheduler = nullptr;
+thread_local int g_current_thread_index = -1;
+}
+}
+
+Ray::TaskScheduler::TaskScheduler(int threads_count) : queues_count_(std::max(threads_count - 1, 0)), pending_count_(0) {
+    queues_.reset(new queue_t[queues_count_]);
+    workers_.reserve(queues_count_);
+    for (int i = 0; i < queues_count_; i++) {
+        workers_.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+    }
+}
+
+Ray::TaskScheduler::~TaskScheduler() {
+    {
+        std::lock_guard<std::mutex> _(wake_mtx_);
+        stop_ = true;
+    }
+    wake_cnd_.notify_all();
+    for (std::thread &t : workers_) {
+        t.join();
+    }
+}
+
+bool Ray::TaskScheduler::PopTask(int queue_index, task_t &out_task) {
+    queue_t &q = queues_[queue_index];
+
+    std::lock_guard<std::mutex> _(q.mtx);
+    if (q.tasks.empty()) return false;
+
+    out_task = q.tasks.front();
+    q.tasks.pop_front();
+    return true;
+}
+
+bool Ray::TaskScheduler::StealTask(int thief_index, task_t &out_task) {
+    const int queues_count = queues_count_;
+
+    for (int i = 1; i <= queues_count; i++) {
+        queue_t &q = queues_[(thief_index + i + queues_count) % queues_count];
+
+        std::lock_guard<std::mutex> _(q.mtx);
+        if (q.tasks.empty()) continue;
+
+        // take work from the opposite end, owner processes its queue from the front
+        out_task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
+
+    return false;
+}
+
+bool Ray::TaskScheduler::RunOneTask(int thread_index) {
+    task_t task;
+    if ((thread_index == -1 || !PopTask(thread_index, task)) && !StealTask(thread_index, task)) {
+        return false;
+    }
+    pending_count_.fetch_sub(1, std::memory_order_relaxed);
+
+    (*task.batch->func)(task.index);
+
+    // batch can be destroyed right after the last decrement, do not touch it after this point
+    task.batch->remaining.fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+void Ray::TaskScheduler::WorkerLoop(int thread_index) {
+    using namespace TaskSchedulerInternal;
+
+    g_current_scheduler = this;
+    g_current_thread_index = thread_index;
+
+    for (;;) {
+        if (RunOneTask(thread_index)) continue;
+
+        std::unique_lock<std::mutex> lock(wake_mtx_);
+        wake_cnd_.wait(lock, [this] { return stop_ || pending_count_.load(std::memory_order_relaxed) > 0; });
+        if (stop_ && pending_count_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+    }
+}
+
+void Ray::TaskScheduler::ParallelFor(int begin, int end, const std::function<void(int)> &f) {
+    using namespace TaskSchedulerInternal;
+
+    const int count = end - begin;
+    if (count <= 0) return;
+
+    const int queues_count = queues_count_;
+    if (!queues_count || count == 1) {
+        for (int i = begin; i < end; i++) {
+            f(i);
+        }
+        return;
+    }
+
+    batch_t batch;
+    batch.func = &f;
+    batch.remaining = count;
+
+    // neighbouring items usually have similar cost (and touch the same data), so give each queue a contiguous block
+    for (int q = 0; q < queues_count; q++) {
+        const int block_beg = begin + int((int64_t(count) * q) / queues_count),
+                  block_end = begin + int((int64_t(count) * (q + 1)) / queues_count);
+        if (block_beg == block_end) continue;
+
+        std::lock_guard<std::mutex> _(queues_[q].mtx);
+        for (int i = block_beg; i < block_end; i++) {
+            queues_[q].tasks.push_back({ &batch, i });
+        }
+    }
+
+    pending_count_.fetch_add(count, std::memory_order_relaxed);
+    {   // make sure sleeping workers do not miss notification
+        std::lock_guard<std::mutex> _(wake_mtx_);
+    }
+    wake_cnd_.notify_all();
+
+    const int thread_index = (g_current_scheduler == this) ? g_current_thread_index : -1;
+
+    while (batch.remaining.load(std::memory_order_acquire)) {
+        if (!RunOneTask(thread_index)) {
+            std::this_thread::yield();
+        }
+    }
+}
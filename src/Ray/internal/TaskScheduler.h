@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Ray {
+/** Pool of worker threads with per-thread task queues.
+    Each worker takes tasks from the front of its own queue and steals from the back
+    of other queues when it runs out of work, so threads that got cheap tasks do not sit idle.
+*/
+class TaskScheduler {
+    struct batch_t {
+        const std::function<void(int)> *func;
+        std::atomic_int remaining;
+    };
+
+    struct task_t {
+        batch_t *batch;
+        int index;
+    };
+
+    struct queue_t {
+        std::mutex mtx;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::thread> workers_;
+    std::unique_ptr<queue_t[]> queues_;
+    int queues_count_;  ///< Same as number of workers, but known before they start (workers_ is filled concurrently with them)
+
+    std::atomic_int pending_count_;
+    std::mutex wake_mtx_;
+    std::condition_variable wake_cnd_;
+    bool stop_ = false;
+
+    bool PopTask(int queue_index, task_t &out_task);
+    bool StealTask(int thief_index, task_t &out_task);
+    bool RunOneTask(int thread_index);
+
+    void WorkerLoop(int thread_index);
+public:
+    /** @brief Creates scheduler
+        @param threads_count total number of threads executing tasks (including calling thread)
+    */
+    explicit TaskScheduler(int threads_count);
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler &rhs) = delete;
+    TaskScheduler &operator=(const TaskScheduler &rhs) = delete;
+
+    /// Number of threads executing tasks (including calling thread)
+    int threads_count() const { return queues_count_ + 1; }
+
+    /** @brief Executes function for each index in range and waits for completion
+        @param begin first index
+        @param end index after the last one
+        @param f function to execute
+
+        Indices are split in contiguous blocks between worker queues, calling thread takes part in execution.
+        Can be called from multiple threads simultaneously (and from inside of tasks).
+    */
+    void ParallelFor(int begin, int end, const std::function<void(int)> &f);
+};
+
+/// Executes function for each index in range using scheduler (serially if scheduler is null)
+inline void ParallelFor(TaskScheduler *scheduler, int begin, int end, const std::function<void(int)> &f) {
+    if (scheduler) {
+        scheduler->ParallelFor(begin, end, f);
+    } else {
+        for (int i = begin; i < end; i++) {
+            f(i);
+        }
+    }
+}
+}
@@ -4,6 +4,8 @@
 
 #include <algorithm> // for std::max
 
+#include "SceneCache.h"
+
 Ray::Ref::TextureAtlasLinear::TextureAtlasLinear(int resx, int resy, int initial_page_count)
     : res_{ resx, resy }, res_f_{ (float)resx, (float)resy }, page_count_(0) {
     if (!Resize(initial_page_count)) {
@@ -98,12 +100,24 @@ void Ray::Ref::TextureAtlasLinear::WritePageData(int page, int posx, int posy, i
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+const int Ray::Ref::TextureAtlasTiled::TileStorage[2] = { TileSize * TileSize, TileBlocks * TileBlocks * BlockSizeBC3 / sizeof(pixel_color8_t) };
+
 Ray::Ref::TextureAtlasTiled::TextureAtlasTiled(int resx, int resy, int initial_page_count)
     : res_{ resx, resy }, res_in_tiles_{ resx / TileSize, resy / TileSize }, res_f_{ (float)resx, (float)resy }, page_count_(0) {
     if ((resx % TileSize) || (resy % TileSize)) {
         throw std::invalid_argument("TextureAtlas resolution should be multiple of tile size!");
     }
 
+    // empty tile is shared between all uncommitted tiles, so Get never has to check for them
+    // (zeroed block decodes to zero texels as well)
+    tile_chunks_.emplace_back(new pixel_color8_t[TilesPerChunk * TileStorage[0]]);
+    memset(&tile_chunks_[0][0], 0, TilesPerChunk * TileStorage[0] * sizeof(pixel_color8_t));
+
+    empty_tile_ = &tile_chunks_[0][0];
+    for (int i = TilesPerChunk - 1; i > 0; i--) {
+        free_tiles_[0].push_back(&tile_chunks_[0][i * TileStorage[0]]);
+    }
+
     if (!Resize(initial_page_count)) {
         throw std::runtime_error("TextureAtlas cannot be resized!");
     }
@@ -112,63 +126,127 @@ Ray::Ref::TextureAtlasTiled::TextureAtlasTiled(int resx, int resy, int initial_p
     temp_storage_.reserve(std::max(resx, resy));
 }
 
-int Ray::Ref::TextureAtlasTiled::Allocate(const pixel_color8_t *data, const int _res[2], int pos[2]) {
+int Ray::Ref::TextureAtlasTiled::Allocate(const pixel_color8_t *data, const int _res[2], int pos[2], bool compress) {
+    if (compress) {
+        std::vector<uint8_t> blocks;
+        EncodeBlocks(data, _res, blocks);
+        return AllocateEncoded(&blocks[0], _res, pos);
+    }
+
     int res[2] = { _res[0] + 2, _res[1] + 2 };
 
-    if (res[0] > res_[0] || res[1] > res_[1]) return -1;
+    int page_index = AllocateRegion(res, false, pos);
+    if (page_index == -1) return -1;
 
-    for (int page_index = 0; page_index < page_count_; page_index++) {
-        int index = splitters_[page_index].Allocate(&res[0], &pos[0]);
-        if (index != -1) {
-            WritePageData(page_index, pos[0] + 1, pos[1] + 1, _res[0], _res[1], &data[0]);
+    WritePageData(page_index, pos[0] + 1, pos[1] + 1, _res[0], _res[1], &data[0]);
 
-            // add 1px border
-            WritePageData(page_index, pos[0] + 1, pos[1], _res[0], 1, &data[(_res[1] - 1) * _res[0]]);
+    // add 1px border
+    WritePageData(page_index, pos[0] + 1, pos[1], _res[0], 1, &data[(_res[1] - 1) * _res[0]]);
 
-            WritePageData(page_index, pos[0] + 1, pos[1] + res[1] - 1, _res[0], 1, &data[0]);
+    WritePageData(page_index, pos[0] + 1, pos[1] + res[1] - 1, _res[0], 1, &data[0]);
 
-            temp_storage_.resize(res[1]);
-            PageData &vertical_border = temp_storage_;
-            vertical_border[0] = data[(_res[1] - 1) * _res[0] + _res[0] - 1];
-            for (int i = 0; i < _res[1]; i++) {
-                vertical_border[i + 1] = data[i * _res[0] + _res[0] - 1];
-            }
-            vertical_border[res[1] - 1] = data[0 * _res[0] + _res[0] - 1];
+    temp_storage_.resize(res[1]);
+    std::vector<pixel_color8_t> &vertical_border = temp_storage_;
+    vertical_border[0] = data[(_res[1] - 1) * _res[0] + _res[0] - 1];
+    for (int i = 0; i < _res[1]; i++) {
+        vertical_border[i + 1] = data[i * _res[0] + _res[0] - 1];
+    }
+    vertical_border[res[1] - 1] = data[0 * _res[0] + _res[0] - 1];
 
-            WritePageData(page_index, pos[0], pos[1], 1, res[1], &vertical_border[0]);
+    WritePageData(page_index, pos[0], pos[1], 1, res[1], &vertical_border[0]);
 
-            vertical_border[0] = data[(_res[1] - 1) * _res[0]];
-            for (int i = 0; i < _res[1]; i++) {
-                vertical_border[i + 1] = data[i * _res[0]];
+    vertical_border[0] = data[(_res[1] - 1) * _res[0]];
+    for (int i = 0; i < _res[1]; i++) {
+        vertical_border[i + 1] = data[i * _res[0]];
+    }
+    vertical_border[res[1] - 1] = data[0];
+
+    WritePageData(page_index, pos[0] + res[0] - 1, pos[1], 1, res[1], &vertical_border[0]);
+
+    return page_index;
+}
+
+int Ray::Ref::TextureAtlasTiled::AllocateEncoded(const uint8_t *blocks, const int _res[2], int pos[2]) {
+    int res[2];
+    GetEncodedSize(_res, res);
+
+    int page_index = AllocateRegion(res, true, pos);
+    if (page_index == -1) return -1;
+
+    const page_t &p = pages_[page_index];
+    for (int by = 0; by < res[1]; by += BlockSize) {
+        for (int bx = 0; bx < res[0]; bx += BlockSize) {
+            memcpy(GetBlock(p, pos[0] + bx, pos[1] + by), blocks, BlockSizeBC3);
+            blocks += BlockSizeBC3;
+        }
+    }
+
+    return page_index;
+}
+
+void Ray::Ref::TextureAtlasTiled::EncodeBlocks(const pixel_color8_t *data, const int res[2], std::vector<uint8_t> &out_blocks) {
+    int size[2];
+    GetEncodedSize(res, size);
+
+    out_blocks.resize((size[0] / BlockSize) * (size[1] / BlockSize) * BlockSizeBC3);
+    uint8_t *out = &out_blocks[0];
+
+    // maps coordinate inside of region to texture coordinate, 1px border wraps around, remaining padding repeats the border
+    auto src_coord = [](int i, int res) -> int {
+        if (i == 0) return res - 1;
+        if (i > res) return 0;
+        return i - 1;
+    };
+
+    pixel_color8_t block_data[BlockSize * BlockSize];
+
+    for (int by = 0; by < size[1]; by += BlockSize) {
+        for (int bx = 0; bx < size[0]; bx += BlockSize) {
+            for (int y = 0; y < BlockSize; y++) {
+                const int srcy = src_coord(by + y, res[1]);
+                for (int x = 0; x < BlockSize; x++) {
+                    block_data[y * BlockSize + x] = data[srcy * res[0] + src_coord(bx + x, res[0])];
+                }
             }
-            vertical_border[res[1] - 1] = data[0];
 
-            WritePageData(page_index, pos[0] + res[0] - 1, pos[1], 1, res[1], &vertical_border[0]);
+            CompressBlockBC3(block_data, out);
+            out += BlockSizeBC3;
+        }
+    }
+}
+
+int Ray::Ref::TextureAtlasTiled::AllocateRegion(const int res[2], bool compressed, int pos[2]) {
+    if (res[0] > res_[0] || res[1] > res_[1]) return -1;
+
+    for (int page_index = 0; page_index < page_count_; page_index++) {
+        page_t &p = pages_[page_index];
+        if (p.compressed != compressed) {
+            if (!splitters_[page_index].empty()) continue;
+            p.compressed = compressed;
+        }
 
+        int index = splitters_[page_index].Allocate(&res[0], &pos[0]);
+        if (index != -1) {
+            CommitTiles(page_index, pos, res);
             return page_index;
         }
     }
 
     Resize(page_count_ * 2);
-    return Allocate(data, _res, pos);
+    return AllocateRegion(res, compressed, pos);
 }
 
 bool Ray::Ref::TextureAtlasTiled::Free(int page, const int pos[2]) {
-    if (page < 0 || page > page_count_) return false;
-#ifndef NDEBUG // Fill region with zeros in debug
+    if (page < 0 || page >= page_count_) return false;
+
     int size[2];
     int index = splitters_[page].FindNode(&pos[0], &size[0]);
-    if (index != -1) {
-        for (int j = pos[1]; j < pos[1] + size[1]; j++) {
-            memset(&pages_[page][j * res_[0] + pos[0]], 0, size[0] * sizeof(pixel_color8_t));
-        }
-        return splitters_[page].Free(index);
-    } else {
+    if (index == -1 || !splitters_[page].Free(index)) {
         return false;
     }
-#else
-    return splitters_[page].Free(&pos[0]);
-#endif
+
+    ReleaseTiles(page, pos, size);
+    return true;
 }
 
 bool Ray::Ref::TextureAtlasTiled::Resize(int new_page_count) {
@@ -177,9 +255,11 @@ bool Ray::Ref::TextureAtlasTiled::Resize(int new_page_count) {
         if (!splitters_[i].empty()) return false;
     }
 
+    // only page tables are allocated here, tiles are committed later on demand
     pages_.resize(new_page_count);
-    for (PageData &p : pages_) {
-        p.resize(res_[0] * res_[1], { 0, 0, 0, 0 });
+    for (page_t &p : pages_) {
+        p.tiles.resize(res_in_tiles_[0] * res_in_tiles_[1], empty_tile_);
+        p.refs.resize(res_in_tiles_[0] * res_in_tiles_[1], 0);
     }
 
     splitters_.resize(new_page_count, TextureSplitter{ &res_[0] });
@@ -188,7 +268,69 @@ bool Ray::Ref::TextureAtlasTiled::Resize(int new_page_count) {
     return true;
 }
 
+void Ray::Ref::TextureAtlasTiled::CommitTiles(int page, const int pos[2], const int size[2]) {
+    page_t &p = pages_[page];
+
+    for (int tiley = pos[1] / TileSize; tiley <= (pos[1] + size[1] - 1) / TileSize; tiley++) {
+        for (int tilex = pos[0] / TileSize; tilex <= (pos[0] + size[0] - 1) / TileSize; tilex++) {
+            const int tile = tiley * res_in_tiles_[0] + tilex;
+            if (p.refs[tile]++) continue;
+
+            std::vector<pixel_color8_t *> &free_tiles = free_tiles_[p.compressed];
+            const int tile_storage = TileStorage[p.compressed];
+
+            if (free_tiles.empty()) {
+                tile_chunks_.emplace_back(new pixel_color8_t[TilesPerChunk * tile_storage]);
+                for (int i = TilesPerChunk - 1; i >= 0; i--) {
+                    free_tiles.push_back(&tile_chunks_.back()[i * tile_storage]);
+                }
+            }
+
+            // texels not covered by region are expected to be zero (like in dense page)
+            p.tiles[tile] = free_tiles.back();
+            free_tiles.pop_back();
+            memset(p.tiles[tile], 0, tile_storage * sizeof(pixel_color8_t));
+
+            committed_tiles_count_++;
+            committed_memory_ += tile_storage * sizeof(pixel_color8_t);
+        }
+    }
+}
+
+void Ray::Ref::TextureAtlasTiled::ReleaseTiles(int page, const int pos[2], const int size[2]) {
+    page_t &p = pages_[page];
+
+    for (int tiley = pos[1] / TileSize; tiley <= (pos[1] + size[1] - 1) / TileSize; tiley++) {
+        for (int tilex = pos[0] / TileSize; tilex <= (pos[0] + size[0] - 1) / TileSize; tilex++) {
+            const int tile = tiley * res_in_tiles_[0] + tilex;
+            if (--p.refs[tile]) {
+#ifndef NDEBUG // Fill freed part of shared tile with zeros in debug
+                for (int y = std::max(pos[1], tiley * TileSize); y < std::min(pos[1] + size[1], (tiley + 1) * TileSize); y++) {
+                    for (int x = std::max(pos[0], tilex * TileSize); x < std::min(pos[0] + size[0], (tilex + 1) * TileSize); x++) {
+                        if (p.compressed) {
+                            // region is block-aligned, whole block belongs to it
+                            memset(GetBlock(p, x, y), 0, BlockSizeBC3);
+                        } else {
+                            p.tiles[tile][(y % TileSize) * TileSize + (x % TileSize)] = { 0, 0, 0, 0 };
+                        }
+                    }
+                }
+#endif
+                continue;
+            }
+
+            free_tiles_[p.compressed].push_back(p.tiles[tile]);
+            p.tiles[tile] = empty_tile_;
+
+            committed_tiles_count_--;
+            committed_memory_ -= TileStorage[p.compressed] * sizeof(pixel_color8_t);
+        }
+    }
+}
+
 void Ray::Ref::TextureAtlasTiled::WritePageData(int page, int posx, int posy, int sizex, int sizey, const pixel_color8_t *data) {
+    page_t &p = pages_[page];
+
     for (int y = 0; y < sizey; y++) {
         int tiley = (posy + y) / TileSize,
             in_tiley = (posy + y) % TileSize;
@@ -197,7 +339,145 @@ void Ray::Ref::TextureAtlasTiled::WritePageData(int page, int posx, int posy, in
             int tilex = (posx + x) / TileSize,
                 in_tilex = (posx + x) % TileSize;
 
-            pages_[page][(tiley * res_in_tiles_[0] + tilex) * TileSize * TileSize + in_tiley * TileSize + in_tilex] = data[y * sizex + x];
+            p.tiles[tiley * res_in_tiles_[0] + tilex][in_tiley * TileSize + in_tilex] = data[y * sizex + x];
+        }
+    }
+}
+
+namespace Ray {
+namespace Ref {
+struct atlas_page_header_t {
+    uint32_t compressed;
+    uint32_t splitter_state_size;
+};
+const uint32_t EmptyTileIndex = 0xffffffff;
+}
+}
+
+void Ray::Ref::TextureAtlasTiled::Save(SceneCache::Writer &w) const {
+    const int tiles_per_page = res_in_tiles_[0] * res_in_tiles_[1];
+
+    auto *headers = w.AddOwnedChunk<atlas_page_header_t>(SceneCache::ChAtlasPages, page_count_);
+    auto *page_tables = w.AddOwnedChunk<uint32_t>(SceneCache::ChAtlasPageTables, size_t(page_count_) * tiles_per_page);
+    auto *refs = w.AddOwnedChunk<uint8_t>(SceneCache::ChAtlasTileRefs, size_t(page_count_) * tiles_per_page);
+
+    size_t splitters_size = 0;
+    for (int i = 0; i < page_count_; i++) {
+        splitters_size += splitters_[i].state_size();
+    }
+    auto *splitters = w.AddOwnedChunk<uint8_t>(SceneCache::ChAtlasSplitters, splitters_size);
+
+    // committed tiles of each format are packed together, page tables refer to them by index
+    uint32_t tiles_count[2] = {};
+    for (int i = 0; i < page_count_; i++) {
+        const page_t &p = pages_[i];
+        for (const pixel_color8_t *tile : p.tiles) {
+            if (tile != empty_tile_) tiles_count[p.compressed]++;
         }
     }
-}
\ No newline at end of file
+
+    pixel_color8_t *tiles[2] = {
+        w.AddOwnedChunk<pixel_color8_t>(SceneCache::ChAtlasTiles, size_t(tiles_count[0]) * TileStorage[0]),
+        w.AddOwnedChunk<pixel_color8_t>(SceneCache::ChAtlasCompressedTiles, size_t(tiles_count[1]) * TileStorage[1])
+    };
+
+    uint32_t tile_index[2] = {};
+    for (int i = 0; i < page_count_; i++) {
+        const page_t &p = pages_[i];
+
+        headers[i].compressed = p.compressed ? 1 : 0;
+        headers[i].splitter_state_size = (uint32_t)splitters_[i].state_size();
+
+        memcpy(splitters, splitters_[i].state(), splitters_[i].state_size());
+        splitters += splitters_[i].state_size();
+
+        memcpy(&refs[size_t(i) * tiles_per_page], &p.refs[0], tiles_per_page);
+
+        for (int j = 0; j < tiles_per_page; j++) {
+            uint32_t &index = page_tables[size_t(i) * tiles_per_page + j];
+            if (p.tiles[j] == empty_tile_) {
+                index = EmptyTileIndex;
+                continue;
+            }
+
+            index = tile_index[p.compressed]++;
+            memcpy(&tiles[p.compressed][size_t(index) * TileStorage[p.compressed]], p.tiles[j], TileStorage[p.compressed] * sizeof(pixel_color8_t));
+        }
+    }
+}
+
+bool Ray::Ref::TextureAtlasTiled::Load(const SceneCache::Reader &r) {
+    const int tiles_per_page = res_in_tiles_[0] * res_in_tiles_[1];
+
+    size_t page_count, page_tables_count, refs_count, splitters_size, tiles_storage_count[2];
+    const auto *headers = r.GetChunk<atlas_page_header_t>(SceneCache::ChAtlasPages, page_count);
+    const auto *page_tables = r.GetChunk<uint32_t>(SceneCache::ChAtlasPageTables, page_tables_count);
+    const auto *refs = r.GetChunk<uint8_t>(SceneCache::ChAtlasTileRefs, refs_count);
+    const auto *splitters = r.GetChunk<uint8_t>(SceneCache::ChAtlasSplitters, splitters_size);
+    const pixel_color8_t *tiles[2] = {
+        r.GetChunk<pixel_color8_t>(SceneCache::ChAtlasTiles, tiles_storage_count[0]),
+        r.GetChunk<pixel_color8_t>(SceneCache::ChAtlasCompressedTiles, tiles_storage_count[1])
+    };
+
+    if (!headers || !page_tables || !refs || !splitters || !tiles[0] || !tiles[1] || !page_count ||
+        page_tables_count != page_count * tiles_per_page || refs_count != page_tables_count ||
+        tiles_storage_count[0] % TileStorage[0] || tiles_storage_count[1] % TileStorage[1]) {
+        return false;
+    }
+
+    const size_t tiles_count[2] = { tiles_storage_count[0] / TileStorage[0], tiles_storage_count[1] / TileStorage[1] };
+
+    // splitters are restored first, they validate their own state
+    std::vector<TextureSplitter> new_splitters(page_count, TextureSplitter{ &res_[0] });
+    for (size_t i = 0; i < page_count; i++) {
+        if (headers[i].splitter_state_size > splitters_size ||
+            !new_splitters[i].SetState(splitters, headers[i].splitter_state_size)) {
+            return false;
+        }
+        splitters += headers[i].splitter_state_size;
+        splitters_size -= headers[i].splitter_state_size;
+
+        for (int j = 0; j < tiles_per_page; j++) {
+            const uint32_t index = page_tables[i * tiles_per_page + j];
+            if (index != EmptyTileIndex && index >= tiles_count[headers[i].compressed != 0]) return false;
+        }
+    }
+
+    // tile pool is reset to its initial state (shared empty tile + the rest of the first chunk)
+    tile_chunks_.resize(1);
+    free_tiles_[0].clear();
+    free_tiles_[1].clear();
+    for (int i = TilesPerChunk - 1; i > 0; i--) {
+        free_tiles_[0].push_back(&tile_chunks_[0][i * TileStorage[0]]);
+    }
+
+    // all committed tiles of each format are copied in one go, page tables are fixed up to point into new chunks
+    pixel_color8_t *tiles_base[2] = {};
+    for (int i = 0; i < 2; i++) {
+        if (!tiles_count[i]) continue;
+        tile_chunks_.emplace_back(new pixel_color8_t[tiles_storage_count[i]]);
+        tiles_base[i] = tile_chunks_.back().get();
+        memcpy(tiles_base[i], tiles[i], tiles_storage_count[i] * sizeof(pixel_color8_t));
+    }
+
+    pages_.clear();
+    pages_.resize(page_count);
+    for (size_t i = 0; i < page_count; i++) {
+        page_t &p = pages_[i];
+        p.compressed = headers[i].compressed != 0;
+        p.refs.assign(&refs[i * tiles_per_page], &refs[(i + 1) * tiles_per_page]);
+        p.tiles.resize(tiles_per_page);
+        for (int j = 0; j < tiles_per_page; j++) {
+            const uint32_t index = page_tables[i * tiles_per_page + j];
+            p.tiles[j] = (index == EmptyTileIndex) ? empty_tile_ : &tiles_base[p.compressed][size_t(index) * TileStorage[p.compressed]];
+        }
+    }
+
+    splitters_ = std::move(new_splitters);
+    page_count_ = (int)page_count;
+
+    committed_tiles_count_ = int(tiles_count[0] + tiles_count[1]);
+    committed_memory_ = (tiles_storage_count[0] + tiles_storage_count[1]) * sizeof(pixel_color8_t);
+
+    return true;
+}
@@ -1,9 +1,17 @@
 #pragma once
 
+#include <memory>
+
 #include "Core.h"
 #include "TextureSplitter.h"
+#include "TextureUtilsRef.h"
 
 namespace Ray {
+namespace SceneCache {
+class Reader;
+class Writer;
+}
+
 namespace Ref {
 class TextureAtlasLinear {
     const int   res_[2];
@@ -31,26 +39,70 @@ public:
         return Get(page, int(x * res_[0] - 0.5f), int(y * res_[1] - 0.5f));
     }
 
+    force_inline void Get2x2(int page, int x, int y, pixel_color8_t out[4]) const {
+        out[0] = Get(page, x + 0, y + 0);
+        out[1] = Get(page, x + 1, y + 0);
+        out[2] = Get(page, x + 0, y + 1);
+        out[3] = Get(page, x + 1, y + 1);
+    }
+
     int Allocate(const pixel_color8_t *data, const int res[2], int pos[2]);
     bool Free(int page, const int pos[2]);
 
     bool Resize(int new_page_count);
 };
 
+/** Sparse atlas, pages are split in tiles which are committed from common pool only when texture data is written,
+    so memory usage grows with number of used texels rather than with number of pages.
+    Page can also store texels in BC3 compressed 4x4 blocks (4 times less memory), compressed and uncompressed textures
+    are never placed on the same page
+*/
 class TextureAtlasTiled {
     static const int TileSize = 8;
+    static const int TilesPerChunk = 256; ///< Number of tiles pool is extended by at once
+    static const int BlockSize = 4;
+    static const int TileBlocks = TileSize / BlockSize;
+    /// Storage size of tile in pixel_color8_t units for uncompressed and compressed page
+    static const int TileStorage[2];
 
     const int   res_[2], res_in_tiles_[2];
     const float res_f_[2];
     int         page_count_;
 
-    using PageData = std::vector<pixel_color8_t>;
+    struct page_t {
+        std::vector<pixel_color8_t *> tiles;  ///< Page table, uncommitted tiles point to shared empty tile
+        std::vector<uint8_t>          refs;   ///< Number of allocated regions overlapping each tile
+        bool                          compressed = false;
+    };
 
     std::vector<TextureSplitter> splitters_;
-    std::vector<PageData>        pages_;
+    std::vector<page_t>          pages_;
     std::vector<pixel_color8_t>  temp_storage_;
 
+    std::vector<std::unique_ptr<pixel_color8_t[]>> tile_chunks_;
+    std::vector<pixel_color8_t *> free_tiles_[2];
+    pixel_color8_t *empty_tile_;
+    int committed_tiles_count_ = 0;
+    size_t committed_memory_ = 0;
+
+    void CommitTiles(int page, const int pos[2], const int size[2]);
+    void ReleaseTiles(int page, const int pos[2], const int size[2]);
     void WritePageData(int page, int posx, int posy, int sizex, int sizey, const pixel_color8_t *data);
+    int AllocateRegion(const int res[2], bool compressed, int pos[2]);
+
+    static void GetEncodedSize(const int res[2], int out_size[2]) {
+        // all regions of compressed page are block-aligned, so blocks are never shared between textures
+        out_size[0] = BlockSize * ((res[0] + 2 + BlockSize - 1) / BlockSize);
+        out_size[1] = BlockSize * ((res[1] + 2 + BlockSize - 1) / BlockSize);
+    }
+
+    force_inline uint8_t *GetBlock(const page_t &p, int x, int y) const {
+        const int tilex = x / TileSize, tiley = y / TileSize;
+        const int in_tilex = (x % TileSize) / BlockSize, in_tiley = (y % TileSize) / BlockSize;
+
+        auto *tile = reinterpret_cast<uint8_t *>(p.tiles[tiley * res_in_tiles_[0] + tilex]);
+        return &tile[(in_tiley * TileBlocks + in_tilex) * BlockSizeBC3];
+    }
 public:
     TextureAtlasTiled(int resx, int resy, int initial_page_count = 1);
 
@@ -58,20 +110,76 @@ public:
     force_inline float size_y() const { return res_f_[1]; }
 
     force_inline pixel_color8_t Get(int page, int x, int y) const {
+        const page_t &p = pages_[page];
+        if (p.compressed) {
+            return DecodeTexelBC3(GetBlock(p, x, y), (y % BlockSize) * BlockSize + (x % BlockSize));
+        }
+
         int tilex = x / TileSize, tiley = y / TileSize;
         int in_tilex = x % TileSize, in_tiley = y % TileSize;
 
-        return pages_[page][(tiley * res_in_tiles_[0] + tilex) * TileSize * TileSize + in_tiley * TileSize + in_tilex];
+        return p.tiles[tiley * res_in_tiles_[0] + tilex][in_tiley * TileSize + in_tilex];
     }
 
     force_inline pixel_color8_t Get(int page, float x, float y) const {
         return Get(page, int(x * res_[0] - 0.5f), int(y * res_[1] - 0.5f));
     }
 
-    int Allocate(const pixel_color8_t *data, const int res[2], int pos[2]);
+    /// Fetches 2x2 texels needed for bilinear filtering, for compressed page block is decoded once if quad does not cross it
+    force_inline void Get2x2(int page, int x, int y, pixel_color8_t out[4]) const {
+        const page_t &p = pages_[page];
+        if (p.compressed && (x % BlockSize) != BlockSize - 1 && (y % BlockSize) != BlockSize - 1) {
+            const uint8_t *block = GetBlock(p, x, y);
+
+            pixel_color8_t colors[4];
+            uint8_t alphas[8];
+            DecodePaletteBC3(block, colors, alphas);
+
+            const int i = (y % BlockSize) * BlockSize + (x % BlockSize);
+            const int texels[] = { i, i + 1, i + BlockSize, i + BlockSize + 1 };
+            for (int j = 0; j < 4; j++) {
+                out[j] = colors[ColorIndexBC3(block, texels[j])];
+                out[j].a = alphas[AlphaIndexBC3(block, texels[j])];
+            }
+            return;
+        }
+
+        out[0] = Get(page, x + 0, y + 0);
+        out[1] = Get(page, x + 1, y + 0);
+        out[2] = Get(page, x + 0, y + 1);
+        out[3] = Get(page, x + 1, y + 1);
+    }
+
+    /** Places texture on page with matching storage format (empty page adopts requested format)
+        @param compress store texture in compressed 4x4 blocks, texture is encoded here
+    */
+    int Allocate(const pixel_color8_t *data, const int res[2], int pos[2], bool compress = false);
+
+    /** Encodes texture (with border) in blocks ready to be placed on compressed page,
+        does not touch atlas, so can be called for many textures in parallel
+    */
+    static void EncodeBlocks(const pixel_color8_t *data, const int res[2], std::vector<uint8_t> &out_blocks);
+
+    /// Places texture previously encoded with EncodeBlocks on compressed page
+    int AllocateEncoded(const uint8_t *blocks, const int res[2], int pos[2]);
     bool Free(int page, const int pos[2]);
 
     bool Resize(int new_page_count);
+
+    /// Adds pages, page tables and committed tiles to scene cache (page tables are stored as tile indices)
+    void Save(SceneCache::Writer &w) const;
+
+    /// Replaces atlas content with one stored in scene cache, returns false (atlas is not changed) if data is malformed
+    bool Load(const SceneCache::Reader &r);
+
+    /// Number of tiles which hold texture data
+    int committed_tiles_count() const { return committed_tiles_count_; }
+
+    /// Size of memory in bytes occupied by committed tiles
+    size_t committed_memory() const { return committed_memory_; }
+
+    /// Size of tile in pixels
+    static int tile_size() { return TileSize; }
 };
 }
 }
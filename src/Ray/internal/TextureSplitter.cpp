@@ -101,8 +101,7 @@ int Ray::TextureSplitter::Insert_Recursive(int i, const int res[2]) {
 }
 
 int Ray::TextureSplitter::Find_Recursive(int i, const int pos[2]) const {
-    if (nodes_[i].is_free ||
-            pos[0] < nodes_[i].pos[0] || pos[0] > (nodes_[i].pos[0] + nodes_[i].size[0]) ||
+    if (pos[0] < nodes_[i].pos[0] || pos[0] > (nodes_[i].pos[0] + nodes_[i].size[0]) ||
             pos[1] < nodes_[i].pos[1] || pos[1] > (nodes_[i].pos[1] + nodes_[i].size[1])) {
         return -1;
     }
@@ -114,7 +113,7 @@ int Ray::TextureSplitter::Find_Recursive(int i, const int pos[2]) const {
         if (ndx != -1) return ndx;
         return Find_Recursive(ch1, pos);
     } else {
-        if (pos[0] == nodes_[i].pos[0] && pos[1] == nodes_[i].pos[1]) {
+        if (!nodes_[i].is_free && pos[0] == nodes_[i].pos[0] && pos[1] == nodes_[i].pos[1]) {
             return i;
         } else {
             return -1;
@@ -151,4 +150,27 @@ void Ray::TextureSplitter::SafeErase(int i, int *indices, int num) {
             indices[j] = i;
         }
     }
+}
+
+bool Ray::TextureSplitter::SetState(const void *state, size_t size) {
+    if (!size || size % sizeof(node_t)) return false;
+
+    const auto *nodes = reinterpret_cast<const node_t *>(state);
+    const int nodes_count = int(size / sizeof(node_t));
+
+    // root must keep size of page
+    if (nodes[0].parent != -1 || nodes[0].size[0] != nodes_[0].size[0] || nodes[0].size[1] != nodes_[0].size[1]) {
+        return false;
+    }
+
+    for (int i = 0; i < nodes_count; i++) {
+        const node_t &n = nodes[i];
+        if (n.parent < -1 || n.parent >= nodes_count || n.child[0] < -1 || n.child[0] >= nodes_count ||
+            n.child[1] < -1 || n.child[1] >= nodes_count) {
+            return false;
+        }
+    }
+
+    nodes_.assign(nodes, nodes + nodes_count);
+    return true;
 }
\ No newline at end of file
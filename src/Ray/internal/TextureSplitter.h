@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 #include <vector>
 
 namespace Ray {
@@ -11,7 +13,7 @@ class TextureSplitter {
         bool is_free = true;
 
         bool has_children() const {
-            return child[0] != 0 || child[1] != 0;
+            return child[0] != -1 || child[1] != -1;
         }
     };
 
@@ -36,6 +38,11 @@ public:
     bool Free(int i);
 
     int FindNode(const int pos[2], int size[2]) const;
+
+    // nodes are trivially copyable, so splitter state can be saved and restored as raw memory
+    const void *state() const { return &nodes_[0]; }
+    size_t state_size() const { return nodes_.size() * sizeof(node_t); }
+    bool SetState(const void *state, size_t size);
 };
 
 }
\ No newline at end of file
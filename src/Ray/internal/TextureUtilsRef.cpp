@@ -2,39 +2,130 @@
 
 #include "CoreRef.h"
 
+#include <cfloat>
 #include <cmath>
+#include <cstring>
 
+#include <algorithm>
 #include <array>
+#include <limits>
 
-std::vector<Ray::pixel_color8_t> Ray::Ref::DownsampleTexture(const std::vector<pixel_color8_t> &_tex, const int res[2]) {
-    if (res[0] == 1 || res[1] == 1) return _tex;
-    
-    const pixel_color8_t *tex = &_tex[0];
+namespace Ray {
+namespace Ref {
+const int LinearLutSize = 4096;
 
-    // TODO: properly downsample non-power-of-2 textures
+struct srgb_tables_t {
+    float to_linear[256];
+    float thresholds[256];  ///< Linear values halfway between neighbouring sRGB values (used for exact rounding)
+    uint8_t from_linear[LinearLutSize];  ///< Approximate conversion from linear, refined with thresholds
 
-    std::vector<pixel_color8_t> ret;
-    ret.reserve(res[0] * res[1] / 4);
+    srgb_tables_t() {
+        auto srgb_to_linear = [](float c) -> float {
+            return (c < 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        };
 
-    for (int j = 0; j < res[1]; j += 2) {
-        for (int i = 0; i < res[0]; i += 2) {
-            int r = tex[(j + 0) * res[0] + i].r + tex[(j + 0) * res[0] + i + 1].r +
-                    tex[(j + 1) * res[0] + i].r + tex[(j + 1) * res[0] + i + 1].r;
-            int g = tex[(j + 0) * res[0] + i].g + tex[(j + 0) * res[0] + i + 1].g +
-                    tex[(j + 1) * res[0] + i].g + tex[(j + 1) * res[0] + i + 1].g;
-            int b = tex[(j + 0) * res[0] + i].b + tex[(j + 0) * res[0] + i + 1].b +
-                    tex[(j + 1) * res[0] + i].b + tex[(j + 1) * res[0] + i + 1].b;
-            int a = tex[(j + 0) * res[0] + i].a + tex[(j + 0) * res[0] + i + 1].a +
-                    tex[(j + 1) * res[0] + i].a + tex[(j + 1) * res[0] + i + 1].a;
+        for (int i = 0; i < 256; i++) {
+            to_linear[i] = srgb_to_linear(i / 255.0f);
+        }
+        for (int i = 0; i < 255; i++) {
+            thresholds[i] = srgb_to_linear((i + 0.5f) / 255.0f);
+        }
+        thresholds[255] = FLT_MAX;
+
+        for (int i = 0, j = 0; i < LinearLutSize; i++) {
+            while (thresholds[j] <= float(i) / (LinearLutSize - 1)) j++;
+            from_linear[i] = uint8_t(j);
+        }
+    }
+};
+
+const srgb_tables_t &srgb_tables() {
+    static const srgb_tables_t tables;
+    return tables;
+}
+
+force_inline simd_fvec4 to_float(const pixel_color8_t &p, const float lut[256]) {
+    return simd_fvec4{ lut[p.r], lut[p.g], lut[p.b], p.a * (1.0f / 255.0f) };
+}
+
+force_inline uint8_t to_srgb8(float val, const srgb_tables_t &tables) {
+    val = std::min(std::max(val, 0.0f), 1.0f);
+
+    // lut gives lower bound, at most a few steps are needed to reach exact value
+    int ret = tables.from_linear[int(val * (LinearLutSize - 1))];
+    while (val >= tables.thresholds[ret]) ret++;
+    return uint8_t(ret);
+}
+
+force_inline uint8_t to_unorm8(float val) {
+    return uint8_t(std::min(std::max(val, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+/// Computes source texels (and their weights) contributing to destination texel, odd sizes use 3 taps to cover whole source
+force_inline int DownsampleTaps(int x, int src_res, int dst_res, int out_taps[3], float out_weights[3]) {
+    out_taps[0] = 2 * x;
+    out_taps[1] = 2 * x + 1;
+    if (src_res == 2 * dst_res) {
+        out_weights[0] = out_weights[1] = 0.5f;
+        return 2;
+    }
+
+    out_taps[2] = 2 * x + 2;
+    out_weights[0] = float(dst_res - x) / src_res;
+    out_weights[1] = float(dst_res) / src_res;
+    out_weights[2] = float(x + 1) / src_res;
+    return 3;
+}
+}
+}
+
+void Ray::Ref::DownsampleTexture(const pixel_color8_t *tex, const int res[2], bool is_srgb, pixel_color8_t *out_tex, int out_row_beg, int out_row_end) {
+    const int out_res[2] = { res[0] / 2, res[1] / 2 };
+
+    const srgb_tables_t &tables = srgb_tables();
 
-            ret.push_back({
-                uint8_t(r / 4), uint8_t(g / 4),
-                uint8_t(b / 4), uint8_t(a / 4)
-            });
+    float unorm_lut[256];
+    if (!is_srgb) {
+        for (int i = 0; i < 256; i++) {
+            unorm_lut[i] = i / 255.0f;
         }
     }
+    const float *lut = is_srgb ? tables.to_linear : unorm_lut;
+
+    // source rows are filtered vertically first, then horizontally
+    aligned_vector<simd_fvec4> row(res[0]);
+
+    for (int y = out_row_beg; y < out_row_end; y++) {
+        int taps[3];
+        float weights[3];
+        const int taps_count = DownsampleTaps(y, res[1], out_res[1], taps, weights);
+
+        for (int x = 0; x < res[0]; x++) {
+            row[x] = to_float(tex[taps[0] * res[0] + x], lut) * weights[0];
+        }
+        for (int k = 1; k < taps_count; k++) {
+            const pixel_color8_t *src_row = &tex[taps[k] * res[0]];
+            for (int x = 0; x < res[0]; x++) {
+                row[x] += to_float(src_row[x], lut) * weights[k];
+            }
+        }
+
+        pixel_color8_t *out_row = &out_tex[y * out_res[0]];
+        for (int x = 0; x < out_res[0]; x++) {
+            const int row_taps_count = DownsampleTaps(x, res[0], out_res[0], taps, weights);
 
-    return ret;
+            simd_fvec4 col = row[taps[0]] * weights[0];
+            for (int k = 1; k < row_taps_count; k++) {
+                col += row[taps[k]] * weights[k];
+            }
+
+            if (is_srgb) {
+                out_row[x] = { to_srgb8(col[0], tables), to_srgb8(col[1], tables), to_srgb8(col[2], tables), to_unorm8(col[3]) };
+            } else {
+                out_row[x] = { to_unorm8(col[0]), to_unorm8(col[1]), to_unorm8(col[2]), to_unorm8(col[3]) };
+            }
+        }
+    }
 }
 
 void Ray::Ref::ComputeTangentBasis(size_t vtx_offset, size_t vtx_start, std::vector<vertex_t> &vertices, std::vector<uint32_t> &new_vtx_indices,
@@ -176,3 +267,168 @@ void Ray::Ref::ComputeTangentBasis(size_t vtx_offset, size_t vtx_start, std::vec
         }
     }
 }
+
+void Ray::Ref::CompressBlockBC3(const pixel_color8_t in[16], uint8_t out[BlockSizeBC3]) {
+    memset(out, 0, BlockSizeBC3);
+
+    {   // alpha endpoints are taken from range of block values
+        int a_min = 255, a_max = 0;
+        for (int i = 0; i < 16; i++) {
+            a_min = std::min(a_min, int(in[i].a));
+            a_max = std::max(a_max, int(in[i].a));
+        }
+
+        out[0] = uint8_t(a_max);
+        out[1] = uint8_t(a_min);
+
+        if (a_max != a_min) {
+            uint8_t alphas[8];
+            for (int j = 0; j < 8; j++) {
+                alphas[j] = DecodeAlphaBC3(out, j);
+            }
+
+            uint64_t bits = 0;
+            for (int i = 0; i < 16; i++) {
+                int best_index = 0, best_dist = 256;
+                for (int j = 0; j < 8; j++) {
+                    const int dist = std::abs(int(in[i].a) - int(alphas[j]));
+                    if (dist < best_dist) {
+                        best_index = j;
+                        best_dist = dist;
+                    }
+                }
+                bits |= uint64_t(best_index) << (3 * i);
+            }
+
+            for (int j = 0; j < 6; j++) {
+                out[2 + j] = uint8_t(bits >> (8 * j));
+            }
+        }
+    }
+
+    // color endpoints are found by projecting block values onto their principal axis
+    float mean[3] = {};
+    for (int i = 0; i < 16; i++) {
+        mean[0] += in[i].r;
+        mean[1] += in[i].g;
+        mean[2] += in[i].b;
+    }
+    for (float &m : mean) m /= 16.0f;
+
+    float cov[6] = {};
+    for (int i = 0; i < 16; i++) {
+        const float d[3] = { in[i].r - mean[0], in[i].g - mean[1], in[i].b - mean[2] };
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+
+    // power iteration converges quickly enough for 3x3 matrix
+    float axis[3] = { 0.9f, 1.0f, 0.7f };
+    for (int iter = 0; iter < 8; iter++) {
+        const float next[3] = { cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                                cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                                cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2] };
+        const float len = std::max(std::max(std::abs(next[0]), std::abs(next[1])), std::abs(next[2]));
+        if (len < FLT_EPS) break;
+        for (int j = 0; j < 3; j++) axis[j] = next[j] / len;
+    }
+
+    float t_min = FLT_MAX, t_max = -FLT_MAX;
+    for (int i = 0; i < 16; i++) {
+        const float t = (in[i].r - mean[0]) * axis[0] + (in[i].g - mean[1]) * axis[1] + (in[i].b - mean[2]) * axis[2];
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+
+    const float axis_len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    if (axis_len2 > FLT_EPS) {
+        t_min /= axis_len2;
+        t_max /= axis_len2;
+    } else {
+        t_min = t_max = 0.0f;
+    }
+
+    auto to_565 = [](const float c[3]) -> int {
+        const int r = std::min(std::max(int(c[0] * 31.0f / 255.0f + 0.5f), 0), 31),
+                  g = std::min(std::max(int(c[1] * 63.0f / 255.0f + 0.5f), 0), 63),
+                  b = std::min(std::max(int(c[2] * 31.0f / 255.0f + 0.5f), 0), 31);
+        return (r << 11) | (g << 5) | b;
+    };
+
+    const float e0[3] = { mean[0] + axis[0] * t_max, mean[1] + axis[1] * t_max, mean[2] + axis[2] * t_max },
+                e1[3] = { mean[0] + axis[0] * t_min, mean[1] + axis[1] * t_min, mean[2] + axis[2] * t_min };
+
+    // writes endpoints, selects closest palette color for each texel and returns total squared error
+    auto write_colors = [&](int c0, int c1) -> int {
+        // first endpoint must be greater to select 4-color mode
+        if (c0 < c1) std::swap(c0, c1);
+
+        out[8] = uint8_t(c0 & 0xff);
+        out[9] = uint8_t(c0 >> 8);
+        out[10] = uint8_t(c1 & 0xff);
+        out[11] = uint8_t(c1 >> 8);
+        out[12] = out[13] = out[14] = out[15] = 0;
+
+        pixel_color8_t colors[4];
+        uint8_t alphas[8];
+        DecodePaletteBC3(out, colors, alphas);
+
+        const int palette_size = (c0 == c1) ? 1 : 4;
+
+        int error = 0;
+        for (int i = 0; i < 16; i++) {
+            int best_index = 0, best_dist = std::numeric_limits<int>::max();
+            for (int j = 0; j < palette_size; j++) {
+                const int dr = int(in[i].r) - colors[j].r, dg = int(in[i].g) - colors[j].g, db = int(in[i].b) - colors[j].b;
+                const int dist = dr * dr + dg * dg + db * db;
+                if (dist < best_dist) {
+                    best_index = j;
+                    best_dist = dist;
+                }
+            }
+            out[12 + i / 4] |= uint8_t(best_index << (2 * (i % 4)));
+            error += best_dist;
+        }
+        return error;
+    };
+
+    const int error = write_colors(to_565(e0), to_565(e1));
+    if (!error) return;
+
+    // refine endpoints with least squares fit for selected indices
+    static const float weights[] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = {}, bx[3] = {};
+    for (int i = 0; i < 16; i++) {
+        const float a = weights[ColorIndexBC3(out, i)], b = 1.0f - a;
+        const float x[3] = { float(in[i].r), float(in[i].g), float(in[i].b) };
+
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int j = 0; j < 3; j++) {
+            ax[j] += a * x[j];
+            bx[j] += b * x[j];
+        }
+    }
+
+    const float det = aa * bb - ab * ab;
+    if (std::abs(det) < FLT_EPS) return;
+
+    float r0[3], r1[3];
+    for (int j = 0; j < 3; j++) {
+        r0[j] = (ax[j] * bb - bx[j] * ab) / det;
+        r1[j] = (bx[j] * aa - ax[j] * ab) / det;
+    }
+
+    uint8_t prev_block[BlockSizeBC3];
+    memcpy(prev_block, out, BlockSizeBC3);
+
+    if (write_colors(to_565(r0), to_565(r1)) > error) {
+        memcpy(out, prev_block, BlockSizeBC3);
+    }
+}
@@ -7,9 +7,75 @@
 
 namespace Ray {
 namespace Ref {
-     std::vector<pixel_color8_t> DownsampleTexture(const std::vector<pixel_color8_t> &_tex, const int res[2]);
+     /** Downsamples texture to (res[0] / 2) x (res[1] / 2), odd dimensions are filtered with 3 taps so whole source is covered
+         @param is_srgb filter color in linear space
+         @param out_row_beg, out_row_end range of destination rows to process (so level can be split between threads)
+     */
+     void DownsampleTexture(const pixel_color8_t *tex, const int res[2], bool is_srgb, pixel_color8_t *out_tex, int out_row_beg, int out_row_end);
 
      void ComputeTangentBasis(size_t vtx_offset, size_t vtx_start, std::vector<vertex_t> &vertices, std::vector<uint32_t> &new_vtx_indices,
                               const uint32_t *indices, size_t indices_count);
+
+     /// Size of compressed 4x4 block in bytes
+     const int BlockSizeBC3 = 16;
+
+     /** Encodes 4x4 block of texels (row by row) in BC3 (DXT5) format: two RGB565 endpoints with 2-bit indices for color
+         and two 8-bit endpoints with 3-bit indices for alpha
+     */
+     void CompressBlockBC3(const pixel_color8_t in[16], uint8_t out[BlockSizeBC3]);
+
+     force_inline void DecodeEndpoint565(const uint8_t *p, int out_rgb[3]) {
+         const int c = p[0] | (p[1] << 8);
+         out_rgb[0] = ((c >> 11) & 0x1f) * 255 / 31;
+         out_rgb[1] = ((c >> 5) & 0x3f) * 255 / 63;
+         out_rgb[2] = (c & 0x1f) * 255 / 31;
+     }
+
+     force_inline int ColorIndexBC3(const uint8_t block[BlockSizeBC3], int i) {
+         return (block[12 + i / 4] >> (2 * (i % 4))) & 0x3;
+     }
+
+     force_inline int AlphaIndexBC3(const uint8_t block[BlockSizeBC3], int i) {
+         const int bit = 3 * i;
+         return ((block[2 + bit / 8] | (block[3 + bit / 8] << 8)) >> (bit % 8)) & 0x7;
+     }
+
+     force_inline uint8_t DecodeAlphaBC3(const uint8_t block[BlockSizeBC3], int index) {
+         const int a0 = block[0], a1 = block[1];
+         if (index < 2) return uint8_t(index ? a1 : a0);
+         if (a0 > a1) return uint8_t(((8 - index) * a0 + (index - 1) * a1) / 7);
+         if (index < 6) return uint8_t(((6 - index) * a0 + (index - 1) * a1) / 5);
+         return uint8_t(index == 6 ? 0 : 255);
+     }
+
+     /// Decodes single texel of 4x4 block
+     force_inline pixel_color8_t DecodeTexelBC3(const uint8_t block[BlockSizeBC3], int i) {
+         // weight of first endpoint for each color index (always 4-color mode)
+         static const int weights[] = { 3, 0, 2, 1 };
+
+         int c0[3], c1[3];
+         DecodeEndpoint565(&block[8], c0);
+         DecodeEndpoint565(&block[10], c1);
+
+         const int w0 = weights[ColorIndexBC3(block, i)], w1 = 3 - w0;
+         return pixel_color8_t{ uint8_t((w0 * c0[0] + w1 * c1[0]) / 3), uint8_t((w0 * c0[1] + w1 * c1[1]) / 3),
+                                uint8_t((w0 * c0[2] + w1 * c1[2]) / 3), DecodeAlphaBC3(block, AlphaIndexBC3(block, i)) };
+     }
+
+     /// Decodes color palette of 4x4 block once, to be used when several texels of the same block are fetched
+     force_inline void DecodePaletteBC3(const uint8_t block[BlockSizeBC3], pixel_color8_t out_colors[4], uint8_t out_alphas[8]) {
+         int c0[3], c1[3];
+         DecodeEndpoint565(&block[8], c0);
+         DecodeEndpoint565(&block[10], c1);
+
+         out_colors[0] = pixel_color8_t{ uint8_t(c0[0]), uint8_t(c0[1]), uint8_t(c0[2]), 0 };
+         out_colors[1] = pixel_color8_t{ uint8_t(c1[0]), uint8_t(c1[1]), uint8_t(c1[2]), 0 };
+         out_colors[2] = pixel_color8_t{ uint8_t((2 * c0[0] + c1[0]) / 3), uint8_t((2 * c0[1] + c1[1]) / 3), uint8_t((2 * c0[2] + c1[2]) / 3), 0 };
+         out_colors[3] = pixel_color8_t{ uint8_t((c0[0] + 2 * c1[0]) / 3), uint8_t((c0[1] + 2 * c1[1]) / 3), uint8_t((c0[2] + 2 * c1[2]) / 3), 0 };
+
+         for (int j = 0; j < 8; j++) {
+             out_alphas[j] = DecodeAlphaBC3(block, j);
+         }
+     }
 }
 }
\ No newline at end of file
@@ -51,7 +51,8 @@ namespace Ray {
         bool
             sse2_supported = false,
             avx_supported = false,
-            avx2_supported = false;
+            avx2_supported = false,
+            avx512_supported = false;
     };
 
     inline CpuFeatures GetCpuFeatures() {
@@ -70,15 +71,17 @@ namespace Ray {
             ret.sse2_supported = (info[3] & ((int)1 << 26)) != 0;
 
             bool os_uses_XSAVE_XRSTORE = (info[2] & (1 << 27)) != 0;
-            bool os_saves_YMM = false;
+            bool os_saves_YMM = false, os_saves_ZMM = false;
             if (os_uses_XSAVE_XRSTORE) {
                 // Check if the OS will save the YMM registers
                 // _XCR_XFEATURE_ENABLED_MASK = 0
                 unsigned long long xcr_feature_mask = _xgetbv(0);
-                os_saves_YMM = (xcr_feature_mask & 0x6) != 0;
+                os_saves_YMM = (xcr_feature_mask & 0x6) == 0x6;
+                // Upper halves of ZMM0-15, ZMM16-31 and opmask registers
+                os_saves_ZMM = (xcr_feature_mask & 0xE6) == 0xE6;
             }
 
-            bool cpu_FMA_support = (info[3] & ((int)1 << 12)) != 0;
+            bool cpu_FMA_support = (info[2] & ((int)1 << 12)) != 0;
 
             bool cpu_AVX_support = (info[2] & (1 << 28)) != 0;
             ret.avx_supported = os_saves_YMM && cpu_AVX_support;
@@ -89,6 +92,10 @@ namespace Ray {
                 bool cpu_AVX2_support = (info[1] & (1 << 5)) != 0;
                 // use fma in conjunction with avx2 support (like microsoft compiler does)
                 ret.avx2_supported = os_saves_YMM && cpu_AVX2_support && cpu_FMA_support;
+
+                bool cpu_AVX512F_support = (info[1] & (1 << 16)) != 0;
+                bool cpu_AVX512DQ_support = (info[1] & (1 << 17)) != 0;
+                ret.avx512_supported = os_saves_ZMM && cpu_AVX512F_support && cpu_AVX512DQ_support && ret.avx2_supported;
             }
         }
 #elif defined(__i386__) || defined(__x86_64__)
@@ -673,6 +673,8 @@ force_inline simd_comp_where_helper<T, S, true> where_not(const simd_vec<T, S> &
 #include "simd_vec_sse.h"
 #elif defined(USE_AVX) || defined(USE_AVX2)
 #include "simd_vec_avx.h"
+#elif defined(USE_AVX512)
+#include "simd_vec_avx512.h"
 #elif defined(USE_NEON)
 #include "simd_vec_neon.h"
 #endif
@@ -705,7 +707,7 @@ using simd_dvec16 = simd_dvec<16>;
 }
 }
 
-#if !defined(USE_SSE2) && !defined(USE_AVX) && !defined(USE_AVX2) && !defined(USE_NEON)
+#if !defined(USE_SSE2) && !defined(USE_AVX) && !defined(USE_AVX2) && !defined(USE_AVX512) && !defined(USE_NEON)
 namespace Ray {
 namespace NS {
 using native_simd_fvec = simd_fvec<1>;
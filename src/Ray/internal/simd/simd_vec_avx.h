@@ -813,7 +813,7 @@ force_inline simd_vec<float, 8> fma(const float a, const simd_vec<float, 8> &b,
 #endif
 
 
-#if defined(USE_AVX) || defined(USE_AVX2)
+#if (defined(USE_AVX) || defined(USE_AVX2)) && !defined(USE_AVX512)
 using native_simd_fvec = simd_vec<float, 8>;
 using native_simd_ivec = simd_vec<int, 8>;
 #endif
@@ -0,0 +1,720 @@
+//#pragma once
+
+// 8-wide vectors are still used for single ray traversal of wide bvh nodes
+#define USE_AVX2
+#include "simd_vec_avx.h"
+#undef USE_AVX2
+
+#include <immintrin.h>
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target ("avx512f,avx512dq")
+#endif
+
+#pragma warning(push)
+#pragma warning(disable : 4752)
+
+// Comparisons produce mask registers, they are expanded to full vectors to keep the same representation
+// as other backends (masks are freely reinterpreted between float and int vectors), where() goes back to mask register
+#define _mm512_cmp_ps_vec(a, b, op) \
+    _mm512_castsi512_ps(_mm512_movm_epi32(_mm512_cmp_ps_mask((a), (b), (op))))
+#define _mm512_cmp_epi32_vec(a, b, op) \
+    _mm512_movm_epi32(_mm512_cmp_epi32_mask((a), (b), (op)))
+
+namespace Ray {
+namespace NS {
+
+// Alignment is set explicitly, otherwise it is limited by target options of whole translation unit
+template <>
+class alignas(64) simd_vec<float, 16> {
+    public:
+    union {
+        __m512 vec_;
+        float comp_[16];
+    };
+
+    friend class simd_vec<int, 16>;
+public:
+    force_inline simd_vec() = default;
+    force_inline simd_vec(float f) {
+        vec_ = _mm512_set1_ps(f);
+    }
+    force_inline simd_vec(float f1, float f2, float f3, float f4, float f5, float f6, float f7, float f8,
+                          float f9, float f10, float f11, float f12, float f13, float f14, float f15, float f16) {
+        vec_ = _mm512_setr_ps(f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16);
+    }
+    force_inline simd_vec(const float *f) {
+        vec_ = _mm512_loadu_ps(f);
+    }
+    force_inline simd_vec(const float *f, simd_mem_aligned_tag) {
+        vec_ = _mm512_load_ps(f);
+    }
+
+    force_inline float &operator[](int i) { return comp_[i]; }
+    force_inline float operator[](int i) const { return comp_[i]; }
+
+    force_inline simd_vec<float, 16> &operator+=(const simd_vec<float, 16> &rhs) {
+        vec_ = _mm512_add_ps(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator+=(float rhs) {
+        vec_ = _mm512_add_ps(vec_, _mm512_set1_ps(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator-=(const simd_vec<float, 16> &rhs) {
+        vec_ = _mm512_sub_ps(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator-=(float rhs) {
+        vec_ = _mm512_sub_ps(vec_, _mm512_set1_ps(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator*=(const simd_vec<float, 16> &rhs) {
+        vec_ = _mm512_mul_ps(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator*=(float rhs) {
+        vec_ = _mm512_mul_ps(vec_, _mm512_set1_ps(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator/=(const simd_vec<float, 16> &rhs) {
+        vec_ = _mm512_div_ps(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> &operator/=(float rhs) {
+        vec_ = _mm512_div_ps(vec_, _mm512_set1_ps(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<float, 16> operator-() const;
+    force_inline operator simd_vec<int, 16>() const;
+
+    force_inline simd_vec<float, 16> sqrt() const;
+
+    force_inline float length() const {
+        float temp = 0;
+        ITERATE(16, { temp += comp_[i] * comp_[i]; })
+        return std::sqrt(temp);
+    }
+
+    force_inline float length2() const {
+        float temp = 0;
+        ITERATE(16, { temp += comp_[i] * comp_[i]; })
+        return temp;
+    }
+
+    force_inline void copy_to(float *f) const {
+        _mm512_storeu_ps(f, vec_);
+    }
+
+    force_inline void copy_to(float *f, simd_mem_aligned_tag) const {
+        _mm512_store_ps(f, vec_);
+    }
+
+    force_inline void blend_to(const simd_vec<float, 16> &mask, const simd_vec<float, 16> &v1) {
+        const __mmask16 m = _mm512_movepi32_mask(_mm512_castps_si512(mask.vec_));
+        vec_ = _mm512_mask_blend_ps(m, vec_, v1.vec_);
+    }
+
+    force_inline void blend_inv_to(const simd_vec<float, 16> &mask, const simd_vec<float, 16> &v1) {
+        const __mmask16 m = _mm512_movepi32_mask(_mm512_castps_si512(mask.vec_));
+        vec_ = _mm512_mask_blend_ps(m, v1.vec_, vec_);
+    }
+
+    force_inline static simd_vec<float, 16> min(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    force_inline static simd_vec<float, 16> max(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+
+    force_inline static simd_vec<float, 16> and_not(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+
+    force_inline static simd_vec<float, 16> floor(const simd_vec<float, 16> &v1);
+
+    force_inline static simd_vec<float, 16> ceil(const simd_vec<float, 16> &v1);
+
+    friend force_inline simd_vec<float, 16> operator&(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator|(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator^(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator+(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator-(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator*(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator/(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+
+    friend force_inline simd_vec<float, 16> operator+(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator-(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator*(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator/(const simd_vec<float, 16> &v1, float v2);
+
+    friend force_inline simd_vec<float, 16> operator+(float v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator-(float v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator*(float v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator/(float v1, const simd_vec<float, 16> &v2);
+
+    friend force_inline simd_vec<float, 16> operator<(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator<=(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator>(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+    friend force_inline simd_vec<float, 16> operator>=(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+
+    friend force_inline simd_vec<float, 16> operator<(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator<=(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator>(const simd_vec<float, 16> &v1, float v2);
+    friend force_inline simd_vec<float, 16> operator>=(const simd_vec<float, 16> &v1, float v2);
+
+    friend force_inline simd_vec<float, 16> clamp(const simd_vec<float, 16> &v1, float min, float max);
+    friend force_inline simd_vec<float, 16> pow(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2);
+
+    friend force_inline simd_vec<float, 16> normalize(const simd_vec<float, 16> &v1);
+
+    friend force_inline simd_vec<float, 16> fma(const simd_vec<float, 16> &a, const simd_vec<float, 16> &b, const simd_vec<float, 16> &c);
+    friend force_inline simd_vec<float, 16> fma(const simd_vec<float, 16> &a, const float b, const simd_vec<float, 16> &c);
+    friend force_inline simd_vec<float, 16> fma(const float a, const simd_vec<float, 16> &b, const float c);
+
+    friend force_inline const float *value_ptr(const simd_vec<float, 16> &v1) {
+        return &v1.comp_[0];
+    }
+
+    static int size() { return 16; }
+    static bool is_native() { return true; }
+};
+
+template <>
+class alignas(64) simd_vec<int, 16> {
+    union {
+        __m512i vec_;
+        int comp_[16];
+    };
+
+    friend class simd_vec<float, 16>;
+public:
+    force_inline simd_vec() = default;
+    force_inline simd_vec(int f) {
+        vec_ = _mm512_set1_epi32(f);
+    }
+    force_inline simd_vec(int i1, int i2, int i3, int i4, int i5, int i6, int i7, int i8,
+                          int i9, int i10, int i11, int i12, int i13, int i14, int i15, int i16) {
+        vec_ = _mm512_setr_epi32(i1, i2, i3, i4, i5, i6, i7, i8, i9, i10, i11, i12, i13, i14, i15, i16);
+    }
+    force_inline simd_vec(const int *f) {
+        vec_ = _mm512_loadu_si512((const __m512i *)f);
+    }
+    force_inline simd_vec(const int *f, simd_mem_aligned_tag) {
+        vec_ = _mm512_load_si512((const __m512i *)f);
+    }
+
+    force_inline int &operator[](int i) { return comp_[i]; }
+    force_inline int operator[](int i) const { return comp_[i]; }
+
+    force_inline simd_vec<int, 16> &operator+=(const simd_vec<int, 16> &rhs) {
+        vec_ = _mm512_add_epi32(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator+=(int rhs) {
+        vec_ = _mm512_add_epi32(vec_, _mm512_set1_epi32(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator-=(const simd_vec<int, 16> &rhs) {
+        vec_ = _mm512_sub_epi32(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator-=(int rhs) {
+        vec_ = _mm512_sub_epi32(vec_, _mm512_set1_epi32(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator*=(const simd_vec<int, 16> &rhs) {
+        vec_ = _mm512_mullo_epi32(vec_, rhs.vec_);
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator*=(int rhs) {
+        vec_ = _mm512_mullo_epi32(vec_, _mm512_set1_epi32(rhs));
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator/=(const simd_vec<int, 16> &rhs) {
+        ITERATE(16, { comp_[i] = comp_[i] / rhs.comp_[i]; })
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> &operator/=(int rhs) {
+        ITERATE(16, { comp_[i] = comp_[i] / rhs; })
+        return *this;
+    }
+
+    force_inline simd_vec<int, 16> operator==(int rhs) const {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(vec_, _mm512_set1_epi32(rhs), _MM_CMPINT_EQ);
+        return ret;
+    }
+
+    force_inline simd_vec<int, 16> operator==(const simd_vec<int, 16> &rhs) const {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(vec_, rhs.vec_, _MM_CMPINT_EQ);
+        return ret;
+    }
+
+    force_inline simd_vec<int, 16> operator!=(int rhs) const {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(vec_, _mm512_set1_epi32(rhs), _MM_CMPINT_NE);
+        return ret;
+    }
+
+    force_inline simd_vec<int, 16> operator!=(const simd_vec<int, 16> &rhs) const {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(vec_, rhs.vec_, _MM_CMPINT_NE);
+        return ret;
+    }
+
+    force_inline operator simd_vec<float, 16>() const {
+        simd_vec<float, 16> ret;
+        ret.vec_ = _mm512_cvtepi32_ps(vec_);
+        return ret;
+    }
+
+    force_inline void copy_to(int *f) const {
+        _mm512_storeu_si512((__m512i *)f, vec_);
+    }
+
+    force_inline void copy_to(int *f, simd_mem_aligned_tag) const {
+        _mm512_store_si512((__m512i *)f, vec_);
+    }
+
+    force_inline void blend_to(const simd_vec<int, 16> &mask, const simd_vec<int, 16> &v1) {
+        vec_ = _mm512_mask_blend_epi32(_mm512_movepi32_mask(mask.vec_), vec_, v1.vec_);
+    }
+
+    force_inline void blend_inv_to(const simd_vec<int, 16> &mask, const simd_vec<int, 16> &v1) {
+        vec_ = _mm512_mask_blend_epi32(_mm512_movepi32_mask(mask.vec_), v1.vec_, vec_);
+    }
+
+    force_inline int movemask() const {
+        return int(_mm512_movepi32_mask(vec_));
+    }
+
+    force_inline bool all_zeros() const {
+        return _mm512_test_epi32_mask(vec_, vec_) == 0;
+    }
+
+    force_inline bool all_zeros(const simd_vec<int, 16> &mask) const {
+        return _mm512_test_epi32_mask(vec_, mask.vec_) == 0;
+    }
+
+    force_inline bool not_all_zeros() const {
+        return _mm512_test_epi32_mask(vec_, vec_) != 0;
+    }
+
+    force_inline static simd_vec<int, 16> min(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_min_epi32(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    force_inline static simd_vec<int, 16> max(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_max_epi32(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    force_inline static simd_vec<int, 16> and_not(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_andnot_si512(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator&(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_and_si512(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator|(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_or_si512(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator^(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_xor_si512(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator+(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_add_epi32(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator-(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_sub_epi32(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator*(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_mullo_epi32(v1.vec_, v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator/(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        ITERATE(16, { temp.comp_[i] = v1.comp_[i] / v2.comp_[i]; })
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator+(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_add_epi32(v1.vec_, _mm512_set1_epi32(v2));
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator-(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_sub_epi32(v1.vec_, _mm512_set1_epi32(v2));
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator*(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_mullo_epi32(v1.vec_, _mm512_set1_epi32(v2));
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator/(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> temp;
+        ITERATE(16, { temp.comp_[i] = v1.comp_[i] / v2; })
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator+(int v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_add_epi32(_mm512_set1_epi32(v1), v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator-(int v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_sub_epi32(_mm512_set1_epi32(v1), v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator*(int v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        temp.vec_ = _mm512_mullo_epi32(_mm512_set1_epi32(v1), v2.vec_);
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator/(int v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> temp;
+        ITERATE(16, { temp.comp_[i] = v1 / v2.comp_[i]; })
+        return temp;
+    }
+
+    friend force_inline simd_vec<int, 16> operator<(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(v1.vec_, v2.vec_, _MM_CMPINT_LT);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator>(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(v1.vec_, v2.vec_, _MM_CMPINT_NLE);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator<(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(v1.vec_, _mm512_set1_epi32(v2), _MM_CMPINT_LT);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator<=(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(v1.vec_, _mm512_set1_epi32(v2), _MM_CMPINT_LE);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator>(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_cmp_epi32_vec(v1.vec_, _mm512_set1_epi32(v2), _MM_CMPINT_NLE);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator>>(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_srlv_epi32(v1.vec_, v2.vec_);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator>>(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_srl_epi32(v1.vec_, _mm_cvtsi32_si128(v2));
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator<<(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_sllv_epi32(v1.vec_, v2.vec_);
+        return ret;
+    }
+
+    friend force_inline simd_vec<int, 16> operator<<(const simd_vec<int, 16> &v1, int v2) {
+        simd_vec<int, 16> ret;
+        ret.vec_ = _mm512_sll_epi32(v1.vec_, _mm_cvtsi32_si128(v2));
+        return ret;
+    }
+
+    friend force_inline bool is_equal(const simd_vec<int, 16> &v1, const simd_vec<int, 16> &v2) {
+        return _mm512_cmpeq_epi32_mask(v1.vec_, v2.vec_) == 0xffff;
+    }
+
+    static int size() { return 16; }
+    static bool is_native() { return true; }
+};
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::operator-() const {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_xor_ps(vec_, _mm512_set1_ps(-0.0f));
+    return temp;
+}
+
+force_inline simd_vec<float, 16>::operator simd_vec<int, 16>() const {
+    simd_vec<int, 16> ret;
+    ret.vec_ = _mm512_cvtps_epi32(vec_);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::sqrt() const {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_sqrt_ps(vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::min(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_min_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::max(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_max_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::and_not(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_andnot_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::floor(const simd_vec<float, 16> &v1) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_roundscale_ps(v1.vec_, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> simd_vec<float, 16>::ceil(const simd_vec<float, 16> &v1) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_roundscale_ps(v1.vec_, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator&(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_and_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator|(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_or_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator^(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_xor_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator+(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_add_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator-(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_sub_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator*(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_mul_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator/(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_div_ps(v1.vec_, v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator+(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_add_ps(v1.vec_, _mm512_set1_ps(v2));
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator-(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_sub_ps(v1.vec_, _mm512_set1_ps(v2));
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator*(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_mul_ps(v1.vec_, _mm512_set1_ps(v2));
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator/(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_div_ps(v1.vec_, _mm512_set1_ps(v2));
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator+(float v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_add_ps(_mm512_set1_ps(v1), v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator-(float v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_sub_ps(_mm512_set1_ps(v1), v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator*(float v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_mul_ps(_mm512_set1_ps(v1), v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator/(float v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> temp;
+    temp.vec_ = _mm512_div_ps(_mm512_set1_ps(v1), v2.vec_);
+    return temp;
+}
+
+force_inline simd_vec<float, 16> operator<(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, v2.vec_, _CMP_LT_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator<=(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, v2.vec_, _CMP_LE_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator>(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, v2.vec_, _CMP_GT_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator>=(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, v2.vec_, _CMP_GE_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator<(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, _mm512_set1_ps(v2), _CMP_LT_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator<=(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, _mm512_set1_ps(v2), _CMP_LE_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator>(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, _mm512_set1_ps(v2), _CMP_GT_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> operator>=(const simd_vec<float, 16> &v1, float v2) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_cmp_ps_vec(v1.vec_, _mm512_set1_ps(v2), _CMP_GE_OS);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> clamp(const simd_vec<float, 16> &v1, float min, float max) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_max_ps(_mm512_set1_ps(min), _mm512_min_ps(v1.vec_, _mm512_set1_ps(max)));
+    return ret;
+}
+
+force_inline simd_vec<float, 16> pow(const simd_vec<float, 16> &v1, const simd_vec<float, 16> &v2) {
+    simd_vec<float, 16> ret;
+    ITERATE(16, { ret.comp_[i] = std::pow(v1.comp_[i], v2.comp_[i]); })
+    return ret;
+}
+
+force_inline simd_vec<float, 16> normalize(const simd_vec<float, 16> &v1) {
+    return v1 / v1.length();
+}
+
+force_inline simd_vec<float, 16> fma(const simd_vec<float, 16> &a, const simd_vec<float, 16> &b, const simd_vec<float, 16> &c) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_fmadd_ps(a.vec_, b.vec_, c.vec_);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> fma(const simd_vec<float, 16> &a, const float b, const simd_vec<float, 16> &c) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_fmadd_ps(a.vec_, _mm512_set1_ps(b), c.vec_);
+    return ret;
+}
+
+force_inline simd_vec<float, 16> fma(const float a, const simd_vec<float, 16> &b, const float c) {
+    simd_vec<float, 16> ret;
+    ret.vec_ = _mm512_fmadd_ps(_mm512_set1_ps(a), b.vec_, _mm512_set1_ps(c));
+    return ret;
+}
+
+#if defined(USE_AVX512)
+using native_simd_fvec = simd_vec<float, 16>;
+using native_simd_ivec = simd_vec<int, 16>;
+#endif
+
+}
+}
+
+#undef _mm512_cmp_ps_vec
+#undef _mm512_cmp_epi32_vec
+
+#pragma warning(pop)
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
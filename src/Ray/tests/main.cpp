@@ -2,18 +2,30 @@
 #include <cstdio>
 
 void test_atlas();
+void test_bvh();
 void test_simd();
 void test_primary_ray_gen();
+void test_ray_sort();
+void test_scene();
+void test_scheduler();
+void test_shadow_rays();
 void test_mesh_lights();
 void test_texture();
+void test_wavefront();
 
 int main() {
     test_atlas();
+    test_bvh();
     test_simd();
     test_primary_ray_gen();
+    test_ray_sort();
+    test_scene();
+    test_scheduler();
 #ifndef _DEBUG
     test_mesh_lights();
+    test_shadow_rays();
     test_texture();
+    test_wavefront();
 #endif
     puts("OK");
 }
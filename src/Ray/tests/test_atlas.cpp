@@ -2,8 +2,12 @@
 
 #include "../internal/TextureAtlasRef.h"
 
+#include <cmath>
+#include <cstdlib>
+
 #include <memory>
 #include <random>
+#include <vector>
 
 void test_atlas() {
     {   // Test two types of atlas
@@ -50,4 +54,124 @@ void test_atlas() {
             }
         }
     }
+
+    {   // Test that sparse atlas commits only tiles touched by textures
+        const int AtlasRes = 1024, TextureRes = 500;
+        Ray::Ref::TextureAtlasTiled atlas = { AtlasRes, AtlasRes };
+
+        require(atlas.committed_tiles_count() == 0);
+
+        auto test_pixels = std::unique_ptr<Ray::pixel_color8_t[]>{ new Ray::pixel_color8_t[TextureRes * TextureRes] };
+        for (int i = 0; i < TextureRes * TextureRes; i++) {
+            test_pixels[i] = { uint8_t(i % 251), uint8_t(i % 241), uint8_t(i % 239), 255 };
+        }
+
+        const int TileSize = Ray::Ref::TextureAtlasTiled::tile_size();
+        const int MaxTilesPerTexture = ((TextureRes + 2) / TileSize + 2) * ((TextureRes + 2) / TileSize + 2);
+
+        // only four textures fit in one page, fifth one makes atlas to add pages
+        int res[2] = { TextureRes, TextureRes }, pos[5][2], page[5];
+        for (int i = 0; i < 5; i++) {
+            page[i] = atlas.Allocate(test_pixels.get(), res, pos[i]);
+            require(page[i] == (i < 4 ? 0 : 1));
+        }
+
+        require(atlas.committed_tiles_count() <= 5 * MaxTilesPerTexture);
+        require(atlas.committed_tiles_count() < 2 * (AtlasRes / TileSize) * (AtlasRes / TileSize));
+
+        for (int i = 0; i < 5; i++) {
+            for (int y = 0; y < TextureRes; y++) {
+                for (int x = 0; x < TextureRes; x++) {
+                    const Ray::pixel_color8_t sampled_color = atlas.Get(page[i], pos[i][0] + x + 1, pos[i][1] + y + 1);
+
+                    const Ray::pixel_color8_t &test_color = test_pixels[y * TextureRes + x];
+                    require(sampled_color.r == test_color.r);
+                    require(sampled_color.g == test_color.g);
+                    require(sampled_color.b == test_color.b);
+                    require(sampled_color.a == test_color.a);
+                }
+            }
+        }
+
+        // unused part of page reads as zero
+        const Ray::pixel_color8_t empty_color = atlas.Get(1, AtlasRes - 1, AtlasRes - 1);
+        require(empty_color.r == 0 && empty_color.g == 0 && empty_color.b == 0 && empty_color.a == 0);
+
+        for (int i = 0; i < 5; i++) {
+            require(atlas.Free(page[i], pos[i]));
+        }
+        require(!atlas.Free(page[0], pos[0]));
+
+        require(atlas.committed_tiles_count() == 0);
+
+        // freed space can be reused
+        require(atlas.Resize(1));
+        require(atlas.Allocate(test_pixels.get(), res, pos[0]) == 0);
+        require(atlas.committed_tiles_count() <= MaxTilesPerTexture);
+    }
+
+    {   // Test block compressed pages
+        const int AtlasRes = 256, TextureResX = 61, TextureResY = 35;
+        Ray::Ref::TextureAtlasTiled atlas = { AtlasRes, AtlasRes }, compressed_atlas = { AtlasRes, AtlasRes };
+
+        std::vector<Ray::pixel_color8_t> test_pixels(TextureResX * TextureResY);
+        for (int y = 0; y < TextureResY; y++) {
+            for (int x = 0; x < TextureResX; x++) {
+                // smooth tileable pattern (border is wrapped around)
+                const float fx = std::sin(2.0f * Ray::PI * x / TextureResX), fy = std::cos(2.0f * Ray::PI * y / TextureResY);
+                test_pixels[y * TextureResX + x] = { uint8_t(128 + 100 * fx), uint8_t(128 + 100 * fy),
+                                                     uint8_t(128 - 50 * fx), uint8_t(128 + 60 * fy) };
+            }
+        }
+
+        int res[2] = { TextureResX, TextureResY }, pos[2], compressed_pos[2];
+        require(atlas.Allocate(&test_pixels[0], res, pos) == 0);
+        require(compressed_atlas.Allocate(&test_pixels[0], res, compressed_pos, true) == 0);
+
+        require(compressed_atlas.committed_memory() * 3 < atlas.committed_memory());
+
+        const int Tolerance = 24;
+        for (int y = -1; y <= TextureResY; y++) {
+            for (int x = -1; x <= TextureResX; x++) {
+                // 1px border wraps around
+                const int srcx = (x + TextureResX) % TextureResX, srcy = (y + TextureResY) % TextureResY;
+                const Ray::pixel_color8_t &test_color = test_pixels[srcy * TextureResX + srcx];
+
+                const Ray::pixel_color8_t sampled_color = compressed_atlas.Get(0, compressed_pos[0] + x + 1, compressed_pos[1] + y + 1);
+                require(std::abs(sampled_color.r - test_color.r) <= Tolerance);
+                require(std::abs(sampled_color.g - test_color.g) <= Tolerance);
+                require(std::abs(sampled_color.b - test_color.b) <= Tolerance);
+                require(std::abs(sampled_color.a - test_color.a) <= 4);
+            }
+        }
+
+        // quad fetch gives the same result as separate fetches (both inside of block and across blocks)
+        for (int y = 0; y < TextureResY; y++) {
+            for (int x = 0; x < TextureResX; x++) {
+                const int px = compressed_pos[0] + x, py = compressed_pos[1] + y;
+
+                Ray::pixel_color8_t quad[4];
+                compressed_atlas.Get2x2(0, px, py, quad);
+
+                const Ray::pixel_color8_t expected[4] = { compressed_atlas.Get(0, px, py), compressed_atlas.Get(0, px + 1, py),
+                                                          compressed_atlas.Get(0, px, py + 1), compressed_atlas.Get(0, px + 1, py + 1) };
+                for (int i = 0; i < 4; i++) {
+                    require(quad[i].r == expected[i].r && quad[i].g == expected[i].g &&
+                            quad[i].b == expected[i].b && quad[i].a == expected[i].a);
+                }
+            }
+        }
+
+        // uncompressed texture is never placed on compressed page
+        int other_pos[2];
+        require(compressed_atlas.Allocate(&test_pixels[0], res, other_pos) == 1);
+
+        require(compressed_atlas.Free(0, compressed_pos));
+        require(compressed_atlas.Free(1, other_pos));
+        require(compressed_atlas.committed_tiles_count() == 0);
+        require(compressed_atlas.committed_memory() == 0);
+
+        // empty page can change its format
+        require(compressed_atlas.Allocate(&test_pixels[0], res, other_pos) == 0);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,429 @@
+#include "test_common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../RendererFactory.h"
+#include "../internal/Core.h"
+#include "../internal/TaskScheduler.h"
+
+namespace {
+void GenerateTriangleSoup(int tris_count, std::vector<float> &attrs, std::vector<uint32_t> &indices) {
+    std::uniform_real_distribution<float> pos_dist(-100.0f, 100.0f), offset_dist(-1.0f, 1.0f);
+    std::mt19937 gen(42);
+
+    for (int i = 0; i < tris_count; i++) {
+        const float center[3] = { pos_dist(gen), pos_dist(gen), pos_dist(gen) };
+        for (int j = 0; j < 3; j++) {
+            // PxyzNxyzTuv layout
+            attrs.push_back(center[0] + offset_dist(gen));
+            attrs.push_back(center[1] + offset_dist(gen));
+            attrs.push_back(center[2] + offset_dist(gen));
+            attrs.insert(attrs.end(), { 0.0f, 1.0f, 0.0f, 0.0f, 0.0f });
+
+            indices.push_back(uint32_t(i * 3 + j));
+        }
+    }
+}
+
+bool LoadBINMesh(const std::string &file_name, std::vector<float> &attrs, std::vector<uint32_t> &indices) {
+    std::ifstream in_file(file_name, std::ios::binary);
+    if (!in_file) return false;
+
+    uint32_t num_attrs, num_indices, num_groups;
+    in_file.read((char *)&num_attrs, 4);
+    in_file.read((char *)&num_indices, 4);
+    in_file.read((char *)&num_groups, 4);
+
+    attrs.resize(num_attrs);
+    in_file.read((char *)&attrs[0], (size_t)num_attrs * 4);
+
+    indices.resize(num_indices);
+    in_file.read((char *)&indices[0], (size_t)num_indices * 4);
+
+    return bool(in_file);
+}
+
+float NodeSurfaceArea(const Ray::bvh_node_t &n) {
+    const float d[3] = { n.bbox_max[0] - n.bbox_min[0], n.bbox_max[1] - n.bbox_min[1], n.bbox_max[2] - n.bbox_min[2] };
+    return 2.0f * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]);
+}
+
+// Expected cost of tracing random ray through bvh (surface area heuristic)
+double CalcTraversalCost(const std::vector<Ray::bvh_node_t> &nodes, float node_traversal_cost) {
+    double cost = 0.0;
+    for (const Ray::bvh_node_t &n : nodes) {
+        if (n.prim_index & Ray::LEAF_NODE_BIT) {
+            cost += double(NodeSurfaceArea(n)) * n.prim_count;
+        } else {
+            cost += double(NodeSurfaceArea(n)) * node_traversal_cost;
+        }
+    }
+    return cost / NodeSurfaceArea(nodes[0]);
+}
+}
+
+void test_bvh() {
+    {   // Parallel build produces the same nodes as sequential one
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        GenerateTriangleSoup(100000, attrs, indices);
+
+        Ray::TaskScheduler scheduler(4);
+
+        for (int use_fast_bvh_build = 0; use_fast_bvh_build < 2; use_fast_bvh_build++) {
+            Ray::bvh_settings_t s;
+            s.use_fast_bvh_build = use_fast_bvh_build != 0;
+
+            std::vector<Ray::bvh_node_t> nodes1, nodes2;
+            std::vector<Ray::tri_accel_t> tris1, tris2;
+            std::vector<uint32_t> tri_indices1, tri_indices2;
+
+            const uint32_t nodes_count1 = Ray::PreprocessMesh(&attrs[0], &indices[0], indices.size(), Ray::PxyzNxyzTuv, 0, s, nodes1, tris1, tri_indices1);
+            const uint32_t nodes_count2 = Ray::PreprocessMesh(&attrs[0], &indices[0], indices.size(), Ray::PxyzNxyzTuv, 0, s, nodes2, tris2, tri_indices2, &scheduler);
+
+            require(nodes_count1 == nodes_count2);
+            require(nodes1.size() == nodes2.size());
+            require(memcmp(&nodes1[0], &nodes2[0], nodes1.size() * sizeof(Ray::bvh_node_t)) == 0);
+            require(tris1.size() == tris2.size());
+            require(memcmp(&tris1[0], &tris2[0], tris1.size() * sizeof(Ray::tri_accel_t)) == 0);
+            require(tri_indices1 == tri_indices2);
+        }
+    }
+
+    {   // Binned SAH gives tree of comparable quality
+        const std::string this_file = __FILE__;
+        const std::string assets_dir = this_file.substr(0, this_file.find_last_of("/\\")) + "/../../../assets/meshes/";
+
+        std::vector<float> soup_attrs;
+        std::vector<uint32_t> soup_indices;
+        GenerateTriangleSoup(20000, soup_attrs, soup_indices);
+
+        struct mesh_t {
+            std::vector<float> attrs;
+            std::vector<uint32_t> indices;
+        } meshes[2] = { { std::move(soup_attrs), std::move(soup_indices) }, { {}, {} } };
+
+        // sponza is optional, it is skipped if mesh file is not found
+        if (!LoadBINMesh(assets_dir + "sponza_simple.bin", meshes[1].attrs, meshes[1].indices)) {
+            meshes[1].indices.clear();
+        }
+
+        for (const mesh_t &m : meshes) {
+            if (m.indices.empty()) continue;
+
+            Ray::bvh_settings_t s;
+
+            std::vector<Ray::bvh_node_t> nodes1, nodes2;
+            std::vector<Ray::tri_accel_t> tris1, tris2;
+            std::vector<uint32_t> tri_indices1, tri_indices2;
+
+            Ray::PreprocessMesh(&m.attrs[0], &m.indices[0], m.indices.size(), Ray::PxyzNxyzTuv, 0, s, nodes1, tris1, tri_indices1);
+
+            s.bins_count = 32;
+            Ray::PreprocessMesh(&m.attrs[0], &m.indices[0], m.indices.size(), Ray::PxyzNxyzTuv, 0, s, nodes2, tris2, tri_indices2);
+
+            const double cost1 = CalcTraversalCost(nodes1, s.node_traversal_cost),
+                         cost2 = CalcTraversalCost(nodes2, s.node_traversal_cost);
+
+            require(cost2 < cost1 * 1.1);
+        }
+    }
+
+    {   // Quantized bounds of compressed wide nodes enclose original ones
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        GenerateTriangleSoup(4000, attrs, indices);
+
+        Ray::bvh_settings_t s;
+
+        std::vector<Ray::bvh_node_t> nodes;
+        std::vector<Ray::tri_accel_t> tris;
+        std::vector<uint32_t> tri_indices;
+
+        Ray::PreprocessMesh(&attrs[0], &indices[0], indices.size(), Ray::PxyzNxyzTuv, 0, s, nodes, tris, tri_indices);
+
+        Ray::aligned_vector<Ray::mbvh_node_t> mnodes;
+        Ray::FlattenBVH_Recursive(&nodes[0], 0, 0xffffffff, mnodes);
+
+        Ray::aligned_vector<Ray::cmbvh_node_t> cmnodes(mnodes.size());
+        Ray::CompressBVH(&mnodes[0], (uint32_t)mnodes.size(), &cmnodes[0]);
+
+        for (size_t i = 0; i < mnodes.size(); i++) {
+            const Ray::mbvh_node_t &n = mnodes[i];
+            const Ray::cmbvh_node_t &cn = cmnodes[i];
+
+            const bool is_leaf = (n.child[0] & Ray::LEAF_NODE_BIT) != 0;
+
+            for (int j = 0; j < 8; j++) {
+                require(n.child[j] == cn.child[j]);
+
+                const bool is_valid = is_leaf ? (j == 0) : (n.child[j] != 0x7fffffff);
+                require(((cn.child_mask >> j) & 1) == (is_valid ? 1 : 0));
+                if (!is_valid) continue;
+
+                float bbox_min[3], bbox_max[3];
+                Ray::DecompressBBox(cn, j, bbox_min, bbox_max);
+
+                for (int k = 0; k < 3; k++) {
+                    require(bbox_min[k] <= n.bbox_min[k][j] && bbox_max[k] >= n.bbox_max[k][j]);
+                }
+            }
+        }
+    }
+
+    {   // Rendering with compressed wide nodes gives the same image
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        GenerateTriangleSoup(2000, attrs, indices);
+
+        const Ray::camera_desc_t cam_desc = TestCameraDesc(300.0f, 60.0f);
+
+        Ray::settings_t s;
+        s.w = s.h = 64;
+        s.use_wide_bvh = true;
+
+        const uint32_t renderer_flags[] = { Ray::RendererRef, Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512 | Ray::RendererNEON };
+
+        for (const uint32_t flags : renderer_flags) {
+            std::vector<Ray::pixel_color_t> images[2];
+
+            for (int use_compressed_bvh = 0; use_compressed_bvh < 2; use_compressed_bvh++) {
+                s.use_compressed_bvh = use_compressed_bvh != 0;
+
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, flags);
+                std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 1.0f);
+
+                const uint32_t mat = AddTestMaterial(*scene);
+                scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(attrs, indices, mat)), TestIdentityXform);
+
+                RenderTestImage(*renderer, scene, images[use_compressed_bvh]);
+            }
+
+            require(TestImageDiff(images[0], images[1]) < 0.001);
+        }
+    }
+
+    {   // Hybrid traversal (whole packets or ray by ray, depending on measured lane utilization) gives the same image
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        // dense enough to produce secondary rays in each tile
+        GenerateTriangleSoup(20000, attrs, indices);
+
+        const Ray::camera_desc_t cam_desc = TestCameraDesc(300.0f, 60.0f);
+
+        Ray::settings_t s;
+        s.w = s.h = 64;
+        s.use_wide_bvh = true;
+
+        // ray by ray only, hybrid with threshold which always keeps packets, hybrid with threshold which always splits them
+        const bool use_hybrid[] = { false, true, true };
+        const float thresholds[] = { 0.0f, 0.0f, 1.1f };
+
+        for (int use_compressed_bvh = 0; use_compressed_bvh < 2; use_compressed_bvh++) {
+            s.use_compressed_bvh = use_compressed_bvh != 0;
+
+            std::vector<Ray::pixel_color_t> images[3];
+
+            for (int mode = 0; mode < 3; mode++) {
+                s.use_hybrid_traversal = use_hybrid[mode];
+                s.single_ray_threshold = thresholds[mode];
+
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512 | Ray::RendererNEON);
+                std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 1.0f);
+
+                const uint32_t mat = AddTestMaterial(*scene);
+                scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(attrs, indices, mat)), TestIdentityXform);
+
+                RenderTestImage(*renderer, scene, images[mode]);
+
+                Ray::RendererBase::stats_t st;
+                renderer->GetStats(st);
+
+                if (renderer->type() != Ray::RendererRef) {
+                    if (use_hybrid[mode]) {
+                        require(st.traversal_total_lanes > 0);
+                        require(st.traversal_active_lanes > 0 && st.traversal_active_lanes <= st.traversal_total_lanes);
+                    } else {
+                        require(st.traversal_total_lanes == 0);
+                    }
+                    require((st.single_ray_packets > 0) == (thresholds[mode] > 1.0f));
+                }
+            }
+
+            for (int mode = 1; mode < 3; mode++) {
+                require(TestImageDiff(images[0], images[mode]) < 0.001);
+            }
+        }
+    }
+
+    {   // Moving instance after it was added gives the same image as adding it at final position
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        GenerateTriangleSoup(2000, attrs, indices);
+
+        const Ray::camera_desc_t cam_desc = TestCameraDesc(600.0f, 60.0f);
+
+        const float instance_offsets[][3] = { { -150.0f, -150.0f, 0.0f }, { 150.0f, -150.0f, 0.0f },
+                                              { -150.0f, 150.0f, 0.0f }, { 150.0f, 150.0f, 0.0f } };
+        // first one is small enough to be refitted, second one triggers full rebuild
+        const float moved_offsets[][3] = { { -140.0f, -160.0f, 10.0f }, { 300.0f, 300.0f, -200.0f } };
+
+        Ray::settings_t s;
+        s.w = s.h = 64;
+
+        for (int use_wide_bvh = 0; use_wide_bvh < 2; use_wide_bvh++) {
+            s.use_wide_bvh = use_wide_bvh != 0;
+
+            for (const float *moved_offset : moved_offsets) {
+                std::vector<Ray::pixel_color_t> images[2];
+
+                for (int moved = 0; moved < 2; moved++) {
+                    std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererRef);
+                    std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 1.0f);
+
+                    const uint32_t mat = AddTestMaterial(*scene);
+                    const uint32_t mesh = scene->AddMesh(TestMeshDesc(attrs, indices, mat));
+
+                    float xform[16] = { 0.25f, 0.0f, 0.0f, 0.0f,
+                                        0.0f, 0.25f, 0.0f, 0.0f,
+                                        0.0f, 0.0f, 0.25f, 0.0f,
+                                        0.0f, 0.0f, 0.0f, 1.0f };
+
+                    uint32_t mesh_instance = 0xffffffff;
+                    for (const float *offset : instance_offsets) {
+                        memcpy(&xform[12], offset, 3 * sizeof(float));
+                        mesh_instance = scene->AddMeshInstance(mesh, xform);
+                    }
+
+                    if (moved) {
+                        memcpy(&xform[12], moved_offset, 3 * sizeof(float));
+                        scene->SetMeshInstanceTransform(mesh_instance, xform);
+                    } else {
+                        scene->RemoveMeshInstance(mesh_instance);
+                        memcpy(&xform[12], moved_offset, 3 * sizeof(float));
+                        scene->AddMeshInstance(mesh, xform);
+                    }
+
+                    RenderTestImage(*renderer, scene, images[moved]);
+                }
+
+                require(TestImageDiff(images[0], images[1]) < 0.001);
+            }
+        }
+    }
+
+    {   // Picking lights from light tree gives unbiased estimate of lighting from all lights
+        std::uniform_real_distribution<float> pos_dist(-50.0f, 50.0f), radius_dist(0.5f, 1.5f), brightness_dist(0.01f, 1.0f),
+                                              dir_dist(-1.0f, 1.0f), spot_dist(0.0f, 0.9f), col_dist(0.1f, 1.0f);
+        std::mt19937 gen(42);
+
+        const auto random_dir = [&]() {
+            float dir[3], len;
+            do {
+                dir[0] = dir_dist(gen); dir[1] = dir_dist(gen); dir[2] = dir_dist(gen);
+                len = std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+            } while (len < 0.001f || len > 1.0f);
+            return std::vector<float>{ dir[0] / len, dir[1] / len, dir[2] / len };
+        };
+
+        std::vector<Ray::light_t> lights(200);
+        for (size_t i = 0; i < lights.size(); i++) {
+            Ray::light_t &l = lights[i];
+
+            const std::vector<float> dir = random_dir();
+            for (int j = 0; j < 3; j++) {
+                l.pos[j] = pos_dist(gen);
+                l.col[j] = col_dist(gen);
+                l.dir[j] = dir[j];
+            }
+            l.radius = radius_dist(gen);
+            l.brightness = brightness_dist(gen);
+            // half of lights are spot lights
+            l.spot = (i % 2) ? spot_dist(gen) : -1.0f;
+        }
+
+        std::vector<Ray::light_node_t> nodes;
+        std::vector<uint32_t> li_indices;
+        const uint32_t nodes_count = Ray::PreprocessLights(&lights[0], lights.size(), nodes, li_indices);
+
+        require(nodes_count == nodes.size());
+        require(li_indices.size() == lights.size());
+
+        {   // check aggregates
+            float total_power = 0.0f;
+            for (const Ray::light_t &l : lights) {
+                total_power += (0.2126f * l.col[0] + 0.7152f * l.col[1] + 0.0722f * l.col[2]) * l.radius * l.radius;
+            }
+            require(std::abs(nodes[0].power - total_power) < 0.001f * total_power);
+
+            for (const Ray::light_node_t &n : nodes) {
+                if (n.prim_index & Ray::LEAF_NODE_BIT) continue;
+
+                const Ray::light_node_t &ch0 = nodes[n.left_child], &ch1 = nodes[n.right_child];
+                require(std::abs(n.power - ch0.power - ch1.power) < 0.001f * n.power);
+
+                for (const Ray::light_node_t *ch : { &ch0, &ch1 }) {
+                    const float d = std::sqrt((ch->center[0] - n.center[0]) * (ch->center[0] - n.center[0]) +
+                                              (ch->center[1] - n.center[1]) * (ch->center[1] - n.center[1]) +
+                                              (ch->center[2] - n.center[2]) * (ch->center[2] - n.center[2]));
+                    require(d + ch->radius <= n.radius * 1.001f + 0.001f);
+                    require(n.cos_theta <= ch->cos_theta + 0.001f);
+                }
+            }
+        }
+
+        const int PointsCount = 16, SamplesCount = 65536;
+
+        int lit_points = 0;
+        for (int i = 0; i < PointsCount; i++) {
+            const float p[3] = { pos_dist(gen), pos_dist(gen), pos_dist(gen) };
+            const std::vector<float> n = random_dir();
+
+            // lighting from all lights (light sphere is approximated with its center)
+            const auto light_contribution = [&](const Ray::light_t &l) {
+                float L[3] = { l.pos[0] - p[0], l.pos[1] - p[1], l.pos[2] - p[2] };
+                const float dist = std::sqrt(L[0] * L[0] + L[1] * L[1] + L[2] * L[2]);
+                L[0] /= dist; L[1] /= dist; L[2] /= dist;
+
+                const float denom = std::max(dist - l.radius, 0.0f) / l.radius + 1.0f;
+                const float atten = std::max((1.0f / (denom * denom) - Ray::LIGHT_ATTEN_CUTOFF / l.brightness) / (1.0f - Ray::LIGHT_ATTEN_CUTOFF), 0.0f);
+
+                const float _dot1 = std::max(L[0] * n[0] + L[1] * n[1] + L[2] * n[2], 0.0f);
+                const float _dot2 = L[0] * l.dir[0] + L[1] * l.dir[1] + L[2] * l.dir[2];
+
+                return (_dot2 > l.spot) ? l.col[1] * atten * _dot1 : 0.0f;
+            };
+
+            double expected = 0.0;
+            for (const Ray::light_t &l : lights) {
+                expected += light_contribution(l);
+            }
+
+            double estimated = 0.0;
+            for (int j = 0; j < SamplesCount; j++) {
+                float u = (j + 0.5f) / SamplesCount, pdf;
+                const uint32_t li = Ray::SampleLightTree(&nodes[0], 0, &lights[0], &li_indices[0], p, &n[0], u, pdf);
+                if (li == 0xffffffff) continue;
+
+                require(li < lights.size());
+                require(pdf > 0.0f && pdf <= 1.0f);
+                require(u >= 0.0f && u < 1.0f);
+
+                estimated += light_contribution(lights[li]) / pdf;
+            }
+            estimated /= SamplesCount;
+
+            require(std::abs(estimated - expected) <= 0.02 * expected + 0.000001);
+            if (expected > 0.0) lit_points++;
+        }
+
+        require(lit_points > PointsCount / 4);
+    }
+}
@@ -5,6 +5,11 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <memory>
+#include <vector>
+
+#include "../RendererBase.h"
+
 static void handle_assert(bool passed, const char* assert, const char* file, long line) {
     if (!passed) {
         printf("Assertion failed %s in %s at line %d\n", assert, file, int(line));
@@ -56,4 +61,94 @@ inline bool operator==(float val, const Approx &app) {
     return std::abs(val - app.val) < app.eps;
 }
 
+// Helpers to set up simple scenes which are rendered and compared in tests
+
+const float TestIdentityXform[16] = { 1.0f, 0.0f, 0.0f, 0.0f,
+                                      0.0f, 1.0f, 0.0f, 0.0f,
+                                      0.0f, 0.0f, 1.0f, 0.0f,
+                                      0.0f, 0.0f, 0.0f, 1.0f };
+
+/// Perspective camera placed at (0, 0, dist) and looking along -Z, image is not filtered or gamma corrected
+inline Ray::camera_desc_t TestCameraDesc(float dist, float fov) {
+    Ray::camera_desc_t cam_desc;
+    cam_desc.type = Ray::Persp;
+    cam_desc.filter = Ray::Box;
+    cam_desc.dtype = Ray::None;
+    cam_desc.origin[0] = 0.0f; cam_desc.origin[1] = 0.0f; cam_desc.origin[2] = dist;
+    cam_desc.fwd[0] = 0.0f; cam_desc.fwd[1] = 0.0f; cam_desc.fwd[2] = -1.0f;
+    cam_desc.fov = fov;
+    return cam_desc;
+}
+
+/// Creates scene with given camera and uniform grey environment
+inline std::shared_ptr<Ray::SceneBase> CreateTestScene(Ray::RendererBase &renderer, const Ray::camera_desc_t &cam_desc, float env_col) {
+    std::shared_ptr<Ray::SceneBase> scene = renderer.CreateScene();
+
+    scene->set_current_cam(scene->AddCamera(cam_desc));
+
+    Ray::environment_desc_t env_desc;
+    env_desc.env_col[0] = env_desc.env_col[1] = env_desc.env_col[2] = env_col;
+    scene->SetEnvironment(env_desc);
+
+    return scene;
+}
+
+/// Adds diffuse material with square texture (white 1x1 texture is used if data is not provided)
+inline uint32_t AddTestMaterial(Ray::SceneBase &scene, const Ray::pixel_color8_t *tex_data = nullptr, int tex_res = 1,
+                                bool generate_mipmaps = false) {
+    static const Ray::pixel_color8_t white = { 255, 255, 255, 255 };
+
+    Ray::tex_desc_t tex_desc;
+    tex_desc.w = tex_desc.h = tex_data ? tex_res : 1;
+    tex_desc.generate_mipmaps = generate_mipmaps;
+    tex_desc.data = tex_data ? tex_data : &white;
+
+    Ray::mat_desc_t mat_desc;
+    mat_desc.type = Ray::DiffuseMaterial;
+    mat_desc.main_texture = scene.AddTexture(tex_desc);
+    return scene.AddMaterial(mat_desc);
+}
+
+/// Description of triangle list in PxyzNxyzTuv layout with single material (arrays are referenced, not copied)
+inline Ray::mesh_desc_t TestMeshDesc(const std::vector<float> &attrs, const std::vector<uint32_t> &indices, uint32_t mat) {
+    Ray::mesh_desc_t mesh_desc;
+    mesh_desc.prim_type = Ray::TriangleList;
+    mesh_desc.layout = Ray::PxyzNxyzTuv;
+    mesh_desc.vtx_attrs = &attrs[0];
+    mesh_desc.vtx_attrs_count = attrs.size() / 8;
+    mesh_desc.vtx_indices = &indices[0];
+    mesh_desc.vtx_indices_count = indices.size();
+    mesh_desc.shapes.push_back({ mat, 0, indices.size() });
+    return mesh_desc;
+}
+
+/// Clears framebuffer and renders whole image with given number of iterations
+inline void RenderTestImage(Ray::RendererBase &renderer, const std::shared_ptr<Ray::SceneBase> &scene,
+                            std::vector<Ray::pixel_color_t> &out_pixels, int iterations = 4) {
+    const auto size = renderer.size();
+
+    renderer.Clear();
+
+    auto reg = Ray::RegionContext{ { 0, 0, size.first, size.second } };
+    for (int i = 0; i < iterations; i++) {
+        renderer.RenderScene(scene, reg);
+    }
+
+    const Ray::pixel_color_t *pixels = renderer.get_pixels_ref();
+    out_pixels.assign(pixels, pixels + size.first * size.second);
+}
+
+/// Returns mean absolute difference of color channels
+inline double TestImageDiff(const std::vector<Ray::pixel_color_t> &img1, const std::vector<Ray::pixel_color_t> &img2) {
+    require(img1.size() == img2.size() && !img1.empty());
+
+    double diff = 0.0;
+    for (size_t i = 0; i < img1.size(); i++) {
+        diff += std::abs(img1[i].r - img2[i].r);
+        diff += std::abs(img1[i].g - img2[i].g);
+        diff += std::abs(img1[i].b - img2[i].b);
+    }
+    return diff / double(img1.size() * 3);
+}
+
 #endif
\ No newline at end of file
@@ -104,10 +104,13 @@ void test_mesh_lights() {
         Ray::settings_t s;
         s.w = 64;
         s.h = 64;
+        // make sure image is split in several tiles
+        s.threads_count = 4;
+        s.tile_size = 16;
 
         std::shared_ptr<Ray::RendererBase> renderer;
 
-        Ray::eRendererType renderer_types[] = { Ray::RendererRef, Ray::RendererSSE2, Ray::RendererAVX, Ray::RendererAVX2,
+        Ray::eRendererType renderer_types[] = { Ray::RendererRef, Ray::RendererSSE2, Ray::RendererAVX, Ray::RendererAVX2, Ray::RendererAVX512,
 #if defined(__ANDROID__)
             Ray::RendererNEON,
 #elif !defined(DISABLE_OCL)
@@ -121,10 +124,12 @@ void test_mesh_lights() {
         for (int bvh_type = 0; bvh_type < 2; bvh_type++) {
             // mode 0 - default
             // mode 1 - with additional SH generation, different sampling method is used, so should be tested separately
+            // mode 2 - wavefront tracing of secondary rays (same image as default mode is expected)
 
-            for (int mode = 0; mode < 2; mode++) {
+            for (int mode = 0; mode < 3; mode++) {
                 for (Ray::eRendererType rt : renderer_types) {
                     s.use_wide_bvh = bvh_type == 0 ? false : true;
+                    s.use_wavefront = mode == 2;
 
                     renderer = Ray::CreateRenderer(s, rt);
 
@@ -200,6 +205,25 @@ void test_mesh_lights() {
 
                     printf("100%%\n");
 
+                    Ray::RendererBase::stats_t st;
+                    renderer->GetStats(st);
+
+                    // one primary ray per pixel is traced for each sample
+                    require(st.rays_traced[0] == 64 * 64 * NUM_SAMPLES);
+                    if (rt != Ray::RendererOCL) {
+#ifdef RAY_ENABLE_TRAVERSAL_COUNTERS
+                        require(st.box_tests > 0 && st.tri_tests > 0);
+#else
+                        require(st.box_tests == 0 && st.tri_tests == 0);
+#endif
+
+                        unsigned long long tiles_count = 0;
+                        for (unsigned long long count : st.tile_time_hist) {
+                            tiles_count += count;
+                        }
+                        require(tiles_count == 16 * NUM_SAMPLES);
+                    }
+
                     const Ray::pixel_color_t *pixels = renderer->get_pixels_ref();
 
                     uint64_t diff = 0;
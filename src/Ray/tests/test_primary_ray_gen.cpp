@@ -8,6 +8,7 @@
 #include "../internal/RendererSSE2.h"
 #include "../internal/RendererAVX.h"
 #include "../internal/RendererAVX2.h"
+#include "../internal/RendererAVX512.h"
 #if !defined(DISABLE_OCL)
 #include "../internal/CoreOCL.h"
 #include "../internal/RendererOCL.h"
@@ -301,7 +302,176 @@ void test_primary_ray_gen() {
     } else {
         std::cout << "Cannot test AVX2" << std::endl;
     }
-    
+
+    if (features.avx512_supported) {
+#if !defined(__ANDROID__)
+        // test Avx512
+        Ray::aligned_vector<Ray::Avx512::ray_packet_t<Ray::Avx512::RayPacketSize>> rays;
+        Ray::Avx512::GeneratePrimaryRays<Ray::Avx512::RayPacketDimX, Ray::Avx512::RayPacketDimY>(0, cam, { 0, 0, 4, 4 }, 4, 4, &dummy_halton[0], rays);
+
+        require(rays.size() == 1);
+
+        // 4x4 packet is made of 2x2 quads
+        const int lane_x[] = { 0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3 },
+                  lane_y[] = { 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 3, 3, 2, 2, 3, 3 };
+
+        // vectors are copied out without calling their members, which are compiled for AVX-512 only
+        int i1[Ray::Avx512::RayPacketSize];
+        memcpy(&i1[0], &rays[0].xy, sizeof(int) * Ray::Avx512::RayPacketSize);
+
+        for (int k = 0; k < Ray::Avx512::RayPacketSize; k++) {
+            require(i1[k] == int(g_primary_ray_gen_test_data[(lane_y[k] * 4 + lane_x[k]) * 23 + 0]));
+        }
+
+#define CHECK_r1_16(off) \
+    for (int k = 0; k < Ray::Avx512::RayPacketSize; k++) {                                              \
+        require(r1[k] == Approx(g_primary_ray_gen_test_data[(lane_y[k] * 4 + lane_x[k]) * 23 + off]));  \
+    }
+
+        float r1[Ray::Avx512::RayPacketSize];
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].o[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(1 + j);
+        }
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].d[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(4 + j);
+        }
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].c[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(7 + j);
+        }
+
+        memcpy(&r1[0], &rays[0].ior, sizeof(float) * Ray::Avx512::RayPacketSize);
+        CHECK_r1_16(10);
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].do_dx[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(11 + j);
+        }
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].dd_dx[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(14 + j);
+        }
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].do_dy[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(17 + j);
+        }
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(&r1[0], &rays[0].dd_dy[j], sizeof(float) * Ray::Avx512::RayPacketSize);
+            CHECK_r1_16(20 + j);
+        }
+
+#undef CHECK_r1_16
+#endif
+    } else {
+        std::cout << "Cannot test AVX512" << std::endl;
+    }
+
+    {
+        // test binned sampling of mesh in texture space (reference)
+        std::vector<Ray::vertex_t> vertices;
+        std::vector<uint32_t> vtx_indices;
+
+        // 3x3 grid of quads covering the whole uv range
+        for (int j = 0; j < 4; j++) {
+            for (int i = 0; i < 4; i++) {
+                Ray::vertex_t v = {};
+                v.p[0] = float(i); v.p[1] = float(j);
+                v.n[2] = 1.0f;
+                v.t[0][0] = float(i) / 3; v.t[0][1] = float(j) / 3;
+                vertices.push_back(v);
+            }
+        }
+        for (uint32_t j = 0; j < 3; j++) {
+            for (uint32_t i = 0; i < 3; i++) {
+                const uint32_t v = j * 4 + i;
+                vtx_indices.insert(vtx_indices.end(), { v, v + 1, v + 5, v, v + 5, v + 4 });
+            }
+        }
+
+        const Ray::mesh_t mesh = { 0, 0, 0, 18 };
+        Ray::transform_t tr = {};
+        for (int i = 0; i < 4; i++) {
+            tr.xform[i * 5] = tr.inv_xform[i * 5] = 1.0f;
+        }
+
+        const int ImgSize = 80;
+
+        Ray::tri_bins_t bins;
+        Ray::Ref::BinMeshInTextureSpace(0, mesh, &vtx_indices[0], &vertices[0], ImgSize, ImgSize, bins);
+
+        require(bins.bins_x == 3 && bins.bins_y == 3);
+        require(bins.offsets.size() == 10);
+        require(bins.tris.size() == bins.offsets.back());
+        for (int b = 0; b < 9; b++) {
+            require(bins.offsets[b + 1] > bins.offsets[b]);
+            for (uint32_t i = bins.offsets[b] + 1; i < bins.offsets[b + 1]; i++) {
+                require(bins.tris[i] > bins.tris[i - 1]);
+            }
+        }
+
+        // cache is filled by regions not aligned with bins
+        const int RegionSize = 24;
+        for (int y = 0; y < ImgSize; y += RegionSize) {
+            for (int x = 0; x < ImgSize; x += RegionSize) {
+                Ray::Ref::UpdateTexelCache(bins, &vtx_indices[0], &vertices[0], { x, y, std::min(RegionSize, ImgSize - x), std::min(RegionSize, ImgSize - y) });
+            }
+        }
+
+        for (int b = 0; b < 9; b++) {
+            require(bins.texels[b] != nullptr);
+        }
+
+        // whole image and several regions must give the same result
+        Ray::aligned_vector<Ray::Ref::ray_packet_t> rays;
+        Ray::aligned_vector<Ray::Ref::hit_data_t> inters;
+        Ray::Ref::SampleMeshInTextureSpace(0, 0, bins, tr, &vtx_indices[0], &vertices[0], { 0, 0, ImgSize, ImgSize }, ImgSize,
+                                           &dummy_halton[0], rays, inters);
+
+        require(inters.size() == ImgSize * ImgSize);
+        for (const Ray::Ref::hit_data_t &inter : inters) {
+            require(inter.mask_values[0] != 0);
+            require(inter.u >= 0.0f && inter.v >= 0.0f && inter.u + inter.v <= 1.0f + 0.000001f);
+        }
+
+        // samples stay close to their texels (near edges they are moved along the edge of cached triangle)
+        for (const Ray::Ref::ray_packet_t &r : rays) {
+            const int x = (r.xy >> 16) & 0x0000ffff, y = r.xy & 0x0000ffff;
+            require(std::abs(r.o[0] - 3.0f * (float(x) + 0.5f) / ImgSize) <= 3.0f / ImgSize);
+            require(std::abs(r.o[1] - 3.0f * (1.0f - (float(y) + 0.5f) / ImgSize)) <= 3.0f / ImgSize);
+            require(r.o[2] == Approx(1.0f));
+        }
+
+        for (int y = 0; y < ImgSize; y += RegionSize) {
+            for (int x = 0; x < ImgSize; x += RegionSize) {
+                const Ray::rect_t r = { x, y, std::min(RegionSize, ImgSize - x), std::min(RegionSize, ImgSize - y) };
+
+                Ray::aligned_vector<Ray::Ref::ray_packet_t> region_rays;
+                Ray::aligned_vector<Ray::Ref::hit_data_t> region_inters;
+                Ray::Ref::SampleMeshInTextureSpace(0, 0, bins, tr, &vtx_indices[0], &vertices[0], r, ImgSize,
+                                                   &dummy_halton[0], region_rays, region_inters);
+
+                for (int yy = 0; yy < r.h; yy++) {
+                    for (int xx = 0; xx < r.w; xx++) {
+                        const Ray::Ref::hit_data_t &i1 = inters[(y + yy) * ImgSize + x + xx],
+                                                   &i2 = region_inters[yy * r.w + xx];
+                        require(i1.xy == i2.xy);
+                        require(i1.mask_values[0] == i2.mask_values[0]);
+                        require(i1.prim_indices[0] == i2.prim_indices[0]);
+                        require(i1.u == i2.u && i1.v == i2.v);
+                    }
+                }
+            }
+        }
+    }
+
     {
 #if defined(__ANDROID__) || defined(DISABLE_OCL)
          std::cout << "Skipping OpenCL test" << std::endl;
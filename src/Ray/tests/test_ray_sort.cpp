@@ -0,0 +1,161 @@
+#include "test_common.h"
+
+#include <cstring>
+
+#include <random>
+#include <vector>
+
+#include "../internal/TaskScheduler.h"
+#if !defined(__ANDROID__)
+#include "../internal/RendererSSE2.h"
+#endif
+
+#include "../internal/simd/detect.h"
+
+#if !defined(__ANDROID__)
+namespace {
+const int S = Ray::Sse2::RayPacketSize;
+
+// Origins and directions are taken from small sets (to get many rays with equal hash),
+// all other fields are derived from unique lane id, which is stored in xy
+void init_lane(Ray::Sse2::ray_packet_t<S> &r, int j, uint32_t id) {
+    for (int k = 0; k < 3; k++) {
+        r.o[k][j] = float((id / 7) % 3) + 0.5f;
+        r.d[k][j] = (id % 2) == uint32_t(k % 2) ? 1.0f : 0.0f;
+        r.c[k][j] = float(id) + 0.1f * k;
+        r.do_dx[k][j] = float(id) + 1.1f * k;
+        r.dd_dx[k][j] = float(id) + 2.1f * k;
+        r.do_dy[k][j] = float(id) + 3.1f * k;
+        r.dd_dy[k][j] = float(id) + 4.1f * k;
+    }
+    r.ior[j] = float(id) + 0.5f;
+    r.xy[j] = int(id);
+    r.ray_depth[j] = int(id * 31);
+}
+
+void init_lane(Ray::Sse2::shadow_ray_t<S> &r, int j, uint32_t id) {
+    for (int k = 0; k < 3; k++) {
+        r.o[k][j] = float((id / 7) % 3) + 0.5f;
+        r.d[k][j] = (id % 2) == uint32_t(k % 2) ? 1.0f : 0.0f;
+        r.c[k][j] = float(id) + 0.1f * k;
+    }
+    r.dist[j] = float(id) + 0.5f;
+    r.rand[j] = float(id) + 0.25f;
+    r.xy[j] = int(id);
+}
+
+bool lanes_equal(const Ray::Sse2::ray_packet_t<S> &r1, int j1, const Ray::Sse2::ray_packet_t<S> &r2, int j2) {
+    bool res = r1.ior[j1] == r2.ior[j2] && r1.xy[j1] == r2.xy[j2] && r1.ray_depth[j1] == r2.ray_depth[j2];
+    for (int k = 0; k < 3; k++) {
+        res &= r1.o[k][j1] == r2.o[k][j2] && r1.d[k][j1] == r2.d[k][j2] && r1.c[k][j1] == r2.c[k][j2];
+        res &= r1.do_dx[k][j1] == r2.do_dx[k][j2] && r1.dd_dx[k][j1] == r2.dd_dx[k][j2];
+        res &= r1.do_dy[k][j1] == r2.do_dy[k][j2] && r1.dd_dy[k][j1] == r2.dd_dy[k][j2];
+    }
+    return res;
+}
+
+bool lanes_equal(const Ray::Sse2::shadow_ray_t<S> &r1, int j1, const Ray::Sse2::shadow_ray_t<S> &r2, int j2) {
+    bool res = r1.dist[j1] == r2.dist[j2] && r1.rand[j1] == r2.rand[j2] && r1.xy[j1] == r2.xy[j2];
+    for (int k = 0; k < 3; k++) {
+        res &= r1.o[k][j1] == r2.o[k][j2] && r1.d[k][j1] == r2.d[k][j2] && r1.c[k][j1] == r2.c[k][j2];
+    }
+    return res;
+}
+
+template <typename RayType>
+void test_sort_and_gather(Ray::TaskScheduler &scheduler) {
+    // big enough to be split in several blocks
+    const int RaysCount = 3000;
+
+    const float root_min[3] = { 0.0f, 0.0f, 0.0f }, cell_size[3] = { 1.0f, 1.0f, 1.0f };
+
+    std::mt19937 gen(42);
+
+    Ray::aligned_vector<RayType> rays(RaysCount);
+    Ray::aligned_vector<Ray::Sse2::simd_ivec<S>> masks(RaysCount);
+
+    int active_count = 0;
+    for (int i = 0; i < RaysCount; i++) {
+        for (int j = 0; j < S; j++) {
+            init_lane(rays[i], j, uint32_t(i * S + j));
+
+            const bool active = (gen() % 3) != 0;
+            masks[i][j] = active ? -1 : 0;
+            active_count += active ? 1 : 0;
+        }
+    }
+
+    // serial and parallel versions give the same result
+    std::vector<Ray::ray_hash_t> hashes[2], hashes_temp[2];
+    Ray::aligned_vector<RayType> out_rays[2];
+    Ray::aligned_vector<Ray::Sse2::simd_ivec<S>> out_masks[2];
+
+    for (int parallel = 0; parallel < 2; parallel++) {
+        hashes[parallel].resize(RaysCount * S);
+        hashes_temp[parallel].resize(RaysCount * S);
+
+        Ray::TaskScheduler *sched = parallel ? &scheduler : nullptr;
+
+        const int hashes_count = Ray::Sse2::SortRays_CPU(&rays[0], &masks[0], RaysCount, root_min, cell_size,
+                                                         &hashes[parallel][0], &hashes_temp[parallel][0], sched);
+        // inactive lanes are dropped
+        require(hashes_count == active_count);
+        hashes[parallel].resize(hashes_count);
+
+        std::vector<bool> visited(RaysCount * S, false);
+        for (int i = 0; i < hashes_count; i++) {
+            const Ray::ray_hash_t &h = hashes[parallel][i];
+            require(masks[h.index / S][h.index % S] != 0);
+            require(!visited[h.index]);
+            visited[h.index] = true;
+
+            if (i > 0) {
+                const Ray::ray_hash_t &prev = hashes[parallel][i - 1];
+                require(prev.hash <= h.hash);
+                // rays with equal hash keep their original order
+                require(prev.hash != h.hash || prev.index < h.index);
+            }
+        }
+
+        const int out_count = (hashes_count + S - 1) / S;
+        out_rays[parallel].resize(out_count);
+        out_masks[parallel].resize(out_count);
+
+        require(Ray::Sse2::GatherRays(&rays[0], &masks[0], &hashes[parallel][0], hashes_count,
+                                      &out_rays[parallel][0], &out_masks[parallel][0], sched) == out_count);
+
+        for (int i = 0; i < out_count * S; i++) {
+            const RayType &r = out_rays[parallel][i / S];
+            if (i < hashes_count) {
+                // all fields are moved along with the ray
+                const uint32_t src = hashes[parallel][i].index;
+                require(out_masks[parallel][i / S][i % S] != 0);
+                require(lanes_equal(r, i % S, rays[src / S], src % S));
+            } else {
+                // tail of last packet is masked out
+                require(out_masks[parallel][i / S][i % S] == 0);
+            }
+        }
+    }
+
+    require(hashes[0].size() == hashes[1].size());
+    require(memcmp(&hashes[0][0], &hashes[1][0], hashes[0].size() * sizeof(Ray::ray_hash_t)) == 0);
+
+    for (size_t i = 0; i < hashes[0].size(); i++) {
+        require(lanes_equal(out_rays[0][i / S], i % S, out_rays[1][i / S], i % S));
+    }
+}
+}
+#endif
+
+void test_ray_sort() {
+#if !defined(__ANDROID__)
+    auto features = Ray::GetCpuFeatures();
+    if (!features.sse2_supported) return;
+
+    Ray::TaskScheduler scheduler(4);
+
+    test_sort_and_gather<Ray::Sse2::ray_packet_t<S>>(scheduler);
+    test_sort_and_gather<Ray::Sse2::shadow_ray_t<S>>(scheduler);
+#endif
+}
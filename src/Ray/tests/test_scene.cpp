@@ -0,0 +1,278 @@
+#include "test_common.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <random>
+#include <vector>
+
+#include "../RendererFactory.h"
+#include "../internal/RangeAllocator.h"
+
+namespace {
+void GenerateBoxes(int boxes_count, uint32_t seed, std::vector<float> &attrs, std::vector<uint32_t> &indices) {
+    std::uniform_real_distribution<float> pos_dist(-50.0f, 50.0f);
+    std::mt19937 gen(seed);
+
+    // two triangles facing camera per box is enough here
+    for (int i = 0; i < boxes_count; i++) {
+        const float center[3] = { pos_dist(gen), pos_dist(gen), pos_dist(gen) };
+        const float corners[4][2] = { { -2.0f, -2.0f }, { 2.0f, -2.0f }, { 2.0f, 2.0f }, { -2.0f, 2.0f } };
+
+        const auto first_vtx = uint32_t(attrs.size() / 8);
+        for (const float *c : corners) {
+            // PxyzNxyzTuv layout
+            attrs.insert(attrs.end(), { center[0] + c[0], center[1] + c[1], center[2], 0.0f, 0.0f, 1.0f, 0.0f, 0.0f });
+        }
+        indices.insert(indices.end(), { first_vtx + 0, first_vtx + 1, first_vtx + 2, first_vtx + 0, first_vtx + 2, first_vtx + 3 });
+    }
+}
+}
+
+void test_scene() {
+    {   // Range allocator reuses freed ranges
+        Ray::RangeAllocator alloc;
+
+        require(alloc.Alloc(10) == 0);
+        require(alloc.Alloc(20) == 10);
+        require(alloc.Alloc(5) == 30);
+        require(alloc.size() == 35);
+
+        alloc.Free(0, 10);
+        require(alloc.used_size() == 25);
+        require(alloc.Alloc(4) == 0);
+        require(alloc.free_ranges_count() == 1);
+
+        // merges with neighbouring free range
+        alloc.Free(10, 20);
+        require(alloc.free_ranges_count() == 1);
+        require(alloc.Alloc(26) == 4);
+
+        // freeing the last range shrinks storage
+        alloc.Free(30, 5);
+        require(alloc.size() == 30);
+        alloc.Free(4, 26);
+        require(alloc.size() == 4);
+        require(alloc.free_ranges_count() == 0);
+        require(alloc.used_size() == 4);
+    }
+
+    {   // Removing mesh in the middle of storage and reusing its space gives the same result as building scene from scratch
+        std::vector<float> attrs[4];
+        std::vector<uint32_t> indices[4];
+        for (int i = 0; i < 4; i++) {
+            GenerateBoxes(250 - 50 * i, uint32_t(i), attrs[i], indices[i]);
+        }
+
+        const Ray::camera_desc_t cam_desc = TestCameraDesc(200.0f, 45.0f);
+
+        Ray::settings_t s;
+        s.w = s.h = 64;
+
+        for (int use_wide_bvh = 0; use_wide_bvh < 2; use_wide_bvh++) {
+            s.use_wide_bvh = use_wide_bvh != 0;
+
+            // mode 0 - meshes 1, 2, 3 are added to empty scene
+            // mode 1 - mesh 0 is removed from scene with meshes 0, 1, 2 before mesh 3 is added (in place of mesh 0)
+            // mode 2 - same as 1, but followed by compaction
+            std::vector<Ray::pixel_color_t> images[3];
+            uint32_t node_counts[3], triangle_counts[3];
+
+            for (int mode = 0; mode < 3; mode++) {
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererRef);
+                std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 1.0f);
+
+                const uint32_t mat = AddTestMaterial(*scene);
+
+                auto add_mesh = [&](int i) {
+                    const uint32_t mesh = scene->AddMesh(TestMeshDesc(attrs[i], indices[i], mat));
+                    scene->AddMeshInstance(mesh, TestIdentityXform);
+                    return mesh;
+                };
+
+                if (mode == 0) {
+                    add_mesh(1);
+                    add_mesh(2);
+                    add_mesh(3);
+                } else {
+                    const uint32_t mesh0 = add_mesh(0);
+                    add_mesh(1);
+                    add_mesh(2);
+                    scene->RemoveMesh(mesh0);
+                    add_mesh(3);
+
+                    if (mode == 2) {
+                        scene->Compact();
+                    }
+                }
+
+                node_counts[mode] = scene->node_count();
+                triangle_counts[mode] = scene->triangle_count();
+
+                RenderTestImage(*renderer, scene, images[mode]);
+            }
+
+            for (int mode = 1; mode < 3; mode++) {
+                require(node_counts[mode] == node_counts[0]);
+                require(triangle_counts[mode] == triangle_counts[0]);
+                require(TestImageDiff(images[0], images[mode]) < 0.001);
+            }
+        }
+    }
+
+    {   // Batch addition of meshes and textures gives the same result as adding them one by one
+        std::vector<float> attrs[4];
+        std::vector<uint32_t> indices[4];
+        for (int i = 0; i < 4; i++) {
+            GenerateBoxes(250 - 50 * i, uint32_t(i), attrs[i], indices[i]);
+        }
+
+        std::vector<Ray::pixel_color8_t> tex_data[3];
+        for (int i = 0; i < 3; i++) {
+            tex_data[i].resize(32 * 32, Ray::pixel_color8_t{ uint8_t(50 * i), 128, 255, 255 });
+        }
+
+        Ray::settings_t s;
+        s.w = s.h = 64;
+        s.threads_count = 4;
+
+        uint32_t node_counts[2], triangle_counts[2];
+
+        for (int batched = 0; batched < 2; batched++) {
+            std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererRef);
+            std::shared_ptr<Ray::SceneBase> scene = renderer->CreateScene();
+
+            Ray::tex_desc_t tex_descs[3];
+            for (int i = 0; i < 3; i++) {
+                tex_descs[i].w = tex_descs[i].h = 32;
+                tex_descs[i].data = &tex_data[i][0];
+            }
+
+            Ray::mat_desc_t mat_desc;
+            mat_desc.type = Ray::DiffuseMaterial;
+
+            uint32_t textures[3];
+            if (batched) {
+                scene->AddTextures(tex_descs, 3, textures);
+            } else {
+                for (int i = 0; i < 3; i++) {
+                    textures[i] = scene->AddTexture(tex_descs[i]);
+                }
+            }
+
+            for (int i = 1; i < 3; i++) {
+                require(textures[i] == textures[0] + i);
+            }
+
+            mat_desc.main_texture = textures[0];
+            const uint32_t mat = scene->AddMaterial(mat_desc);
+
+            Ray::mesh_desc_t mesh_descs[4];
+            for (int i = 0; i < 4; i++) {
+                mesh_descs[i].prim_type = Ray::TriangleList;
+                mesh_descs[i].layout = Ray::PxyzNxyzTuv;
+                mesh_descs[i].vtx_attrs = &attrs[i][0];
+                mesh_descs[i].vtx_attrs_count = attrs[i].size() / 8;
+                mesh_descs[i].vtx_indices = &indices[i][0];
+                mesh_descs[i].vtx_indices_count = indices[i].size();
+                mesh_descs[i].shapes.push_back({ mat, 0, indices[i].size() });
+            }
+
+            uint32_t meshes[4];
+            if (batched) {
+                scene->AddMeshes(mesh_descs, 4, meshes);
+            } else {
+                for (int i = 0; i < 4; i++) {
+                    meshes[i] = scene->AddMesh(mesh_descs[i]);
+                }
+            }
+
+            for (int i = 1; i < 4; i++) {
+                require(meshes[i] == meshes[0] + i);
+            }
+
+            node_counts[batched] = scene->node_count();
+            triangle_counts[batched] = scene->triangle_count();
+        }
+
+        require(node_counts[0] == node_counts[1]);
+        require(triangle_counts[0] == triangle_counts[1]);
+    }
+    {   // Scene loaded from cache renders the same image as original one
+        std::vector<float> attrs;
+        std::vector<uint32_t> indices;
+        GenerateBoxes(200, 7, attrs, indices);
+
+        std::vector<Ray::pixel_color8_t> tex_data(32 * 32);
+        for (int i = 0; i < 32 * 32; i++) {
+            tex_data[i] = Ray::pixel_color8_t{ uint8_t(8 * (i % 32)), uint8_t(8 * (i / 32)), 128, 255 };
+        }
+
+        const Ray::camera_desc_t cam_desc = TestCameraDesc(200.0f, 45.0f);
+
+        const int ImgSize = 64;
+        const char *CacheFileName = "test_scene.cache";
+
+        for (int variant = 0; variant < 4; variant++) {
+            Ray::settings_t s;
+            s.w = s.h = ImgSize;
+            s.use_wide_bvh = variant != 0;
+            s.use_compressed_bvh = variant == 2;
+            s.use_tex_compression = variant == 3;
+
+            std::vector<Ray::pixel_color_t> images[2];
+            uint32_t node_counts[2], triangle_counts[2];
+
+            {   // original scene
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererRef);
+                std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 0.5f);
+
+                const uint32_t mat = AddTestMaterial(*scene, &tex_data[0], 32, true);
+                scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(attrs, indices, mat)), TestIdentityXform);
+
+                Ray::light_desc_t light_desc;
+                light_desc.type = Ray::PointLight;
+                light_desc.position[0] = 0.0f; light_desc.position[1] = 0.0f; light_desc.position[2] = 100.0f;
+                light_desc.radius = 1.0f;
+                light_desc.color[0] = light_desc.color[1] = light_desc.color[2] = 1000.0f;
+                scene->AddLight(light_desc);
+
+                node_counts[0] = scene->node_count();
+                triangle_counts[0] = scene->triangle_count();
+
+                RenderTestImage(*renderer, scene, images[0]);
+
+                require(scene->SaveCache(CacheFileName));
+            }
+
+            {   // scene loaded from cache
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererRef);
+                std::shared_ptr<Ray::SceneBase> scene = renderer->CreateScene();
+
+                require(scene->LoadCache(CacheFileName));
+
+                node_counts[1] = scene->node_count();
+                triangle_counts[1] = scene->triangle_count();
+
+                RenderTestImage(*renderer, scene, images[1]);
+            }
+
+            {   // cache made for different tree layout is rejected
+                Ray::settings_t s2 = s;
+                s2.use_wide_bvh = !s.use_wide_bvh;
+
+                std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s2, Ray::RendererRef);
+                std::shared_ptr<Ray::SceneBase> scene = renderer->CreateScene();
+
+                require(!scene->LoadCache(CacheFileName));
+                require(scene->triangle_count() == 0);
+            }
+
+            require(node_counts[0] == node_counts[1]);
+            require(triangle_counts[0] == triangle_counts[1]);
+            require(memcmp(&images[0][0], &images[1][0], ImgSize * ImgSize * sizeof(Ray::pixel_color_t)) == 0);
+        }
+
+        std::remove(CacheFileName);
+    }
+}
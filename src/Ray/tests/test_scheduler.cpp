@@ -0,0 +1,46 @@
+#include "test_common.h"
+
+#include <atomic>
+#include <vector>
+
+#include "../internal/TaskScheduler.h"
+
+void test_scheduler() {
+    {   // Every index is processed exactly once
+        Ray::TaskScheduler scheduler(4);
+        require(scheduler.threads_count() == 4);
+
+        std::vector<std::atomic_int> counters(1000);
+        for (auto &c : counters) c = 0;
+
+        scheduler.ParallelFor(0, 1000, [&](int i) { counters[i]++; });
+
+        for (const auto &c : counters) {
+            require(c == 1);
+        }
+    }
+
+    {   // Uneven tasks and nested calls
+        Ray::TaskScheduler scheduler(3);
+
+        std::atomic_int sum(0);
+        scheduler.ParallelFor(0, 16, [&](int i) {
+            scheduler.ParallelFor(0, i * 10, [&](int j) { sum += j % 2; });
+        });
+
+        int expected = 0;
+        for (int i = 0; i < 16; i++) {
+            expected += (i * 10) / 2;
+        }
+        require(sum == expected);
+    }
+
+    {   // Single thread executes everything inline
+        Ray::TaskScheduler scheduler(1);
+        require(scheduler.threads_count() == 1);
+
+        int sum = 0;
+        scheduler.ParallelFor(10, 20, [&](int i) { sum += i; });
+        require(sum == 145);
+    }
+}
@@ -0,0 +1,115 @@
+#include "test_common.h"
+
+#include <vector>
+
+#include "../RendererFactory.h"
+
+namespace {
+// Square facing +Z (or -Z if flipped) in PxyzNxyzTuv layout
+void AddQuad(float cx, float cy, float z, float half_size, bool flip, std::vector<float> &attrs, std::vector<uint32_t> &indices) {
+    const float corners[4][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f } };
+    const float nz = flip ? -1.0f : 1.0f;
+
+    const auto first_vtx = uint32_t(attrs.size() / 8);
+    for (const float *c : corners) {
+        attrs.insert(attrs.end(), { cx + c[0] * half_size, cy + c[1] * half_size, z, 0.0f, 0.0f, nz, 0.5f + 0.5f * c[0], 0.5f + 0.5f * c[1] });
+    }
+    if (flip) {
+        indices.insert(indices.end(), { first_vtx + 0, first_vtx + 2, first_vtx + 1, first_vtx + 0, first_vtx + 3, first_vtx + 2 });
+    } else {
+        indices.insert(indices.end(), { first_vtx + 0, first_vtx + 1, first_vtx + 2, first_vtx + 0, first_vtx + 2, first_vtx + 3 });
+    }
+}
+
+// Average brightness of 5x5 pixels window
+float WindowLuminance(const std::vector<Ray::pixel_color_t> &img, int w, int x, int y) {
+    float sum = 0.0f;
+    for (int j = y - 2; j <= y + 2; j++) {
+        for (int i = x - 2; i <= x + 2; i++) {
+            const Ray::pixel_color_t &p = img[j * w + i];
+            sum += p.r + p.g + p.b;
+        }
+    }
+    return sum / 25.0f;
+}
+}
+
+void test_shadow_rays() {
+    // floor with occluder above it
+    std::vector<float> attrs;
+    std::vector<uint32_t> indices;
+    AddQuad(0.0f, 0.0f, 0.0f, 100.0f, false, attrs, indices);
+    AddQuad(0.0f, 0.0f, 20.0f, 5.0f, false, attrs, indices);
+
+    // emissive square facing floor (it is not sampled directly, only reached by bounced rays)
+    std::vector<float> light_attrs;
+    std::vector<uint32_t> light_indices;
+    AddQuad(0.0f, 0.0f, 60.0f, 6.0f, true, light_attrs, light_indices);
+
+    const Ray::camera_desc_t cam_desc = TestCameraDesc(100.0f, 45.0f);
+
+    Ray::settings_t s;
+    s.w = s.h = 64;
+    // make sure image is split in several tiles
+    s.threads_count = 4;
+    s.tile_size = 16;
+
+    const uint32_t simd_types = Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512 | Ray::RendererNEON;
+
+    // scene 1 - point and mesh lights
+    // scene 0 - no lights (shadow rays are never emitted, environment is the only source of light)
+    for (int with_lights = 1; with_lights >= 0; with_lights--) {
+        // mode 0 - reference renderer
+        // mode 1 - SIMD renderer, shadow rays are sorted and traced per tile
+        // mode 2 - SIMD renderer, shadow rays of whole region are sorted and traced together
+        std::vector<Ray::pixel_color_t> images[3];
+
+        for (int mode = 0; mode < 3; mode++) {
+            s.use_wavefront = mode == 2;
+
+            std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, mode == 0 ? Ray::RendererRef : simd_types);
+            std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, with_lights ? 0.0f : 0.5f);
+
+            const uint32_t mat = AddTestMaterial(*scene);
+            scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(attrs, indices, mat)), TestIdentityXform);
+
+            if (with_lights) {
+                Ray::light_desc_t light_desc;
+                light_desc.type = Ray::PointLight;
+                light_desc.position[0] = -30.0f; light_desc.position[1] = 0.0f; light_desc.position[2] = 40.0f;
+                light_desc.radius = 1.0f;
+                light_desc.color[0] = light_desc.color[1] = light_desc.color[2] = 1000.0f;
+                scene->AddLight(light_desc);
+
+                const Ray::pixel_color8_t white = { 255, 255, 255, 255 };
+
+                Ray::tex_desc_t tex_desc;
+                tex_desc.w = tex_desc.h = 1;
+                tex_desc.data = &white;
+
+                Ray::mat_desc_t light_mat_desc;
+                light_mat_desc.type = Ray::EmissiveMaterial;
+                light_mat_desc.strength = 10.0f;
+                light_mat_desc.main_texture = scene->AddTexture(tex_desc);
+                const uint32_t light_mat = scene->AddMaterial(light_mat_desc);
+
+                scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(light_attrs, light_indices, light_mat)), TestIdentityXform);
+            }
+
+            RenderTestImage(*renderer, scene, images[mode], 16);
+        }
+
+        for (int mode = 1; mode < 3; mode++) {
+            require(TestImageDiff(images[0], images[mode]) < 0.01);
+        }
+
+        if (with_lights) {
+            // occluder casts shadow of point light around x = 30, while the same point at x = -30 is lit by it
+            for (int mode = 0; mode < 3; mode++) {
+                const float shadowed = WindowLuminance(images[mode], s.w, 55, 32),
+                            lit = WindowLuminance(images[mode], s.w, 9, 32);
+                require(lit > 0.0f && shadowed < 0.5f * lit);
+            }
+        }
+    }
+}
@@ -45,6 +45,25 @@ void test_simd_avx2() {
 #undef USE_AVX2
 #undef NS
 
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target ("avx512f,avx512dq")
+#endif
+
+#define NS Avx512
+#define USE_AVX512
+#include "../internal/simd/simd_vec.h"
+
+void test_simd_avx512() {
+#include "test_simd.ipp"
+}
+#undef USE_AVX512
+#undef NS
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
 #endif
 
 void test_simd() {
@@ -70,5 +89,11 @@ void test_simd() {
     } else {
         puts("Skipping avx2 test!");
     }
+
+    if (features.avx512_supported) {
+        test_simd_avx512();
+    } else {
+        puts("Skipping avx512 test!");
+    }
 #endif
 }
\ No newline at end of file
@@ -452,5 +452,472 @@ using namespace Ray::NS;
     require(v6[6] == 0);
     require(v6[7] == 2);
 
+    std::cout << "OK" << std::endl;
+}
+
+{
+    std::cout << "Test simd_fvec16 native? = " << simd_fvec16::is_native() << " | ";
+
+    simd_fvec16 v1, v2 = { 42.0f }, v3 = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f, 16.0f };
+
+    require(v2[0] == 42.0f);
+    require(v2[1] == 42.0f);
+    require(v2[2] == 42.0f);
+    require(v2[3] == 42.0f);
+    require(v2[4] == 42.0f);
+    require(v2[5] == 42.0f);
+    require(v2[6] == 42.0f);
+    require(v2[7] == 42.0f);
+    require(v2[8] == 42.0f);
+    require(v2[9] == 42.0f);
+    require(v2[10] == 42.0f);
+    require(v2[11] == 42.0f);
+    require(v2[12] == 42.0f);
+    require(v2[13] == 42.0f);
+    require(v2[14] == 42.0f);
+    require(v2[15] == 42.0f);
+
+    require(v3[0] == 1.0f);
+    require(v3[1] == 2.0f);
+    require(v3[2] == 3.0f);
+    require(v3[3] == 4.0f);
+    require(v3[4] == 5.0f);
+    require(v3[5] == 6.0f);
+    require(v3[6] == 7.0f);
+    require(v3[7] == 8.0f);
+    require(v3[8] == 9.0f);
+    require(v3[9] == 10.0f);
+    require(v3[10] == 11.0f);
+    require(v3[11] == 12.0f);
+    require(v3[12] == 13.0f);
+    require(v3[13] == 14.0f);
+    require(v3[14] == 15.0f);
+    require(v3[15] == 16.0f);
+
+    simd_fvec16 v4(v2), v5 = v3;
+
+    require(v4[0] == 42.0f);
+    require(v4[1] == 42.0f);
+    require(v4[2] == 42.0f);
+    require(v4[3] == 42.0f);
+    require(v4[4] == 42.0f);
+    require(v4[5] == 42.0f);
+    require(v4[6] == 42.0f);
+    require(v4[7] == 42.0f);
+    require(v4[8] == 42.0f);
+    require(v4[9] == 42.0f);
+    require(v4[10] == 42.0f);
+    require(v4[11] == 42.0f);
+    require(v4[12] == 42.0f);
+    require(v4[13] == 42.0f);
+    require(v4[14] == 42.0f);
+    require(v4[15] == 42.0f);
+
+    require(v5[0] == 1.0f);
+    require(v5[1] == 2.0f);
+    require(v5[2] == 3.0f);
+    require(v5[3] == 4.0f);
+    require(v5[4] == 5.0f);
+    require(v5[5] == 6.0f);
+    require(v5[6] == 7.0f);
+    require(v5[7] == 8.0f);
+    require(v5[8] == 9.0f);
+    require(v5[9] == 10.0f);
+    require(v5[10] == 11.0f);
+    require(v5[11] == 12.0f);
+    require(v5[12] == 13.0f);
+    require(v5[13] == 14.0f);
+    require(v5[14] == 15.0f);
+    require(v5[15] == 16.0f);
+
+    v1 = v5;
+
+    require(v1[0] == 1.0f);
+    require(v1[1] == 2.0f);
+    require(v1[2] == 3.0f);
+    require(v1[3] == 4.0f);
+    require(v1[4] == 5.0f);
+    require(v1[5] == 6.0f);
+    require(v1[6] == 7.0f);
+    require(v1[7] == 8.0f);
+    require(v1[8] == 9.0f);
+    require(v1[9] == 10.0f);
+    require(v1[10] == 11.0f);
+    require(v1[11] == 12.0f);
+    require(v1[12] == 13.0f);
+    require(v1[13] == 14.0f);
+    require(v1[14] == 15.0f);
+    require(v1[15] == 16.0f);
+
+    v1 = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 2.0f, 5.0f };
+    v2 = { 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 10.0f, 12.0f, 1.0f, 3.0f, 2.0f, 14.0f, 4.0f, 9.0f, 5.0f, 7.0f, 11.0f };
+
+    v3 = v1 + v2;
+    v4 = v1 - v2;
+    v5 = v1 * v2;
+    auto v6 = v1 / v2;
+    
+    require(v3[0] == Approx(5));
+    require(v3[1] == Approx(7));
+    require(v3[2] == Approx(9));
+    require(v3[3] == Approx(11));
+    require(v3[4] == Approx(13));
+    require(v3[5] == Approx(14));
+    require(v3[6] == Approx(15));
+    require(v3[7] == Approx(3));
+    require(v3[8] == Approx(4));
+    require(v3[9] == Approx(8));
+    require(v3[10] == Approx(21));
+    require(v3[11] == Approx(12));
+    require(v3[12] == Approx(18));
+    require(v3[13] == Approx(15));
+    require(v3[14] == Approx(9));
+    require(v3[15] == Approx(16));
+
+    require(v4[0] == Approx(-3));
+    require(v4[1] == Approx(-3));
+    require(v4[2] == Approx(-3));
+    require(v4[3] == Approx(-3));
+    require(v4[4] == Approx(-3));
+    require(v4[5] == Approx(-6));
+    require(v4[6] == Approx(-9));
+    require(v4[7] == Approx(1));
+    require(v4[8] == Approx(-2));
+    require(v4[9] == Approx(4));
+    require(v4[10] == Approx(-7));
+    require(v4[11] == Approx(4));
+    require(v4[12] == Approx(0));
+    require(v4[13] == Approx(5));
+    require(v4[14] == Approx(-5));
+    require(v4[15] == Approx(-6));
+
+    require(v5[0] == Approx(4));
+    require(v5[1] == Approx(10));
+    require(v5[2] == Approx(18));
+    require(v5[3] == Approx(28));
+    require(v5[4] == Approx(40));
+    require(v5[5] == Approx(40));
+    require(v5[6] == Approx(36));
+    require(v5[7] == Approx(2));
+    require(v5[8] == Approx(3));
+    require(v5[9] == Approx(12));
+    require(v5[10] == Approx(98));
+    require(v5[11] == Approx(32));
+    require(v5[12] == Approx(81));
+    require(v5[13] == Approx(50));
+    require(v5[14] == Approx(14));
+    require(v5[15] == Approx(55));
+
+    require(v6[0] == Approx(0.25));
+    require(v6[1] == Approx(0.4));
+    require(v6[2] == Approx(0.5));
+    require(v6[3] == Approx(0.57143));
+    require(v6[4] == Approx(0.625));
+    require(v6[5] == Approx(0.4));
+    require(v6[6] == Approx(0.25));
+    require(v6[7] == Approx(2));
+    require(v6[8] == Approx(0.33333));
+    require(v6[9] == Approx(3));
+    require(v6[10] == Approx(0.5));
+    require(v6[11] == Approx(2));
+    require(v6[12] == Approx(1));
+    require(v6[13] == Approx(2));
+    require(v6[14] == Approx(0.28571));
+    require(v6[15] == Approx(0.45455));
+
+    v5 = sqrt(v5);
+
+    require(v5[0] == Approx(2));
+    require(v5[1] == Approx(3.16228));
+    require(v5[2] == Approx(4.24264));
+    require(v5[3] == Approx(5.2915));
+    require(v5[4] == Approx(6.32456));
+    require(v5[5] == Approx(6.32456));
+    require(v5[6] == Approx(6));
+    require(v5[7] == Approx(1.41421));
+    require(v5[8] == Approx(1.73205));
+    require(v5[9] == Approx(3.4641));
+    require(v5[10] == Approx(9.89949));
+    require(v5[11] == Approx(5.65685));
+    require(v5[12] == Approx(9));
+    require(v5[13] == Approx(7.07107));
+    require(v5[14] == Approx(3.74166));
+    require(v5[15] == Approx(7.4162));
+
+    simd_fvec16 v9 = { 3.0f, 6.0f, 7.0f, 6.0f, 2.0f, 12.0f, 18.0f, 0.0f, 5.0f, 2.0f, 9.0f, 3.0f, 9.0f, 6.0f, 1.0f, 20.0f };
+
+    auto v10 = v2 < v9;
+
+    require(v10[0] == 0);
+    require(reinterpret_cast<const uint32_t&>(v10[1]) == 0xFFFFFFFF);
+    require(reinterpret_cast<const uint32_t&>(v10[2]) == 0xFFFFFFFF);
+    require(v10[3] == 0);
+    require(v10[4] == 0);
+    require(reinterpret_cast<const uint32_t&>(v10[5]) == 0xFFFFFFFF);
+    require(reinterpret_cast<const uint32_t&>(v10[6]) == 0xFFFFFFFF);
+    require(v10[7] == 0);
+    require(reinterpret_cast<const uint32_t&>(v10[8]) == 0xFFFFFFFF);
+    require(v10[9] == 0);
+    require(v10[10] == 0);
+    require(v10[11] == 0);
+    require(v10[12] == 0);
+    require(reinterpret_cast<const uint32_t&>(v10[13]) == 0xFFFFFFFF);
+    require(v10[14] == 0);
+    require(reinterpret_cast<const uint32_t&>(v10[15]) == 0xFFFFFFFF);
+
+    auto v11 = v2 > v9;
+
+    require(reinterpret_cast<const uint32_t&>(v11[0]) == 0xFFFFFFFF);
+    require(v11[1] == 0);
+    require(v11[2] == 0);
+    require(reinterpret_cast<const uint32_t&>(v11[3]) == 0xFFFFFFFF);
+    require(reinterpret_cast<const uint32_t&>(v11[4]) == 0xFFFFFFFF);
+    require(v11[5] == 0);
+    require(v11[6] == 0);
+    require(reinterpret_cast<const uint32_t&>(v11[7]) == 0xFFFFFFFF);
+    require(v11[8] == 0);
+    require(v11[9] == 0);
+    require(reinterpret_cast<const uint32_t&>(v11[10]) == 0xFFFFFFFF);
+    require(reinterpret_cast<const uint32_t&>(v11[11]) == 0xFFFFFFFF);
+    require(v11[12] == 0);
+    require(v11[13] == 0);
+    require(reinterpret_cast<const uint32_t&>(v11[14]) == 0xFFFFFFFF);
+    require(v11[15] == 0);
+
+    simd_fvec16 v12 = v1;
+    where(v10, v12) = v9;
+
+    require(v12[0] == 1.0f);
+    require(v12[1] == 6.0f);
+    require(v12[2] == 7.0f);
+    require(v12[3] == 4.0f);
+    require(v12[4] == 5.0f);
+    require(v12[5] == 12.0f);
+    require(v12[6] == 18.0f);
+    require(v12[7] == 2.0f);
+    require(v12[8] == 5.0f);
+    require(v12[9] == 6.0f);
+    require(v12[10] == 7.0f);
+    require(v12[11] == 8.0f);
+    require(v12[12] == 9.0f);
+    require(v12[13] == 6.0f);
+    require(v12[14] == 2.0f);
+    require(v12[15] == 20.0f);
+
+    require(reinterpret_cast<const simd_ivec16&>(v10).movemask() == 0xa166);
+    require(reinterpret_cast<const simd_ivec16&>(v10).not_all_zeros());
+    require(reinterpret_cast<const simd_ivec16&>(v10).all_zeros(reinterpret_cast<const simd_ivec16&>(v11)));
+
+    std::cout << "OK" << std::endl;
+}
+
+{
+    std::cout << "Test simd_ivec16 native? = " << simd_ivec16::is_native() << " | ";
+
+    simd_ivec16 v1, v2 = { 42 }, v3 = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+    require(v2[0] == 42);
+    require(v2[1] == 42);
+    require(v2[2] == 42);
+    require(v2[3] == 42);
+    require(v2[4] == 42);
+    require(v2[5] == 42);
+    require(v2[6] == 42);
+    require(v2[7] == 42);
+    require(v2[8] == 42);
+    require(v2[9] == 42);
+    require(v2[10] == 42);
+    require(v2[11] == 42);
+    require(v2[12] == 42);
+    require(v2[13] == 42);
+    require(v2[14] == 42);
+    require(v2[15] == 42);
+
+    require(v3[0] == 1);
+    require(v3[1] == 2);
+    require(v3[2] == 3);
+    require(v3[3] == 4);
+    require(v3[4] == 5);
+    require(v3[5] == 6);
+    require(v3[6] == 7);
+    require(v3[7] == 8);
+    require(v3[8] == 9);
+    require(v3[9] == 10);
+    require(v3[10] == 11);
+    require(v3[11] == 12);
+    require(v3[12] == 13);
+    require(v3[13] == 14);
+    require(v3[14] == 15);
+    require(v3[15] == 16);
+
+    simd_ivec16 v4(v2), v5 = v3;
+
+    require(v4[0] == 42);
+    require(v4[1] == 42);
+    require(v4[2] == 42);
+    require(v4[3] == 42);
+    require(v4[4] == 42);
+    require(v4[5] == 42);
+    require(v4[6] == 42);
+    require(v4[7] == 42);
+    require(v4[8] == 42);
+    require(v4[9] == 42);
+    require(v4[10] == 42);
+    require(v4[11] == 42);
+    require(v4[12] == 42);
+    require(v4[13] == 42);
+    require(v4[14] == 42);
+    require(v4[15] == 42);
+
+    require(v5[0] == 1);
+    require(v5[1] == 2);
+    require(v5[2] == 3);
+    require(v5[3] == 4);
+    require(v5[4] == 5);
+    require(v5[5] == 6);
+    require(v5[6] == 7);
+    require(v5[7] == 8);
+    require(v5[8] == 9);
+    require(v5[9] == 10);
+    require(v5[10] == 11);
+    require(v5[11] == 12);
+    require(v5[12] == 13);
+    require(v5[13] == 14);
+    require(v5[14] == 15);
+    require(v5[15] == 16);
+
+    v1 = v5;
+
+    require(v1[0] == 1);
+    require(v1[1] == 2);
+    require(v1[2] == 3);
+    require(v1[3] == 4);
+    require(v1[4] == 5);
+    require(v1[5] == 6);
+    require(v1[6] == 7);
+    require(v1[7] == 8);
+    require(v1[8] == 9);
+    require(v1[9] == 10);
+    require(v1[10] == 11);
+    require(v1[11] == 12);
+    require(v1[12] == 13);
+    require(v1[13] == 14);
+    require(v1[14] == 15);
+    require(v1[15] == 16);
+
+    v1 = { 1, 2, 3, 4, 5, 4, 3, 2, 1, 6, 7, 8, 9, 10, 2, 5 };
+    v2 = { 4, 5, 6, 7, 8, 10, 12, 1, 3, 2, 14, 4, 9, 5, 7, 11 };
+
+    v3 = v1 + v2;
+    v4 = v1 - v2;
+    v5 = v1 * v2;
+    auto v6 = v1 / v2;
+    
+    require(v3[0] == 5);
+    require(v3[1] == 7);
+    require(v3[2] == 9);
+    require(v3[3] == 11);
+    require(v3[4] == 13);
+    require(v3[5] == 14);
+    require(v3[6] == 15);
+    require(v3[7] == 3);
+    require(v3[8] == 4);
+    require(v3[9] == 8);
+    require(v3[10] == 21);
+    require(v3[11] == 12);
+    require(v3[12] == 18);
+    require(v3[13] == 15);
+    require(v3[14] == 9);
+    require(v3[15] == 16);
+
+    require(v4[0] == -3);
+    require(v4[1] == -3);
+    require(v4[2] == -3);
+    require(v4[3] == -3);
+    require(v4[4] == -3);
+    require(v4[5] == -6);
+    require(v4[6] == -9);
+    require(v4[7] == 1);
+    require(v4[8] == -2);
+    require(v4[9] == 4);
+    require(v4[10] == -7);
+    require(v4[11] == 4);
+    require(v4[12] == 0);
+    require(v4[13] == 5);
+    require(v4[14] == -5);
+    require(v4[15] == -6);
+
+    require(v5[0] == 4);
+    require(v5[1] == 10);
+    require(v5[2] == 18);
+    require(v5[3] == 28);
+    require(v5[4] == 40);
+    require(v5[5] == 40);
+    require(v5[6] == 36);
+    require(v5[7] == 2);
+    require(v5[8] == 3);
+    require(v5[9] == 12);
+    require(v5[10] == 98);
+    require(v5[11] == 32);
+    require(v5[12] == 81);
+    require(v5[13] == 50);
+    require(v5[14] == 14);
+    require(v5[15] == 55);
+
+    require(v6[0] == 0);
+    require(v6[1] == 0);
+    require(v6[2] == 0);
+    require(v6[3] == 0);
+    require(v6[4] == 0);
+    require(v6[5] == 0);
+    require(v6[6] == 0);
+    require(v6[7] == 2);
+    require(v6[8] == 0);
+    require(v6[9] == 3);
+    require(v6[10] == 0);
+    require(v6[11] == 2);
+    require(v6[12] == 1);
+    require(v6[13] == 2);
+    require(v6[14] == 0);
+    require(v6[15] == 0);
+
+    auto v7 = v1 < v2;
+
+    require(v7[0] == -1);
+    require(v7[1] == -1);
+    require(v7[2] == -1);
+    require(v7[3] == -1);
+    require(v7[4] == -1);
+    require(v7[5] == -1);
+    require(v7[6] == -1);
+    require(v7[7] == 0);
+    require(v7[8] == -1);
+    require(v7[9] == 0);
+    require(v7[10] == -1);
+    require(v7[11] == 0);
+    require(v7[12] == 0);
+    require(v7[13] == 0);
+    require(v7[14] == -1);
+    require(v7[15] == -1);
+
+    auto v8 = (v1 << 2) >> 1;
+
+    require(v8[0] == 2);
+    require(v8[1] == 4);
+    require(v8[2] == 6);
+    require(v8[3] == 8);
+    require(v8[4] == 10);
+    require(v8[5] == 8);
+    require(v8[6] == 6);
+    require(v8[7] == 4);
+    require(v8[8] == 2);
+    require(v8[9] == 12);
+    require(v8[10] == 14);
+    require(v8[11] == 16);
+    require(v8[12] == 18);
+    require(v8[13] == 20);
+    require(v8[14] == 4);
+    require(v8[15] == 10);
+
     std::cout << "OK" << std::endl;
 }
\ No newline at end of file
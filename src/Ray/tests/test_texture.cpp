@@ -4,14 +4,48 @@
 #include <cstring>
 
 #include <fstream>
+#include <vector>
 
 #include "../RendererFactory.h"
+#include "../internal/TextureUtilsRef.h"
 
 #include "test_scene2.h"
 
 void WriteTGA(const uint8_t *data, int w, int h, int bpp, const std::string &name);
 
 void test_texture() {
+    {   // Test mip level generation
+        const Ray::pixel_color8_t black = { 0, 0, 0, 0 }, white = { 255, 255, 255, 255 }, gray = { 90, 90, 90, 90 };
+        const Ray::pixel_color8_t checker[] = { black, white, white, black };
+
+        const int res[2] = { 2, 2 };
+        Ray::pixel_color8_t unorm_result, srgb_result;
+        Ray::Ref::DownsampleTexture(checker, res, false, &unorm_result, 0, 1);
+        Ray::Ref::DownsampleTexture(checker, res, true, &srgb_result, 0, 1);
+
+        require(unorm_result.r == 128 && unorm_result.a == 128);
+        // color is averaged in linear space, alpha is always linear
+        require(srgb_result.r == 188 && srgb_result.g == 188 && srgb_result.b == 188 && srgb_result.a == 128);
+
+        // odd size is filtered with three taps with whole source covered
+        const Ray::pixel_color8_t npot[] = { black, gray, { 180, 180, 180, 180 },
+                                             black, gray, { 180, 180, 180, 180 } };
+        const int npot_res[2] = { 3, 2 };
+        Ray::pixel_color8_t npot_result;
+        Ray::Ref::DownsampleTexture(npot, npot_res, false, &npot_result, 0, 1);
+        require(npot_result.r == 90 && npot_result.a == 90);
+
+        // constant color is preserved exactly
+        std::vector<Ray::pixel_color8_t> constant(7 * 5, { 17, 100, 230, 255 }), constant_result(3 * 2);
+        const int constant_res[2] = { 7, 5 };
+        for (int is_srgb = 0; is_srgb < 2; is_srgb++) {
+            Ray::Ref::DownsampleTexture(&constant[0], constant_res, is_srgb != 0, &constant_result[0], 0, 2);
+            for (const Ray::pixel_color8_t &p : constant_result) {
+                require(p.r == 17 && p.g == 100 && p.b == 230 && p.a == 255);
+            }
+        }
+    }
+
     const int NUM_SAMPLES = 256;
 
     // Setup camera
@@ -80,7 +114,7 @@ void test_texture() {
 
         std::shared_ptr<Ray::RendererBase> renderer;
 
-        Ray::eRendererType renderer_types[] = { Ray::RendererRef, Ray::RendererSSE2, Ray::RendererAVX, Ray::RendererAVX2,
+        Ray::eRendererType renderer_types[] = { Ray::RendererRef, Ray::RendererSSE2, Ray::RendererAVX, Ray::RendererAVX2, Ray::RendererAVX512,
 #if defined(__ANDROID__)
             Ray::RendererNEON,
 #elif !defined(DISABLE_OCL)
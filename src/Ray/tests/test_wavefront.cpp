@@ -0,0 +1,94 @@
+#include "test_common.h"
+
+#include <random>
+#include <vector>
+
+#include "../RendererFactory.h"
+
+namespace {
+// Randomly oriented triangles scattered in a cube, rays bounce between them several times before escaping
+void GenerateTriangleCloud(int tris_count, std::vector<float> &attrs, std::vector<uint32_t> &indices) {
+    std::uniform_real_distribution<float> pos_dist(-40.0f, 40.0f), offset_dist(-6.0f, 6.0f);
+    std::mt19937 gen(7);
+
+    for (int i = 0; i < tris_count; i++) {
+        const float center[3] = { pos_dist(gen), pos_dist(gen), pos_dist(gen) };
+
+        float p[3][3];
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                p[j][k] = center[k] + offset_dist(gen);
+            }
+        }
+
+        const float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] },
+                    e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+        float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+        const float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len < 0.001f) continue;
+        n[0] /= len; n[1] /= len; n[2] /= len;
+
+        // non-degenerate uvs are needed to get tangent frame for bounced rays
+        const float uvs[3][2] = { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, 1.0f } };
+
+        const auto first_vtx = uint32_t(attrs.size() / 8);
+        for (int j = 0; j < 3; j++) {
+            // PxyzNxyzTuv layout
+            attrs.insert(attrs.end(), { p[j][0], p[j][1], p[j][2], n[0], n[1], n[2], uvs[j][0], uvs[j][1] });
+            indices.push_back(first_vtx + j);
+        }
+    }
+}
+}
+
+void test_wavefront() {
+    std::vector<float> attrs;
+    std::vector<uint32_t> indices;
+    GenerateTriangleCloud(4000, attrs, indices);
+
+    const Ray::camera_desc_t cam_desc = TestCameraDesc(150.0f, 45.0f);
+
+    // grey material, so pixel color depends on number of bounces
+    const Ray::pixel_color8_t grey = { 128, 128, 128, 255 };
+
+    Ray::settings_t s;
+    s.w = s.h = 64;
+    // make sure image is split in several tiles
+    s.tile_size = 16;
+
+    for (int use_wide_bvh = 0; use_wide_bvh < 2; use_wide_bvh++) {
+        s.use_wide_bvh = use_wide_bvh != 0;
+
+        // mode 0 - secondary rays are traced per tile
+        // mode 1 - secondary rays of whole region are traced together by single thread
+        // mode 2 - same as 1, but with several threads (chunks of queue are processed in parallel)
+        std::vector<Ray::pixel_color_t> images[3];
+        Ray::RendererBase::stats_t stats[3];
+
+        for (int mode = 0; mode < 3; mode++) {
+            s.use_wavefront = mode != 0;
+            s.threads_count = mode == 2 ? 4 : 1;
+
+            std::shared_ptr<Ray::RendererBase> renderer = Ray::CreateRenderer(s, Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512 | Ray::RendererNEON);
+            std::shared_ptr<Ray::SceneBase> scene = CreateTestScene(*renderer, cam_desc, 1.0f);
+
+            const uint32_t mat = AddTestMaterial(*scene, &grey);
+            scene->AddMeshInstance(scene->AddMesh(TestMeshDesc(attrs, indices, mat)), TestIdentityXform);
+
+            RenderTestImage(*renderer, scene, images[mode]);
+            renderer->GetStats(stats[mode]);
+        }
+
+        // scene is dense enough to produce several bounces
+        require(stats[0].rays_traced[1] > 0 && stats[0].rays_traced[2] > 0);
+
+        for (int mode = 1; mode < 3; mode++) {
+            // random sequences are bound to pixels, so order in which rays are traced does not change the result
+            require(TestImageDiff(images[0], images[mode]) < 0.001);
+            for (int bounce = 0; bounce < Ray::RendererBase::stats_t::BouncesCount; bounce++) {
+                require(stats[mode].rays_traced[bounce] == stats[0].rays_traced[bounce]);
+            }
+            require(stats[mode].rays_terminated == stats[0].rays_terminated);
+        }
+    }
+}
@@ -0,0 +1,329 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <Ray/RendererFactory.h>
+#include <Sys/Json.h>
+
+#include "../DemoLib/load/Load.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_STATIC
+#include <Ren/SOIL2/stb_image_write.h>
+
+/*
+    Headless renderer used for offline rendering and performance regression testing.
+
+    Usage: RayCLI -scene assets/scenes/sponza_simple.json [-w 640] [-h 360] [-spp 64] [-backend ref|sse2|avx|avx2|avx512]
+                  [-threads 0] [-repeat 1] [-out image.png] [-json result.json] [-baseline baseline.json] [-tolerance 0.1]
+                  [-tex_compression] [-hybrid_traversal] [-single_ray_threshold 0.3] [-scene_cache scene.cache]
+
+    Each repetition renders scene from scratch with the same sampling sequence, so number of traced rays (and resulting image)
+    depends only on scene, resolution, spp and backend. Best time of all repetitions is used to reduce noise.
+    When baseline is specified, result is compared against it and non-zero code is returned in case of regression.
+    Rays count must match exactly, while Mrays/s is absolute, so it can be compared only with baseline recorded on the same machine.
+    When scene cache is specified, scene is loaded from it (skipping parsing and BVH building), if cache is missing or
+    outdated it is written after scene is loaded from json.
+*/
+
+namespace RayCLIInternal {
+struct result_t {
+    std::string backend;
+    int w, h, spp;
+    double time_s, mrays_per_s;
+    unsigned long long rays_count;
+    Ray::RendererBase::stats_t stats;
+};
+
+unsigned long long TotalRays(const Ray::RendererBase::stats_t &st) {
+    unsigned long long rays_count = 0;
+    for (unsigned long long count : st.rays_traced) {
+        rays_count += count;
+    }
+    return rays_count;
+}
+
+const char *BackendName(Ray::eRendererType type) {
+    switch (type) {
+    case Ray::RendererRef:
+        return "ref";
+    case Ray::RendererSSE2:
+        return "sse2";
+    case Ray::RendererAVX:
+        return "avx";
+    case Ray::RendererAVX2:
+        return "avx2";
+    case Ray::RendererAVX512:
+        return "avx512";
+    case Ray::RendererNEON:
+        return "neon";
+    case Ray::RendererOCL:
+        return "ocl";
+    }
+    return "unknown";
+}
+
+uint32_t BackendFlags(const std::string &name) {
+    if (name == "ref") {
+        return Ray::RendererRef;
+    } else if (name == "sse2") {
+        return Ray::RendererSSE2;
+    } else if (name == "avx") {
+        return Ray::RendererAVX;
+    } else if (name == "avx2") {
+        return Ray::RendererAVX2;
+    } else if (name == "avx512") {
+        return Ray::RendererAVX512;
+    } else if (name == "neon") {
+        return Ray::RendererNEON;
+    }
+    return 0;
+}
+
+bool WriteImage(const std::string &name, const Ray::pixel_color_t *pixels, int w, int h) {
+    std::vector<uint8_t> data(w * h * 3);
+    for (int i = 0; i < w * h; i++) {
+        data[i * 3 + 0] = (uint8_t)(std::min(std::max(pixels[i].r, 0.0f), 1.0f) * 255);
+        data[i * 3 + 1] = (uint8_t)(std::min(std::max(pixels[i].g, 0.0f), 1.0f) * 255);
+        data[i * 3 + 2] = (uint8_t)(std::min(std::max(pixels[i].b, 0.0f), 1.0f) * 255);
+    }
+
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tga") == 0) {
+        return stbi_write_tga(name.c_str(), w, h, 3, &data[0]) != 0;
+    }
+    return stbi_write_png(name.c_str(), w, h, 3, &data[0], w * 3) != 0;
+}
+
+JsObject WriteResult(const std::string &scene_name, const result_t &res) {
+    JsObject js_result;
+    js_result.Push("scene", JsString{ scene_name });
+    js_result.Push("backend", JsString{ res.backend });
+    js_result.Push("width", JsNumber{ double(res.w) });
+    js_result.Push("height", JsNumber{ double(res.h) });
+    js_result.Push("spp", JsNumber{ double(res.spp) });
+    js_result.Push("time_s", JsNumber{ res.time_s });
+    js_result.Push("rays_count", JsNumber{ double(res.rays_count) });
+    js_result.Push("mrays_per_s", JsNumber{ res.mrays_per_s });
+    js_result.Push("stats", WriteStats(res.stats));
+    return js_result;
+}
+
+// returns false if current result is considered as regression
+bool CompareWithBaseline(const result_t &res, const JsObject &js_baseline, double tolerance) {
+    const std::string &baseline_backend = ((const JsString &)js_baseline.at("backend")).val;
+    const int baseline_w = (int)((const JsNumber &)js_baseline.at("width")).val,
+              baseline_h = (int)((const JsNumber &)js_baseline.at("height")).val,
+              baseline_spp = (int)((const JsNumber &)js_baseline.at("spp")).val;
+
+    if (baseline_backend != res.backend || baseline_w != res.w || baseline_h != res.h || baseline_spp != res.spp) {
+        fprintf(stderr, "Baseline was recorded with different settings (%s %ix%i %i spp)\n",
+                baseline_backend.c_str(), baseline_w, baseline_h, baseline_spp);
+        return false;
+    }
+
+    bool res_ok = true;
+
+    // rendering is deterministic, so rays count changes only with changes in algorithm
+    const auto baseline_rays_count = (unsigned long long)((const JsNumber &)js_baseline.at("rays_count")).val;
+    if (baseline_rays_count != res.rays_count) {
+        fprintf(stderr, "Rays count differs from baseline: %llu vs %llu\n", res.rays_count, baseline_rays_count);
+        res_ok = false;
+    }
+
+    const double baseline_mrays_per_s = ((const JsNumber &)js_baseline.at("mrays_per_s")).val;
+    const double speedup = res.mrays_per_s / baseline_mrays_per_s;
+    printf("Baseline:         %.2f Mrays/s (%+.1f%%)\n", baseline_mrays_per_s, 100.0 * (speedup - 1.0));
+    if (speedup < 1.0 - tolerance) {
+        fprintf(stderr, "Performance regression: %.2f Mrays/s vs %.2f Mrays/s\n", res.mrays_per_s, baseline_mrays_per_s);
+        res_ok = false;
+    }
+
+    return res_ok;
+}
+}
+
+int main(int argc, char *argv[]) {
+    using namespace RayCLIInternal;
+
+    std::string scene_name = "assets/scenes/sponza_simple.json", backend, out_image, out_json, baseline, scene_cache;
+    int w = 640, h = 360, spp = 64, threads_count = 0, repeat_count = 1;
+    double tolerance = 0.1;
+    bool use_tex_compression = false, use_hybrid_traversal = false;
+    float single_ray_threshold = Ray::settings_t{}.single_ray_threshold;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if ((arg == "-scene" || arg == "-s") && (i + 1 < argc)) {
+            scene_name = argv[++i];
+        } else if (arg == "-w" && (i + 1 < argc)) {
+            w = atoi(argv[++i]);
+        } else if (arg == "-h" && (i + 1 < argc)) {
+            h = atoi(argv[++i]);
+        } else if (arg == "-spp" && (i + 1 < argc)) {
+            spp = atoi(argv[++i]);
+        } else if (arg == "-backend" && (i + 1 < argc)) {
+            backend = argv[++i];
+        } else if (arg == "-threads" && (i + 1 < argc)) {
+            threads_count = atoi(argv[++i]);
+        } else if (arg == "-repeat" && (i + 1 < argc)) {
+            repeat_count = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "-out" && (i + 1 < argc)) {
+            out_image = argv[++i];
+        } else if (arg == "-json" && (i + 1 < argc)) {
+            out_json = argv[++i];
+        } else if (arg == "-baseline" && (i + 1 < argc)) {
+            baseline = argv[++i];
+        } else if (arg == "-tolerance" && (i + 1 < argc)) {
+            tolerance = atof(argv[++i]);
+        } else if (arg == "-tex_compression") {
+            use_tex_compression = true;
+        } else if (arg == "-hybrid_traversal") {
+            use_hybrid_traversal = true;
+        } else if (arg == "-single_ray_threshold" && (i + 1 < argc)) {
+            single_ray_threshold = (float)atof(argv[++i]);
+        } else if (arg == "-scene_cache" && (i + 1 < argc)) {
+            scene_cache = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+            return -1;
+        }
+    }
+
+    uint32_t flags = Ray::RendererRef | Ray::RendererSSE2 | Ray::RendererAVX | Ray::RendererAVX2 | Ray::RendererAVX512 | Ray::RendererNEON;
+    if (!backend.empty()) {
+        flags = BackendFlags(backend);
+        if (!flags) {
+            fprintf(stderr, "Unknown backend %s\n", backend.c_str());
+            return -1;
+        }
+    }
+
+    Ray::settings_t s;
+    s.w = w;
+    s.h = h;
+    s.threads_count = threads_count;
+    s.use_tex_compression = use_tex_compression;
+    s.use_hybrid_traversal = use_hybrid_traversal;
+    s.single_ray_threshold = single_ray_threshold;
+
+    auto renderer = Ray::CreateRenderer(s, flags);
+    if (!renderer || (!backend.empty() && renderer->type() != flags)) {
+        fprintf(stderr, "Backend %s is not supported\n", backend.c_str());
+        return -1;
+    }
+
+    std::shared_ptr<Ray::SceneBase> scene;
+    if (!scene_cache.empty()) {
+        scene = renderer->CreateScene();
+        if (!scene->LoadCache(scene_cache.c_str())) {
+            scene = nullptr;
+        }
+    }
+
+    if (!scene) {
+        JsObject js_scene;
+
+        std::ifstream in_file(scene_name, std::ios::binary);
+        if (!js_scene.Read(in_file)) {
+            fprintf(stderr, "Failed to parse scene file %s\n", scene_name.c_str());
+            return -1;
+        }
+
+        try {
+            scene = LoadScene(renderer.get(), js_scene);
+        } catch (std::exception &e) {
+            fprintf(stderr, "Failed to load scene: %s\n", e.what());
+        }
+
+        if (!scene) {
+            return -1;
+        }
+
+        if (!scene_cache.empty() && !scene->SaveCache(scene_cache.c_str())) {
+            fprintf(stderr, "Failed to write scene cache %s\n", scene_cache.c_str());
+        }
+    }
+
+    result_t res = {};
+    res.backend = BackendName(renderer->type());
+    res.w = w;
+    res.h = h;
+    res.spp = spp;
+
+    for (int i = 0; i < repeat_count; i++) {
+        renderer->Clear();
+        renderer->ResetStats();
+
+        // new region context starts sampling sequence from the beginning
+        Ray::RegionContext region{ { 0, 0, w, h } };
+
+        const auto time_start = std::chrono::high_resolution_clock::now();
+
+        for (int j = 0; j < spp; j++) {
+            renderer->RenderScene(scene, region);
+        }
+
+        const double time_s = std::chrono::duration<double>{ std::chrono::high_resolution_clock::now() - time_start }.count();
+        if (i == 0 || time_s < res.time_s) {
+            res.time_s = time_s;
+            renderer->GetStats(res.stats);
+        }
+    }
+
+    res.rays_count = TotalRays(res.stats);
+    res.mrays_per_s = double(res.rays_count) / (res.time_s * 1000000.0);
+
+    {
+        // stage times are summed across threads
+        const double threads = renderer->threads_count();
+        const Ray::RendererBase::stats_t &st = res.stats;
+
+        printf("Scene:            %s\n", scene_name.c_str());
+        printf("Backend:          %s (%i threads)\n", res.backend.c_str(), renderer->threads_count());
+        printf("Resolution:       %ix%i, %i spp\n", w, h, spp);
+        printf("Time:             %.3f s\n", res.time_s);
+        printf("Rays:             %llu\n", res.rays_count);
+        printf("Performance:      %.2f Mrays/s\n", res.mrays_per_s);
+        printf("Primary ray gen:  %.1f ms\n", st.time_primary_ray_gen_us / (1000.0 * threads));
+        printf("Primary trace:    %.1f ms\n", st.time_primary_trace_us / (1000.0 * threads));
+        printf("Primary shade:    %.1f ms\n", st.time_primary_shade_us / (1000.0 * threads));
+        printf("Secondary sort:   %.1f ms\n", st.time_secondary_sort_us / (1000.0 * threads));
+        printf("Secondary gather: %.1f ms\n", st.time_secondary_gather_us / (1000.0 * threads));
+        printf("Secondary trace:  %.1f ms\n", st.time_secondary_trace_us / (1000.0 * threads));
+        printf("Secondary shade:  %.1f ms\n", st.time_secondary_shade_us / (1000.0 * threads));
+    }
+
+    if (!out_image.empty()) {
+        if (!WriteImage(out_image, renderer->get_pixels_ref(), w, h)) {
+            fprintf(stderr, "Failed to write image %s\n", out_image.c_str());
+            return -1;
+        }
+    }
+
+    if (!out_json.empty()) {
+        std::ofstream out_file(out_json, std::ios::binary);
+        WriteResult(scene_name, res).Write(out_file);
+    }
+
+    if (!baseline.empty()) {
+        JsObject js_baseline;
+
+        std::ifstream in_file(baseline, std::ios::binary);
+        if (!js_baseline.Read(in_file)) {
+            fprintf(stderr, "Failed to parse baseline file %s\n", baseline.c_str());
+            return -1;
+        }
+
+        if (!CompareWithBaseline(res, js_baseline, tolerance)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -1,7 +1,9 @@
 #include "AssetFile.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 
@@ -33,7 +35,7 @@ public:
 
 struct Package {
     std::string name;
-    std::vector<Sys::FileDesc> file_list;
+    std::unique_ptr<PackReader> reader;
 };
 
 std::vector<Package> added_packages;
@@ -46,7 +48,7 @@ std::ostringstream Sys::CannotOpenFileException::cnvt;
 AAssetManager* Sys::AssetFile::asset_manager_ = nullptr;
 #endif
 
-Sys::AssetFile::AssetFile(const char *file_name, int mode) : mode_(mode), name_(file_name), size_(0), pos_override_(0) {
+Sys::AssetFile::AssetFile(const char *file_name, int mode) : mode_(mode), name_(file_name), size_(0), pos_(0) {
     using namespace std;
 
     if (mode == FileIn) {
@@ -91,29 +93,29 @@ Sys::AssetFile::AssetFile(const char *file_name, int mode) : mode_(mode), name_(
 
         size_ = AAsset_getLength(asset_file_);
 #else
-        file_stream_ = new std::fstream();
-
-        string fname = file_name;
         for (auto &p : added_packages) {
-            for (auto &f : p.file_list) {
-                if (fname == f.name) {
-                    file_stream_->open(p.name, std::ios::in | std::ios::binary);
-                    if (!file_stream_->good()) {
+            const uint32_t i = p.reader->FindFile(file_name);
+            if (i != PackNoEntry) {
+                const PackEntry &e = p.reader->entry(i);
+                size_ = size_t(e.orig_size);
+                if (e.flags & PackCompressed) {
+                    mem_buf_ = new char[size_];
+                    if (!p.reader->Read(i, 0, mem_buf_, size_)) {
                         throw Sys::CannotOpenFileException(file_name);
                     }
-                    file_stream_->seekg(f.off, ios::beg);
-                    pos_override_ = f.off;
-                    size_ = f.size;
-                    goto OPENED;
+                    mem_data_ = mem_buf_;
+                } else {
+                    mem_data_ = p.reader->GetData(i);
                 }
+                return;
             }
         }
 
+        file_stream_ = new std::fstream();
         file_stream_->open(file_name, std::ios::in | std::ios::binary);
         file_stream_->seekg(0, std::ios::end);
         size_ = (size_t)file_stream_->tellg();
         file_stream_->seekg(0, std::ios::beg);
-OPENED:
         if (!file_stream_->good()) {
             throw Sys::CannotOpenFileException(file_name);
         }
@@ -137,6 +139,7 @@ Sys::AssetFile::~AssetFile() {
     AAsset_close(asset_file_);
 #else
     delete file_stream_;
+    delete[] mem_buf_;
 #endif
 }
 
@@ -145,6 +148,15 @@ bool Sys::AssetFile::Read(char *buf, size_t size) {
 #ifdef __ANDROID__
     return !(AAsset_read(asset_file_, buf, size) < 0);
 #else
+    if (mem_data_) {
+        if (size > size_ - pos_) {
+            pos_ = size_;
+            return false;
+        }
+        memcpy(buf, mem_data_ + pos_, size);
+        pos_ += size;
+        return true;
+    }
     assert(file_stream_);
     file_stream_->read(buf, size);
     return bool(*file_stream_);
@@ -155,7 +167,13 @@ void Sys::AssetFile::Seek(size_t pos) {
 #ifdef __ANDROID__
     AAsset_seek(asset_file_, pos, SEEK_SET);
 #else
-    file_stream_->seekg(pos_override_ + pos);
+    if (mem_data_) {
+        pos_ = std::min(pos, size_);
+    } else if (mode_ == FileIn) {
+        file_stream_->seekg(pos);
+    } else {
+        file_stream_->seekp(pos);
+    }
 #endif
 }
 
@@ -163,7 +181,7 @@ Sys::AssetFile::operator bool() {
 #ifdef __ANDROID__
     return bool(AAsset_getLength(asset_file_));
 #else
-    return file_stream_ != nullptr && bool(*file_stream_);
+    return mem_data_ != nullptr || (file_stream_ != nullptr && bool(*file_stream_));
 #endif
 }
 
@@ -183,7 +201,10 @@ size_t Sys::AssetFile::pos() {
 #ifdef __ANDROID__
     return AAsset_seek(asset_file_, 0, SEEK_CUR);
 #else
-    return (size_t)file_stream_->tellg() - pos_override_;
+    if (mem_data_) {
+        return pos_;
+    }
+    return (size_t)file_stream_->tellg();
 #endif
 }
 
@@ -202,10 +223,14 @@ void Sys::AssetFile::AddPackage(const char *name) {
             name[ln - 2] != 'c' || name[ln - 1] != 'k') {
         throw std::runtime_error("Invalid package file!");
     }
+    std::unique_ptr<PackReader> reader(new PackReader);
+    if (!reader->Open(name)) {
+        throw Sys::CannotOpenFileException(name);
+    }
     added_packages.emplace_back();
     Package &p = added_packages.back();
     p.name = name;
-    p.file_list = Sys::EnumFilesInPackage(name);
+    p.reader = std::move(reader);
 }
 
 void Sys::AssetFile::RemovePackage(const char *name) {
@@ -215,4 +240,13 @@ void Sys::AssetFile::RemovePackage(const char *name) {
             return;
         }
     }
+}
+
+bool Sys::AssetFile::IsInPackage(const char *file_name) {
+    for (const auto &p : added_packages) {
+        if (p.reader->FindFile(file_name) != PackNoEntry) {
+            return true;
+        }
+    }
+    return false;
 }
\ No newline at end of file
@@ -19,10 +19,13 @@ class AssetFile {
     AAsset* asset_file_ = nullptr;
 #else
     std::fstream *file_stream_ = nullptr;
+    // files from added packages are read directly from memory
+    const char *mem_data_ = nullptr;
+    char *mem_buf_ = nullptr;
 #endif
     int mode_ = -1;
     std::string name_;
-    size_t size_ = 0, pos_override_ = 0;
+    size_t size_ = 0, pos_ = 0;
 public:
     AssetFile(const char *file_name, int mode = FileIn);
     AssetFile(const std::string &file_name, int mode = FileIn) : AssetFile(file_name.c_str(), mode) {}
@@ -62,7 +65,9 @@ public:
     };
 
     static void AddPackage(const char *name);
+    /// Files opened from package must be closed before it is removed
     static void RemovePackage(const char *name);
+    static bool IsInPackage(const char *file_name);
 #ifdef __ANDROID__
     static void InitAssetManager(class AAssetManager*);
     int32_t descriptor(off_t *start, off_t *len);
@@ -11,7 +11,8 @@ void Sys::LoadAssetComplete(const char *url, void *arg, onload_func onload, oner
 #include <memory>
 
 #include "AssetFile.h"
-#ifdef _WIN32
+#if defined(_WIN32) || (defined(__linux__) && !defined(__ANDROID__))
+#define USE_ASYNC_FILE_READER
 #include "AsyncFileReader.h"
 #endif
 #include "ThreadWorker.h"
@@ -22,7 +23,7 @@ namespace Sys {
 std::unique_ptr<Sys::ThreadWorker> g_worker;
 std::unique_ptr<char[]> g_file_read_buffer;
 size_t g_file_read_buffer_size;
-#ifdef _WIN32
+#ifdef USE_ASYNC_FILE_READER
 Sys::AsyncFileReader g_file_reader;
 #endif
 }
@@ -33,28 +34,32 @@ void Sys::LoadAssetComplete(const char *url, void *arg, onload_func onload, oner
 #if defined(IMITATE_LONG_LOAD)
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
 #endif
-#ifdef _WIN32
-        size_t file_size = 0;
-        bool success = g_file_reader.ReadFile(url_str.c_str(), g_file_read_buffer_size, &g_file_read_buffer[0], file_size);
+#ifdef USE_ASYNC_FILE_READER
+        // packaged files are already mapped into memory
+        if (!AssetFile::IsInPackage(url_str.c_str())) {
+            size_t file_size = 0;
+            bool success = g_file_reader.ReadFile(url_str.c_str(), g_file_read_buffer_size, &g_file_read_buffer[0], file_size);
 
-        if (!success && file_size) {
-            while (file_size > g_file_read_buffer_size) {
-                g_file_read_buffer_size *= 2;
+            if (!success && file_size) {
+                while (file_size > g_file_read_buffer_size) {
+                    g_file_read_buffer_size *= 2;
+                }
+                g_file_read_buffer.reset(new char[g_file_read_buffer_size]);
+                success = g_file_reader.ReadFile(url_str.c_str(), g_file_read_buffer_size, &g_file_read_buffer[0], file_size);
             }
-            g_file_read_buffer.reset(new char[g_file_read_buffer_size]);
-            success = g_file_reader.ReadFile(url_str.c_str(), g_file_read_buffer_size, &g_file_read_buffer[0], file_size);
-        }
 
-        if (success) {
-            if (onload) {
-                onload(arg, &g_file_read_buffer[0], (int)file_size);
-            }
-        } else {
-            if (onerror) {
-                onerror(arg);
+            if (success) {
+                if (onload) {
+                    onload(arg, &g_file_read_buffer[0], (int)file_size);
+                }
+            } else {
+                if (onerror) {
+                    onerror(arg);
+                }
             }
+            return;
         }
-#else
+#endif
         AssetFile in_file(url_str.c_str(), AssetFile::FileIn);
         if (!in_file) {
             if (onerror) {
@@ -76,7 +81,6 @@ void Sys::LoadAssetComplete(const char *url, void *arg, onload_func onload, oner
         if (onload) {
             onload(arg, &g_file_read_buffer[0], size);
         }
-#endif
     });
 }
 
@@ -91,4 +95,4 @@ void Sys::StopWorker() {
     g_file_read_buffer.reset();
 }
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
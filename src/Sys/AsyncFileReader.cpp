@@ -1,11 +1,36 @@
 #include "AsyncFileReader.h"
 
+#include <cstring>
+
 #include <algorithm>
 
 #ifdef _WIN32
 #include <Windows.h>
 #undef min
 #undef max
+#else
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <future>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ThreadPool.h"
+
+#if defined(__linux__) && !defined(__ANDROID__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
+#endif
 #endif
 
 namespace Sys {
@@ -35,7 +60,7 @@ namespace Sys {
             ::ReadFile(h_file, b, chunk_size_, NULL, &ov);
         }
     public:
-        AsyncFileReaderImpl() {
+        explicit AsyncFileReaderImpl(uint32_t) {
             SYSTEM_INFO os_info;
             ::GetSystemInfo(&os_info);
 
@@ -107,16 +132,362 @@ namespace Sys {
             ::CloseHandle(h_file);
             return true;
         }
+
+        const char *backend_name() const { return "overlapped"; }
     };
 #else
     class AsyncFileReaderImpl {
+        static const int RequestsCount = 16;
+        static const int ThreadsCount = 4;
+
+        size_t page_size_, chunk_size_;
+        bool direct_io_;
+
+        // page-aligned buffers are needed only for O_DIRECT, otherwise chunks are read straight into destination
+        void *buf_ = nullptr;
+        char *req_bufs_[RequestsCount];
+
+        std::unique_ptr<ThreadPool> threads_;
+
+        struct read_request_t {
+            size_t chunk, done, bytes;
+            iovec iov;
+        };
+
+        int OpenFile(const char *file_path) {
+#ifdef O_DIRECT
+            if (direct_io_) {
+                const int fd = open(file_path, O_RDONLY | O_DIRECT);
+                // some file systems (e.g. tmpfs) do not support direct I/O
+                if (fd != -1 || errno != EINVAL) return fd;
+            }
+#endif
+            const int fd = open(file_path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+            if (fd != -1) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            return fd;
+        }
+
+        char *RequestDst(int slot, read_request_t &req, void *out_data) const {
+            return buf_ ? req_bufs_[slot] : (char *)out_data + req.chunk * chunk_size_;
+        }
+
+        size_t RequestSize(const read_request_t &req) const {
+            // O_DIRECT requires aligned size, reading past the end of file just returns less data
+            return buf_ ? chunk_size_ - req.done : req.bytes - req.done;
+        }
+
+        void InitRequest(read_request_t &req, size_t chunk, size_t file_size) const {
+            req.chunk = chunk;
+            req.done = 0;
+            req.bytes = std::min(chunk_size_, file_size - chunk * chunk_size_);
+        }
+
+        void CompleteRequest(int slot, const read_request_t &req, void *out_data) const {
+            if (buf_) {
+                memcpy((char *)out_data + req.chunk * chunk_size_, req_bufs_[slot], req.bytes);
+            }
+        }
+
+        bool ReadChunk(int fd, int slot, read_request_t req, void *out_data) const {
+            char *dst = RequestDst(slot, req, out_data);
+            while (req.done < req.bytes) {
+                const ssize_t res = pread(fd, dst + req.done, RequestSize(req), off_t(req.chunk * chunk_size_ + req.done));
+                if (res < 0 && errno == EINTR) continue;
+                if (res <= 0) return false;
+                req.done += (size_t)res;
+            }
+            CompleteRequest(slot, req, out_data);
+            return true;
+        }
+
+        bool ReadFile_ThreadPool(int fd, size_t file_size, void *out_data) {
+            if (!threads_) {
+                threads_.reset(new ThreadPool(ThreadsCount));
+            }
+
+            const size_t chunks_count = (file_size + chunk_size_ - 1) / chunk_size_;
+
+            std::deque<std::future<bool>> requests;
+            auto request_chunk = [&](size_t chunk) {
+                read_request_t req;
+                InitRequest(req, chunk, file_size);
+                requests.push_back(threads_->enqueue([this, fd, chunk, req, out_data]() {
+                    return ReadChunk(fd, int(chunk % RequestsCount), req, out_data);
+                }));
+            };
+
+            size_t next_chunk = 0;
+            while (next_chunk < std::min(chunks_count, (size_t)RequestsCount)) {
+                request_chunk(next_chunk++);
+            }
+
+            // requests are waited for in order, so slot of completed chunk is free for the next one
+            bool res = true;
+            while (!requests.empty()) {
+                res &= requests.front().get();
+                requests.pop_front();
+
+                if (res && next_chunk < chunks_count) {
+                    request_chunk(next_chunk++);
+                }
+            }
+
+            return res;
+        }
+
+#ifdef USE_IO_URING
+        struct {
+            int fd = -1;
+            void *sq_ptr = nullptr, *cq_ptr = nullptr;
+            size_t sq_size = 0, cq_size = 0;
+            io_uring_sqe *sqes = nullptr;
+            size_t sqes_size = 0;
+            unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+            unsigned *cq_head, *cq_tail, *cq_mask;
+            io_uring_cqe *cqes;
+        } ring_;
+
+        bool InitRing() {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+
+            // fails with ENOSYS on old kernels or EPERM if disabled by seccomp/sysctl
+            ring_.fd = (int)syscall(__NR_io_uring_setup, RequestsCount, &p);
+            if (ring_.fd < 0) {
+                ring_.fd = -1;
+                return false;
+            }
+
+            ring_.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            ring_.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single_mmap) {
+                ring_.sq_size = ring_.cq_size = std::max(ring_.sq_size, ring_.cq_size);
+            }
+
+            void *sq_ptr = mmap(nullptr, ring_.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_.fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED) {
+                DestroyRing();
+                return false;
+            }
+            ring_.sq_ptr = sq_ptr;
+
+            if (single_mmap) {
+                ring_.cq_ptr = ring_.sq_ptr;
+            } else {
+                void *cq_ptr = mmap(nullptr, ring_.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_.fd, IORING_OFF_CQ_RING);
+                if (cq_ptr == MAP_FAILED) {
+                    DestroyRing();
+                    return false;
+                }
+                ring_.cq_ptr = cq_ptr;
+            }
+
+            ring_.sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            void *sqes = mmap(nullptr, ring_.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_.fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) {
+                DestroyRing();
+                return false;
+            }
+            ring_.sqes = (io_uring_sqe *)sqes;
+
+            char *sq = (char *)ring_.sq_ptr, *cq = (char *)ring_.cq_ptr;
+            ring_.sq_head = (unsigned *)(sq + p.sq_off.head);
+            ring_.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+            ring_.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+            ring_.sq_array = (unsigned *)(sq + p.sq_off.array);
+            ring_.cq_head = (unsigned *)(cq + p.cq_off.head);
+            ring_.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+            ring_.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+            ring_.cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+            return true;
+        }
+
+        void DestroyRing() {
+            if (ring_.sqes) munmap(ring_.sqes, ring_.sqes_size);
+            if (ring_.cq_ptr && ring_.cq_ptr != ring_.sq_ptr) munmap(ring_.cq_ptr, ring_.cq_size);
+            if (ring_.sq_ptr) munmap(ring_.sq_ptr, ring_.sq_size);
+            if (ring_.fd != -1) close(ring_.fd);
+            ring_.sqes = nullptr;
+            ring_.sq_ptr = ring_.cq_ptr = nullptr;
+            ring_.fd = -1;
+        }
+
+        void SubmitRead(int fd, int slot, read_request_t &req, void *out_data) {
+            req.iov.iov_base = RequestDst(slot, req, out_data) + req.done;
+            req.iov.iov_len = RequestSize(req);
+
+            const unsigned tail = *ring_.sq_tail;
+            const unsigned index = tail & *ring_.sq_mask;
+
+            io_uring_sqe &sqe = ring_.sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            // READV is supported since the first io_uring version (5.1)
+            sqe.opcode = IORING_OP_READV;
+            sqe.fd = fd;
+            sqe.off = uint64_t(req.chunk * chunk_size_ + req.done);
+            sqe.addr = (uint64_t)(uintptr_t)&req.iov;
+            sqe.len = 1;
+            sqe.user_data = (uint64_t)slot;
+
+            ring_.sq_array[index] = index;
+            __atomic_store_n(ring_.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        bool ReadFile_IoUring(int fd, size_t file_size, void *out_data) {
+            const size_t chunks_count = (file_size + chunk_size_ - 1) / chunk_size_;
+
+            read_request_t requests[RequestsCount];
+            unsigned to_submit = 0, in_flight = 0;
+            size_t next_chunk = 0;
+
+            for (int i = 0; i < RequestsCount && next_chunk < chunks_count; i++) {
+                InitRequest(requests[i], next_chunk++, file_size);
+                SubmitRead(fd, i, requests[i], out_data);
+                to_submit++;
+            }
+
+            bool res = true;
+            while (to_submit || in_flight) {
+                // submits new requests and waits for at least one completion with single call
+                const int ret = (int)syscall(__NR_io_uring_enter, ring_.fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    // nothing was submitted, so nothing is in flight (requests are not resubmitted after error)
+                    res = false;
+                    to_submit = 0;
+                    if (!in_flight) break;
+                    continue;
+                }
+                in_flight += (unsigned)ret;
+                to_submit -= (unsigned)ret;
+
+                unsigned head = *ring_.cq_head;
+                const unsigned tail = __atomic_load_n(ring_.cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                    const io_uring_cqe &cqe = ring_.cqes[head & *ring_.cq_mask];
+                    const int slot = (int)cqe.user_data;
+                    read_request_t &req = requests[slot];
+                    in_flight--;
+
+                    if (cqe.res == -EAGAIN || cqe.res == -EINTR) {
+                        if (res) {
+                            SubmitRead(fd, slot, req, out_data);
+                            to_submit++;
+                        }
+                        continue;
+                    }
+
+                    if (cqe.res <= 0) {
+                        // error or unexpected end of file
+                        res = false;
+                        continue;
+                    }
+
+                    req.done += (size_t)cqe.res;
+                    if (!res) continue;
+
+                    if (req.done < req.bytes) {
+                        // short read, request the rest
+                        SubmitRead(fd, slot, req, out_data);
+                        to_submit++;
+                        continue;
+                    }
+
+                    CompleteRequest(slot, req, out_data);
+
+                    if (next_chunk < chunks_count) {
+                        InitRequest(req, next_chunk++, file_size);
+                        SubmitRead(fd, slot, req, out_data);
+                        to_submit++;
+                    }
+                }
+                __atomic_store_n(ring_.cq_head, head, __ATOMIC_RELEASE);
+            }
+
+            return res;
+        }
+#endif
     public:
-        bool ReadFile(const char *file_path, size_t max_size, void *out_data, size_t &out_size) { return false; }
+        explicit AsyncFileReaderImpl(uint32_t flags) : direct_io_((flags & AsyncFileReader::DirectIO) != 0) {
+            page_size_ = (size_t)sysconf(_SC_PAGESIZE);
+            chunk_size_ = page_size_ * 128;
+
+            if (direct_io_ && posix_memalign(&buf_, page_size_, chunk_size_ * RequestsCount) == 0) {
+                for (int i = 0; i < RequestsCount; i++) {
+                    req_bufs_[i] = (char *)buf_ + i * chunk_size_;
+                }
+            } else {
+                buf_ = nullptr;
+            }
+
+#ifdef USE_IO_URING
+            if (!(flags & AsyncFileReader::NoIoUring)) {
+                InitRing();
+            }
+#endif
+        }
+
+        ~AsyncFileReaderImpl() {
+#ifdef USE_IO_URING
+            DestroyRing();
+#endif
+            free(buf_);
+        }
+
+        bool ReadFile(const char *file_path, size_t max_size, void *out_data, size_t &out_size) {
+            const int fd = OpenFile(file_path);
+            if (fd == -1) {
+                out_size = 0;
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                out_size = 0;
+                return false;
+            }
+
+            out_size = (size_t)st.st_size;
+
+            if (max_size < out_size) {
+                close(fd);
+                return false;
+            }
+
+            bool res = false;
+#ifdef USE_IO_URING
+            if (ring_.fd != -1) {
+                res = ReadFile_IoUring(fd, out_size, out_data);
+                if (!res) {
+                    // e.g. operation is not supported for this file, thread pool is used from now on
+                    DestroyRing();
+                }
+            }
+#endif
+            if (!res) {
+                res = ReadFile_ThreadPool(fd, out_size, out_data);
+            }
+
+            close(fd);
+            return res;
+        }
+
+        const char *backend_name() const {
+#ifdef USE_IO_URING
+            if (ring_.fd != -1) return "io_uring";
+#endif
+            return "pread";
+        }
     };
 #endif
 }
 
-Sys::AsyncFileReader::AsyncFileReader() : impl_(new AsyncFileReaderImpl) {
+Sys::AsyncFileReader::AsyncFileReader(uint32_t flags) : impl_(new AsyncFileReaderImpl(flags)) {
 
 }
 
@@ -124,4 +495,8 @@ Sys::AsyncFileReader::~AsyncFileReader() {}
 
 bool Sys::AsyncFileReader::ReadFile(const char *file_path, size_t max_size, void *out_data, size_t &out_size) {
     return impl_->ReadFile(file_path, max_size, out_data, out_size);
+}
+
+const char *Sys::AsyncFileReader::backend_name() const {
+    return impl_->backend_name();
 }
\ No newline at end of file
@@ -1,16 +1,35 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 #include <memory>
 
 namespace Sys {
     class AsyncFileReaderImpl;
 
+    /** Reads whole file with several outstanding chunk requests.
+        Windows - overlapped I/O, Linux - io_uring (if kernel allows it) or pread on thread pool.
+    */
     class AsyncFileReader {
         std::unique_ptr<AsyncFileReaderImpl> impl_;
     public:
-        AsyncFileReader();
+        enum eFlags {
+            DirectIO = (1 << 0),        ///< Bypass page cache (always on Windows, O_DIRECT on Linux if file system supports it)
+            NoIoUring = (1 << 1),       ///< Use thread pool even if io_uring is available (Linux only)
+        };
+
+        explicit AsyncFileReader(uint32_t flags = 0);
         ~AsyncFileReader();
 
+        /** @brief Reads file into buffer
+            @param max_size size of out_data buffer
+            @param out_size receives file size (also if buffer is too small, so it can be resized and call repeated)
+            @return false if file cannot be read or does not fit in buffer
+        */
         bool ReadFile(const char *file_path, size_t max_size, void *out_data, size_t &out_size);
+
+        /// Name of backend used for reading ("overlapped", "io_uring" or "pread")
+        const char *backend_name() const;
     };
 }
\ No newline at end of file
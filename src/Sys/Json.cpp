@@ -1,19 +1,364 @@
 #include "Json.h"
 
-//#include <cctype>
-//#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
 #include <iostream>
+#include <iterator>
 #include <stdexcept>
 
-//#pragma warning(disable : 4996)
+namespace JsonInternal {
+const char *SkipWhitespace(const char *p, const char *end) {
+    while (p != end && isspace((unsigned char)*p)) ++p;
+    return p;
+}
+
+void AppendUTF8(uint32_t cp, std::string &out) {
+    if (cp < 0x80) {
+        out += char(cp);
+    } else if (cp < 0x800) {
+        out += char(0xc0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += char(0xe0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
+    } else {
+        out += char(0xf0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3f));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
+    }
+}
+
+bool ReadHex4(const char *&p, const char *end, uint32_t &out) {
+    if (end - p < 4) return false;
+    out = 0;
+    for (int i = 0; i < 4; i++) {
+        const char c = *p++;
+        out <<= 4;
+        if (c >= '0' && c <= '9') {
+            out |= uint32_t(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            out |= uint32_t(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            out |= uint32_t(c - 'A' + 10);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decodes string starting from p (placed after opening quote), unescaped runs are appended at once
+bool AppendString(const char *&p, const char *end, std::string &out) {
+    while (true) {
+        const char *run = p;
+        while (p != end && *p != '\"' && *p != '\\') ++p;
+        out.append(run, p);
+        if (p == end) {
+            std::cerr << "JsString::Read(): Unexpected end of string" << std::endl;
+            return false;
+        }
+        if (*p++ == '\"') return true;
+        if (p == end) return false;
+
+        const char c = *p++;
+        switch (c) {
+        case '\"':
+        case '\\':
+        case '/':
+            out += c;
+            break;
+        case 'b':
+            out += '\b';
+            break;
+        case 'f':
+            out += '\f';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        case 't':
+            out += '\t';
+            break;
+        case 'u': {
+            uint32_t cp;
+            if (!ReadHex4(p, end, cp)) return false;
+            if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                // surrogate pair
+                const char *_p = p + 2;
+                uint32_t lo;
+                if (ReadHex4(_p, end, lo) && lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    p = _p;
+                }
+            }
+            AppendUTF8(cp, out);
+        } break;
+        default:
+            std::cerr << "JsString::Read(): Unknown escape sequence \\" << c << std::endl;
+            return false;
+        }
+    }
+}
+
+bool ReadString(const char *&p, const char *end, std::string &out) {
+    p = SkipWhitespace(p, end);
+    if (p == end || *p != '\"') {
+        std::cerr << "JsString::Read(): Expected '\"' instead of " << (p != end ? *p : ' ') << std::endl;
+        return false;
+    }
+    ++p;
+    out.clear();
+    return AppendString(p, end, out);
+}
+
+/* String is referenced directly inside of buffer, unless it contains escape sequences (in that case it is decoded
+   into scratch buffer) */
+bool ReadStringView(const char *&p, const char *end, std::string &scratch, const char *&out_str, size_t &out_len) {
+    p = SkipWhitespace(p, end);
+    if (p == end || *p != '\"') {
+        std::cerr << "JsString::Read(): Expected '\"' instead of " << (p != end ? *p : ' ') << std::endl;
+        return false;
+    }
+    const char *beg = ++p;
+    while (p != end && *p != '\"' && *p != '\\') ++p;
+    if (p != end && *p == '\"') {
+        out_str = beg;
+        out_len = size_t(p - beg);
+        ++p;
+        return true;
+    }
+    scratch.assign(beg, p);
+    if (!AppendString(p, end, scratch)) return false;
+    out_str = scratch.c_str();
+    out_len = scratch.length();
+    return true;
+}
+
+bool ReadNumber(const char *&p, const char *end, double &out) {
+    p = SkipWhitespace(p, end);
+    const char *beg = p;
+    while (p != end && (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) ++p;
+    const size_t len = size_t(p - beg);
+    if (!len) {
+        std::cerr << "JsNumber::Read(): Number expected" << std::endl;
+        return false;
+    }
+
+    // strtod requires null-terminated string
+    char buf[64];
+    std::string long_buf;
+    char *str = buf;
+    if (len < sizeof(buf)) {
+        memcpy(buf, beg, len);
+        buf[len] = '\0';
+    } else {
+        long_buf.assign(beg, p);
+        str = &long_buf[0];
+    }
+
+    char *str_end;
+    out = strtod(str, &str_end);
+    if (str_end != str + len) {
+        // parsing stopped earlier (e.g. in '1-2'), rest is left in buffer
+        p = beg + (str_end - str);
+        return str_end != str;
+    }
+    return true;
+}
+
+bool ReadLiteral(const char *&p, const char *end, JsLiteralType &out) {
+    p = SkipWhitespace(p, end);
+    const size_t len = size_t(end - p);
+    if (len >= 4 && strncmp(p, "null", 4) == 0) {
+        out = JS_NULL;
+        p += 4;
+        return true;
+    } else if (len >= 4 && strncmp(p, "true", 4) == 0) {
+        out = JS_TRUE;
+        p += 4;
+        return true;
+    } else if (len >= 5 && strncmp(p, "false", 5) == 0) {
+        out = JS_FALSE;
+        p += 5;
+        return true;
+    }
+
+    std::cerr << "JsLiteral::Read(): null, true or false expected" << std::endl;
+    return false;
+}
+
+void WriteString(std::ostream &out, const std::string &str) {
+    static const char hex[] = "0123456789abcdef";
+
+    out << '\"';
+    size_t run = 0;
+    for (size_t i = 0; i < str.length(); i++) {
+        const char c = str[i];
+        if (c != '\"' && c != '\\' && (unsigned char)c >= 0x20) continue;
+
+        out.write(&str[run], std::streamsize(i - run));
+        run = i + 1;
+        if (c == '\"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c == '\n') {
+            out << "\\n";
+        } else if (c == '\r') {
+            out << "\\r";
+        } else if (c == '\t') {
+            out << "\\t";
+        } else if (c == '\b') {
+            out << "\\b";
+        } else if (c == '\f') {
+            out << "\\f";
+        } else {
+            out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        }
+    }
+    out.write(&str[0] + run, std::streamsize(str.length() - run));
+    out << '\"';
+}
+
+// Whole stream is read at once and parsed from memory, stream is left positioned right after parsed value
+template <typename T> bool ReadFromStream(std::istream &in, T &val) {
+    std::string buf;
+
+    const std::streampos start = in.tellg();
+    if (start != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+        const std::streampos stop = in.tellg();
+        in.seekg(start);
+        buf.resize(size_t(stop - start));
+        if (!buf.empty()) {
+            in.read(&buf[0], std::streamsize(buf.size()));
+            buf.resize(size_t(in.gcount()));
+        }
+    } else {
+        in.clear();
+        buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    const char *p = buf.c_str(), *end = p + buf.length();
+    const bool res = val.Read(p, end);
+
+    if (start != std::streampos(-1)) {
+        in.clear();
+        in.seekg(start + std::streamoff(p - buf.c_str()));
+    }
+    return res;
+}
+
+class SaxParser {
+    JsSaxHandler &handler_;
+    std::string scratch_;
+public:
+    explicit SaxParser(JsSaxHandler &handler) : handler_(handler) {}
+
+    bool ParseObject(const char *&p, const char *end);
+    bool ParseArray(const char *&p, const char *end);
+    bool ParseValue(const char *&p, const char *end);
+};
+}
+
+bool JsonInternal::SaxParser::ParseObject(const char *&p, const char *end) {
+    ++p; // skip '{'
+    if (!handler_.OnObjectBegin()) return false;
+
+    p = SkipWhitespace(p, end);
+    if (p != end && *p == '}') {
+        ++p;
+        return handler_.OnObjectEnd();
+    }
+
+    while (p != end) {
+        const char *key;
+        size_t key_len;
+        if (!ReadStringView(p, end, scratch_, key, key_len) || !handler_.OnKey(key, key_len)) return false;
+
+        p = SkipWhitespace(p, end);
+        if (p == end || *p != ':') return false;
+        ++p;
+
+        if (!ParseValue(p, end)) return false;
+
+        p = SkipWhitespace(p, end);
+        if (p == end) break;
+        const char c = *p++;
+        if (c == '}') return handler_.OnObjectEnd();
+        if (c != ',') {
+            std::cerr << "JsObject::Read(): Expected '}' instead of " << c << std::endl;
+            return false;
+        }
+    }
+    return false;
+}
+
+bool JsonInternal::SaxParser::ParseArray(const char *&p, const char *end) {
+    ++p; // skip '['
+    if (!handler_.OnArrayBegin()) return false;
+
+    p = SkipWhitespace(p, end);
+    if (p != end && *p == ']') {
+        ++p;
+        return handler_.OnArrayEnd();
+    }
+
+    while (p != end) {
+        if (!ParseValue(p, end)) return false;
+
+        p = SkipWhitespace(p, end);
+        if (p == end) break;
+        const char c = *p++;
+        if (c == ']') return handler_.OnArrayEnd();
+        if (c != ',') {
+            std::cerr << "JsArray::Read(): Expected ']' instead of " << c << std::endl;
+            return false;
+        }
+    }
+    return false;
+}
+
+bool JsonInternal::SaxParser::ParseValue(const char *&p, const char *end) {
+    p = SkipWhitespace(p, end);
+    if (p == end) return false;
+
+    const char c = *p;
+    if (c == '{') {
+        return ParseObject(p, end);
+    } else if (c == '[') {
+        return ParseArray(p, end);
+    } else if (c == '\"') {
+        const char *str;
+        size_t len;
+        return ReadStringView(p, end, scratch_, str, len) && handler_.OnString(str, len);
+    } else if (isdigit((unsigned char)c) || c == '-') {
+        double val;
+        return ReadNumber(p, end, val) && handler_.OnNumber(val);
+    } else {
+        JsLiteralType val;
+        return ReadLiteral(p, end, val) && handler_.OnLiteral(val);
+    }
+}
+
+bool JsParse(const char *&p, const char *end, JsSaxHandler &handler) {
+    JsonInternal::SaxParser parser(handler);
+    return parser.ParseValue(p, end);
+}
+
+/////////////////////////////////////////////////////////////////
 
 bool JsNumber::Read(std::istream &in) {
-    char c;
-    while (in.read(&c, 1) && isspace(c));
-    in.seekg(-1, std::ios::cur);
-    return bool(in >> val);
+    return JsonInternal::ReadFromStream(in, *this);
+}
+
+bool JsNumber::Read(const char *&p, const char *end) {
+    return JsonInternal::ReadNumber(p, end, val);
 }
 
 void JsNumber::Write(std::ostream &out, JsFlags /*flags*/) const {
@@ -23,32 +368,15 @@ void JsNumber::Write(std::ostream &out, JsFlags /*flags*/) const {
 /////////////////////////////////////////////////////////////////
 
 bool JsString::Read(std::istream &in) {
-    char cur, prev = 0;
-    while (in.read(&cur, 1) && isspace(cur));
-    if (cur != '\"') {
-        std::cerr << "JsString::Read(): Expected '\"' instead of " << cur << std::endl;
-        return false;
-    }
-    while (in.read(&cur, 1)) {
-        if (cur == '\"' && prev != '\\') break;
-        if (prev == '\\') {
-            char new_c = 0;
-            if (cur == '\"' || cur == '\\' || cur == '/' || cur == '\t' || cur == '\n' || cur == '\r' || cur == '\f' || cur == '\b') {
-                new_c = cur;
-            }
-            if (new_c) {
-                val = val.substr(0, val.length() - 1);
-                val += new_c;
-            }
-        }
-        val += cur;
-        prev = cur;
-    }
-    return true;
+    return JsonInternal::ReadFromStream(in, *this);
+}
+
+bool JsString::Read(const char *&p, const char *end) {
+    return JsonInternal::ReadString(p, end, val);
 }
 
 void JsString::Write(std::ostream &out, JsFlags /*flags*/) const {
-    out << '\"' << val << '\"';
+    JsonInternal::WriteString(out, val);
 }
 
 /////////////////////////////////////////////////////////////////
@@ -76,29 +404,39 @@ bool JsArray::operator==(const JsArray &rhs) const {
 }
 
 bool JsArray::Read(std::istream &in) {
-    char c;
-    if (!in.read(&c, 1) || c != '[') {
-        std::cerr << "JsArray::Read(): Expected '[' instead of " << c << std::endl;
+    return JsonInternal::ReadFromStream(in, *this);
+}
+
+bool JsArray::Read(const char *&p, const char *end) {
+    using namespace JsonInternal;
+
+    elements.clear();
+
+    p = SkipWhitespace(p, end);
+    if (p == end || *p != '[') {
+        std::cerr << "JsArray::Read(): Expected '[' instead of " << (p != end ? *p : ' ') << std::endl;
         return false;
     }
 
-    while (in.read(&c, 1)) {
-        if (isspace(c)) continue;
-        if (c == ']') return true;
-        in.seekg(-1, std::ios::cur);
+    p = SkipWhitespace(p + 1, end);
+    if (p != end && *p == ']') {
+        ++p;
+        return true;
+    }
 
-        elements.emplace_back(JS_NULL);
-        if (!elements.back().Read(in)) {
+    while (p != end) {
+        elements.emplace_back(JsElement{});
+        if (!elements.back().Read(p, end)) {
             return false;
         }
 
-        while (in.read(&c, 1) && isspace(c));
+        p = SkipWhitespace(p, end);
+        if (p == end) break;
+        const char c = *p++;
+        if (c == ']') return true;
         if (c != ',') {
-            if (c != ']') {
-                std::cerr << "JsArray::Read(): Expected ']' instead of " << c << std::endl;
-                return false;
-            }
-            return true;
+            std::cerr << "JsArray::Read(): Expected ']' instead of " << c << std::endl;
+            return false;
         }
     }
     return false;
@@ -131,12 +469,6 @@ void JsArray::Write(std::ostream &out, JsFlags flags) const {
 
 /////////////////////////////////////////////////////////////////
 
-std::pair<std::string, JsElement> &JsObject::operator[](size_t i) {
-    auto it = elements.begin();
-    std::advance(it, i);
-    return *it;
-}
-
 JsElement &JsObject::operator[](const std::string &s) {
     for (auto &e : elements) {
         if (e.first == s) {
@@ -190,37 +522,52 @@ void JsObject::Push(const std::string &s, const JsElement &el) {
 }
 
 bool JsObject::Read(std::istream &in) {
+    return JsonInternal::ReadFromStream(in, *this);
+}
+
+bool JsObject::Read(const char *&p, const char *end) {
+    using namespace JsonInternal;
+
     elements.clear();
 
-    char c;
-    if (!in.read(&c, 1) || c != '{') {
-        std::cerr << "JsObject::Read(): Expected '{' instead of " << c << std::endl;
+    p = SkipWhitespace(p, end);
+    if (p == end || *p != '{') {
+        std::cerr << "JsObject::Read(): Expected '{' instead of " << (p != end ? *p : ' ') << std::endl;
         return false;
     }
-    while (in.read(&c, 1)) {
-        if (isspace(c)) continue;
-        if (c == '}') return true;
-        in.seekg(-1, std::ios::cur);
 
-        JsString key;
-        if (!key.Read(in)) {
+    p = SkipWhitespace(p + 1, end);
+    if (p != end && *p == '}') {
+        ++p;
+        return true;
+    }
+
+    while (p != end) {
+        elements.emplace_back(std::string(), JsElement{});
+        auto &el = elements.back();
+        if (!ReadString(p, end, el.first)) {
+            elements.pop_back();
             return false;
         }
 
-        while (in.read(&c, 1) && isspace(c));
-        if (c != ':') return false;
-
-        while (in.read(&c, 1) && isspace(c));
-        in.seekg(-1, std::ios::cur);
+        p = SkipWhitespace(p, end);
+        if (p == end || *p != ':') {
+            elements.pop_back();
+            return false;
+        }
+        ++p;
 
-        elements.emplace_back(key.val, JsLiteral{ JS_NULL });
-        if (!elements.back().second.Read(in)) {
+        if (!el.second.Read(p, end)) {
             return false;
         }
 
-        while (in.read(&c, 1) && isspace(c));
+        p = SkipWhitespace(p, end);
+        if (p == end) break;
+        const char c = *p++;
+        if (c == '}') return true;
         if (c != ',') {
-            return (c == '}');
+            std::cerr << "JsObject::Read(): Expected '}' instead of " << c << std::endl;
+            return false;
         }
     }
     return false;
@@ -240,7 +587,8 @@ void JsObject::Write(std::ostream &out, JsFlags flags) const {
     out << '{';
     for (auto it = elements.cbegin(); it != elements.cend(); ++it) {
         out << ident_str;
-        out << '\"' << it->first << "\" : ";
+        JsonInternal::WriteString(out, it->first);
+        out << " : ";
         it->second.Write(out, flags);
         if (it != std::prev(elements.end(), 1)) {
             out << ", ";
@@ -255,27 +603,11 @@ void JsObject::Write(std::ostream &out, JsFlags flags) const {
 /////////////////////////////////////////////////////////////////
 
 bool JsLiteral::Read(std::istream &in) {
-    char c;
-    while (in.read(&c, 1) && isspace(c));
-    in.seekg(-1, std::ios::cur);
-
-    char str[5] {};
-    if (!in.read(str, 4)) return false;
-
-    if (strcmp(str, "null") == 0) {
-        val = JS_NULL;
-        return true;
-    } else if (strcmp(str, "true") == 0) {
-        val = JS_TRUE;
-        return true;
-    } else if (strcmp(str, "fals") == 0) {
-        if (!in.read(&c, 1) || c != 'e') return false;
-        val = JS_FALSE;
-        return true;
-    }
+    return JsonInternal::ReadFromStream(in, *this);
+}
 
-    std::cerr << "JsLiteral::Read(): null, true or false expected" << std::endl;
-    return false;
+bool JsLiteral::Read(const char *&p, const char *end) {
+    return JsonInternal::ReadLiteral(p, end, val);
 }
 
 void JsLiteral::Write(std::ostream &out, JsFlags /*flags*/) const {
@@ -375,6 +707,12 @@ JsElement::JsElement(const JsElement &rhs) {
     }
 }
 
+JsElement::JsElement(JsElement &&rhs) noexcept {
+    type_ = rhs.type_;
+    p_ = rhs.p_;
+    rhs.p_ = nullptr;
+}
+
 JsElement::~JsElement() {
     DestroyValue();
 }
@@ -431,7 +769,7 @@ JsElement::operator const JsLiteral &() const {
     return *lit_;
 }
 
-JsElement &JsElement::operator=(JsElement &&rhs) {
+JsElement &JsElement::operator=(JsElement &&rhs) noexcept {
     DestroyValue();
     type_ = rhs.type_;
     p_ = rhs.p_;
@@ -474,31 +812,34 @@ bool JsElement::operator==(const JsElement &rhs) const {
 }
 
 bool JsElement::Read(std::istream &in) {
+    return JsonInternal::ReadFromStream(in, *this);
+}
+
+bool JsElement::Read(const char *&p, const char *end) {
     DestroyValue();
-    char c;
-    while (in.read(&c, 1) && isspace(c));
-    in.seekg(-1, std::ios::cur);
+    p = JsonInternal::SkipWhitespace(p, end);
+    const char c = (p != end) ? *p : '\0';
     if (c == '\"') {
         type_ = JS_STRING;
         str_ = new JsString();
-        return str_->Read(in);
+        return str_->Read(p, end);
     } else if (c == '[') {
         type_ = JS_ARRAY;
         arr_ = new JsArray();
-        return arr_->Read(in);
+        return arr_->Read(p, end);
     } else if (c == '{') {
         type_ = JS_OBJECT;
         obj_ = new JsObject();
-        return obj_->Read(in);
+        return obj_->Read(p, end);
     } else {
-        if (isdigit(c) || c == '-') {
+        if (isdigit((unsigned char)c) || c == '-') {
             type_ = JS_NUMBER;
             num_ = new JsNumber();
-            return num_->Read(in);
+            return num_->Read(p, end);
         } else {
             type_ = JS_LITERAL;
             lit_ = new JsLiteral(JS_NULL);
-            return lit_->Read(in);
+            return lit_->Read(p, end);
         }
     }
 }
@@ -1,9 +1,9 @@
 #pragma once
 
 #include <iosfwd>
-#include <list>
 #include <string>
 #include <utility>
+#include <vector>
 
 enum JsType { JS_OBJECT, JS_ARRAY, JS_NUMBER, JS_LITERAL, JS_STRING };
 enum JsLiteralType { JS_TRUE, JS_FALSE, JS_NULL };
@@ -44,6 +44,7 @@ struct JsNumber {
     }
 
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
@@ -59,11 +60,12 @@ struct JsString {
     }
 
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
 struct JsArray {
-    std::list<JsElement> elements;
+    std::vector<JsElement> elements;
 
     JsArray() {}
     JsArray(const JsElement *v, size_t num);
@@ -71,15 +73,11 @@ struct JsArray {
     JsArray(std::initializer_list<JsElement> &&l);
 
     JsElement &operator[](size_t i) {
-        auto it = elements.begin();
-        std::advance(it, i);
-        return *it;
+        return elements[i];
     }
 
     const JsElement &operator[](size_t i) const {
-        auto it = elements.cbegin();
-        std::advance(it, i);
-        return *it;
+        return elements[i];
     }
 
     const JsElement &at(size_t i) const;
@@ -97,14 +95,26 @@ struct JsArray {
         elements.push_back(e);
     }
 
+    void Push(JsElement &&e) {
+        elements.push_back(std::move(e));
+    }
+
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
 struct JsObject {
-    std::list<std::pair<std::string, JsElement>> elements;
+    std::vector<std::pair<std::string, JsElement>> elements;
+
+    std::pair<std::string, JsElement> &operator[](size_t i) {
+        return elements[i];
+    }
+
+    const std::pair<std::string, JsElement> &operator[](size_t i) const {
+        return elements[i];
+    }
 
-    std::pair<std::string, JsElement> &operator[](size_t i);
     JsElement &operator[](const std::string &s);
 
     const JsElement &at(const std::string &s) const;
@@ -124,6 +134,7 @@ struct JsObject {
     void Push(const std::string &s, const JsElement &e);
 
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
@@ -140,6 +151,7 @@ struct JsLiteral {
     }
 
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
@@ -156,6 +168,12 @@ private:
     };
 
     void DestroyValue();
+
+    // placeholder which is filled during parsing
+    JsElement() : type_(JS_LITERAL), p_(nullptr) {}
+
+    friend struct JsArray;
+    friend struct JsObject;
 public:
     explicit JsElement(double val);
     explicit JsElement(const char *str);
@@ -167,6 +185,7 @@ public:
     JsElement(const JsObject &rhs);
     JsElement(const JsLiteral &rhs);
     JsElement(const JsElement &rhs);
+    JsElement(JsElement &&rhs) noexcept;
 
     ~JsElement();
 
@@ -186,7 +205,7 @@ public:
     operator const JsObject &() const;
     operator const JsLiteral &() const;
 
-    JsElement &operator=(JsElement &&rhs);
+    JsElement &operator=(JsElement &&rhs) noexcept;
     JsElement &operator=(const JsElement &rhs);
 
     bool operator==(const JsElement &rhs) const;
@@ -196,6 +215,27 @@ public:
     }
 
     bool Read(std::istream &in);
+    bool Read(const char *&p, const char *end);
     void Write(std::ostream &out, JsFlags flags = JsFlags()) const;
 };
 
+/** Callbacks of streaming (SAX-style) parser, allow to consume document without building a tree of JsElements.
+    Strings are passed as pointer/length pair which is valid only during the call. Returning false stops parsing.
+*/
+struct JsSaxHandler {
+    virtual ~JsSaxHandler() {}
+
+    virtual bool OnObjectBegin() { return true; }
+    virtual bool OnObjectEnd() { return true; }
+    virtual bool OnArrayBegin() { return true; }
+    virtual bool OnArrayEnd() { return true; }
+
+    virtual bool OnKey(const char * /*str*/, size_t /*len*/) { return true; }
+    virtual bool OnNumber(double /*val*/) { return true; }
+    virtual bool OnString(const char * /*str*/, size_t /*len*/) { return true; }
+    virtual bool OnLiteral(JsLiteralType /*val*/) { return true; }
+};
+
+/// Parses single value from buffer and advances p past it
+bool JsParse(const char *&p, const char *end, JsSaxHandler &handler);
+
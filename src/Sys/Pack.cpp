@@ -2,100 +2,568 @@
 
 #include <cassert>
 
+#include <algorithm>
 #include <memory>
 
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#elif !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "AssetFile.h"
 
-void Sys::ReadPackage(const char *pack_name, onfile_func on_file) {
-    AssetFile in_file(pack_name, AssetFile::FileIn);
-    size_t file_size = in_file.size();
+namespace PackInternal {
+// descriptor of old package format
+struct FileDescV1 {
+    char name[120];
+    uint32_t off, size;
+};
+static_assert(sizeof(FileDescV1) == 128, "!!!");
+
+const int HashBits = 16;
+const size_t MinMatch = 4;
+const size_t MaxOffset = 65535;
+// the same restrictions as in LZ4 (last bytes are always literals)
+const size_t LastLiterals = 5;
+const size_t MatchFindLimit = 12;
+
+uint32_t Read32(const uint8_t *p) {
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(uint32_t));
+    return ret;
+}
+
+uint32_t HashSequence(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - HashBits);
+}
+
+uint8_t *WriteLength(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = uint8_t(len);
+    return op;
+}
+
+bool ReadLength(const uint8_t *&ip, const uint8_t *iend, size_t &len) {
+    uint8_t b;
+    do {
+        if (ip == iend) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+uint64_t AlignUp(uint64_t val, uint64_t alignment) {
+    return alignment * ((val + alignment - 1) / alignment);
+}
+}
+
+uint32_t Sys::PackHash(const char *name, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= uint8_t(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+size_t Sys::PackCompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    using namespace PackInternal;
+
+    std::unique_ptr<uint32_t[]> table(new uint32_t[1u << HashBits]);
+    std::fill(&table[0], &table[0] + (1u << HashBits), PackNoEntry);
+
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *iend = src + src_size;
+    const uint8_t *mflimit = (src_size > MatchFindLimit) ? (iend - MatchFindLimit) : src;
+    const uint8_t *matchlimit = iend - std::min(src_size, LastLiterals);
+
+    uint8_t *op = dst, *oend = dst + dst_size;
+
+    while (ip < mflimit) {
+        const uint32_t seq = Read32(ip);
+        const uint32_t h = HashSequence(seq);
+        const uint32_t ref = table[h];
+        table[h] = uint32_t(ip - src);
+
+        if (ref == PackNoEntry || size_t(ip - src) - ref > MaxOffset || Read32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        const uint8_t *match = src + ref;
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            --ip;
+            --match;
+        }
+
+        const uint8_t *match_end = ip + MinMatch;
+        while (match_end < matchlimit && *match_end == match[match_end - ip]) {
+            ++match_end;
+        }
+
+        const size_t lit_len = size_t(ip - anchor), match_len = size_t(match_end - ip) - MinMatch;
+        // token + literals + offset + lengths
+        if (size_t(oend - op) < 1 + lit_len + 2 + (lit_len / 255 + 1) + (match_len / 255 + 1)) return 0;
+
+        uint8_t *token = op++;
+        *token = uint8_t(std::min<size_t>(lit_len, 15) << 4);
+        if (lit_len >= 15) {
+            op = WriteLength(op, lit_len - 15);
+        }
+        memcpy(op, anchor, lit_len);
+        op += lit_len;
+
+        const size_t offset = size_t(ip - match);
+        *op++ = uint8_t(offset & 0xff);
+        *op++ = uint8_t(offset >> 8);
+
+        *token |= uint8_t(std::min<size_t>(match_len, 15));
+        if (match_len >= 15) {
+            op = WriteLength(op, match_len - 15);
+        }
+
+        ip = anchor = match_end;
+    }
+
+    const size_t lit_len = size_t(iend - anchor);
+    if (size_t(oend - op) < 1 + lit_len + (lit_len / 255 + 1)) return 0;
+
+    uint8_t *token = op++;
+    *token = uint8_t(std::min<size_t>(lit_len, 15) << 4);
+    if (lit_len >= 15) {
+        op = WriteLength(op, lit_len - 15);
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return size_t(op - dst);
+}
+
+bool Sys::PackDecompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    using namespace PackInternal;
+
+    const uint8_t *ip = src, *iend = src + src_size;
+    uint8_t *op = dst, *oend = dst + dst_size;
+
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+
+        size_t lit_len = (token >> 4);
+        if (lit_len == 15 && !ReadLength(ip, iend, lit_len)) return false;
+        if (size_t(iend - ip) < lit_len || size_t(oend - op) < lit_len) return false;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        if (ip == iend) {
+            // last sequence has no match
+            break;
+        }
+
+        if (iend - ip < 2) return false;
+        const size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > size_t(op - dst)) return false;
+
+        size_t match_len = (token & 15);
+        if (match_len == 15 && !ReadLength(ip, iend, match_len)) return false;
+        match_len += MinMatch;
+        if (size_t(oend - op) < match_len) return false;
+
+        const uint8_t *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+        } else {
+            // overlapping copy (repeated pattern)
+            for (size_t i = 0; i < match_len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op == oend;
+}
+
+bool Sys::PackReader::Open(const char *pack_name) {
+    Close();
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(pack_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    file_ = file;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(uint32_t)) {
+        Close();
+        return false;
+    }
+    size_ = (size_t)file_size.QuadPart;
+
+    // copy-on-write mapping, so data passed to user callbacks can be modified
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (mapping_) {
+        data_ = (const uint8_t *)MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0);
+    }
+#elif defined(USE_MMAP)
+    fd_ = open(pack_name, O_RDONLY);
+    if (fd_ == -1) return false;
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size < (off_t)sizeof(uint32_t)) {
+        Close();
+        return false;
+    }
+    size_ = (size_t)st.st_size;
+
+    void *mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_, 0);
+    if (mapping != MAP_FAILED) {
+        data_ = (const uint8_t *)mapping;
+    }
+#endif
+    if (!data_) {
+        // whole file is read into memory instead
+        try {
+            AssetFile in_file(pack_name, AssetFile::FileIn);
+            size_ = in_file.size();
+            owned_data_.reset(new uint8_t[size_]);
+            if (size_ < sizeof(uint32_t) || !in_file.Read((char *)owned_data_.get(), size_)) {
+                Close();
+                return false;
+            }
+            data_ = owned_data_.get();
+        } catch (...) {
+            Close();
+            return false;
+        }
+    }
+
+    if (!ValidateDirectory() && !ConvertV1Directory()) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void Sys::PackReader::Close() {
+    if (data_ && data_ != owned_data_.get()) {
+#if defined(_WIN32)
+        UnmapViewOfFile(data_);
+#elif defined(USE_MMAP)
+        munmap((void *)data_, size_);
+#endif
+    }
+#if defined(_WIN32)
+    if (mapping_) CloseHandle(mapping_);
+    if (file_) CloseHandle(file_);
+    file_ = mapping_ = nullptr;
+#elif defined(USE_MMAP)
+    if (fd_ != -1) close(fd_);
+    fd_ = -1;
+#endif
+    owned_data_.reset();
+    data_ = nullptr;
+    size_ = 0;
+
+    buckets_ = nullptr;
+    entries_ = nullptr;
+    names_ = nullptr;
+    file_count_ = bucket_count_ = 0;
+
+    v1_buckets_.clear();
+    v1_entries_.clear();
+    v1_names_.clear();
+}
+
+bool Sys::PackReader::ValidateDirectory() {
+    if (size_ < sizeof(PackHeader)) return false;
+
+    const auto *header = (const PackHeader *)data_;
+    if (header->magic != PackMagic || header->version != PackVersion) return false;
+
+    if (!header->bucket_count || (header->bucket_count & (header->bucket_count - 1)) ||
+        header->buckets_offset % alignof(uint32_t) || header->entries_offset % alignof(PackEntry) ||
+        header->buckets_offset > size_ || uint64_t(header->bucket_count) * sizeof(uint32_t) > size_ - header->buckets_offset ||
+        header->entries_offset > size_ || uint64_t(header->file_count) * sizeof(PackEntry) > size_ - header->entries_offset ||
+        header->names_offset > size_ || header->names_size > size_ - header->names_offset) {
+        return false;
+    }
+
+    buckets_ = (const uint32_t *)(data_ + header->buckets_offset);
+    entries_ = (const PackEntry *)(data_ + header->entries_offset);
+    names_ = (const char *)(data_ + header->names_offset);
+    file_count_ = header->file_count;
+    bucket_count_ = header->bucket_count;
+
+    for (uint32_t i = 0; i < bucket_count_; i++) {
+        if (buckets_[i] != PackNoEntry && buckets_[i] >= file_count_) return false;
+    }
+
+    for (uint32_t i = 0; i < file_count_; i++) {
+        const PackEntry &e = entries_[i];
+        if (e.offset > size_ || e.size > size_ - e.offset || (e.next != PackNoEntry && e.next >= file_count_) ||
+            uint64_t(e.name_offset) + e.name_len >= header->names_size || names_[e.name_offset + e.name_len] != '\0' ||
+            (!(e.flags & PackCompressed) && e.size != e.orig_size)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Sys::PackReader::ConvertV1Directory() {
+    using namespace PackInternal;
+
     uint32_t num_files;
-    in_file.Read((char*)&num_files, sizeof(uint32_t));
+    memcpy(&num_files, data_, sizeof(uint32_t));
+    if (sizeof(uint32_t) + uint64_t(num_files) * sizeof(FileDescV1) > size_) return false;
 
-    std::vector<FileDesc> file_list;
+    bucket_count_ = 1;
+    while (bucket_count_ < num_files) {
+        bucket_count_ *= 2;
+    }
+    v1_buckets_.assign(bucket_count_, PackNoEntry);
+    v1_entries_.resize(num_files);
 
-    //size_t file_pos = sizeof(uint32_t) + num_files * (120 + 2 * sizeof(uint32_t));
-    for (unsigned i = 0; i < num_files; i++) {
-        file_list.emplace_back();
-        FileDesc &f = file_list.back();
-        in_file.Read((char*)&f, sizeof(FileDesc));
-        assert(f.off + f.size <= file_size);
+    for (uint32_t i = 0; i < num_files; i++) {
+        FileDescV1 f;
+        memcpy(&f, data_ + sizeof(uint32_t) + i * sizeof(FileDescV1), sizeof(FileDescV1));
+        f.name[sizeof(f.name) - 1] = '\0';
+        if (uint64_t(f.off) + f.size > size_) return false;
+
+        PackEntry &e = v1_entries_[i];
+        memset(&e, 0, sizeof(PackEntry));
+        e.offset = f.off;
+        e.size = e.orig_size = f.size;
+        e.name_offset = uint32_t(v1_names_.size());
+        e.name_len = uint32_t(strlen(f.name));
+        e.hash = PackHash(f.name, e.name_len);
+
+        v1_names_.insert(v1_names_.end(), f.name, f.name + e.name_len + 1);
+    }
+
+    // first file wins in case of duplicated names
+    for (uint32_t i = num_files; i-- > 0;) {
+        uint32_t &bucket = v1_buckets_[v1_entries_[i].hash & (bucket_count_ - 1)];
+        v1_entries_[i].next = bucket;
+        bucket = i;
+    }
+
+    buckets_ = v1_buckets_.data();
+    entries_ = v1_entries_.data();
+    names_ = v1_names_.data();
+    file_count_ = num_files;
+
+    return true;
+}
+
+uint32_t Sys::PackReader::FindFile(const char *name) const {
+    if (!bucket_count_) return PackNoEntry;
+
+    const size_t len = strlen(name);
+    const uint32_t hash = PackHash(name, len);
+
+    uint32_t i = buckets_[hash & (bucket_count_ - 1)];
+    // chain length is bounded by file count to be safe against malformed files
+    for (uint32_t j = 0; i != PackNoEntry && j < file_count_; i = entries_[i].next, j++) {
+        const PackEntry &e = entries_[i];
+        if (e.hash == hash && e.name_len == len && memcmp(names_ + e.name_offset, name, len) == 0) {
+            return i;
+        }
     }
+    return PackNoEntry;
+}
 
-    for (auto &f : file_list) {
-        std::unique_ptr<char[]> buf(new char[f.size]);
-        in_file.Seek(f.off);
-        in_file.Read(buf.get(), f.size);
+const char *Sys::PackReader::GetView(const char *name, size_t &out_size) const {
+    const uint32_t i = FindFile(name);
+    if (i == PackNoEntry || (entries_[i].flags & PackCompressed)) return nullptr;
+    out_size = size_t(entries_[i].size);
+    return GetData(i);
+}
 
-        on_file(f.name, buf.get(), f.size);
+bool Sys::PackReader::Read(uint32_t i, size_t pos, char *buf, size_t size) const {
+    const PackEntry &e = entries_[i];
+    if (pos > e.orig_size || size > e.orig_size - pos) return false;
+
+    if (e.flags & PackCompressed) {
+        if (pos == 0 && size == e.orig_size) {
+            return PackDecompress((const uint8_t *)GetData(i), size_t(e.size), (uint8_t *)buf, size);
+        }
+        std::unique_ptr<uint8_t[]> temp(new uint8_t[size_t(e.orig_size)]);
+        if (!PackDecompress((const uint8_t *)GetData(i), size_t(e.size), temp.get(), size_t(e.orig_size))) return false;
+        memcpy(buf, temp.get() + pos, size);
+    } else {
+        memcpy(buf, GetData(i) + pos, size);
+    }
+    return true;
+}
+
+void Sys::ReadPackage(const char *pack_name, onfile_func on_file) {
+    PackReader reader;
+    if (!reader.Open(pack_name)) return;
+
+    std::unique_ptr<char[]> buf;
+    size_t buf_size = 0;
+
+    for (uint32_t i = 0; i < reader.file_count(); i++) {
+        const PackEntry &e = reader.entry(i);
+        if (e.flags & PackCompressed) {
+            if (e.orig_size > buf_size) {
+                buf_size = size_t(e.orig_size);
+                buf.reset(new char[buf_size]);
+            }
+            if (!reader.Read(i, 0, buf.get(), size_t(e.orig_size))) continue;
+            on_file(reader.name(i), buf.get(), int(e.orig_size));
+        } else {
+            // data is passed directly from copy-on-write mapping
+            on_file(reader.name(i), (void *)reader.GetData(i), int(e.size));
+        }
     }
 }
 
 #ifndef __ANDROID__
-void Sys::WritePackage(const char *pack_name, std::vector<std::string> &file_list) {
+void Sys::WritePackage(const char *pack_name, std::vector<std::string> &file_list, uint32_t flags, uint32_t alignment) {
+    using namespace PackInternal;
+
+    assert(alignment && (alignment & (alignment - 1)) == 0);
+
+    PackHeader header = {};
+    header.magic = PackMagic;
+    header.version = PackVersion;
+    header.file_count = uint32_t(file_list.size());
+    header.bucket_count = 1;
+    while (header.bucket_count < header.file_count) {
+        header.bucket_count *= 2;
+    }
+    header.alignment = alignment;
+
+    std::vector<uint32_t> buckets(header.bucket_count, PackNoEntry);
+    std::vector<PackEntry> entries(file_list.size());
+    std::vector<char> names;
+
+    for (size_t i = 0; i < file_list.size(); i++) {
+        const std::string &f = file_list[i];
+        PackEntry &e = entries[i];
+        e.name_offset = uint32_t(names.size());
+        e.name_len = uint32_t(f.length());
+        e.hash = PackHash(f.c_str(), f.length());
+        names.insert(names.end(), f.c_str(), f.c_str() + f.length() + 1);
+    }
+    for (uint32_t i = header.file_count; i-- > 0;) {
+        uint32_t &bucket = buckets[entries[i].hash & (header.bucket_count - 1)];
+        entries[i].next = bucket;
+        bucket = i;
+    }
+    header.names_size = uint32_t(names.size());
+
+    header.buckets_offset = sizeof(PackHeader);
+    header.entries_offset = AlignUp(header.buckets_offset + buckets.size() * sizeof(uint32_t), alignof(PackEntry));
+    header.names_offset = header.entries_offset + entries.size() * sizeof(PackEntry);
+
+    static const char zeroes[256] = {};
+
     AssetFile out_file(pack_name, AssetFile::FileOut);
-    uint32_t num_files = (uint32_t)file_list.size();
-    out_file.Write((char*)&num_files, sizeof(uint32_t));
+    uint64_t pos = 0;
+    auto write_padding = [&](uint64_t new_pos) {
+        while (pos < new_pos) {
+            const size_t len = size_t(std::min<uint64_t>(new_pos - pos, sizeof(zeroes)));
+            out_file.Write(zeroes, len);
+            pos += len;
+        }
+    };
+
+    // directory is written once file offsets are known
+    write_padding(header.names_offset + names.size());
+
+    std::unique_ptr<char[]> buf, compressed_buf;
+    size_t buf_size = 0, compressed_buf_size = 0;
+
+    for (size_t i = 0; i < file_list.size(); i++) {
+        AssetFile in_file(file_list[i].c_str(), AssetFile::FileIn);
+        const size_t file_size = in_file.size();
+        if (file_size > buf_size) {
+            buf_size = file_size;
+            buf.reset(new char[buf_size]);
+        }
+        in_file.Read(buf.get(), file_size);
+
+        PackEntry &e = entries[i];
+        e.offset = AlignUp(pos, alignment);
+        e.size = e.orig_size = file_size;
 
-    size_t file_pos = sizeof(uint32_t) + num_files * (120 + 2 * sizeof(uint32_t));
-    for (auto &f : file_list) {
-        assert(f.length() < 124);
-        AssetFile in_file(f.c_str(), AssetFile::FileIn);
-        char name[120] {};
-        strcpy(name, f.c_str());
-        uint32_t file_size = (uint32_t)in_file.size();
-        out_file.Write(name, sizeof(name));
-        out_file.Write((char*)&file_pos, sizeof(uint32_t));
-        out_file.Write((char*)&file_size, sizeof(uint32_t));
-        file_pos += file_size;
+        const char *data = buf.get();
+        if (flags & PackCompressed) {
+            // compression is used only if it saves at least 1/8 of size
+            const size_t max_size = file_size - file_size / 8;
+            if (max_size > compressed_buf_size) {
+                compressed_buf_size = max_size;
+                compressed_buf.reset(new char[compressed_buf_size]);
+            }
+            const size_t compressed_size = PackCompress((const uint8_t *)buf.get(), file_size,
+                                                        (uint8_t *)compressed_buf.get(), max_size);
+            if (compressed_size) {
+                e.size = compressed_size;
+                e.flags |= PackCompressed;
+                data = compressed_buf.get();
+            }
+        }
+
+        write_padding(e.offset);
+        out_file.Write(data, size_t(e.size));
+        pos += e.size;
     }
 
-    for (auto &f : file_list) {
-        AssetFile in_file(f.c_str(), AssetFile::FileIn);
-        std::unique_ptr<char[]> buf(new char[in_file.size()]);
-        in_file.Read(buf.get(), in_file.size());
-        out_file.Write(buf.get(), in_file.size());
+    out_file.Seek(0);
+    out_file.Write((const char *)&header, sizeof(PackHeader));
+    out_file.Write((const char *)buckets.data(), buckets.size() * sizeof(uint32_t));
+    out_file.Seek(size_t(header.entries_offset));
+    if (!entries.empty()) {
+        out_file.Write((const char *)entries.data(), entries.size() * sizeof(PackEntry));
     }
+    out_file.Write(names.data(), names.size());
 }
 #endif
 
 std::vector<Sys::FileDesc> Sys::EnumFilesInPackage(const char *pack_name) {
-    AssetFile in_file(pack_name, AssetFile::FileIn);
-    size_t file_size = in_file.size();
-    uint32_t num_files;
-    in_file.Read((char*)&num_files, sizeof(uint32_t));
-
     std::vector<FileDesc> file_list;
 
-    //size_t file_pos = sizeof(uint32_t) + num_files * (120 + 2 * sizeof(uint32_t));
-    for (unsigned i = 0; i < num_files; i++) {
+    PackReader reader;
+    if (!reader.Open(pack_name)) return file_list;
+
+    for (uint32_t i = 0; i < reader.file_count(); i++) {
+        const PackEntry &e = reader.entry(i);
         file_list.emplace_back();
         FileDesc &f = file_list.back();
-        in_file.Read((char*)&f, sizeof(FileDesc));
-        assert(f.off + f.size <= file_size);
+        f.name = reader.name(i);
+        f.off = e.offset;
+        f.size = e.size;
+        f.orig_size = e.orig_size;
+        f.flags = e.flags;
     }
 
     return file_list;
 }
 
-bool Sys::ReadFromPackage(const char *pack_name, const char *fname, size_t pos, char *buf, size_t /*size*/) {
-    AssetFile in_file(pack_name, AssetFile::FileIn);
-    //size_t file_size = in_file.size();
-    uint32_t num_files;
-    in_file.Read((char*)&num_files, sizeof(uint32_t));
-
-    //size_t file_pos = sizeof(uint32_t) + num_files * (120 + 2 * sizeof(uint32_t));
-    for (unsigned i = 0; i < num_files; i++) {
-        char name[120] {};
-        in_file.Read(name, sizeof(name));
-        uint32_t off, size;
-        in_file.Read((char*)&off, sizeof(uint32_t));
-        in_file.Read((char*)&size, sizeof(uint32_t));
-        if (strcmp(name, fname) == 0) {
-            in_file.Seek(off + pos);
-            in_file.Read(buf, size);
-            return true;
-        }
-    }
-    return false;
+bool Sys::ReadFromPackage(const char *pack_name, const char *fname, size_t pos, char *buf, size_t size) {
+    PackReader reader;
+    if (!reader.Open(pack_name)) return false;
+
+    const uint32_t i = reader.FindFile(fname);
+    return i != PackNoEntry && reader.Read(i, pos, buf, size);
 }
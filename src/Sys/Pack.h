@@ -3,25 +3,122 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace Sys {
 typedef void(*onfile_func)(const char *name, void *data, int size);
 
+/*  Package layout (v2):
+        PackHeader
+        uint32_t buckets[bucket_count]      - index of first entry in hash chain (or PackNoEntry)
+        PackEntry entries[file_count]       - chained through PackEntry::next
+        char names[names_size]              - null-terminated file names
+        file data                           - each file starts at offset aligned to PackHeader::alignment
+    Directory is used in place after mapping of file, so lookup does not require parsing or allocations.
+    Packages of older format (plain table of 128-byte descriptors) are still readable.
+*/
+const uint32_t PackMagic = 0x324b4150; // 'PAK2'
+const uint32_t PackVersion = 2;
+const uint32_t PackDefaultAlignment = 64;
+const uint32_t PackNoEntry = 0xffffffff;
+
+enum ePackFlags : uint32_t {
+    PackCompressed = (1 << 0) ///< entry is stored in LZ4 block format
+};
+
+struct PackHeader {
+    uint32_t magic, version;
+    uint32_t file_count, bucket_count; ///< bucket_count is power of two
+    uint32_t alignment, names_size;
+    uint64_t buckets_offset, entries_offset, names_offset;
+};
+static_assert(sizeof(PackHeader) == 48, "!!!");
+
+struct PackEntry {
+    uint64_t offset, size;  ///< location of stored (possibly compressed) data
+    uint64_t orig_size;     ///< size of file contents
+    uint32_t name_offset, name_len;
+    uint32_t hash, next;
+    uint32_t flags, reserved;
+};
+static_assert(sizeof(PackEntry) == 48, "!!!");
+
 struct FileDesc {
-    char name[120];
-    uint32_t off, size;
+    std::string name;
+    uint64_t off, size, orig_size;
+    uint32_t flags;
+};
+
+uint32_t PackHash(const char *name, size_t len);
+
+/// Maps package into memory, files can be accessed without copying
+class PackReader {
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    void *file_ = nullptr, *mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    std::unique_ptr<uint8_t[]> owned_data_; ///< used when file can not be mapped
+
+    const uint32_t *buckets_ = nullptr;
+    const PackEntry *entries_ = nullptr;
+    const char *names_ = nullptr;
+    uint32_t file_count_ = 0, bucket_count_ = 0;
+
+    // directory of old format is converted on load
+    std::vector<uint32_t> v1_buckets_;
+    std::vector<PackEntry> v1_entries_;
+    std::vector<char> v1_names_;
+
+    bool ValidateDirectory();
+    bool ConvertV1Directory();
+public:
+    PackReader() = default;
+    PackReader(const PackReader &rhs) = delete;
+    PackReader &operator=(const PackReader &rhs) = delete;
+    ~PackReader() { Close(); }
+
+    bool Open(const char *pack_name);
+    void Close();
+
+    bool is_open() const { return data_ != nullptr; }
+    uint32_t file_count() const { return file_count_; }
+
+    const PackEntry &entry(uint32_t i) const { return entries_[i]; }
+    const char *name(uint32_t i) const { return names_ + entries_[i].name_offset; }
+
+    /// Returns index of file or PackNoEntry, lookup goes through hashed directory
+    uint32_t FindFile(const char *name) const;
+
+    /// Returns stored data of file (compressed entries are returned as is)
+    const char *GetData(uint32_t i) const { return (const char *)data_ + entries_[i].offset; }
+
+    /** @brief Returns zero-copy view of file contents
+        @return Pointer into mapped package, nullptr if file is missing or stored compressed
+    */
+    const char *GetView(const char *name, size_t &out_size) const;
+
+    /// Copies (decompressing if needed) part of file contents, fails if range is out of file bounds
+    bool Read(uint32_t i, size_t pos, char *buf, size_t size) const;
 };
-static_assert(sizeof(FileDesc) == 128, "!!!");
-static_assert(offsetof(FileDesc, off) == 120, "!!!");
-static_assert(offsetof(FileDesc, size) == 124, "!!!");
 
 void ReadPackage(const char *pack_name, onfile_func on_file);
-void WritePackage(const char *pack_name, std::vector<std::string> &file_list);
+/** @param flags combination of ePackFlags, compression is applied only to files which become smaller
+    @param alignment alignment of file data (must be power of two)
+*/
+void WritePackage(const char *pack_name, std::vector<std::string> &file_list, uint32_t flags = 0,
+                  uint32_t alignment = PackDefaultAlignment);
 
 std::vector<FileDesc> EnumFilesInPackage(const char *pack_name);
 
 bool ReadFromPackage(const char *pack_name, const char *fname, size_t pos, char *buf, size_t size);
-bool ReadFromPackage(const char *pack_name, const char *fname, size_t pos, char *buf, size_t size);
+
+/// LZ4 block compression, returns compressed size or zero if result does not fit into dst
+size_t PackCompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
+/// Returns true if data was decompressed into exactly dst_size bytes
+bool PackDecompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
 }
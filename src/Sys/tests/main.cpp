@@ -13,7 +13,7 @@ int main() {
     test_async_file();
     test_json();
     test_optional();
-    //test_pack();
+    test_pack();
     test_signal();
     puts("OK");
 }
@@ -1,7 +1,13 @@
 #include "test_common.h"
 
+#include <cstdio>
 #include <cstring>
+
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <string>
 
 #include "../AssetFile.h"
 #include "../AsyncFileReader.h"
@@ -9,7 +15,8 @@
 
 void test_async_file() {
     const char *test_file_name = "test.bin";
-    size_t test_file_size = 64 * 1024 * 1024;
+    // last chunk is incomplete
+    size_t test_file_size = 64 * 1024 * 1024 + 1000;
 
     char test_data[1024];
     for (int j = 0; j < 1024; j++) {
@@ -20,7 +27,7 @@ void test_async_file() {
         std::ofstream out_file(test_file_name, std::ios::binary);
 
         for (size_t i = 0; i < test_file_size; i += 1024) {
-            out_file.write(test_data, sizeof(test_data));
+            out_file.write(test_data, std::min(sizeof(test_data), test_file_size - i));
         }
     }
 
@@ -28,15 +35,67 @@ void test_async_file() {
     size_t file_data_buf_size = test_file_size;
     file_data_buf.reset(new char[file_data_buf_size]);
 
-    {   // read file
-        Sys::AsyncFileReader reader;
+    auto check_data = [&]() {
+        for (size_t i = 0; i < test_file_size; i += 1024) {
+            require(memcmp(&file_data_buf[i], &test_data[0], std::min(sizeof(test_data), test_file_size - i)) == 0);
+        }
+    };
+
+    const uint32_t reader_flags[] = { 0, Sys::AsyncFileReader::DirectIO, Sys::AsyncFileReader::NoIoUring,
+                                      Sys::AsyncFileReader::NoIoUring | Sys::AsyncFileReader::DirectIO };
+
+    for (const uint32_t flags : reader_flags) {   // read file
+        Sys::AsyncFileReader reader(flags);
         size_t file_size = 0;
 
+        memset(&file_data_buf[0], 0, file_data_buf_size);
+
+        require(reader.ReadFile(test_file_name, file_data_buf_size, file_data_buf.get(), file_size));
+        require(file_size == test_file_size);
+        check_data();
+
+        // reader is reused for the next file
+        file_size = 0;
         require(reader.ReadFile(test_file_name, file_data_buf_size, file_data_buf.get(), file_size));
         require(file_size == test_file_size);
 
-        for (size_t i = 0; i < file_size; i += 1024) {
-            require(memcmp(&file_data_buf[i], &test_data[0], 1024) == 0);
+        // too small buffer, file size is returned anyway
+        file_size = 0;
+        require(!reader.ReadFile(test_file_name, file_data_buf_size - 1, file_data_buf.get(), file_size));
+        require(file_size == test_file_size);
+
+        require(!reader.ReadFile("non_existing.bin", file_data_buf_size, file_data_buf.get(), file_size));
+        require(file_size == 0);
+    }
+
+    {   // throughput of async reader vs sync read (file is likely in page cache, except for direct I/O)
+        const int RepeatCount = 4;
+
+        auto measure = [&](const char *name, const std::function<bool()> &read_file) {
+            double best_time_s = 0.0;
+            for (int i = 0; i < RepeatCount; i++) {
+                auto t1 = std::chrono::high_resolution_clock::now();
+                require(read_file());
+                const double time_s = std::chrono::duration<double>{ std::chrono::high_resolution_clock::now() - t1 }.count();
+                if (i == 0 || time_s < best_time_s) best_time_s = time_s;
+            }
+            check_data();
+            printf("%-24s %8.1f MB/s\n", name, double(test_file_size) / (best_time_s * 1024.0 * 1024.0));
+        };
+
+        measure("sync", [&]() {
+            Sys::AssetFile in_file(test_file_name, Sys::AssetFile::FileIn);
+            return in_file.size() == test_file_size && in_file.Read(&file_data_buf[0], test_file_size);
+        });
+
+        for (const uint32_t flags : reader_flags) {
+            Sys::AsyncFileReader reader(flags);
+            const std::string name = std::string("async ") + reader.backend_name() + ((flags & Sys::AsyncFileReader::DirectIO) ? " direct" : "");
+
+            measure(name.c_str(), [&]() {
+                size_t file_size = 0;
+                return reader.ReadFile(test_file_name, file_data_buf_size, file_data_buf.get(), file_size) && file_size == test_file_size;
+            });
         }
     }
 
@@ -1,6 +1,9 @@
 #include "test_common.h"
 
+#include <algorithm>
+
 #include <sstream>
+#include <string>
 
 #include "../Json.h"
 
@@ -393,4 +396,146 @@ AGAIN3:
         require(((const JsArray &)arr.at(5)).at(0) == JsString{ "qwe" });
         require(((const JsArray &)arr.at(5)).at(1) == JsNumber{ 4.0 });
     }
+
+    {
+        // Parsing from memory buffer
+        JsElement el(JS_NULL);
+        const char *p = json_example3, *end = json_example3 + sizeof(json_example3) - 1;
+        require(el.Read(p, end));
+        require(p == end);
+
+        const JsObject &root = el;
+        const JsObject &menu = root.at("menu");
+        const JsArray &menuitem = ((const JsObject &)menu.at("popup")).at("menuitem");
+        require(menuitem.Size() == 3);
+        require(((const JsObject &)menuitem[2]).at("value") == JsString{ "Close" });
+        require(menu[0].first == "id");
+        require(menu[1].first == "value");
+
+        // several values in one buffer, pointer is advanced past each of them
+        const char values[] = "12.5 \"str\" [1, 2]  true{\"a\" : null}";
+        p = values;
+        end = values + sizeof(values) - 1;
+        JsNumber num;
+        require(num.Read(p, end) && num == 12.5);
+        JsString str;
+        require(str.Read(p, end) && str == JsString{ "str" });
+        JsArray arr;
+        require(arr.Read(p, end) && arr.Size() == 2);
+        JsLiteral lit(JS_NULL);
+        require(lit.Read(p, end) && lit.val == JS_TRUE);
+        JsObject obj;
+        require(obj.Read(p, end) && obj.Size() == 1);
+        require(p == end);
+
+        // truncated input
+        const char truncated[] = "{\"a\" : [1, 2, 3], \"b\" : \"qwe";
+        for (size_t len = 0; len < sizeof(truncated) - 1; len++) {
+            p = truncated;
+            require(!el.Read(p, truncated + len));
+        }
+    }
+
+    {
+        // Escape sequences
+        const char escaped[] = "\"quote\\\" slash\\\\ \\/ \\n\\t \\u0041\\u00e9\\ud83d\\ude00\"";
+        const char *p = escaped, *end = escaped + sizeof(escaped) - 1;
+        JsString s1;
+        require(s1.Read(p, end));
+        require(s1.val == "quote\" slash\\ / \n\t A\xc3\xa9\xf0\x9f\x98\x80");
+
+        // written string is escaped back
+        std::stringstream ss;
+        s1.Write(ss);
+        JsString s2;
+        require(s2.Read(ss));
+        require(s1 == s2);
+
+        JsObject obj;
+        obj["key \"with\" quotes"] = JsString{ "val\\ue" };
+        ss.str("");
+        ss.clear();
+        obj.Write(ss);
+        JsObject obj2;
+        require(obj2.Read(ss));
+        require(obj == obj2);
+    }
+
+    {
+        // SAX-style parsing
+        struct Handler : public JsSaxHandler {
+            std::string out;
+            int depth = 0, max_depth = 0;
+            double numbers_sum = 0.0;
+
+            bool OnObjectBegin() override {
+                out += '{';
+                max_depth = std::max(max_depth, ++depth);
+                return true;
+            }
+            bool OnObjectEnd() override {
+                out += '}';
+                --depth;
+                return true;
+            }
+            bool OnArrayBegin() override {
+                out += '[';
+                max_depth = std::max(max_depth, ++depth);
+                return true;
+            }
+            bool OnArrayEnd() override {
+                out += ']';
+                --depth;
+                return true;
+            }
+            bool OnKey(const char *str, size_t len) override {
+                out.append(str, len);
+                out += ':';
+                return true;
+            }
+            bool OnNumber(double val) override {
+                numbers_sum += val;
+                out += 'n';
+                return true;
+            }
+            bool OnString(const char *str, size_t len) override {
+                out += '\'';
+                out.append(str, len);
+                out += '\'';
+                return true;
+            }
+            bool OnLiteral(JsLiteralType val) override {
+                out += (val == JS_TRUE) ? 't' : (val == JS_FALSE ? 'f' : '0');
+                return true;
+            }
+        };
+
+        const char doc[] = "{ \"a\" : [1, 2.5, -3e1], \"b\\n\" : { \"c\" : \"d\\\"\", \"e\" : [] , \"f\" : {} }, \"g\" : [true, false, null] }";
+        const char *p = doc, *end = doc + sizeof(doc) - 1;
+
+        Handler handler;
+        require(JsParse(p, end, handler));
+        require(p == end);
+        require(handler.out == "{a:[nnn]b\n:{c:'d\"'e:[]f:{}}g:[tf0]}");
+        require(handler.depth == 0);
+        require(handler.max_depth == 3);
+        require(handler.numbers_sum == Approx(-26.5));
+
+        // parsing is stopped by handler
+        struct StopHandler : public JsSaxHandler {
+            int count = 0;
+            bool OnNumber(double /*val*/) override {
+                return ++count < 2;
+            }
+        } stop_handler;
+        p = doc;
+        require(!JsParse(p, end, stop_handler));
+        require(stop_handler.count == 2);
+
+        // malformed document
+        const char bad_doc[] = "{ \"a\" : [1, 2 \"b\" : 3 }";
+        p = bad_doc;
+        Handler bad_handler;
+        require(!JsParse(p, bad_doc + sizeof(bad_doc) - 1, bad_handler));
+    }
 }
@@ -1,56 +1,225 @@
 #include "test_common.h"
 
+#include <cstdlib>
+#include <cstring>
+
 #include <algorithm>
 #include <fstream>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "../AssetFile.h"
 #include "../Pack.h"
 
 namespace {
-std::vector<std::string> file_list = { "./constant.fs", "./src/CMakeLists.txt" };
+std::vector<std::string> file_list = { "./test_pack_file1.txt", "./test_pack_file2.bin", "./test_pack_empty.bin",
+                                        "./test_pack_dir/with_quite_long_file_name_that_would_not_fit_into_old_"
+                                        "package_format_descriptor_which_had_only_120_characters_for_it.txt" };
+
+std::string ReadWholeFile(const std::string &name) {
+    std::ifstream in_file(name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in_file), std::istreambuf_iterator<char>());
+}
 }
 
 void test_pack() {
+    {   // create test files (text is compressible, binary is not)
+        std::string text;
+        for (int i = 0; i < 2000; i++) {
+            text += "line number " + std::to_string(i) + " of test file\n";
+        }
+        std::ofstream(file_list[0], std::ios::binary) << text;
+
+        std::string bin(100000, '\0');
+        for (char &c : bin) {
+            c = char(rand() % 256);
+        }
+        std::ofstream(file_list[1], std::ios::binary) << bin;
+
+        std::ofstream(file_list[2], std::ios::binary);
+
+#ifdef _WIN32
+        system("mkdir test_pack_dir");
+#else
+        system("mkdir -p test_pack_dir");
+#endif
+        std::ofstream(file_list[3], std::ios::binary) << "short file";
+    }
+
+    {   // compression round trip
+        std::vector<uint8_t> src(300000);
+        for (size_t i = 0; i < src.size(); i++) {
+            // runs, repeated patterns and noise
+            src[i] = (i % 7000 < 3000) ? uint8_t(i % 13) : ((i % 7000 < 5000) ? uint8_t(42) : uint8_t(rand() % 256));
+        }
+        std::vector<uint8_t> compressed(src.size() + src.size() / 255 + 16), decompressed(src.size());
 
-    {
+        const size_t compressed_size = Sys::PackCompress(src.data(), src.size(), compressed.data(), compressed.size());
+        require(compressed_size > 0 && compressed_size < src.size() / 2);
+        require(Sys::PackDecompress(compressed.data(), compressed_size, decompressed.data(), decompressed.size()));
+        require(src == decompressed);
+
+        // wrong output size or truncated input is detected
+        require(!Sys::PackDecompress(compressed.data(), compressed_size, decompressed.data(), decompressed.size() - 1));
+        require(!Sys::PackDecompress(compressed.data(), compressed_size - 1, decompressed.data(), decompressed.size()));
+
+        // does not fit
+        require(Sys::PackCompress(src.data(), src.size(), compressed.data(), 100) == 0);
+
+        // small inputs are stored as literals
+        for (size_t len = 0; len < 20; len++) {
+            const size_t size = Sys::PackCompress(src.data(), len, compressed.data(), compressed.size());
+            require(size == len + (len < 15 ? 1 : 2));
+            require(Sys::PackDecompress(compressed.data(), size, decompressed.data(), len));
+            require(memcmp(src.data(), decompressed.data(), len) == 0);
+        }
+    }
+
+    for (const uint32_t flags : { 0u, uint32_t(Sys::PackCompressed) }) {
         // Save/Load package
-        Sys::WritePackage("./my_pack.pack", file_list);
+        Sys::WritePackage("./my_pack.pack", file_list, flags);
 
         auto OnFile = [](const char *name, void *data, int size) {
             auto it = std::find(file_list.begin(), file_list.end(), name);
             require(it != file_list.end());
 
-            Sys::AssetFile in_file(name, Sys::AssetFile::FileIn);
-            require(in_file.size() == size);
-
-            std::unique_ptr<char[]> buf(new char[size]);
-            in_file.Read(buf.get(), (size_t)size);
-            const char *p1 = (char*)data;
-            const char *p2 = buf.get();
-            require(memcmp(p1, p2, (size_t)size) == 0);
+            const std::string contents = ReadWholeFile(name);
+            require(contents.size() == size_t(size));
+            require(memcmp(data, contents.data(), (size_t)size) == 0);
         };
         Sys::ReadPackage("./my_pack.pack", OnFile);
 
         std::vector<Sys::FileDesc> list = Sys::EnumFilesInPackage("./my_pack.pack");
+        require(list.size() == file_list.size());
+        for (size_t i = 0; i < list.size(); i++) {
+            require(list[i].name == file_list[i]);
+            require(list[i].off % Sys::PackDefaultAlignment == 0);
+        }
+        // only text file is compressible
+        require(bool(list[0].flags & Sys::PackCompressed) == bool(flags & Sys::PackCompressed));
+        require(list[0].size < list[0].orig_size || !(flags & Sys::PackCompressed));
+        require(!(list[1].flags & Sys::PackCompressed));
+        require(list[1].size == 100000);
+
+        Sys::PackReader reader;
+        require(reader.Open("./my_pack.pack"));
+        require(reader.file_count() == file_list.size());
+        require(reader.FindFile("./non_existing.txt") == Sys::PackNoEntry);
 
-        require(std::string(list[0].name) == "./constant.fs");
-        require(std::string(list[1].name) == "./src/CMakeLists.txt");
+        for (size_t i = 0; i < file_list.size(); i++) {
+            const uint32_t index = reader.FindFile(file_list[i].c_str());
+            require(index == i);
+
+            const std::string contents = ReadWholeFile(file_list[i]);
+
+            size_t view_size = 0;
+            const char *view = reader.GetView(file_list[i].c_str(), view_size);
+            if (reader.entry(index).flags & Sys::PackCompressed) {
+                require(view == nullptr);
+            } else {
+                require(view != nullptr);
+                require(view_size == contents.size());
+                require(memcmp(view, contents.data(), view_size) == 0);
+                // data is aligned in memory
+                require(uintptr_t(view) % Sys::PackDefaultAlignment == 0);
+            }
+
+            if (contents.size() > 20) {
+                // partial read
+                char buf[10];
+                require(Sys::ReadFromPackage("./my_pack.pack", file_list[i].c_str(), 10, buf, sizeof(buf)));
+                require(memcmp(buf, &contents[10], sizeof(buf)) == 0);
+                require(!reader.Read(index, contents.size() - 5, buf, sizeof(buf)));
+            }
+        }
+    }
+
+    {   // many files are found through hashed directory
+        std::vector<std::string> many_files;
+        for (int i = 0; i < 300; i++) {
+            many_files.push_back(file_list[i % 2]);
+        }
+        many_files.push_back(file_list[3]);
+        Sys::WritePackage("./my_pack.pack", many_files, 0, 4096);
+
+        Sys::PackReader reader;
+        require(reader.Open("./my_pack.pack"));
+        require(reader.file_count() == 301);
+        // first of duplicated files is returned
+        require(reader.FindFile(file_list[0].c_str()) == 0);
+        require(reader.FindFile(file_list[1].c_str()) == 1);
+        require(reader.FindFile(file_list[3].c_str()) == 300);
+        for (uint32_t i = 0; i < reader.file_count(); i++) {
+            require(reader.entry(i).offset % 4096 == 0);
+        }
     }
 
-    {
-        // Add package to AssetFile
+    {   // old package format is still readable
+        const std::string contents = ReadWholeFile(file_list[0]);
+
+        std::ofstream out_file("./my_pack_v1.pack", std::ios::binary);
+        const uint32_t num_files = 1;
+        out_file.write((const char *)&num_files, sizeof(uint32_t));
+        char name[120] = {};
+        strcpy(name, file_list[0].c_str());
+        const uint32_t off = sizeof(uint32_t) + 128, size = uint32_t(contents.size());
+        out_file.write(name, sizeof(name));
+        out_file.write((const char *)&off, sizeof(uint32_t));
+        out_file.write((const char *)&size, sizeof(uint32_t));
+        out_file.write(contents.data(), contents.size());
+        out_file.close();
+
+        std::vector<Sys::FileDesc> list = Sys::EnumFilesInPackage("./my_pack_v1.pack");
+        require(list.size() == 1);
+        require(list[0].name == file_list[0]);
+        require(list[0].off == off && list[0].size == size);
+
+        Sys::PackReader reader;
+        require(reader.Open("./my_pack_v1.pack"));
+        size_t view_size = 0;
+        const char *view = reader.GetView(file_list[0].c_str(), view_size);
+        require(view && view_size == contents.size());
+        require(memcmp(view, contents.data(), view_size) == 0);
+    }
+
+    {   // Add package to AssetFile
+        Sys::WritePackage("./my_pack.pack", file_list, Sys::PackCompressed);
         Sys::AssetFile::AddPackage("./my_pack.pack");
+        require(Sys::AssetFile::IsInPackage(file_list[0].c_str()));
+
+        // original files are removed, so data can only come from package
+        std::vector<std::string> contents;
+        for (const std::string &f : file_list) {
+            contents.push_back(ReadWholeFile(f));
+            remove(f.c_str());
+        }
 
-        Sys::AssetFile in_file1("./constant.fs", Sys::AssetFile::FileIn);
-        std::ifstream in_file2("./constant.fs", std::ios::ate | std::ios::binary);
-        size_t size = (size_t)in_file2.tellg();
-        in_file2.seekg(0, std::ios::beg);
-        require(in_file1.size() == size);
+        for (size_t i = 0; i < file_list.size(); i++) {
+            Sys::AssetFile in_file(file_list[i], Sys::AssetFile::FileIn);
+            require(in_file);
+            require(in_file.size() == contents[i].size());
 
-        std::unique_ptr<char[]> buf1(new char[size]), buf2(new char[size]);
-        require(in_file1.Read(buf1.get(), size));
-        in_file2.read(buf2.get(), size);
-        require(memcmp(buf1.get(), buf2.get(), size) == 0);
+            std::string buf(contents[i].size(), '\0');
+            require(in_file.Read(&buf[0], buf.size()));
+            require(buf == contents[i]);
+            require(in_file.pos() == buf.size());
+
+            if (buf.size() > 20) {
+                in_file.Seek(10);
+                char part[10];
+                require(in_file.Read(part, sizeof(part)));
+                require(memcmp(part, &contents[i][10], sizeof(part)) == 0);
+                require(!in_file.Read(&buf[0], buf.size()));
+            }
+        }
+
+        Sys::AssetFile::RemovePackage("./my_pack.pack");
+        require(!Sys::AssetFile::IsInPackage(file_list[0].c_str()));
     }
+
+    remove("./my_pack.pack");
+    remove("./my_pack_v1.pack");
+    system("rmdir test_pack_dir");
 }